@@ -0,0 +1,124 @@
+#include "Affinity.hpp"
+#include "Config.hpp"
+#include "LoopbackTransport.hpp"
+#include "MQTTAgent.hpp"
+#include "MQTTMetrics.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+/*
+ * Compares the receive and dispatch path with unpinned threads against the
+ * same run with the dispatch workers, timer thread and callback thread
+ * pinned. Messages carry their publish time, so handlers record the latency
+ * from publish to handler. The feeder keeps a bounded number of messages
+ * outstanding, so the p99 reflects the path rather than an ever growing
+ * queue.
+ *
+ * Usage: bench_affinity [messages] [workers] [worker_cpus] [timer_cpus]
+ *                       [callback_cpus]
+ */
+
+const std::string BENCH_TOPIC{"bench/affinity"};
+const size_t PAYLOAD_SIZE = 1024;
+const size_t OUTSTANDING = 256;
+
+struct Result {
+  double messages_per_second;
+  double p50_ms;
+  double p99_ms;
+};
+
+Result run(size_t messages, size_t workers, const std::string &worker_cpus,
+           const std::string &timer_cpus, const std::string &callback_cpus) {
+  LoopbackBroker broker;
+  LoopbackTransport feed(broker);
+  feed.connect(mqtt::connect_options());
+
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://")
+                      .set_client_id("bench-affinity-agent")
+                      .add_subscription(BENCH_TOPIC, QoSLevel::AT_MOST_ONCE)
+                      .set_metrics(false, std::chrono::seconds(60))
+                      .set_thread_pool_size(workers)
+                      .set_cpu_affinity(worker_cpus, timer_cpus, callback_cpus)
+                      .build();
+  MQTTCallback callback(config.client_id, log_options(config));
+  MQTTAgent &agent = MQTTAgent::get_instance(
+      config, callback, std::make_unique<LoopbackTransport>(broker));
+  agent.connect();
+
+  // Handlers read the whole payload, like a parser would
+  LatencyHistogram latency;
+  std::atomic<size_t> handled{0};
+  std::atomic<uint64_t> checksum{0};
+  agent.add_handler(BENCH_TOPIC, [&](const mqtt::const_message_ptr &msg) {
+    const std::string &payload = msg->get_payload_str();
+    int64_t sent;
+    std::memcpy(&sent, payload.data(), sizeof(sent));
+    uint64_t sum = 0;
+    for (unsigned char c : payload)
+      sum = sum * 31 + c;
+    checksum.fetch_add(sum, std::memory_order_relaxed);
+    latency.record(std::chrono::steady_clock::now().time_since_epoch() -
+                   std::chrono::steady_clock::duration(sent));
+    handled++;
+  });
+
+  std::string payload(PAYLOAD_SIZE, 'x');
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < messages; ++i) {
+    while (i - std::min(i, handled.load()) >= OUTSTANDING)
+      std::this_thread::yield();
+    int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+    std::memcpy(&payload[0], &now, sizeof(now));
+    feed.publish(mqtt::make_message(BENCH_TOPIC, payload, 0, false));
+  }
+  while (handled < messages)
+    std::this_thread::yield();
+  auto elapsed = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+
+  agent.shutdown();
+  MQTTAgent::release_instance();
+  return {messages / elapsed, latency.percentile_ms(0.5),
+          latency.percentile_ms(0.99)};
+}
+
+int main(int argc, char *argv[]) {
+  size_t cpus = std::max(1u, std::thread::hardware_concurrency());
+  size_t messages = argc > 1 ? std::stoul(argv[1]) : 200000;
+  size_t workers = argc > 2 ? std::stoul(argv[2]) : std::min<size_t>(4, cpus);
+
+  // By default the workers take the first CPUs and the timer and callback
+  // threads the next one, wrapping around on small machines
+  std::string worker_cpus =
+      argc > 3 ? argv[3] : "0-" + std::to_string(std::min(workers, cpus) - 1);
+  std::string timer_cpus =
+      argc > 4 ? argv[4] : std::to_string(std::min(workers, cpus) % cpus);
+  std::string callback_cpus = argc > 5 ? argv[5] : timer_cpus;
+
+  Result unpinned = run(messages, workers, "", "", "");
+  Result pinned =
+      run(messages, workers, worker_cpus, timer_cpus, callback_cpus);
+
+  auto print = [](const char *name, const Result &result) {
+    std::cout << name << result.messages_per_second << " msgs/s, p50 "
+              << result.p50_ms << " ms, p99 " << result.p99_ms << " ms\n";
+  };
+  std::cout << "messages:   " << messages << " (" << PAYLOAD_SIZE
+            << " bytes)\n"
+            << "workers:    " << workers << " on CPUs "
+            << format_cpu_list(parse_cpu_list(worker_cpus)) << "\n"
+            << "timer:      CPUs " << timer_cpus << "\n"
+            << "callback:   CPUs " << callback_cpus << "\n";
+  print("unpinned:   ", unpinned);
+  print("pinned:     ", pinned);
+  std::cout << std::flush;
+  return 0;
+}
@@ -0,0 +1,173 @@
+#include "MQTTMetrics.hpp"
+#include "MessagePool.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Compares building publish messages with mqtt::make_message against
+ * MessagePool::make_message. Every publishing thread keeps a window of
+ * messages in flight, like the client does until delivery_complete, and
+ * hands completed messages to a releasing thread, like the client's callback
+ * thread. Heap allocations are counted by replacing the global operator new.
+ *
+ * Usage: bench_allocator [messages_per_thread] [threads] [payload_bytes]
+ */
+
+std::atomic<size_t> heap_allocations{0};
+
+void *operator new(size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *block = std::malloc(size ? size : 1))
+    return block;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *block) noexcept { std::free(block); }
+void operator delete(void *block, size_t) noexcept { std::free(block); }
+
+const size_t IN_FLIGHT = 64;
+
+// Batches a publishing thread may have waiting for release
+const size_t MAX_PENDING_BATCHES = 4;
+
+struct Batch {
+  std::vector<mqtt::message_ptr> messages;
+  std::atomic<size_t> *pending;
+};
+
+// Releases messages handed over by the publishing threads
+class Releaser {
+public:
+  Releaser() : thread_([this]() { run(); }) {}
+
+  ~Releaser() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  void release(Batch &&batch) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      batches_.push_back(std::move(batch));
+    }
+    cv_.notify_one();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Batch> batches_;
+  bool stop_ = false;
+  std::thread thread_;
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() { return stop_ || !batches_.empty(); });
+      if (batches_.empty())
+        return;
+      auto batch = std::move(batches_.front());
+      batches_.pop_front();
+      lock.unlock();
+      batch.messages.clear();
+      (*batch.pending)--;
+      lock.lock();
+    }
+  }
+};
+
+template <typename MakeMessage>
+void run(const char *name, MakeMessage make, size_t messages, size_t threads,
+         size_t payload_bytes) {
+  std::string payload(payload_bytes, 'x');
+  std::vector<std::string> topics;
+  for (int i = 0; i < 16; i++)
+    topics.push_back("bench/allocator/" + std::to_string(i));
+
+  size_t allocations_before = heap_allocations;
+  auto start = std::chrono::steady_clock::now();
+  {
+    Releaser releaser;
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++)
+      workers.emplace_back([&]() {
+        std::atomic<size_t> pending{0};
+        Batch batch{{}, &pending};
+        batch.messages.reserve(IN_FLIGHT);
+        for (size_t i = 0; i < messages; i++) {
+          batch.messages.push_back(make(topics[i % topics.size()], payload));
+          if (batch.messages.size() < IN_FLIGHT)
+            continue;
+
+          // Like a full in-flight window, wait for completions
+          while (pending >= MAX_PENDING_BATCHES)
+            std::this_thread::yield();
+          pending++;
+          releaser.release(std::move(batch));
+          batch = Batch{{}, &pending};
+          batch.messages.reserve(IN_FLIGHT);
+        }
+        while (pending)
+          std::this_thread::yield();
+      });
+    for (auto &worker : workers)
+      worker.join();
+  }
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  size_t total = messages * threads;
+  std::cout << name << ":\n"
+            << "  rate:            " << total / seconds << " msgs/s\n"
+            << "  allocations/msg: "
+            << static_cast<double>(heap_allocations - allocations_before) /
+                   total
+            << "\n"
+            << "  RSS:             "
+            << PlatformMetrics::get_resident_set_bytes() / 1024 << " KiB"
+            << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t messages = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  size_t threads = argc > 2 ? std::stoul(argv[2]) : 4;
+  size_t payload_bytes = argc > 3 ? std::stoul(argv[3]) : 256;
+
+  std::cout << threads << " threads x " << messages << " messages, "
+            << payload_bytes << " byte payloads, " << IN_FLIGHT
+            << " in flight per thread\n";
+
+  run(
+      "mqtt::make_message",
+      [](const std::string &topic, const std::string &payload) {
+        return mqtt::make_message(topic, payload, 1, false);
+      },
+      messages, threads, payload_bytes);
+
+  run(
+      "MessagePool::make_message",
+      [](const std::string &topic, const std::string &payload) {
+        return MessagePool::make_message(topic, payload, 1, false);
+      },
+      messages, threads, payload_bytes);
+
+  auto stats = MessagePool::stats();
+  std::cout << "pool: " << stats.reused << " reused, "
+            << stats.heap_allocations << " allocated ("
+            << stats.allocations_per_message() << "/msg)" << std::endl;
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include "Config.hpp"
+#include "ConfigImage.hpp"
+#include "Dispatcher.hpp"
+#include "MQTTMetrics.hpp"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <nlohmann/json.hpp>
+#include <string>
+
+/*
+ * Compares the startup cost of a json config against its compiled image on
+ * the path the agent takes: ConfigBuilder::load picks the loader by file
+ * magic, then the shared subscriptions are routed in a Dispatcher the way
+ * the MQTTAgent constructor does. The files stay in the page cache, so this
+ * measures parsing rather than disk reads.
+ *
+ * Usage: bench_config_load [subscriptions] [iterations]
+ */
+
+const std::string JSON_PATH{"bench_config_load.json"};
+const std::string IMAGE_PATH{"bench_config_load.bin"};
+
+void write_config(size_t subscriptions) {
+  nlohmann::json j;
+  j["broker_url"] = "tcp://localhost:1883";
+  j["client_id"] = "bench-config-agent";
+  j["heartbeat_interval"] = 10;
+  j["max_inflight_messages"] = 100;
+  j["subscriptions"] = nlohmann::json::array();
+  for (size_t i = 0; i < subscriptions; ++i) {
+    std::string site = "site/" + std::to_string(i % 100);
+    std::string topic =
+        i % 10 == 0   ? site + "/device/+/temperature"
+        : i % 10 == 1 ? "$share/workers/" + site + "/device/" +
+                            std::to_string(i) + "/#"
+                      : site + "/device/" + std::to_string(i) + "/temperature";
+    j["subscriptions"].push_back({{"topic", topic}, {"qos_level", i % 3}});
+  }
+  std::ofstream(JSON_PATH) << j.dump(2);
+}
+
+/*
+ * Loads a config and routes its shared subscriptions like MQTTAgent.
+ * @return Number of subscriptions loaded
+ */
+size_t start_up(const std::string &path) {
+  Config config = ConfigBuilder::load(path);
+  PlatformMetrics metrics;
+  Dispatcher dispatcher(metrics, 1, 64);
+  for (const auto &subscription : config.subscriptions)
+    if (subscription_filter(subscription) != subscription)
+      dispatcher.add_subscription(subscription);
+  return config.subscriptions.size();
+}
+
+int main(int argc, char *argv[]) {
+  size_t subscriptions = argc > 1 ? std::stoul(argv[1]) : 10000;
+  int iterations = argc > 2 ? std::stoi(argv[2]) : 20;
+
+  write_config(subscriptions);
+  ConfigImage::compile(ConfigBuilder::load_from_json(JSON_PATH), IMAGE_PATH);
+
+  size_t json_loaded = 0, image_loaded = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    json_loaded = start_up(JSON_PATH);
+  auto json_done = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < iterations; ++i)
+    image_loaded = start_up(IMAGE_PATH);
+  auto image_done = std::chrono::steady_clock::now();
+
+  auto per_load_ms = [&](std::chrono::steady_clock::duration elapsed) {
+    return std::chrono::duration<double, std::milli>(elapsed).count() /
+           iterations;
+  };
+
+  std::ifstream json_file(JSON_PATH, std::ios::ate);
+  std::ifstream image_file(IMAGE_PATH, std::ios::ate);
+  std::cout << "Subscriptions:  " << subscriptions << "\n"
+            << "JSON:           " << per_load_ms(json_done - start)
+            << " ms per start, " << json_file.tellg() << " bytes\n"
+            << "Image:          " << per_load_ms(image_done - json_done)
+            << " ms per start, " << image_file.tellg() << " bytes\n"
+            << "Speedup:        "
+            << per_load_ms(json_done - start) /
+                   per_load_ms(image_done - json_done)
+            << "x\n"
+            << "Loaded:         " << json_loaded << " / " << image_loaded
+            << std::endl;
+
+  std::remove(JSON_PATH.c_str());
+  std::remove(IMAGE_PATH.c_str());
+  return json_loaded == image_loaded ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#include "Config.hpp"
+#include "LoopbackTransport.hpp"
+#include "MQTTAgent.hpp"
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+/*
+ * Measures the agent's receive and dispatch path over an in-process
+ * loopback broker, so the numbers contain no network time.
+ *
+ * Usage: bench_loopback [messages] [qos] [latency_us] [loss]
+ */
+
+const std::string BENCH_TOPIC{"bench/loopback"};
+
+// Counts completed publishes of the feeding client
+class Feeder : public TransportListener {
+public:
+  std::atomic<size_t> delivered{0};
+
+  void connected(const std::string &) override {}
+  void connection_lost(const std::string &) override {}
+  void message_arrived(mqtt::const_message_ptr) override {}
+  void delivery_complete(const mqtt::const_message_ptr &,
+                         const mqtt::delivery_token_ptr &) override {
+    delivered++;
+  }
+};
+
+int main(int argc, char *argv[]) {
+  size_t messages = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  int qos = argc > 2 ? std::stoi(argv[2]) : 0;
+  LoopbackConditions conditions;
+  conditions.latency = std::chrono::microseconds(argc > 3 ? std::stol(argv[3])
+                                                          : 0);
+  conditions.loss = argc > 4 ? std::stod(argv[4]) : 0.0;
+
+  LoopbackBroker broker;
+  broker.set_conditions(conditions);
+
+  Feeder feeder;
+  LoopbackTransport feed(broker);
+  feed.set_listener(feeder);
+  feed.connect(mqtt::connect_options());
+
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://")
+                      .set_client_id("bench-loopback-agent")
+                      .add_subscription(BENCH_TOPIC, static_cast<QoSLevel>(qos))
+                      .set_metrics(false, std::chrono::seconds(60))
+                      .build();
+  MQTTCallback callback(config.client_id, log_options(config));
+  MQTTAgent &agent = MQTTAgent::get_instance(
+      config, callback, std::make_unique<LoopbackTransport>(broker));
+  agent.connect();
+
+  std::atomic<size_t> handled{0};
+  agent.add_handler(BENCH_TOPIC,
+                    [&](const mqtt::const_message_ptr &) { handled++; });
+
+  auto payload = std::string(64, 'x');
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < messages; ++i)
+    feed.publish(mqtt::make_message(BENCH_TOPIC, payload, qos, false));
+  auto published = std::chrono::steady_clock::now();
+
+  // Lost QoS 0 messages never arrive, so wait for the broker instead
+  broker.wait_idle(std::chrono::minutes(5));
+  while (handled < callback.metrics.messages_received)
+    std::this_thread::yield();
+  auto done = std::chrono::steady_clock::now();
+
+  auto seconds = [&](std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<double>(end - start).count();
+  };
+
+  std::cout << "messages:        " << messages << " (QoS " << qos << ")\n"
+            << "latency/loss:    " << conditions.latency.count() << " us / "
+            << conditions.loss << "\n"
+            << "publish rate:    " << messages / seconds(published)
+            << " msgs/s\n"
+            << "handled:         " << handled << "\n"
+            << "packets lost:    " << broker.packets_lost() << "\n"
+            << "end to end rate: " << handled / seconds(done) << " msgs/s"
+            << std::endl;
+
+  agent.shutdown();
+  MQTTAgent::release_instance();
+  return 0;
+}
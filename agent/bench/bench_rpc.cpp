@@ -0,0 +1,135 @@
+#include "Config.hpp"
+#include "MQTTAgent.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mqtt/async_client.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Measures RPC round trips through the local broker against an in-process
+ * echo responder.
+ *
+ * Usage: bench_rpc [broker_url] [requests] [max_outstanding]
+ */
+
+const std::string ECHO_TOPIC{"bench/rpc/echo"};
+
+// Answers every request with its own payload
+class EchoResponder : public virtual mqtt::callback {
+public:
+  explicit EchoResponder(mqtt::async_client &client) : client_(client) {}
+
+  void message_arrived(mqtt::const_message_ptr msg) override {
+    auto response = RPCClient::make_response(msg, msg->get_payload_str(), 0);
+    if (response)
+      client_.publish(response);
+  }
+
+private:
+  mqtt::async_client &client_;
+};
+
+int main(int argc, char *argv[]) {
+  std::string broker = argc > 1 ? argv[1] : "tcp://localhost:1883";
+  size_t requests = argc > 2 ? std::stoul(argv[2]) : 100000;
+  size_t max_outstanding = argc > 3 ? std::stoul(argv[3]) : 20000;
+
+  // Responder
+  mqtt::async_client responder(broker, "bench-rpc-responder",
+                               mqtt::create_options(MQTTVERSION_5));
+  EchoResponder echo(responder);
+  responder.set_callback(echo);
+  responder
+      .connect(mqtt::connect_options_builder()
+                   .mqtt_version(MQTTVERSION_5)
+                   .clean_start(true)
+                   .finalize())
+      ->wait();
+  responder.subscribe(ECHO_TOPIC, 0)->wait();
+
+  // Agent
+  Config config = ConfigBuilder()
+                      .set_broker_url(broker)
+                      .set_client_id("bench-rpc-agent")
+                      .enable_mqtt_v5()
+                      .set_rpc("", std::chrono::milliseconds(30000))
+                      .set_metrics(false, std::chrono::seconds(60))
+                      .build();
+  MQTTCallback callback(config.client_id, log_options(config));
+  MQTTAgent &agent = MQTTAgent::get_instance(config, callback);
+  if (!agent.connect()) {
+    std::cerr << "Could not connect to " << broker << std::endl;
+    return 1;
+  }
+
+  std::vector<double> latencies_us(requests, 0.0);
+  std::atomic<size_t> completed{0};
+  std::atomic<size_t> failed{0};
+  std::mutex mutex;
+  std::condition_variable window;
+  size_t outstanding = 0;
+  double call_overhead_us = 0.0;
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < requests; ++i) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      window.wait(lock, [&]() { return outstanding < max_outstanding; });
+      ++outstanding;
+    }
+
+    auto sent = std::chrono::steady_clock::now();
+    agent.call(
+        ECHO_TOPIC, "ping",
+        [&, i, sent](RPCStatus status, mqtt::const_message_ptr) {
+          auto elapsed = std::chrono::steady_clock::now() - sent;
+          latencies_us[i] =
+              std::chrono::duration<double, std::micro>(elapsed).count();
+          if (status != RPCStatus::OK)
+            failed++;
+          completed++;
+
+          std::lock_guard<std::mutex> lock(mutex);
+          --outstanding;
+          window.notify_one();
+        },
+        QoSLevel::AT_MOST_ONCE);
+    call_overhead_us += std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - sent)
+                            .count();
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    window.wait(lock, [&]() { return outstanding == 0; });
+  }
+  auto total = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                             start)
+                   .count();
+
+  std::sort(latencies_us.begin(), latencies_us.end());
+  auto percentile = [&](double p) {
+    return latencies_us[static_cast<size_t>(p * (latencies_us.size() - 1))];
+  };
+
+  std::cout << "requests:        " << requests << "\n"
+            << "failed:          " << failed << "\n"
+            << "max outstanding: " << max_outstanding << "\n"
+            << "throughput:      " << requests / total << " calls/s\n"
+            << "call() overhead: " << call_overhead_us / requests << " us\n"
+            << "round trip p50:  " << percentile(0.50) << " us\n"
+            << "round trip p99:  " << percentile(0.99) << " us\n"
+            << "round trip max:  " << latencies_us.back() << " us"
+            << std::endl;
+
+  agent.shutdown();
+  MQTTAgent::release_instance();
+  responder.disconnect()->wait();
+  return failed == 0 ? 0 : 1;
+}
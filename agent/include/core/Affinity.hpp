@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/*
+ * CPU placement of the agent's threads.
+ *
+ * Linux allocates a page on the NUMA node of the CPU that first touches it.
+ * Threads therefore pin themselves before they allocate their own queues and
+ * buffers, which places that memory on the node they run on without libnuma.
+ */
+
+/*
+ * Parses a CPU list in the kernel's format, e.g. "0-3,8,10-11".
+ * @return The CPUs in ascending order without duplicates; empty for ""
+ * @throws std::invalid_argument if list is malformed or names a CPU outside
+ * of what cpu_set_t can hold
+ */
+std::vector<int> parse_cpu_list(const std::string &list);
+
+/* Formats cpus as a CPU list, collapsing consecutive CPUs into ranges */
+std::string format_cpu_list(const std::vector<int> &cpus);
+
+/*
+ * Restricts the calling thread to cpus. Does nothing if cpus is empty.
+ * @return false if the kernel refused, e.g. because none of cpus is online
+ */
+bool pin_current_thread(const std::vector<int> &cpus);
+
+/* NUMA node of the CPU the calling thread runs on, or -1 if unknown */
+int current_numa_node();
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "Config.hpp"
+#include "MQTTMetrics.hpp"
+#include <cstddef>
+#include <vector>
+
+/*
+ * Load measured over one tuning interval
+ */
+struct TuningSample {
+  size_t dispatch_samples = 0;
+  double dispatch_p99_ms = 0.0; // Queued for the workers to handlers done
+  size_t queue_depth = 0;       // Messages waiting for a worker
+  size_t publish_samples = 0;
+  double publish_p99_ms = 0.0;       // Publish call to acknowledgement
+  double publish_queue_p99_ms = 0.0; // Publish call to hand over
+  size_t publish_queued = 0;         // Messages waiting for the window
+  // False if too few publishes were acknowledged and the p99 is the hand
+  // over, e.g. for QoS 0 traffic
+  bool publish_acknowledged = false;
+};
+
+/*
+ * Settings the tuner controls
+ */
+struct TuningSettings {
+  size_t workers = 0;
+  size_t max_inflight = 0;
+  size_t batch_bytes = 0; // Scheduler quantum
+};
+
+/**
+ * Percentile of the samples that several histograms received since the
+ * previous call, computed from the difference of their bucket counters.
+ */
+class LatencyWindow {
+public:
+  explicit LatencyWindow(std::vector<const LatencyHistogram *> histograms);
+
+  /*
+   * Closes the current window and starts the next one.
+   * @param quantile Quantile to compute, e.g. 0.99
+   * @param p_ms Upper bound of the bucket holding the quantile; 0 if the
+   * window is empty
+   * @return Number of samples in the window
+   */
+  size_t advance(double quantile, double &p_ms);
+
+private:
+  std::vector<const LatencyHistogram *> histograms_;
+  std::vector<size_t> seen_; // Per bucket, summed over the histograms
+};
+
+/**
+ * Closed loop controller that keeps the handler and publish p99 under the
+ * configured target.
+ *
+ * Every interval it compares the p99 of the interval with the target. A
+ * handler p99 above the target with messages still queued adds a worker,
+ * one below half of the target with an empty queue removes one.
+ *
+ * The publish batch is the scheduler's DRR quantum. It does not change how
+ * much is sent, only how finely realtime and bulk messages interleave: a
+ * publish p99 above the target halves it, so realtime messages wait behind
+ * shorter bulk runs, and a p99 below half of the target with messages
+ * queued doubles it again, which costs fewer turn changes. The in-flight
+ * window only matters for acknowledged publishes, so it is sized from the
+ * QoS 1/2 delivery p99 alone: above the target it widens when messages
+ * mostly wait for a slot and narrows when the broker is slow to
+ * acknowledge; below half of the target with messages queued it widens.
+ * The window never shrinks to the control reserve, or realtime and bulk
+ * could not send at all.
+ *
+ * Each setting moves by one step per interval and stays within the
+ * configured bounds; an interval with fewer than MIN_SAMPLES samples leaves
+ * its settings alone.
+ */
+class AutoTuner {
+public:
+  static const size_t MIN_SAMPLES = 20;
+
+  /* @param metrics Histograms to read, and where decisions are recorded */
+  explicit AutoTuner(PlatformMetrics &metrics);
+
+  /* Do not allow copying */
+  AutoTuner(const AutoTuner &obj) = delete;
+  AutoTuner &operator=(const AutoTuner &obj) = delete;
+
+  /*
+   * Measures the interval since the previous call.
+   * @param queue_depth Messages waiting for a dispatch worker
+   * @param publish_queued Realtime and bulk messages waiting for the window
+   */
+  TuningSample sample(size_t queue_depth, size_t publish_queued);
+
+  /*
+   * Adjusts settings for the measured load and records every change in
+   * PlatformMetrics::tuning.
+   * @param config Target, interval and bounds
+   * @param sample Load of the last interval
+   * @param settings Settings in effect; updated in place
+   * @return The changes made, empty if settings stay as they are
+   */
+  std::vector<TuningDecision> decide(const Config &config,
+                                     const TuningSample &sample,
+                                     TuningSettings &settings);
+
+private:
+  PlatformMetrics &metrics_;
+  LatencyWindow dispatch_;
+  LatencyWindow delivery_;
+  LatencyWindow queue_;
+};
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "Config.hpp"
+#include "ConfigImage.hpp"
+#include "MQTTMetrics.hpp"
+#include "TopicMatcher.hpp"
+#include "Transport.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Forwards messages received from the local broker to upstream brokers, as
+ * configured by Config::bridge_upstreams and Config::bridge_routes.
+ *
+ * A message is forwarded by every route whose filter matches its topic,
+ * found through the precompiled trie of Config::image when the config was
+ * loaded from an image and a TopicMatcher otherwise. The
+ * forwarded message gets a rewritten topic and QoS but shares the payload
+ * buffer of the received one, so no payload bytes are copied. Forwarding
+ * happens on the thread that received the message; a route never blocks it.
+ * Once a route has max_pending QoS 1/2 messages not yet completed by its
+ * upstream, further messages of that route are dropped and counted, while
+ * the other routes keep forwarding. QoS 0 messages are never acknowledged
+ * and count as forwarded once the upstream transport took them. Upstreams
+ * that are down are retried by reconnect().
+ */
+class Bridge {
+public:
+  /* Creates the transport of an upstream from its connection config */
+  using TransportFactory =
+      std::function<std::unique_ptr<Transport>(const Config &upstream)>;
+
+  /*
+   * @param config Agent config with the bridge to run. Upstreams inherit its
+   * connection settings, like the keep alive and protocol version
+   * @param metrics Receives the per route metrics
+   * @param actions Receives the results of upstream Paho actions
+   * @param factory Creates the upstream transports; PahoTransport if empty
+   */
+  Bridge(const Config &config, PlatformMetrics &metrics,
+         mqtt::iaction_listener &actions, TransportFactory factory = nullptr);
+
+  ~Bridge();
+
+  /* Do not allow copying */
+  Bridge(const Bridge &obj) = delete;
+  Bridge &operator=(const Bridge &obj) = delete;
+
+  /* Period of reconnect() attempts the agent schedules */
+  static constexpr std::chrono::seconds RECONNECT_INTERVAL{5};
+
+  /*
+   * Connects every upstream that is not connected yet.
+   * @return true if all upstreams are connected
+   */
+  bool connect();
+
+  /*
+   * Starts connect() in the background if an upstream is down and no
+   * attempt is running yet. Does nothing before the first connect() and
+   * after disconnect(). Never blocks, so it can run on the timer wheel.
+   */
+  void reconnect();
+
+  /* Waits for a running reconnect attempt and disconnects every upstream */
+  void disconnect();
+
+  /*
+   * Forwards msg along every matching route.
+   * @return Number of routes that published the message
+   */
+  size_t forward(const mqtt::const_message_ptr &msg);
+
+  /* Messages forwarded and not completed by their upstream yet */
+  size_t pending() const;
+
+  /*
+   * Blocks until no message is pending.
+   * @return false if messages are still pending at deadline
+   */
+  bool drain(std::chrono::steady_clock::time_point deadline);
+
+  /*
+   * Gives up on the pending messages, counting them as dropped.
+   * @return Number of messages given up on
+   */
+  size_t abandon();
+
+  /*
+   * Topic a message received on topic is forwarded with: local_prefix is
+   * replaced by remote_prefix if topic starts with it, otherwise
+   * remote_prefix is prepended.
+   */
+  static std::string rewrite(const BridgeRoute &route,
+                             const std::string &topic);
+
+  /*
+   * Connection config of an upstream: the agent's config with the upstream's
+   * broker, identity and TLS files, and without subscriptions, persistence,
+   * last will or automatic reconnect; reconnect() retries upstreams.
+   */
+  static Config upstream_config(const Config &config,
+                                const BridgeUpstream &upstream);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  class Upstream;
+
+  struct Route {
+    BridgeRoute config;
+    Upstream *upstream;
+    BridgeRouteMetrics *metrics;
+  };
+
+  /*
+   * Forwarded message not completed yet. Holding msg keeps its address, the
+   * key of the entry, from being reused before the entry is gone
+   */
+  struct Pending {
+    Route *route;
+    Clock::time_point arrived;
+    mqtt::const_message_ptr msg;
+  };
+
+  std::vector<std::unique_ptr<Upstream>> upstreams_;
+  std::vector<Route> routes_;
+  TopicMatcher matcher_; // Route filters to route indices
+
+  // Config::image if it holds the config's subscriptions, which include
+  // every route filter. Its trie replaces matcher_
+  std::shared_ptr<const ConfigImage> image_;
+  std::vector<std::vector<size_t>> image_routes_; // Per image subscription
+
+  /*
+   * Uses the trie of config's image for the routes, unless the config was
+   * changed after it was loaded.
+   * @return false if there is no usable image
+   */
+  bool use_image(const Config &config);
+
+  mutable std::mutex mutex_;
+  std::condition_variable idle_;
+  size_t pending_count_ = 0;
+
+  // Background connect() started by reconnect(). Guarded by reconnect_mutex_
+  std::mutex reconnect_mutex_;
+  std::future<void> reconnecting_;
+  bool started_ = false; // connect() was called and disconnect() was not
+
+  /* Called by an upstream when its publish of msg is complete */
+  void complete(Upstream &upstream, const mqtt::message *msg);
+
+  /* Called by an upstream when its publish of msg failed */
+  void fail(Upstream &upstream, const mqtt::message *msg);
+
+  /* Drops the pending messages of upstream after a clean reconnect */
+  void reset(Upstream &upstream);
+
+  /* Removes a pending message. Lock must be held */
+  void release(Upstream &upstream, const mqtt::message *msg, bool forwarded);
+};
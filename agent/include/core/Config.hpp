@@ -1,9 +1,12 @@
 #pragma once
 
+#include "Affinity.hpp"
+#include "TopicMatcher.hpp"
 #include <algorithm>
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include <stdexcept>
 #include <string>
@@ -38,8 +41,47 @@ LogLevel string_to_log_level(const std::string &log_level);
  */
 std::string log_level_to_string(LogLevel level);
 
+class ConfigImage;
+
+/*
+ * Upstream broker of the bridge. Settings not listed here, like the keep
+ * alive and protocol version, are taken from the agent's own connection
+ */
+struct BridgeUpstream {
+  std::string name;
+  std::string broker_url;
+  std::string client_id;
+  std::string username;
+  std::string password;
+  bool use_ssl = false;
+  std::string ca_certificate_file;
+  std::string client_certificate_file;
+  std::string client_private_key_file;
+};
+
+/*
+ * Bridge route. Forwards messages received on filter to an upstream,
+ * replacing local_prefix at the start of the topic with remote_prefix
+ */
+struct BridgeRoute {
+  std::string name;   // Key of the route's metrics
+  std::string filter; // Topic filter or $share/<group>/<filter>
+  std::string upstream;
+  std::string local_prefix;
+  std::string remote_prefix;
+  // Upstream QoS, indexed by the QoS the message was received with
+  QoSLevel qos_map[3] = {QoSLevel::AT_MOST_ONCE, QoSLevel::AT_LEAST_ONCE,
+                         QoSLevel::EXACTLY_ONCE};
+  // Unacknowledged messages after which the route drops new ones
+  size_t max_pending = 1000;
+};
+
+bool operator==(const BridgeUpstream &a, const BridgeUpstream &b);
+bool operator==(const BridgeRoute &a, const BridgeRoute &b);
+
 /**
- * Configuration structure for the MQTT platform
+ * Configuration structure for the MQTT platform. New settings also need an id
+ * in the settings list of ConfigImage.cpp to survive compilation to an image
  */
 struct Config {
   // Connection settings
@@ -52,6 +94,7 @@ struct Config {
   std::chrono::seconds connect_timeout{10};
   std::chrono::seconds keep_alive_interval{60};
   bool clean_session = true;
+  bool mqtt_v5 = false;
   bool automatic_reconnect = false;
   std::chrono::seconds reconnect_delay;
   int max_reconnect_attempts = -1; // -1 = infinite
@@ -67,7 +110,8 @@ struct Config {
   // QoS settings
   QoSLevel qos_level = QoSLevel::AT_LEAST_ONCE;
 
-  // Subscriptions
+  // Subscriptions. Entries are plain topic filters or shared subscriptions
+  // of the form $share/<group>/<filter>
   std::vector<std::string> subscriptions;
   std::unordered_map<std::string, QoSLevel> subscription_qos;
 
@@ -78,12 +122,24 @@ struct Config {
   QoSLevel last_will_qos = QoSLevel::AT_LEAST_ONCE;
   bool last_will_retained = true;
 
-  // SSL/TLS settings
+  // SSL/TLS settings. The broker_url must use the ssl:// or mqtts:// scheme;
+  // the client certificate and key are only needed if the broker asks for
+  // them
   bool use_ssl = false;
   std::string ca_certificate_file;
   std::string client_certificate_file;
   std::string client_private_key_file;
 
+  // TLS session resumption. Paho keeps the session of the client's first
+  // handshake and offers it on every later connect, automatic reconnects
+  // included, but only for connections without a clean session: MQTT v5
+  // always qualifies, as clean_session is sent as clean start there, MQTT
+  // 3.1.1 needs clean_session off. A TLS 1.3 session only becomes resumable
+  // with a ticket the broker sends after the handshake, when Paho has already
+  // kept it, so resumption pins the connection to TLS 1.2. The broker has to
+  // keep a session cache
+  bool tls_session_resumption = false;
+
   // Logging settings
 
   LogLevel log_level = LogLevel::NONE;
@@ -93,11 +149,90 @@ struct Config {
   // Performance settings
   size_t max_inflight_messages = 20;
   std::chrono::milliseconds message_timeout{30000};
+  bool enable_message_pool = true; // Build published messages from MessagePool
+
+  // Outbound priority classes. Control messages (heartbeats, status) are
+  // sent first and may use the whole in-flight window; realtime and bulk
+  // share the rest of it by weight, counted in bytes. A message that waited
+  // longer than its class's max wait is sent ahead of its turn. Publishing
+  // blocks while the class's queue is full, for at most message_timeout
+  size_t control_reserved_inflight = 2;
+  size_t realtime_weight = 4;
+  size_t bulk_weight = 1;
+  std::chrono::milliseconds realtime_max_wait{100};
+  std::chrono::milliseconds bulk_max_wait{2000};
+  size_t publish_queue_size = 10000;
+
+  // Shutdown waits up to drain_timeout for queued and in-flight publishes
+  // and queued handler work. With persistence enabled, what is left is
+  // written to persistence_directory and sent or handled on the next connect;
+  // otherwise it is dropped
+  std::chrono::milliseconds drain_timeout{5000};
+
+  // Adaptive tuning. When enabled, a controller on the timer wheel adjusts
+  // the dispatch workers, the in-flight window and the publish batch every
+  // tuning_interval, within the bounds below, to keep the p99 of handler and
+  // publish latency under tuning_target_p99. thread_pool_size and
+  // max_inflight_messages are where it starts. The publish batch is the
+  // scheduler's quantum. tuning_min_inflight has to exceed
+  // control_reserved_inflight so realtime and bulk keep a slot
+  bool enable_auto_tuning = false;
+  std::chrono::milliseconds tuning_target_p99{100};
+  std::chrono::milliseconds tuning_interval{1000};
+  size_t tuning_min_workers = 1;
+  size_t tuning_max_workers = 16;
+  size_t tuning_min_inflight = 10;
+  size_t tuning_max_inflight = 1000;
+  size_t tuning_min_batch_bytes = 256;
+  size_t tuning_max_batch_bytes = 65536;
 
   // Metrics settings
   bool enable_metrics = true;
   std::chrono::seconds metrics_report_interval{60};
 
+  // Topic aliases (MQTT v5 only). The maximum is advertised to the broker for
+  // inbound aliases and caps the outbound alias table, which is further
+  // limited by the maximum the broker advertises
+  bool enable_topic_aliases = false;
+  uint16_t topic_alias_maximum = 64;
+
+  // RPC settings (MQTT v5 only). An empty response topic defaults to
+  // rpc/<client_id>/response
+  std::string rpc_response_topic;
+  std::chrono::milliseconds rpc_timeout{5000};
+
+  // Scheduler settings
+  std::chrono::seconds heartbeat_interval{10};
+  std::chrono::milliseconds timer_resolution{10};
+
+  // CPU affinity, as CPU lists like "0-3,8". Empty leaves a thread to the
+  // scheduler. Dispatch workers take one CPU of worker_cpus each, round
+  // robin; the timer thread and the client's callback thread are confined to
+  // their whole list
+  std::string worker_cpus;
+  std::string timer_cpus;
+  std::string callback_cpus;
+
+  // Capture settings. When set, every received message is appended to this
+  // trace file for later replay
+  std::string capture_file_path;
+
+  // Tracing settings. When set and the trace points are compiled in, hot
+  // path spans are recorded and written to this file as Chrome trace JSON on
+  // shutdown
+  std::string trace_file_path;
+
+  // Bridge mode. Every route's filter is also a subscription; messages that
+  // match a route are forwarded to its upstream broker in addition to being
+  // handled locally
+  std::vector<BridgeUpstream> bridge_upstreams;
+  std::vector<BridgeRoute> bridge_routes;
+
+  // Compiled image the config was loaded from, if any. Its topic filter trie
+  // matches topics against the subscriptions above without building a
+  // TopicMatcher; the Bridge finds its routes through it
+  std::shared_ptr<const ConfigImage> image;
+
   // Validation method
   bool validate() const {
     if (broker_url.empty()) {
@@ -116,12 +251,140 @@ struct Config {
       std::cout << "No message_queue_size " << std::endl;
       return false;
     }
+    if (max_inflight_messages <= control_reserved_inflight) {
+      std::cout << "No max_inflight_messages " << std::endl;
+      return false;
+    }
+    if (realtime_weight == 0 || bulk_weight == 0) {
+      std::cout << "No priority weights " << std::endl;
+      return false;
+    }
+    if (publish_queue_size == 0) {
+      std::cout << "No publish_queue_size " << std::endl;
+      return false;
+    }
+    if (drain_timeout.count() < 0) {
+      std::cout << "No drain_timeout " << std::endl;
+      return false;
+    }
+    if (enable_auto_tuning &&
+        (tuning_target_p99.count() <= 0 || tuning_interval.count() <= 0 ||
+         tuning_min_workers == 0 || tuning_min_workers > tuning_max_workers ||
+         tuning_min_inflight <= control_reserved_inflight ||
+         tuning_min_inflight > tuning_max_inflight ||
+         tuning_min_batch_bytes == 0 ||
+         tuning_min_batch_bytes > tuning_max_batch_bytes)) {
+      std::cout << "No tuning bounds " << std::endl;
+      return false;
+    }
+    for (const auto *cpus : {&worker_cpus, &timer_cpus, &callback_cpus}) {
+      try {
+        parse_cpu_list(*cpus);
+      } catch (const std::invalid_argument &e) {
+        std::cout << e.what() << std::endl;
+        return false;
+      }
+    }
     if (enable_persistence && persistence_directory.empty()) {
       std::cout << "No enable_persistence " << std::endl;
       return false;
     }
+    for (const auto &subscription : subscriptions) {
+      std::string group, filter = subscription;
+      if (subscription.compare(0, SHARED_SUBSCRIPTION_PREFIX.size(),
+                               SHARED_SUBSCRIPTION_PREFIX) == 0 &&
+          !parse_shared_subscription(subscription, group, filter)) {
+        std::cout << "Invalid shared subscription " << subscription
+                  << std::endl;
+        return false;
+      }
+      if (!is_valid_topic_filter(filter)) {
+        std::cout << "Invalid subscription " << subscription << std::endl;
+        return false;
+      }
+    }
+    if (!validate_tls(broker_url, use_ssl, ca_certificate_file,
+                      client_certificate_file, client_private_key_file, ""))
+      return false;
+    if (tls_session_resumption && (!use_ssl || (!mqtt_v5 && clean_session))) {
+      std::cout << "No tls_session_resumption without use_ssl or with a clean "
+                   "MQTT 3.1.1 session "
+                << std::endl;
+      return false;
+    }
+    if (enable_topic_aliases && (!mqtt_v5 || topic_alias_maximum == 0)) {
+      std::cout << "No topic aliases without mqtt_v5 " << std::endl;
+      return false;
+    }
+    for (const auto &upstream : bridge_upstreams) {
+      if (upstream.name.empty() || upstream.broker_url.empty() ||
+          upstream.client_id.empty()) {
+        std::cout << "No name, broker_url or client_id for bridge upstream "
+                  << upstream.name << std::endl;
+        return false;
+      }
+      if (!validate_tls(upstream.broker_url, upstream.use_ssl,
+                        upstream.ca_certificate_file,
+                        upstream.client_certificate_file,
+                        upstream.client_private_key_file,
+                        "for bridge upstream " + upstream.name))
+        return false;
+    }
+    for (const auto &route : bridge_routes) {
+      if (std::none_of(bridge_upstreams.begin(), bridge_upstreams.end(),
+                       [&](const BridgeUpstream &upstream) {
+                         return upstream.name == route.upstream;
+                       })) {
+        std::cout << "No bridge upstream " << route.upstream << " for route "
+                  << route.name << std::endl;
+        return false;
+      }
+      if (!is_valid_topic_filter(subscription_filter(route.filter)) ||
+          route.max_pending == 0 ||
+          std::any_of(std::begin(route.qos_map), std::end(route.qos_map),
+                      [](QoSLevel qos) {
+                        return qos < QoSLevel::AT_MOST_ONCE ||
+                               qos > QoSLevel::EXACTLY_ONCE;
+                      })) {
+        std::cout << "Invalid bridge route " << route.name << std::endl;
+        return false;
+      }
+    }
+    if (heartbeat_interval.count() <= 0) {
+      std::cout << "No heartbeat_interval " << std::endl;
+      return false;
+    }
+    if (timer_resolution.count() <= 0) {
+      std::cout << "No timer_resolution " << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  /*
+   * TLS checks shared by the agent's connection and the bridge upstreams.
+   * @param context Appended to the messages, empty for the agent's
+   * connection
+   */
+  static bool validate_tls(const std::string &broker_url, bool use_ssl,
+                           const std::string &ca_certificate_file,
+                           const std::string &client_certificate_file,
+                           const std::string &client_private_key_file,
+                           const std::string &context) {
     if (use_ssl && ca_certificate_file.empty()) {
-      std::cout << "No use_ssl " << std::endl;
+      std::cout << "No ca_certificate_file for use_ssl " << context
+                << std::endl;
+      return false;
+    }
+    if (use_ssl && broker_url.compare(0, 6, "ssl://") != 0 &&
+        broker_url.compare(0, 8, "mqtts://") != 0) {
+      std::cout << "No ssl:// or mqtts:// broker_url for use_ssl " << context
+                << std::endl;
+      return false;
+    }
+    if (client_certificate_file.empty() != client_private_key_file.empty()) {
+      std::cout << "No client certificate without private key " << context
+                << std::endl;
       return false;
     }
     return true;
@@ -133,7 +396,7 @@ struct Config {
  */
 struct log_options {
   log_options() = default;
-  explicit log_options(Config &config)
+  explicit log_options(const Config &config)
       : log_file_path(config.log_file_path), log_level(config.log_level),
         log_to_console(config.log_to_console) {}
   std::string log_file_path;
@@ -157,10 +420,18 @@ public:
   ConfigBuilder &set_credentials(const std::string &username,
                                  const std::string &password);
   ConfigBuilder &set_thread_pool_size(size_t count);
+  ConfigBuilder &set_message_queue_size(size_t size);
   ConfigBuilder &add_subscription(const std::string &topic, QoSLevel qos);
+  ConfigBuilder &add_shared_subscription(const std::string &group,
+                                         const std::string &topic,
+                                         QoSLevel qos);
   ConfigBuilder &enable_persistence(const std::string &directory);
   ConfigBuilder &set_qos_level(QoSLevel qos);
   ConfigBuilder &enable_ssl(const std::string &ca_cert);
+  ConfigBuilder &set_client_certificate(const std::string &certificate,
+                                        const std::string &private_key);
+  ConfigBuilder &enable_tls_session_resumption();
+  ConfigBuilder &set_clean_session(bool clean_session);
   ConfigBuilder &set_last_will(const std::string &topic,
                                const std::string &message, QoSLevel qos,
                                bool retained);
@@ -170,12 +441,57 @@ public:
 
   ConfigBuilder &enable_auto_reconnect(std::chrono::seconds delay);
 
+  ConfigBuilder &enable_mqtt_v5();
+  ConfigBuilder &enable_topic_aliases(uint16_t maximum);
+  ConfigBuilder &set_rpc(const std::string &response_topic,
+                         std::chrono::milliseconds timeout);
+
+  ConfigBuilder &set_heartbeat_interval(std::chrono::seconds interval);
+  ConfigBuilder &set_timer_resolution(std::chrono::milliseconds resolution);
+  ConfigBuilder &set_metrics(bool enabled, std::chrono::seconds interval);
+  ConfigBuilder &enable_capture(const std::string &path);
+  ConfigBuilder &enable_tracing(const std::string &path);
+  ConfigBuilder &enable_message_pool(bool enabled);
+  ConfigBuilder &set_inflight_window(size_t max_inflight,
+                                     size_t control_reserved);
+  ConfigBuilder &set_priority_weights(size_t realtime, size_t bulk);
+  ConfigBuilder &set_starvation_bounds(std::chrono::milliseconds realtime,
+                                       std::chrono::milliseconds bulk);
+  ConfigBuilder &set_publish_queue_size(size_t size);
+  ConfigBuilder &set_drain_timeout(std::chrono::milliseconds timeout);
+  ConfigBuilder &enable_auto_tuning(std::chrono::milliseconds target_p99,
+                                    std::chrono::milliseconds interval);
+  ConfigBuilder &set_tuning_bounds(size_t min_workers, size_t max_workers,
+                                   size_t min_inflight, size_t max_inflight,
+                                   size_t min_batch_bytes,
+                                   size_t max_batch_bytes);
+  ConfigBuilder &set_cpu_affinity(const std::string &workers,
+                                  const std::string &timer,
+                                  const std::string &callback);
+  ConfigBuilder &add_bridge_upstream(const BridgeUpstream &upstream);
+  ConfigBuilder &add_bridge_route(const BridgeRoute &route, QoSLevel qos);
+
   /*
    * @desc Build a Config object from a json file.
    * @param path Path to json file
    */
   static Config load_from_json(const std::string &path);
 
+  /*
+   * @desc Build a Config object from an image written by ConfigImage::compile.
+   * The image was validated when it was compiled, so only its integrity is
+   * checked.
+   * @param path Path to the image
+   */
+  static Config load_from_image(const std::string &path);
+
+  /*
+   * @desc Build a Config object from a config image or a json file, depending
+   * on the contents of the file.
+   * @param path Path to the image or json file
+   */
+  static Config load(const std::string &path);
+
   /*
    * @desc Finalize the build of the Config object.
    */
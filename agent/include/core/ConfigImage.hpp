@@ -0,0 +1,168 @@
+#pragma once
+
+#include "Config.hpp"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Binary config image layout. All integers are little endian and every
+ * section starts on an 8 byte boundary so a memory mapped image can be read
+ * in place. Offsets are relative to the start of the image.
+ *
+ *   ConfigImageHeader
+ *   settings       ImageSetting[]       Every Config field but subscriptions
+ *   strings        char[]               String values, subscriptions, levels
+ *   subscriptions  ImageSubscription[]  In Config::subscriptions order
+ *   nodes          ImageNode[]          Topic filter trie, root first
+ *   edges          ImageEdge[]          Literal children, sorted per node
+ *   values         uint32_t[]           Subscription indices per node
+ *   bridge         ImageSetting[]       Bridge upstreams and routes
+ *
+ * Every bridge upstream or route starts with a setting of id
+ * IMAGE_BRIDGE_ELEMENT whose value is IMAGE_BRIDGE_UPSTREAM or
+ * IMAGE_BRIDGE_ROUTE, followed by the settings of its fields.
+ */
+struct ImageSection {
+  uint64_t offset;
+  uint64_t count; // Elements, or bytes for strings
+};
+
+struct ConfigImageHeader {
+  char magic[4];     // "MQCI"
+  uint32_t version;  // CONFIG_IMAGE_VERSION
+  uint64_t size;     // Size of the whole image
+  uint64_t checksum; // FNV-1a of everything after the header
+  ImageSection settings;
+  ImageSection strings;
+  ImageSection subscriptions;
+  ImageSection nodes;
+  ImageSection edges;
+  ImageSection values;
+  ImageSection bridge;
+};
+
+struct ImageSetting {
+  uint16_t id;     // Stable id of the Config field
+  uint8_t type;    // IMAGE_SETTING_*
+  uint8_t reserved;
+  uint32_t length; // String length
+  int64_t value;   // Integer value, or string offset
+};
+
+struct ImageSubscription {
+  uint32_t offset; // Subscription string
+  uint32_t length;
+  uint8_t qos;
+  uint8_t reserved[7];
+};
+
+struct ImageNode {
+  uint32_t first_edge;
+  uint32_t edge_count;
+  uint32_t first_value;
+  uint32_t value_count;
+  uint32_t single_child; // '+' child or IMAGE_NONE
+  uint32_t multi_child;  // '#' child or IMAGE_NONE
+};
+
+struct ImageEdge {
+  uint32_t label_offset;
+  uint32_t label_length;
+  uint32_t child;
+  uint32_t reserved;
+};
+
+const uint32_t CONFIG_IMAGE_VERSION = 2;
+const uint32_t IMAGE_NONE = 0xffffffff;
+const uint8_t IMAGE_SETTING_INTEGER = 0;
+const uint8_t IMAGE_SETTING_STRING = 1;
+const uint16_t IMAGE_BRIDGE_ELEMENT = 0;
+const int64_t IMAGE_BRIDGE_UPSTREAM = 1;
+const int64_t IMAGE_BRIDGE_ROUTE = 2;
+
+/**
+ * A Config compiled into a binary image, read through a read-only memory
+ * mapping.
+ *
+ * compile() validates the configuration and precomputes what startup
+ * otherwise derives from the JSON: the subscription list with its QoS table
+ * and a trie of the subscription filters. Loading checks the header,
+ * checksum and bounds once and then reads everything in place, without
+ * parsing or validating individual entries. Settings are stored by field id,
+ * so an image stays readable when fields are added.
+ */
+class ConfigImage {
+public:
+  /*
+   * @param path Path of the image
+   * @throws std::runtime_error if the file is missing, not an image of this
+   * version or corrupt
+   */
+  explicit ConfigImage(const std::string &path);
+
+  ~ConfigImage();
+
+  /* Do not allow copying */
+  ConfigImage(const ConfigImage &obj) = delete;
+  ConfigImage &operator=(const ConfigImage &obj) = delete;
+
+  /*
+   * Writes config as an image, replacing path atomically.
+   * @throws std::invalid_argument if config does not validate
+   * @throws std::runtime_error if the image cannot be written
+   */
+  static void compile(const Config &config, const std::string &path);
+
+  /* Checks whether path starts like a config image */
+  static bool is_image(const std::string &path);
+
+  /*
+   * Fills config with the stored settings, subscriptions, QoS table and
+   * bridge.
+   * Fields missing from the image keep their value.
+   */
+  void read(Config &config) const;
+
+  size_t subscription_count() const { return subscription_count_; }
+
+  /* Subscription string, pointing into the mapping */
+  std::string_view subscription(size_t index) const;
+
+  QoSLevel subscription_qos(size_t index) const;
+
+  /*
+   * Appends the index of every subscription whose filter matches topic to
+   * out, using the precompiled trie. Follows the rules of TopicMatcher.
+   */
+  void match(std::string_view topic, std::vector<size_t> &out) const;
+
+  /* Size of the mapping in bytes */
+  size_t size() const { return size_; }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+
+  const ImageSetting *settings_ = nullptr;
+  size_t setting_count_ = 0;
+  const char *strings_ = nullptr;
+  const ImageSubscription *subscriptions_ = nullptr;
+  size_t subscription_count_ = 0;
+  const ImageNode *nodes_ = nullptr;
+  const ImageEdge *edges_ = nullptr;
+  const uint32_t *values_ = nullptr;
+  const ImageSetting *bridge_ = nullptr;
+  size_t bridge_count_ = 0;
+
+  /* Checks every offset and index of the image. Throws if one is off */
+  void validate(const ConfigImageHeader &header, const std::string &path);
+
+  std::string_view string_at(uint32_t offset, uint32_t length) const {
+    return std::string_view(strings_ + offset, length);
+  }
+
+  void match(uint32_t node, const std::vector<std::string_view> &levels,
+             size_t index, std::vector<size_t> &out) const;
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+
+/**
+ * Watches a configuration file with inotify and reports changes.
+ *
+ * The directory of the file is watched rather than the file itself, so
+ * editors and deployment tools that replace the file through a rename are
+ * picked up as well. Bursts of events are debounced into one notification.
+ */
+class ConfigWatcher {
+public:
+  /* Called on the watcher thread with the path of the changed file */
+  using ChangeHandler = std::function<void(const std::string &path)>;
+
+  /*
+   * @param path Path of the configuration file
+   * @param on_change Called once the file has been quiet for debounce
+   * @param debounce Quiet period required after the last event
+   */
+  ConfigWatcher(const std::string &path, ChangeHandler on_change,
+                std::chrono::milliseconds debounce =
+                    std::chrono::milliseconds{200});
+
+  /* Stops the watcher thread */
+  ~ConfigWatcher();
+
+  /* Do not allow copying */
+  ConfigWatcher(const ConfigWatcher &obj) = delete;
+  ConfigWatcher &operator=(const ConfigWatcher &obj) = delete;
+
+  /*
+   * Starts watching.
+   * @return false if the file's directory cannot be watched
+   */
+  bool start();
+
+  /* Stops watching and joins the watcher thread */
+  void stop();
+
+private:
+  std::string directory_;
+  std::string file_name_;
+  ChangeHandler on_change_;
+  std::chrono::milliseconds debounce_;
+
+  int inotify_fd_ = -1;
+  int stop_fd_ = -1;
+  std::thread thread_;
+
+  /* Reads pending events. Returns true if any of them concern the file */
+  bool read_events();
+
+  void thread_main();
+};
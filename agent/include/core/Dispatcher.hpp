@@ -0,0 +1,161 @@
+#pragma once
+
+#include "MQTTMetrics.hpp"
+#include "TopicMatcher.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mqtt/message.h>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Hands incoming messages to a pool of worker threads which run the handlers
+ * registered for the matching topic filters.
+ *
+ * Routes are keyed by subscription: a shared subscription
+ * ($share/<group>/<filter>) routes messages published on <filter> and
+ * accounts them to the share group in PlatformMetrics. A message that
+ * carries MQTT v5 subscription identifiers only goes to the routes of the
+ * subscriptions that delivered it, so a plain subscription overlapping a
+ * shared one does not feed the group. Handlers run without the routes lock
+ * held and may register further handlers. The queue is bounded;
+ * dispatch() blocks the caller while it is full, which pushes back on the
+ * network instead of growing without limit.
+ */
+class Dispatcher {
+public:
+  using Handler = std::function<void(const mqtt::const_message_ptr &msg)>;
+
+  /*
+   * @param metrics Metrics updated for every processed message
+   * @param workers Number of worker threads
+   * @param queue_size Maximum number of queued messages
+   * @param cpus CPUs the workers are pinned to, one each and round robin.
+   * Empty leaves them unpinned
+   */
+  Dispatcher(PlatformMetrics &metrics, size_t workers, size_t queue_size,
+             std::vector<int> cpus = {});
+
+  /* Stops the workers, dropping queued messages */
+  ~Dispatcher();
+
+  /* Do not allow copying */
+  Dispatcher(const Dispatcher &obj) = delete;
+  Dispatcher &operator=(const Dispatcher &obj) = delete;
+
+  /*
+   * Registers a subscription so its messages are routed and, for shared
+   * subscriptions, counted against the share group.
+   * @return Subscription identifier to subscribe with, so messages tagged
+   * with it reach this route only. Derived from subscription alone
+   */
+  int add_subscription(const std::string &subscription);
+
+  /*
+   * Registers a handler for a subscription.
+   * @param subscription Topic filter or $share/<group>/<filter>
+   * @param handler Called on a worker thread for every matching message
+   */
+  void add_handler(const std::string &subscription, Handler handler);
+
+  /*
+   * Queues a message for the workers. Blocks while the queue is full.
+   * @return false if the dispatcher is stopped or has no routes
+   */
+  bool dispatch(mqtt::const_message_ptr msg);
+
+  /* Starts the worker threads */
+  void start();
+
+  /*
+   * Changes the number of workers, also while running. Surplus workers leave
+   * after their current message; growing starts new workers right away.
+   * Never waits for a running handler.
+   */
+  void set_worker_count(size_t workers);
+
+  size_t worker_count() const;
+
+  /*
+   * Blocks until the queue is empty and no handler runs, or until deadline.
+   * @return true if the dispatcher is idle
+   */
+  bool drain(std::chrono::steady_clock::time_point deadline);
+
+  /*
+   * Stops and joins the worker threads. Handlers that are running finish
+   * first.
+   * @return The messages that were still queued
+   */
+  std::vector<mqtt::const_message_ptr> stop();
+
+  /* Number of messages waiting for a worker */
+  size_t queue_depth() const;
+
+private:
+  struct Queued {
+    mqtt::const_message_ptr msg;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  struct Worker {
+    std::thread thread;
+    size_t index = 0;     // Picks the worker's CPU
+    bool retired = false; // Leave after the current message
+    bool done = false;    // Left, so joining does not wait for a handler
+  };
+
+  struct Route {
+    std::string subscription;
+    std::string group; // Empty for plain subscriptions
+    int identifier = 0; // Set by add_subscription
+    // Replaced rather than changed, so workers run a copy without the lock
+    std::shared_ptr<const std::vector<Handler>> handlers;
+  };
+
+  // Route of a message, taken under the lock and run after releasing it
+  struct Matched {
+    const Route *route;
+    GroupMetrics *group;
+    std::shared_ptr<const std::vector<Handler>> handlers;
+  };
+
+  PlatformMetrics &metrics_;
+  size_t worker_count_; // Guarded by queue_mutex_ once started
+  size_t queue_size_;
+  std::vector<int> cpus_;
+
+  // Routes never shrink, so indices in matcher_ and pointers to the routes
+  // stay valid
+  mutable std::shared_mutex routes_mutex_;
+  std::deque<Route> routes_;
+  TopicMatcher matcher_;
+
+  mutable std::mutex queue_mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::condition_variable idle_;
+  std::deque<Queued> queue_;
+  size_t active_ = 0; // Workers running handlers
+  bool stopping_ = false;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  // Workers retired by set_worker_count, joined once they are done or by
+  // stop()
+  std::vector<std::unique_ptr<Worker>> retired_;
+
+  /* Returns the index of the route for subscription. Lock must be held */
+  size_t route_for(const std::string &subscription);
+
+  void process(const mqtt::const_message_ptr &msg);
+  /* Starts a worker. Lock must be held */
+  void spawn(size_t index);
+
+  /* Pins the worker and runs handlers until stop() or its retirement */
+  void worker_main(Worker *worker);
+};
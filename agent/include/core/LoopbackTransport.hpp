@@ -0,0 +1,207 @@
+#pragma once
+
+#include "TopicMatcher.hpp"
+#include "Transport.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Network conditions simulated by a LoopbackBroker
+ */
+struct LoopbackConditions {
+  // One way delay of every packet
+  std::chrono::microseconds latency{0};
+
+  // Probability in [0, 1] that a packet is lost. Lost QoS 0 packets are gone;
+  // lost QoS 1 and 2 packets are retransmitted after retry_interval, so they
+  // arrive exactly once, late
+  double loss = 0.0;
+  std::chrono::microseconds retry_interval{10000};
+};
+
+class LoopbackTransport;
+
+/**
+ * In-memory stand-in for an MQTT broker. LoopbackTransports attached to the
+ * same broker exchange messages through it, with topic filter matching,
+ * shared subscriptions, retained messages and QoS acknowledgements, but
+ * without sockets.
+ *
+ * Every packet is scheduled on the broker's delivery thread, which also runs
+ * the clients' callbacks in order, the way a Paho client's callback thread
+ * does.
+ */
+class LoopbackBroker {
+public:
+  /*
+   * @param seed Seed of the packet loss generator, so lossy runs are
+   * reproducible
+   */
+  explicit LoopbackBroker(uint32_t seed = 1);
+
+  /* Stops the delivery thread. Attached transports must be destroyed first */
+  ~LoopbackBroker();
+
+  /* Do not allow copying */
+  LoopbackBroker(const LoopbackBroker &obj) = delete;
+  LoopbackBroker &operator=(const LoopbackBroker &obj) = delete;
+
+  /* Changes the simulated network conditions for packets sent from now on */
+  void set_conditions(const LoopbackConditions &conditions);
+
+  LoopbackConditions conditions() const;
+
+  /* Messages the broker has routed to subscribers */
+  size_t messages_routed() const { return messages_routed_; }
+
+  /* Packets dropped by the simulated loss */
+  size_t packets_lost() const { return packets_lost_; }
+
+  /*
+   * Blocks until every scheduled packet has been delivered.
+   * @return false if packets are still pending after timeout
+   */
+  bool wait_idle(std::chrono::milliseconds timeout);
+
+private:
+  friend class LoopbackTransport;
+
+  using Clock = std::chrono::steady_clock;
+
+  struct Event {
+    Clock::time_point due;
+    uint64_t sequence; // Keeps events with the same due time in FIFO order
+    std::function<void()> action;
+
+    bool operator>(const Event &other) const {
+      return due != other.due ? due > other.due : sequence > other.sequence;
+    }
+  };
+
+  struct Subscription {
+    uint64_t client = 0;
+    std::string subscription;
+    std::string group; // Empty for non-shared subscriptions
+    int qos = 0;
+    int identifier = 0; // Tagged on deliveries unless 0
+  };
+
+  mutable std::mutex mutex_;
+  LoopbackConditions conditions_;
+  std::mt19937 random_;
+  std::uniform_real_distribution<double> loss_distribution_{0.0, 1.0};
+
+  uint64_t next_client_ = 1;
+  std::unordered_map<uint64_t, LoopbackTransport *> clients_;
+
+  // Subscriptions indexed by the matcher; erased slots are reused
+  TopicMatcher matcher_;
+  std::vector<Subscription> subscriptions_;
+  std::vector<size_t> free_subscriptions_;
+  std::map<std::string, size_t> group_cursors_;
+  std::map<std::string, mqtt::const_message_ptr> retained_;
+
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events_;
+  uint64_t next_sequence_ = 0;
+  bool stopping_ = false;
+  bool delivering_ = false;
+  std::condition_variable wakeup_;
+  std::condition_variable idle_;
+
+  // Held while a client callback runs, so detach() can wait for it
+  std::mutex callback_mutex_;
+
+  std::atomic<size_t> messages_routed_{0};
+  std::atomic<size_t> packets_lost_{0};
+
+  std::thread thread_;
+
+  uint64_t attach(LoopbackTransport *client);
+  void detach(uint64_t client);
+
+  void subscribe(uint64_t client, const std::string &subscription, int qos,
+                 int identifier);
+  void unsubscribe(uint64_t client, const std::string &subscription);
+  void publish(uint64_t client, mqtt::const_message_ptr msg);
+
+  /* Removes a subscription. Lock must be held */
+  void erase_subscription(size_t index);
+
+  /* Delivers a published message to the matching subscriptions */
+  void route(const mqtt::const_message_ptr &msg);
+
+  /*
+   * Sends a packet over the simulated network: action runs on the delivery
+   * thread after the latency, unless the packet is lost. Lock must be held
+   */
+  void transmit(int qos, std::function<void()> action);
+
+  /* Queues action to run after delay. Lock must be held */
+  void schedule(Clock::duration delay, std::function<void()> action);
+
+  /* Runs a callback of client unless it has been detached meanwhile */
+  void notify(uint64_t client,
+              const std::function<void(LoopbackTransport &)> &callback);
+
+  void thread_main();
+};
+
+/**
+ * Transport that connects to a LoopbackBroker in the same process.
+ */
+class LoopbackTransport : public Transport {
+public:
+  explicit LoopbackTransport(LoopbackBroker &broker);
+
+  /* Detaches from the broker, dropping the client's subscriptions */
+  ~LoopbackTransport() override;
+
+  /* Do not allow copying */
+  LoopbackTransport(const LoopbackTransport &obj) = delete;
+  LoopbackTransport &operator=(const LoopbackTransport &obj) = delete;
+
+  void set_listener(TransportListener &listener) override;
+  ConnectResult connect(const mqtt::connect_options &options) override;
+  void disconnect() override;
+  bool is_connected() const override;
+  void subscribe(const std::string &subscription, int qos,
+                 int identifier = 0) override;
+  void unsubscribe(const std::string &subscription) override;
+  void publish(const mqtt::message_ptr &msg) override;
+
+  /*
+   * Simulates a lost connection: the listener is told on the calling thread
+   * and the broker keeps the client's subscriptions
+   */
+  void drop();
+
+  /*
+   * Simulates an automatic reconnect after drop(). Without a present session
+   * the broker forgets the client's subscriptions first
+   */
+  void reconnect(bool session_present);
+
+private:
+  friend class LoopbackBroker;
+
+  LoopbackBroker &broker_;
+  uint64_t id_;
+  std::atomic<bool> connected_{false};
+  TransportListener *listener_ = nullptr;
+
+  /* Queues the connected callback. Broker lock must be held */
+  void schedule_connected();
+
+  /* Drops the client's subscriptions. Broker lock must be held */
+  void erase_subscriptions();
+};
@@ -1,11 +1,26 @@
 #ifndef MQTTAGENT_HPP
 #define MQTTAGENT_HPP
 
+#include "AutoTuner.hpp"
+#include "Bridge.hpp"
 #include "Config.hpp"
+#include "Dispatcher.hpp"
 #include "MQTTCallback.hpp"
+#include "MessageTrace.hpp"
+#include "PublishScheduler.hpp"
+#include "RPCClient.hpp"
+#include "TimerWheel.hpp"
+#include "TopicAliases.hpp"
+#include "Transport.hpp"
 #include <atomic>
 #include <cstdlib>
 #include <ctime>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <mqtt/async_client.h>
 #include <mqtt/delivery_token.h>
 #include <mqtt/message.h>
@@ -14,38 +29,111 @@
 /*
  * Basic MQTT Connection and Messaging
  */
-class MQTTAgent {
+class MQTTAgent : private TransportListener {
 private:
   static MQTTAgent *instance;
 
-  // Object that describes the configuration of this client
-  Config config_;
+  // Object that describes the configuration of this client. Immutable
+  // snapshot that apply_config() swaps atomically; always read it through
+  // config()
+  std::shared_ptr<const Config> config_;
 
-  // Smart pointer to mqtt::async_client object
-  std::unique_ptr<mqtt::async_client> client_;
+  // Serializes apply_config() calls and tuning intervals
+  std::mutex reload_mutex_;
+
+  // Trace of received messages. Only created if Config::capture_file_path
+  // is set. Declared before transport_ and timers_ so it outlives both
+  std::unique_ptr<TraceWriter> capture_;
 
   // Reference to a callback object
   MQTTCallback &callback_;
 
+  // Forwards matching messages to upstream brokers. Only created if the
+  // config has bridge routes. Declared before transport_ so it outlives the
+  // callbacks that feed it
+  std::unique_ptr<Bridge> bridge_;
+
   // Connection options
   mqtt::connect_options connect_options_;
 
+  // Outbound queues per priority class, feeding the in-flight window.
+  // Declared before timers_ so the heartbeat cannot outlive it
+  PublishScheduler scheduler_;
+
+  // Runs heartbeats and other periodic work. Its tasks reach into members
+  // declared after it, so the destructor stops it first
+  TimerWheel timers_;
+
+  // CPUs of the client's callback thread, from Config::callback_cpus
+  std::vector<int> callback_cpus_;
+
+  // Periodic tasks of run(), rescheduled when their intervals are reloaded
+  std::mutex periodic_mutex_;
+  bool periodic_active_ = false;
+  TimerWheel::TimerId heartbeat_timer_ = 0;
+  TimerWheel::TimerId metrics_timer_ = 0;
+  TimerWheel::TimerId capture_timer_ = 0;
+  TimerWheel::TimerId tuning_timer_ = 0;
+
+  // Adjusts workers, in-flight window and publish batch to the load. Only
+  // created if Config::enable_auto_tuning is set
+  std::unique_ptr<AutoTuner> tuner_;
+  std::atomic<size_t> heartbeat_count_{0};
+
+  // Topic alias tables of the current connection, and the alias maximum the
+  // broker advertised in its last CONNACK
+  OutboundTopicAliases outbound_aliases_;
+  InboundTopicAliases inbound_aliases_;
+  std::atomic<uint16_t> broker_alias_maximum_{0};
+
+  // steady_clock time the connection was lost, 0 while connected. Used for
+  // PlatformMetrics::reconnect_latency
+  std::atomic<int64_t> connection_lost_at_{0};
+
+  // Pending request table for RPC calls. Only created for MQTT v5
+  std::unique_ptr<RPCClient> rpc_;
+
+  // Filters and their QoS as last sent to the broker's session, including
+  // the RPC response topic. A reload while disconnected only changes the
+  // config; the difference is sent once connected again, also when the
+  // session is resumed
+  std::mutex subscriptions_mutex_;
+  std::unordered_map<std::string, int> subscribed_;
+
+  // Runs message handlers on Config::thread_pool_size workers. Declared
+  // after anything a handler may use, and stopped by the destructor before
+  // the transport goes
+  Dispatcher dispatcher_;
+
+  // Connection to the broker, an mqtt::async_client unless a transport was
+  // passed to get_instance. Declared last: destroying it waits for a
+  // callback that is running and ends them, so none reaches a member that
+  // is already gone
+  std::unique_ptr<Transport> transport_;
+
   // True if the user requests a shutdown via Ctrl + C
   static std::atomic<bool> shutdown_requested;
 
+  // eventfd that wakes run() as soon as a shutdown is requested
+  static int shutdown_event_fd;
+
   /*
    * Constructor that copies config into member variable, creates
-   * mqtt::async_client object and sets callback and connection options for the
-   * client object
+   * the transport and sets callback and connection options for it
    * @param config Config object that describes the configuration for the agent
+   * @param transport Transport to use, or null for an mqtt::async_client
    */
-  MQTTAgent(const Config &config, MQTTCallback &callback);
+  MQTTAgent(const Config &config, MQTTCallback &callback,
+            std::unique_ptr<Transport> transport);
 
   /* Do not allow copying */
   MQTTAgent(const MQTTAgent &obj) = delete;
 
-  /* Keep destructor private */
-  ~MQTTAgent() = default;
+  /*
+   * Keep destructor private. Stops the timer wheel and the dispatcher before
+   * any member a task or handler may use is destroyed
+   */
+  ~MQTTAgent();
 
 public:
   /*
@@ -55,6 +143,14 @@ public:
    */
   static MQTTAgent &get_instance(const Config &config, MQTTCallback &callback);
 
+  /*
+   * Get singleton instance of MQTTAgent that talks to the broker through
+   * transport, e.g. a LoopbackTransport. The transport is ignored if the
+   * instance already exists.
+   */
+  static MQTTAgent &get_instance(const Config &config, MQTTCallback &callback,
+                                 std::unique_ptr<Transport> transport);
+
   static void release_instance();
 
   /*
@@ -69,19 +165,102 @@ public:
    *  @param payload The payload for the message
    *  @param qos The QoS level for this message
    *  @param retained Determines whether this message is retained
+   *  @param priority The class the message is queued in until the in-flight
+   *  window has room for it
    */
   void publish_message(const std::string &topic, const std::string &payload,
                        QoSLevel qos = QoSLevel::AT_LEAST_ONCE,
-                       bool retained = false);
+                       bool retained = false,
+                       Priority priority = Priority::REALTIME);
 
   /*
-   * Starts the agent. Currently sends a heartbeat every 10 seconds until
-   * interrupted by Ctrl + C.
+   * Registers a handler for messages on a subscription. Handlers run on the
+   * dispatcher's worker threads, after the callback's message_arrived.
+   * @param subscription Topic filter or $share/<group>/<filter>. Handlers for
+   * a shared subscription receive the messages published on <filter> and are
+   * counted in the group's metrics
+   * @param handler Called for every matching message
+   */
+  void add_handler(const std::string &subscription,
+                   Dispatcher::Handler handler);
+
+  /*
+   * Sends an RPC request and returns a future for the response. The request
+   * carries this agent's response topic and a correlation id; the future
+   * holds an RPCError if no response arrives within Config::rpc_timeout.
+   * Requires Config::mqtt_v5.
+   * @param topic The topic the responder listens on
+   * @param payload The payload of the request
+   * @param qos The QoS level of the request
+   */
+  std::future<mqtt::const_message_ptr>
+  call(const std::string &topic, const std::string &payload,
+       QoSLevel qos = QoSLevel::AT_LEAST_ONCE);
+
+  /*
+   * Sends an RPC request and invokes callback once with the response or the
+   * timeout. Requires Config::mqtt_v5.
+   */
+  void call(const std::string &topic, const std::string &payload,
+            RPCClient::ResponseCallback callback,
+            QoSLevel qos = QoSLevel::AT_LEAST_ONCE);
+
+  /*
+   * Publishes the response to an RPC request received by this agent.
+   * @param request The request message, as passed to message_arrived
+   * @param payload The payload of the response
+   * @return false if request carries no response topic
+   */
+  bool reply(const mqtt::const_message_ptr &request, const std::string &payload,
+             QoSLevel qos = QoSLevel::AT_LEAST_ONCE);
+
+  /*
+   * Runs a message through the receive path as if it had just arrived from
+   * the broker: RPC responses, the callback's message_arrived and the
+   * dispatcher. Used to replay captured traffic.
+   * @param msg The message, with its topic alias already resolved
+   */
+  void deliver(mqtt::const_message_ptr msg);
+
+  /*
+   * Starts the agent. Sends a heartbeat every Config::heartbeat_interval and
+   * reports metrics every Config::metrics_report_interval until interrupted
+   * by Ctrl + C.
    */
   void run();
 
   /*
-   * Unsubscribes from all active subscriptions and disconnects the client.
+   * Returns the current configuration snapshot. The snapshot never changes;
+   * apply_config() replaces it with a new one.
+   */
+  std::shared_ptr<const Config> config() const {
+    return std::atomic_load(&config_);
+  }
+
+  /*
+   * Applies a reloaded configuration without reconnecting. Subscriptions are
+   * diffed into the minimal SUBSCRIBE/UNSUBSCRIBE calls; logging, metrics,
+   * heartbeat, default QoS and timeout settings take effect immediately.
+   * Settings bound to the connection or the thread pools keep their current
+   * value.
+   * @param config The new configuration
+   * @return Names of the changed settings that need a restart
+   */
+  std::vector<std::string> apply_config(const Config &config);
+
+  /*
+   * Timer wheel of the agent. Periodic and one-shot work can be scheduled on
+   * it; tasks run on the wheel thread.
+   */
+  TimerWheel &timers() { return timers_; }
+
+  /*
+   * Stops intake, drains and disconnects. All subscriptions are removed;
+   * then queued handler work, and after it queued and in-flight publishes,
+   * get up to Config::drain_timeout to complete. Publishes are refused once
+   * the handlers are done and count as dropped. What is left goes to the
+   * offline store if persistence is enabled and is dropped otherwise; the
+   * counts end up in PlatformMetrics.
    */
   void shutdown();
 
@@ -92,15 +271,105 @@ public:
   static void signal_handler(int signum) {
     std::cout << "\nReceived signal " << signum
               << ". Initiating graceful shutdown..." << std::endl;
-    shutdown_requested = true;
+    request_shutdown();
   }
 
+  /*
+   * Makes run() return as soon as possible. Async-signal-safe.
+   */
+  static void request_shutdown();
+
 private:
+  /*
+   * Queues a prepared message in its priority class.
+   */
+  void send(mqtt::message_ptr msg, Priority priority);
+
+  /*
+   * Hands a message to the transport, reporting the outcome to callback_.
+   * Called by scheduler_.
+   * @return false if the transport refused the message
+   */
+  bool transmit(const mqtt::message_ptr &msg);
+
+  /*
+   * Returns a copy of msg using an outbound topic alias when enabled, or msg
+   * itself. Called by scheduler_ in send order.
+   */
+  mqtt::message_ptr encode(const mqtt::message_ptr &msg);
+
+  /* Forgets the topic aliases of the previous connection */
+  void reset_topic_aliases();
+
+  /* Throws if RPC is not available on this agent */
+  RPCClient &rpc();
+
+  /*
+   * Runs one interval of the tuner and applies its decisions to the
+   * dispatcher and the scheduler. Called on the timer wheel.
+   */
+  void tune();
+
+  /* Confines the calling callback thread to callback_cpus_, once */
+  void pin_callback_thread();
+
+  // TransportListener. Routes RPC responses to rpc_ and forwards everything
+  // else to callback_
+  void connected(const std::string &cause) override;
+  void connection_lost(const std::string &cause) override;
+  void message_arrived(mqtt::const_message_ptr msg) override;
+  void delivery_complete(const mqtt::const_message_ptr &msg,
+                         const mqtt::delivery_token_ptr &tok) override;
+  void delivery_failed(const mqtt::const_message_ptr &msg) override;
+
   /*
    * Configures the connect_options member variable via the
    * mqtt::connect_options_builder.
    */
   void setup_connection_options();
+
+  /*
+   * Blocks until request_shutdown() has been called.
+   */
+  void wait_for_shutdown();
+
+  /*
+   * Schedules heartbeat, metrics report and tuning. periodic_mutex_ must be
+   * held
+   */
+  void schedule_periodic_work(const Config &config);
+
+  /* Cancels the tasks of schedule_periodic_work. periodic_mutex_ must be held */
+  void cancel_periodic_work();
+
+  /*
+   * Brings the session's subscriptions in line with the current config:
+   * unsubscribes from filters no longer in it and subscribes to new filters
+   * and filters whose QoS changed. Does nothing while disconnected.
+   * @param session_present false if the broker started a new session, which
+   * has no subscriptions
+   */
+  void update_subscriptions(bool session_present);
+
+  /*
+   * Waits for the dispatcher, then for the publish queues and the in-flight
+   * window until deadline, then persists or drops what is left.
+   */
+  void drain(std::chrono::steady_clock::time_point deadline);
+
+  /*
+   * Path of one file of the offline store: publishes that were not
+   * acknowledged ("unsent") or received messages that were not handled
+   * ("unprocessed") at the last shutdown.
+   */
+  std::string offline_store_path(const std::string &kind) const;
+
+  /*
+   * Queues the unsent publishes in their class and dispatches the
+   * unprocessed messages of the offline store, then removes them from it.
+   * Stale control messages are dropped.
+   */
+  void restore_offline_store();
 };
 
 #endif
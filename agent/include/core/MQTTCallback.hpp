@@ -1,5 +1,7 @@
 #include "Config.hpp"
 #include "MQTTMetrics.hpp"
+#include "MessagePool.hpp"
+#include <atomic>
 #include <cstdlib>
 #include <ctime>
 #include <fstream>
@@ -16,14 +18,23 @@ private:
   std::string client_id;
 
   std::ofstream log_file;
+  std::string log_file_path;
   std::mutex log_mutex;
-  LogLevel log_level;
-  bool log_to_console;
+  std::atomic<LogLevel> log_level;
+  std::atomic<bool> log_to_console;
+  std::atomic<bool> log_to_file{false};
+
+  // Pool counters at the previous metrics report
+  MessagePool::Stats last_pool_stats;
+
+public:
+  // True if a message of this level would be written anywhere. Callers
+  // check it before formatting a log line
+  bool should_log(LogLevel level) const;
 
   // Central logging function
   void log(LogLevel level, const std::string &msg);
 
-public:
   /*
    * Create an implementation of functions to respond to async events
    * @param client_id String that identifies the client. Only used for logging
@@ -34,6 +45,19 @@ public:
   // Metrics for the platform
   PlatformMetrics metrics;
 
+  // Logs a one line summary of the platform metrics. Pool allocations are
+  // per message since the previous report
+  void report_metrics();
+
+  // Logs a setting change made by the adaptive tuner
+  void report_tuning(const TuningDecision &decision);
+
+  /*
+   * Changes the log level, console output and log file at runtime.
+   * @param logOpts The new logging options
+   */
+  void set_log_options(const log_options &logOpts);
+
   // Connection callbacks
   virtual void connected(const std::string &cause) override;
 
@@ -47,5 +71,6 @@ public:
 
   virtual void on_success(const mqtt::token &tok) override;
 
+  // tok is null when the agent runs over a transport without Paho tokens
   virtual void delivery_complete(mqtt::delivery_token_ptr tok) override;
 };
@@ -1,7 +1,161 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
 #include <atomic>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Throughput of one shared subscription group
+ */
+struct GroupMetrics {
+    std::atomic<size_t> messages_received = 0;
+    std::atomic<size_t> messages_processed = 0;
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    double get_messages_per_second() const {
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        return elapsed > 0 ? messages_processed / elapsed : 0.0;
+    }
+};
+
+/**
+ * Latency distribution with about 12% resolution. Every power of two of
+ * microseconds is split into 8 linear buckets; recording is lock free
+ */
+struct LatencyHistogram {
+    static const size_t SUB_BUCKETS = 8;
+    static const size_t BUCKETS = 36 * SUB_BUCKETS; // Up to about 76 hours
+
+    std::atomic<size_t> buckets[BUCKETS] = {};
+    std::atomic<size_t> samples = 0;
+    std::atomic<uint64_t> max_us = 0;
+
+    void record(std::chrono::steady_clock::duration latency) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+        uint64_t value = us > 0 ? static_cast<uint64_t>(us) : 0;
+        buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        samples.fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t max = max_us.load(std::memory_order_relaxed);
+        while (value > max && !max_us.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Upper bound of the bucket holding the given quantile, e.g. 0.99
+    double percentile_ms(double quantile) const {
+        size_t total = samples.load(std::memory_order_relaxed);
+        if (total == 0)
+            return 0.0;
+
+        size_t rank = static_cast<size_t>(quantile * total);
+        size_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen > rank)
+                return std::min<uint64_t>(bucket_limit(i), max_us) / 1000.0;
+        }
+        return max_us / 1000.0;
+    }
+
+    static size_t bucket_of(uint64_t us) {
+        if (us < SUB_BUCKETS)
+            return us;
+        size_t exponent = 63 - __builtin_clzll(us);
+        size_t index = (exponent - 2) * SUB_BUCKETS + ((us >> (exponent - 3)) & (SUB_BUCKETS - 1));
+        return index < BUCKETS ? index : BUCKETS - 1;
+    }
+
+    // Largest value, in microseconds, that falls into bucket index
+    static uint64_t bucket_limit(size_t index) {
+        if (index < SUB_BUCKETS)
+            return index;
+        size_t exponent = index / SUB_BUCKETS + 2;
+        uint64_t width = uint64_t(1) << (exponent - 3);
+        return (uint64_t(1) << exponent) + (index % SUB_BUCKETS + 1) * width - 1;
+    }
+};
+
+/**
+ * Outbound traffic of one publish priority class
+ */
+struct PriorityMetrics {
+    std::atomic<size_t> queued = 0;                 // Waiting for the in-flight window
+    std::atomic<size_t> sent = 0;
+    std::atomic<size_t> dropped = 0;                // Queue full, publish failed or expired
+    std::atomic<size_t> expired = 0;                // Not complete within the message timeout
+    std::atomic<size_t> starvation_promotions = 0;  // Sent ahead of its turn after max wait
+    LatencyHistogram queue_latency;                 // Publish call to hand over to the client
+    LatencyHistogram delivery_latency;              // Publish call to delivery_complete (QoS > 0)
+};
+
+/**
+ * Forwarding of one bridge route
+ */
+struct BridgeRouteMetrics {
+    std::atomic<size_t> forwarded = 0;  // Completed by the upstream broker
+    std::atomic<size_t> dropped = 0;    // Over max_pending, publish failed or lost with the session
+    std::atomic<size_t> pending = 0;    // Published and not completed yet
+    std::atomic<size_t> bytes = 0;      // Payload bytes forwarded
+    LatencyHistogram latency;           // Arrival from the local broker to upstream completion
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    double get_messages_per_second() const {
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        return elapsed > 0 ? forwarded / elapsed : 0.0;
+    }
+};
+
+/**
+ * One setting change made by the adaptive tuner
+ */
+struct TuningDecision {
+    std::chrono::system_clock::time_point time;
+    std::string setting;  // "workers", "max_inflight" or "batch_bytes"
+    size_t from = 0;
+    size_t to = 0;
+    std::string reason;
+};
+
+/**
+ * Settings and decisions of the adaptive tuner, for auditing it
+ */
+struct TuningMetrics {
+    static const size_t HISTORY = 64;
+
+    std::atomic<size_t> intervals = 0;          // Intervals evaluated
+    std::atomic<size_t> decisions = 0;          // Setting changes over all intervals
+    std::atomic<size_t> workers = 0;            // Settings in effect
+    std::atomic<size_t> max_inflight = 0;
+    std::atomic<size_t> batch_bytes = 0;
+    std::atomic<double> dispatch_p99_ms = 0.0;  // Measured over the last interval
+    std::atomic<double> publish_p99_ms = 0.0;
+
+    void record(const TuningDecision &decision) {
+        std::lock_guard<std::mutex> lock(recent_mutex);
+        decisions++;
+        recent.push_back(decision);
+        if (recent.size() > HISTORY)
+            recent.pop_front();
+    }
+
+    // The last HISTORY decisions, oldest first
+    std::vector<TuningDecision> history() const {
+        std::lock_guard<std::mutex> lock(recent_mutex);
+        return std::vector<TuningDecision>(recent.begin(), recent.end());
+    }
+
+    std::deque<TuningDecision> recent;
+    mutable std::mutex recent_mutex;
+};
 
 /**
  * Structure for platform metrics
@@ -13,6 +167,19 @@ struct PlatformMetrics {
     std::atomic<size_t> connection_events = 0;
     std::atomic<double> average_processing_time_ms = 0.0;
     std::atomic<bool> is_connected = false;
+    std::atomic<int64_t> topic_alias_bytes_saved_out = 0;
+    std::atomic<int64_t> topic_alias_bytes_saved_in = 0;
+    std::atomic<size_t> connect_failures = 0;
+    // connect() to CONNACK. TCP connect, TLS handshake, broker authentication
+    // and CONNACK together, as Paho does not time the handshake by itself
+    LatencyHistogram connect_latency;
+    LatencyHistogram reconnect_latency;  // Connection lost to connected again
+    std::atomic<size_t> drained_on_shutdown = 0;    // Sent or handled within the drain timeout
+    std::atomic<size_t> persisted_on_shutdown = 0;  // Left to the offline store
+    std::atomic<size_t> dropped_on_shutdown = 0;    // Lost at shutdown
+    std::atomic<size_t> restored_messages = 0;      // Taken from the offline store at connect
+    LatencyHistogram dispatch_latency;  // Queued for the workers to handlers done
+    TuningMetrics tuning;
     std::atomic<std::chrono::system_clock::time_point> start_time;
     
     PlatformMetrics() {
@@ -29,4 +196,41 @@ struct PlatformMetrics {
         auto uptime = get_uptime_seconds();
         return uptime > 0 ? static_cast<double>(messages_processed) / uptime : 0.0;
     }
+
+    // Resident set size of the process, from /proc/self/statm
+    static size_t get_resident_set_bytes() {
+        std::ifstream statm("/proc/self/statm");
+        size_t pages = 0, resident = 0;
+        statm >> pages >> resident;
+        return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+
+    // Per share group metrics, keyed by group name. Entries are never removed
+    // so references returned by group() stay valid
+    GroupMetrics &group(const std::string &name) {
+        std::lock_guard<std::mutex> lock(groups_mutex);
+        auto &entry = groups[name];
+        if (!entry)
+            entry = std::make_unique<GroupMetrics>();
+        return *entry;
+    }
+
+    std::map<std::string, std::unique_ptr<GroupMetrics>> groups;
+    mutable std::mutex groups_mutex;
+
+    // Per bridge route metrics, keyed by route name. Like groups, entries are
+    // never removed
+    BridgeRouteMetrics &bridge_route(const std::string &name) {
+        std::lock_guard<std::mutex> lock(bridge_routes_mutex);
+        auto &entry = bridge_routes[name];
+        if (!entry)
+            entry = std::make_unique<BridgeRouteMetrics>();
+        return *entry;
+    }
+
+    std::map<std::string, std::unique_ptr<BridgeRouteMetrics>> bridge_routes;
+    mutable std::mutex bridge_routes_mutex;
+
+    // Indexed by Priority
+    PriorityMetrics priorities[3];
 };
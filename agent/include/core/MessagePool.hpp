@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <mqtt/message.h>
+#include <new>
+#include <string>
+
+/**
+ * Per-thread pools for the objects created on every publish.
+ *
+ * Small blocks (message objects, shared_ptr control blocks) come from
+ * per-thread free lists of a few size classes, payload strings are recycled
+ * with their capacity, and topic strings are interned per thread. Memory
+ * always returns to the pool of the thread that allocated it: a message
+ * released on another thread (for a publish, by the client after
+ * delivery_complete) is pushed onto a lock-free list the owner collects once
+ * its own free lists run dry. Each thread caches a bounded number of blocks
+ * and frees the rest.
+ *
+ * Only the publish path is pooled. Received messages are built by the client
+ * library, which offers no allocator hook, so they are allocated as usual.
+ */
+class MessagePool {
+public:
+  /* Largest block served from the free lists */
+  static const size_t MAX_BLOCK_SIZE = 512;
+
+  /* Blocks of one size class a thread keeps for reuse */
+  static const size_t MAX_CACHED_BLOCKS = 1024;
+
+  /* Payload strings with a larger capacity are not kept for reuse */
+  static const size_t MAX_CACHED_PAYLOAD = 64 * 1024;
+
+  struct Stats {
+    size_t messages = 0;         // Messages built by make_message
+    size_t heap_allocations = 0; // Blocks and strings the pools had to allocate
+    size_t reused = 0;           // Blocks and strings served from the pools
+
+    double allocations_per_message() const {
+      return messages ? static_cast<double>(heap_allocations) / messages : 0.0;
+    }
+
+    /* Counts since an earlier snapshot */
+    Stats since(const Stats &earlier) const {
+      return {messages - earlier.messages,
+              heap_allocations - earlier.heap_allocations,
+              reused - earlier.reused};
+    }
+  };
+
+  /*
+   * Builds a message from pooled memory. The message behaves like one from
+   * mqtt::make_message.
+   */
+  static mqtt::message_ptr make_message(const std::string &topic,
+                                        const std::string &payload,
+                                        int qos = 0, bool retained = false);
+
+  static void *allocate(size_t size);
+  static void deallocate(void *block, size_t size);
+
+  /* Counters summed over all threads, including finished ones */
+  static Stats stats();
+};
+
+/**
+ * STL allocator over MessagePool, e.g. for std::allocate_shared.
+ */
+template <typename T> struct PoolAllocator {
+  using value_type = T;
+
+  PoolAllocator() = default;
+  template <typename U> PoolAllocator(const PoolAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(MessagePool::allocate(n * sizeof(T)));
+  }
+  void deallocate(T *block, size_t n) {
+    MessagePool::deallocate(block, n * sizeof(T));
+  }
+
+  template <typename U> bool operator==(const PoolAllocator<U> &) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const PoolAllocator<U> &) const {
+    return false;
+  }
+};
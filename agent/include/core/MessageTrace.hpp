@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mqtt/message.h>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Binary trace file layout. All integers are little endian and every record
+ * starts on an 8 byte boundary so a memory mapped trace can be read in place.
+ *
+ *   TraceFileHeader
+ *   { TraceRecordHeader, topic bytes, payload bytes, properties, padding }...
+ *
+ * Properties are a sequence of { uint8_t identifier, uint32_t length, value
+ * bytes } for the MQTT v5 properties a trace keeps: response topic and
+ * correlation data. Version 1 traces have no properties and no priority.
+ */
+struct TraceFileHeader {
+  char magic[4];           // "MQTR"
+  uint32_t version;        // TRACE_VERSION
+  uint64_t start_time_ns;  // Wall clock time of the capture start
+};
+
+struct TraceRecordHeader {
+  uint64_t timestamp_ns;   // Time since the capture start
+  uint32_t topic_length;
+  uint32_t payload_length;
+  uint8_t qos;
+  uint8_t flags;           // TRACE_FLAG_* bits
+  uint8_t priority;        // Class of a publish, or TRACE_NO_PRIORITY
+  uint8_t reserved;
+  uint32_t properties_length;
+};
+
+const uint32_t TRACE_VERSION = 2;
+const uint8_t TRACE_FLAG_RETAINED = 0x01;
+const uint8_t TRACE_NO_PRIORITY = 0xff;
+
+/*
+ * One message of a trace. topic, payload and the properties point into the
+ * reader's mapping.
+ */
+struct TraceRecord {
+  uint64_t timestamp_ns = 0;
+  std::string_view topic;
+  std::string_view payload;
+  int qos = 0;
+  bool retained = false;
+  uint8_t priority = TRACE_NO_PRIORITY;
+  std::string_view response_topic;   // Empty if the message had none
+  std::string_view correlation_data; // Empty if the message had none
+
+  /* Copies the record into a message, with the properties it kept */
+  mqtt::message_ptr to_message() const;
+};
+
+/**
+ * Appends received messages to a trace file.
+ *
+ * Records are encoded into an in-memory buffer and written out in large
+ * chunks, so capturing costs one copy of the message per record.
+ */
+class TraceWriter {
+public:
+  /*
+   * Creates or truncates the trace file.
+   * @param path Path of the trace file
+   * @param buffer_size Bytes buffered before they are written out
+   * @throws std::runtime_error if the file cannot be created
+   */
+  explicit TraceWriter(const std::string &path,
+                       size_t buffer_size = 1 << 20);
+
+  /* Flushes and closes the file */
+  ~TraceWriter();
+
+  /* Do not allow copying */
+  TraceWriter(const TraceWriter &obj) = delete;
+  TraceWriter &operator=(const TraceWriter &obj) = delete;
+
+  /*
+   * Appends a message to the trace.
+   * @param priority Class the message was published with, if any
+   */
+  void record(const mqtt::message &msg, uint8_t priority = TRACE_NO_PRIORITY);
+
+  /* Writes out every buffered record */
+  void flush();
+
+  /* Number of records written so far */
+  size_t records() const { return records_.load(); }
+
+private:
+  int fd_ = -1;
+  size_t buffer_size_;
+  uint64_t start_ns_;
+  std::mutex mutex_;
+  std::vector<char> buffer_;
+  std::atomic<size_t> records_{0};
+
+  /* Writes the buffer to the file. Lock must be held */
+  void write_buffer();
+};
+
+/**
+ * Reads a trace file through a read-only memory mapping.
+ */
+class TraceReader {
+public:
+  /*
+   * @param path Path of the trace file
+   * @throws std::runtime_error if the file is missing or not a trace
+   */
+  explicit TraceReader(const std::string &path);
+
+  ~TraceReader();
+
+  /* Do not allow copying */
+  TraceReader(const TraceReader &obj) = delete;
+  TraceReader &operator=(const TraceReader &obj) = delete;
+
+  /*
+   * Reads the next record.
+   * @return false at the end of the trace or at a truncated record
+   */
+  bool next(TraceRecord &record);
+
+  /* Starts reading from the first record again */
+  void rewind();
+
+  /* Wall clock time at which the capture started, in ns since the epoch */
+  uint64_t start_time_ns() const { return start_time_ns_; }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  size_t offset_ = 0;
+  uint32_t version_ = TRACE_VERSION;
+  uint64_t start_time_ns_ = 0;
+};
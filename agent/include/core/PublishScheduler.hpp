@@ -0,0 +1,264 @@
+#pragma once
+
+#include "Config.hpp"
+#include "MQTTMetrics.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mqtt/message.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Priority classes of outbound messages
+ */
+enum class Priority : int {
+  CONTROL = 0,  // Heartbeats and status; never waits behind other traffic
+  REALTIME = 1, // Latency sensitive application traffic
+  BULK = 2      // Telemetry and other throughput traffic
+};
+
+const size_t PRIORITY_COUNT = 3;
+
+/*
+ * Helper function to convert a Priority to a string
+ */
+std::string priority_to_string(Priority priority);
+
+/*
+ * Struct to define the settings of the PublishScheduler
+ */
+struct scheduler_options {
+  scheduler_options() = default;
+  explicit scheduler_options(const Config &config)
+      : max_inflight(config.max_inflight_messages),
+        control_reserved(config.control_reserved_inflight),
+        weights{0, config.realtime_weight, config.bulk_weight},
+        max_wait{std::chrono::milliseconds(0), config.realtime_max_wait,
+                 config.bulk_max_wait},
+        queue_size(config.publish_queue_size),
+        enqueue_timeout(config.message_timeout),
+        inflight_timeout(config.message_timeout) {}
+  size_t max_inflight = 20;
+  size_t control_reserved = 2;
+  // Indexed by Priority; unused for control
+  size_t weights[PRIORITY_COUNT] = {0, 4, 1};
+  std::chrono::milliseconds max_wait[PRIORITY_COUNT] = {
+      std::chrono::milliseconds(0), std::chrono::milliseconds(100),
+      std::chrono::milliseconds(2000)};
+  size_t queue_size = 10000;
+  std::chrono::milliseconds enqueue_timeout{30000};
+  // A message that is not complete this long after it was sent gives up its
+  // window slot
+  std::chrono::milliseconds inflight_timeout{30000};
+  // Bytes a class with weight 1 sends per round before the other class gets
+  // its turn, i.e. its publish batch
+  size_t quantum = 1024;
+};
+
+/*
+ * A message left in the scheduler, with the class it was queued in
+ */
+struct PendingMessage {
+  mqtt::message_ptr msg;
+  Priority priority;
+};
+
+/**
+ * Feeds outbound messages into the client's in-flight window by priority.
+ *
+ * Every class has its own queue. A QoS 1/2 message occupies a window slot
+ * from the moment it is handed to the client until its delivery completes;
+ * QoS 0 messages take no slot but still only leave their queue while one is
+ * free. Control messages are sent first and may use
+ * every slot, the other classes only max_inflight - control_reserved of
+ * them, so a heartbeat never waits for bulk acknowledgements. Realtime and
+ * bulk share their slots by deficit round robin over message bytes, with
+ * one quantum per round scaled by the class weight. A class that has not
+ * sent anything for longer than its max wait is served next, which bounds
+ * starvation under sustained higher priority load.
+ *
+ * Sending happens on the threads that call enqueue() and complete(), never
+ * under the scheduler's lock; one thread sends at a time so the order within
+ * a class is kept. enqueue() must not block the thread that reports
+ * delivery completions, or a full queue only drains after the timeout.
+ * With a resumer, a call sends at most one round of realtime and bulk
+ * bytes, at least one message, so a backlog does not hold up the calling
+ * thread; the next call or resume() carries on. Control messages are never
+ * held back.
+ */
+class PublishScheduler {
+public:
+  /* Hands a message to the client. Returns false if it was not accepted */
+  using Sender = std::function<bool(const mqtt::message_ptr &msg)>;
+
+  /*
+   * Returns the message to hand to the client in place of a queued one, e.g.
+   * a copy using a topic alias, or the message itself. Called in send order
+   * under the scheduler's lock, so it must not call back into the scheduler.
+   */
+  using Encoder =
+      std::function<mqtt::message_ptr(const mqtt::message_ptr &msg)>;
+
+  /*
+   * Arranges for resume() to be called soon on another thread, e.g. a timer
+   * task. Called without the scheduler's lock when a call stopped at its
+   * budget with messages left that the window would take
+   */
+  using Resumer = std::function<void()>;
+
+  /*
+   * @param metrics Metrics updated per priority class
+   * @param sender Called for every message leaving the queues
+   * @param encoder Applied to every message before it is sent, if set.
+   * complete() and fail() then take the encoded message, while
+   * take_pending() returns the queued one
+   * @param resumer Continues a backlog after a call used up its budget. If
+   * empty, every call sends all the window takes
+   */
+  PublishScheduler(PlatformMetrics &metrics, Sender sender,
+                   const scheduler_options &options = scheduler_options(),
+                   Encoder encoder = nullptr, Resumer resumer = nullptr);
+
+  /* Do not allow copying */
+  PublishScheduler(const PublishScheduler &obj) = delete;
+  PublishScheduler &operator=(const PublishScheduler &obj) = delete;
+
+  /* Applies new weights, bounds and window size to queued messages too */
+  void set_options(const scheduler_options &options);
+
+  scheduler_options options() const;
+
+  /*
+   * Queues a message and sends what the window allows. Blocks while the
+   * class's queue is full, for at most the enqueue timeout; control
+   * messages are never refused.
+   * @return false if the message was dropped
+   */
+  bool enqueue(mqtt::message_ptr msg, Priority priority);
+
+  /*
+   * Releases the window slot of a delivered message and sends the next
+   * ones. Messages the scheduler did not send are ignored.
+   */
+  void complete(const mqtt::message *msg);
+
+  /*
+   * Releases the window slot of a message whose publish failed, counting it
+   * as dropped, and sends the next ones.
+   */
+  void fail(const mqtt::message *msg);
+
+  /*
+   * Releases the window slots of messages in flight for longer than the
+   * in-flight timeout, counting them as dropped. Called periodically.
+   * @return Number of messages expired
+   */
+  size_t expire();
+
+  /*
+   * Forgets all in-flight messages, e.g. after their session was lost, and
+   * sends what the window allows.
+   */
+  void reset_inflight();
+
+  /* Sends the next round of a backlog, as requested through the resumer */
+  void resume();
+
+  /*
+   * Refuses every further message, including control messages, and wakes
+   * publishers blocked on a full queue. Queued messages are still sent.
+   */
+  void close();
+
+  /*
+   * Blocks until every queue is empty and every in-flight message is
+   * complete, or until deadline.
+   * @return true if nothing is left
+   */
+  bool drain(std::chrono::steady_clock::time_point deadline);
+
+  /*
+   * Removes every queued and in-flight message.
+   * @param queued Receives the messages never handed to the client, by class
+   * @param inflight Receives the messages handed to the client whose
+   * delivery did not complete
+   */
+  void take_pending(std::vector<PendingMessage> &queued,
+                    std::vector<PendingMessage> &inflight);
+
+  /* Messages enqueue() accepted so far */
+  size_t accepted() const;
+
+  /* Messages enqueue() refused because the scheduler was closed */
+  size_t refused() const;
+
+  /* Messages of a class waiting for the window */
+  size_t queued(Priority priority) const;
+
+  /* Messages handed to the client and not yet complete */
+  size_t inflight() const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Entry {
+    mqtt::message_ptr msg;
+    Clock::time_point enqueued;
+  };
+
+  struct InFlight {
+    mqtt::message_ptr msg;     // As queued; kept for take_pending
+    mqtt::message_ptr encoded; // As sent; keeps the key alive
+    Priority priority;
+    Clock::time_point enqueued;
+    Clock::time_point sent;
+  };
+
+  PlatformMetrics &metrics_;
+  Sender sender_;
+  Encoder encoder_;
+  Resumer resumer_;
+  scheduler_options options_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable space_cv_;
+  std::condition_variable idle_cv_;
+  std::deque<Entry> queues_[PRIORITY_COUNT];
+  std::unordered_map<const mqtt::message *, InFlight> inflight_;
+
+  // Deficit round robin state over the non-control classes
+  size_t deficit_[PRIORITY_COUNT] = {};
+  size_t turn_ = static_cast<size_t>(Priority::REALTIME);
+  bool quantum_added_ = false;
+
+  // When each class last sent, or got a message into its empty queue
+  Clock::time_point last_served_[PRIORITY_COUNT];
+
+  // Set while a thread sends; others leave their work to it
+  bool sending_ = false;
+
+  // Set from requesting a resume() until it runs
+  bool resume_requested_ = false;
+
+  // Set by close()
+  bool closed_ = false;
+
+  size_t accepted_ = 0;
+  size_t refused_ = 0;
+
+  /*
+   * Sends until the queues are empty, the window is full or, with a
+   * resumer, the budget of the call is used up
+   */
+  void pump(std::unique_lock<std::mutex> &lock);
+
+  /* Picks the class to send from next. mutex_ must be held */
+  bool next(size_t &cls);
+
+  /* Moves the round robin to the next class. mutex_ must be held */
+  void advance();
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "TimerWheel.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <mqtt/message.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+/*
+ * Outcome of an RPC call
+ */
+enum class RPCStatus { OK, TIMEOUT, CANCELLED };
+
+/*
+ * Exception stored in the future of a call that did not get a response
+ */
+class RPCError : public std::runtime_error {
+public:
+  RPCError(RPCStatus status, const std::string &what)
+      : std::runtime_error(what), status(status) {}
+  RPCStatus status;
+};
+
+/**
+ * Request/response calls over MQTT v5.
+ *
+ * Every request carries the agent's response topic and a unique correlation
+ * id as MQTT v5 properties. Ids are prefixed with a random nonce per client,
+ * so a late or session-queued response to a previous run of the agent never
+ * completes a call of this one. Responders publish their reply to the response
+ * topic with the same correlation data; the agent routes those messages to
+ * handle_response(), which completes the matching pending request. Pending
+ * requests live in a sharded table so concurrent calls rarely contend, and
+ * each one holds a one-shot timer on the agent's timer wheel.
+ */
+class RPCClient {
+public:
+  /*
+   * Called exactly once per call, on the MQTT callback thread for responses
+   * and on the timer wheel thread for timeouts.
+   * @param status OK if a response arrived
+   * @param response The response message, nullptr unless status is OK
+   */
+  using ResponseCallback =
+      std::function<void(RPCStatus status, mqtt::const_message_ptr response)>;
+
+  /* Sends a fully built request message */
+  using PublishFunction = std::function<void(mqtt::message_ptr msg)>;
+
+  /*
+   * @param timers Timer wheel used for request timeouts
+   * @param response_topic Topic this agent receives responses on
+   * @param publish Function used to send requests
+   */
+  RPCClient(TimerWheel &timers, const std::string &response_topic,
+            PublishFunction publish);
+
+  /* Fails every pending call with RPCStatus::CANCELLED */
+  ~RPCClient();
+
+  /* Do not allow copying */
+  RPCClient(const RPCClient &obj) = delete;
+  RPCClient &operator=(const RPCClient &obj) = delete;
+
+  /*
+   * Sends a request and invokes callback with the response or the timeout.
+   * @param topic Topic of the request
+   * @param payload Payload of the request
+   * @param qos The QoS level of the request
+   * @param timeout Time to wait for the response
+   * @param callback Invoked once with the outcome of the call
+   */
+  void call(const std::string &topic, const std::string &payload, int qos,
+            std::chrono::milliseconds timeout, ResponseCallback callback);
+
+  /*
+   * Sends a request and returns a future for the response. The future holds
+   * an RPCError if the call times out or is cancelled.
+   */
+  std::future<mqtt::const_message_ptr> call(const std::string &topic,
+                                            const std::string &payload,
+                                            int qos,
+                                            std::chrono::milliseconds timeout);
+
+  /*
+   * Completes the pending call that matches the correlation data of msg.
+   * @return false if msg does not belong to a pending call
+   */
+  bool handle_response(const mqtt::const_message_ptr &msg);
+
+  /*
+   * Builds the reply to a request received by a responder: the reply goes to
+   * the request's response topic and echoes its correlation data.
+   * @return nullptr if request has no response topic
+   */
+  static mqtt::message_ptr make_response(const mqtt::const_message_ptr &request,
+                                         const std::string &payload,
+                                         int qos = 1);
+
+  /* Fails every pending call with RPCStatus::CANCELLED */
+  void cancel_all();
+
+  const std::string &response_topic() const { return response_topic_; }
+
+  /* Number of calls waiting for a response */
+  size_t pending() const { return pending_; }
+
+  // Counters for the calls made through this client
+  std::atomic<size_t> calls_sent{0};
+  std::atomic<size_t> calls_completed{0};
+  std::atomic<size_t> calls_timed_out{0};
+
+private:
+  struct PendingCall {
+    ResponseCallback callback;
+    TimerWheel::TimerId timer = 0;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, PendingCall> calls;
+  };
+
+  static constexpr size_t SHARDS = 32;
+
+  TimerWheel &timers_;
+  std::string response_topic_;
+  PublishFunction publish_;
+
+  const uint64_t nonce_; // Random, first half of the correlation data
+  std::atomic<uint64_t> next_correlation_id_{1};
+  std::atomic<size_t> pending_{0};
+  std::array<Shard, SHARDS> shards_;
+
+  Shard &shard_for(uint64_t id) { return shards_[id % SHARDS]; }
+
+  /* Removes a pending call from the table. Returns false if already gone */
+  bool take(uint64_t id, PendingCall &out);
+
+  std::string encode_correlation(uint64_t id) const;
+  /* Returns false for data of another client or another run */
+  bool decode_correlation(const std::string &data, uint64_t &id) const;
+};
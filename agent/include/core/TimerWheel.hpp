@@ -0,0 +1,141 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Hierarchical timer wheel driven by a dedicated thread.
+ *
+ * The wheel has LEVELS levels of SLOTS slots each. Level 0 advances once per
+ * tick and every level above it spans SLOTS times the range of the level
+ * below. Timers are kept in intrusive lists so scheduling and cancelling are
+ * O(1); a timer is cascaded down towards level 0 as its expiry approaches.
+ */
+class TimerWheel {
+public:
+  using TimerId = uint64_t;
+  using Task = std::function<void()>;
+
+  /*
+   * Create a stopped timer wheel.
+   * @param tick Resolution of the wheel. Timers fire at most one tick late.
+   * @param cpus CPUs the wheel thread is confined to; empty for any
+   */
+  explicit TimerWheel(
+      std::chrono::milliseconds tick = std::chrono::milliseconds{10},
+      std::vector<int> cpus = {});
+
+  /* Stops the wheel thread if it is still running */
+  ~TimerWheel();
+
+  /* Do not allow copying */
+  TimerWheel(const TimerWheel &obj) = delete;
+  TimerWheel &operator=(const TimerWheel &obj) = delete;
+
+  /*
+   * Starts the wheel thread. Timers scheduled before start() are kept and
+   * fire once the thread is running.
+   */
+  void start();
+
+  /*
+   * Wakes the wheel thread immediately and joins it. Pending timers are
+   * discarded. Must not be called from inside a task.
+   */
+  void stop();
+
+  /*
+   * Schedules a task to run once.
+   * @param delay Time until the task runs
+   * @param task Callable invoked on the wheel thread
+   * @return Id that can be passed to cancel()
+   */
+  TimerId schedule_once(std::chrono::milliseconds delay, Task task);
+
+  /*
+   * Schedules a task to run every interval, the first time one interval from
+   * now.
+   * @param interval Period between runs. Must be at least one tick
+   * @param task Callable invoked on the wheel thread
+   * @return Id that can be passed to cancel()
+   */
+  TimerId schedule_periodic(std::chrono::milliseconds interval, Task task);
+
+  /*
+   * Cancels a timer. Safe to call from inside a task, including the task of
+   * the timer being cancelled.
+   * @param id Id returned by schedule_once or schedule_periodic
+   * @return true if the timer was still pending
+   */
+  bool cancel(TimerId id);
+
+  /* Number of timers currently scheduled */
+  size_t size() const;
+
+  /* True while the wheel thread is running */
+  bool is_running() const { return running_; }
+
+private:
+  static constexpr unsigned LEVEL_BITS = 6;
+  static constexpr unsigned SLOTS = 1u << LEVEL_BITS;
+  static constexpr unsigned LEVELS = 4;
+  static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+
+  struct Timer {
+    TimerId id = 0;
+    uint64_t expiry = 0;   // Absolute tick at which the timer fires
+    uint64_t interval = 0; // Period in ticks, 0 for one-shot timers
+    Task task;
+    Timer *prev = nullptr;
+    Timer *next = nullptr;
+    unsigned level = 0;
+    unsigned slot = 0;
+    bool running = false;
+    std::atomic<bool> cancelled{false};
+  };
+
+  std::chrono::milliseconds tick_;
+  std::chrono::steady_clock::time_point epoch_;
+  std::vector<int> cpus_;
+
+  // Last tick that has been fully processed
+  uint64_t current_ = 0;
+  TimerId next_id_ = 1;
+
+  std::array<std::array<Timer *, SLOTS>, LEVELS> slots_{};
+  std::array<uint64_t, LEVELS> occupied_{}; // One bit per non-empty slot
+  std::unordered_map<TimerId, std::unique_ptr<Timer>> timers_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::thread thread_;
+  std::atomic<bool> running_{false};
+  bool stop_requested_ = false;
+
+  TimerId add_timer(uint64_t delay_ticks, uint64_t interval_ticks, Task task);
+  uint64_t to_ticks(std::chrono::milliseconds duration) const;
+  uint64_t now_ticks() const;
+
+  /* Links a timer into the slot that matches its expiry. Lock must be held */
+  void link(Timer *timer);
+
+  /* Removes a timer from its slot. Lock must be held */
+  void unlink(Timer *timer);
+
+  /* Re-links every timer of a higher level slot. Lock must be held */
+  void cascade(unsigned level, unsigned slot);
+
+  /* Returns the next tick worth waking up for. Lock must be held */
+  uint64_t next_wakeup_tick() const;
+
+  void thread_main();
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <mqtt/message.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Outbound MQTT v5 topic alias table of one connection.
+ *
+ * Topics are mapped to aliases 1..maximum in least recently used order. When
+ * the table is full the least recently used topic gives up its alias, and the
+ * next publish on the new topic carries both the full topic and the alias so
+ * the broker learns the new mapping.
+ *
+ * A new mapping only reaches the broker with the publish that carries it, so
+ * publishes must leave in the order apply() handled them. MQTTAgent applies
+ * aliases in the PublishScheduler's encoder, which runs on the scheduler's
+ * single sending thread right before each message is sent.
+ */
+class OutboundTopicAliases {
+public:
+  /*
+   * Forgets every mapping. Must be called whenever the connection changes,
+   * since aliases only live as long as a network connection.
+   * @param maximum Number of aliases the broker accepts. 0 disables aliasing
+   */
+  void reset(uint16_t maximum);
+
+  /*
+   * Uses a topic alias for msg when possible: either the topic is replaced
+   * by its alias, or a new alias is attached next to the full topic. msg
+   * itself is left as it is, so it can still be stored or resent on another
+   * connection.
+   * @param msg The message to send
+   * @param saved Set to the number of bytes saved on the wire (negative for
+   * a new mapping)
+   * @return A copy carrying the alias, or msg itself if aliasing is off
+   */
+  mqtt::message_ptr apply(const mqtt::message_ptr &msg, int64_t &saved);
+
+  uint16_t maximum() const;
+
+private:
+  struct Entry {
+    std::string topic;
+    uint16_t alias;
+  };
+
+  mutable std::mutex mutex_;
+  uint16_t maximum_ = 0;
+  std::list<Entry> lru_; // Most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> by_topic_;
+};
+
+/**
+ * Inbound MQTT v5 topic alias table of one connection. Resolves messages
+ * the broker sent with an empty topic and a topic alias.
+ */
+class InboundTopicAliases {
+public:
+  /*
+   * Forgets every mapping.
+   * @param maximum Number of aliases advertised to the broker
+   */
+  void reset(uint16_t maximum);
+
+  /*
+   * Records or resolves the topic alias carried by msg.
+   * @param msg The message as received
+   * @param saved Set to the number of bytes the alias saved on the wire
+   * @return msg itself, a copy carrying the resolved topic, or nullptr if
+   * the alias is unknown
+   */
+  mqtt::const_message_ptr resolve(const mqtt::const_message_ptr &msg,
+                                  int64_t &saved);
+
+private:
+  mutable std::mutex mutex_;
+  std::vector<std::string> topics_; // Indexed by alias
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Prefix of MQTT v5 shared subscriptions: $share/<group>/<filter>
+ */
+const std::string SHARED_SUBSCRIPTION_PREFIX{"$share/"};
+
+/*
+ * Splits a shared subscription into its group and topic filter.
+ * @param subscription Subscription string as sent to the broker
+ * @param group Set to the share group name
+ * @param filter Set to the underlying topic filter
+ * @return false if subscription is not a well formed shared subscription
+ */
+bool parse_shared_subscription(const std::string &subscription,
+                               std::string &group, std::string &filter);
+
+/*
+ * Returns the topic filter messages of a subscription are published on, i.e.
+ * the filter without any $share/<group>/ prefix.
+ */
+std::string subscription_filter(const std::string &subscription);
+
+/*
+ * Checks that a topic filter is well formed: '#' only as the last level and
+ * wildcards only as whole levels.
+ */
+bool is_valid_topic_filter(const std::string &filter);
+
+/*
+ * Checks whether a topic matches a topic filter.
+ */
+bool topic_matches_filter(const std::string &filter, const std::string &topic);
+
+/**
+ * Trie of topic filters. Each filter is associated with one or more values
+ * and match() collects the values of every filter that matches a topic, so
+ * the cost of a lookup depends on the depth of the topic rather than on the
+ * number of filters.
+ */
+class TopicMatcher {
+public:
+  /*
+   * Associates a value with a filter.
+   */
+  void insert(const std::string &filter, size_t value);
+
+  /*
+   * Removes one association of value with filter.
+   * @return false if the association did not exist
+   */
+  bool erase(const std::string &filter, size_t value);
+
+  /*
+   * Appends the values of every filter that matches topic to out.
+   */
+  void match(const std::string &topic, std::vector<size_t> &out) const;
+
+  bool empty() const { return size_ == 0; }
+
+  /* Number of filter/value associations */
+  size_t size() const { return size_; }
+
+private:
+  struct Node {
+    std::unordered_map<std::string, std::unique_ptr<Node>> children;
+    std::vector<size_t> values;
+  };
+
+  Node root_;
+  size_t size_ = 0;
+
+  static void match(const Node &node, const std::vector<std::string> &levels,
+                    size_t index, std::vector<size_t> &out);
+};
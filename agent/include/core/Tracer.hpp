@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * One recorded span. name and category must be string literals.
+ */
+struct TraceEvent {
+  const char *category;
+  const char *name;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  uint32_t thread_id;
+};
+
+/**
+ * In-process tracer for the hot paths of the agent.
+ *
+ * Every thread records into its own ring buffer, so tracing threads do not
+ * contend with each other; once a ring is full the oldest events are
+ * overwritten. The recorded spans can be exported as Chrome trace JSON and
+ * opened in chrome://tracing or ui.perfetto.dev.
+ *
+ * Trace points are placed with the MQTT_TRACE_SCOPE macro, which compiles to
+ * nothing unless the build defines MQTT_AGENT_TRACING (CMake option
+ * MQTT_AGENT_ENABLE_TRACING). Compiled in but disabled, a trace point costs
+ * one relaxed atomic load.
+ */
+class Tracer {
+public:
+  /* Process wide tracer used by the trace points */
+  static Tracer &instance();
+
+  /*
+   * Starts recording.
+   * @param events_per_thread Capacity of each thread's ring buffer
+   */
+  void enable(size_t events_per_thread = 1 << 16);
+
+  /* Stops recording. Recorded events are kept until clear() */
+  void disable();
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  /* Records a span on the calling thread's ring buffer */
+  void record(const char *category, const char *name, uint64_t start_ns,
+              uint64_t end_ns);
+
+  /* Returns the recorded events of all threads, oldest first per thread */
+  std::vector<TraceEvent> events() const;
+
+  /* Drops all recorded events */
+  void clear();
+
+  /*
+   * Writes the recorded events as Chrome trace JSON.
+   * @return false if the file cannot be written
+   */
+  bool write_chrome_trace(const std::string &path) const;
+
+  /* Monotonic timestamp used for the events */
+  static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+private:
+  struct ThreadBuffer {
+    std::mutex mutex; // Only contended while events are exported
+    std::vector<TraceEvent> ring;
+    uint64_t written = 0;
+    uint32_t thread_id = 0;
+  };
+
+  std::atomic<bool> enabled_{false};
+  std::atomic<size_t> capacity_{1 << 16};
+
+  // Buffers outlive their threads so events of finished threads can still
+  // be exported
+  mutable std::mutex buffers_mutex_;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+
+  Tracer() = default;
+
+  ThreadBuffer &thread_buffer();
+};
+
+/**
+ * Records the lifetime of the object as a span, if the tracer is enabled when
+ * the object is created.
+ */
+class TraceScope {
+public:
+  TraceScope(const char *category, const char *name)
+      : category_(category), name_(name),
+        start_ns_(Tracer::instance().enabled() ? Tracer::now_ns() : 0) {}
+
+  ~TraceScope() {
+    if (start_ns_)
+      Tracer::instance().record(category_, name_, start_ns_,
+                                Tracer::now_ns());
+  }
+
+  /* Do not allow copying */
+  TraceScope(const TraceScope &obj) = delete;
+  TraceScope &operator=(const TraceScope &obj) = delete;
+
+private:
+  const char *category_;
+  const char *name_;
+  uint64_t start_ns_;
+};
+
+#define MQTT_TRACE_CONCAT_INNER(a, b) a##b
+#define MQTT_TRACE_CONCAT(a, b) MQTT_TRACE_CONCAT_INNER(a, b)
+
+#ifdef MQTT_AGENT_TRACING
+#define MQTT_TRACE_SCOPE(category, name)                                       \
+  TraceScope MQTT_TRACE_CONCAT(trace_scope_, __LINE__)(category, name)
+#else
+#define MQTT_TRACE_SCOPE(category, name)                                       \
+  do {                                                                         \
+  } while (0)
+#endif
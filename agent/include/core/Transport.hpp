@@ -0,0 +1,150 @@
+#pragma once
+
+#include "Config.hpp"
+#include <memory>
+#include <mqtt/async_client.h>
+#include <mqtt/message.h>
+#include <mqtt/properties.h>
+#include <string>
+
+/**
+ * Receives the events of a Transport. Callbacks run on a thread owned by the
+ * transport.
+ */
+class TransportListener {
+public:
+  virtual ~TransportListener() = default;
+
+  virtual void connected(const std::string &cause) = 0;
+
+  virtual void connection_lost(const std::string &cause) = 0;
+
+  virtual void message_arrived(mqtt::const_message_ptr msg) = 0;
+
+  /*
+   * Called once a publish is complete: acknowledged for QoS 1 and 2, sent for
+   * QoS 0.
+   * @param msg The published message
+   * @param tok The Paho delivery token, or null for transports that do not
+   * use Paho
+   */
+  virtual void delivery_complete(const mqtt::const_message_ptr &msg,
+                                 const mqtt::delivery_token_ptr &tok) = 0;
+
+  /*
+   * Called if a publish that publish() accepted failed later on and will not
+   * complete. Transports that report every publish as complete never call
+   * it.
+   * @param msg The published message
+   */
+  virtual void delivery_failed(const mqtt::const_message_ptr &msg) {
+    (void)msg;
+  }
+};
+
+/*
+ * Outcome of a successful Transport::connect
+ */
+struct ConnectResult {
+  bool session_present = false;
+
+  // CONNACK properties (MQTT v5)
+  mqtt::properties properties;
+};
+
+/*
+ * Builds the connect options described by config: protocol version,
+ * session, credentials, last will, TLS and topic alias maximum.
+ */
+mqtt::connect_options make_connect_options(const Config &config);
+
+/**
+ * Connection to a broker as used by MQTTAgent. Errors are reported by
+ * throwing mqtt::exception, like mqtt::async_client does.
+ */
+class Transport {
+public:
+  virtual ~Transport() = default;
+
+  /* Sets the receiver of the transport's events. Call before connect() */
+  virtual void set_listener(TransportListener &listener) = 0;
+
+  /*
+   * Connects and blocks until the broker answered.
+   * @param options The connect options built from the Config
+   */
+  virtual ConnectResult connect(const mqtt::connect_options &options) = 0;
+
+  /* Disconnects and blocks until the disconnect is complete */
+  virtual void disconnect() = 0;
+
+  virtual bool is_connected() const = 0;
+
+  /*
+   * Subscribes to a topic filter or shared subscription.
+   * @param identifier MQTT v5 subscription identifier the broker tags the
+   * messages of this subscription with, 0 for none
+   */
+  virtual void subscribe(const std::string &subscription, int qos,
+                         int identifier = 0) = 0;
+
+  virtual void unsubscribe(const std::string &subscription) = 0;
+
+  /* Starts a publish. Completion is reported through delivery_complete */
+  virtual void publish(const mqtt::message_ptr &msg) = 0;
+
+  /*
+   * True if publishes that were not acknowledged are kept on disk and sent
+   * again when a later connection resumes the session
+   */
+  virtual bool persists_publishes() const { return false; }
+};
+
+/**
+ * Transport over mqtt::async_client, i.e. a real broker connection.
+ */
+class PahoTransport : public Transport, private mqtt::callback {
+public:
+  /*
+   * Creates the client described by config.
+   * @param config Broker URL, client id, protocol version and persistence
+   * @param actions Receives the results of connect, subscribe and publish
+   * actions
+   */
+  PahoTransport(const Config &config, mqtt::iaction_listener &actions);
+
+  void set_listener(TransportListener &listener) override;
+  ConnectResult connect(const mqtt::connect_options &options) override;
+  void disconnect() override;
+  bool is_connected() const override;
+  void subscribe(const std::string &subscription, int qos,
+                 int identifier = 0) override;
+  void unsubscribe(const std::string &subscription) override;
+  void publish(const mqtt::message_ptr &msg) override;
+  bool persists_publishes() const override;
+
+private:
+  // Reports failed publishes to the listener and every outcome to the
+  // action listener
+  class PublishActions : public mqtt::iaction_listener {
+  public:
+    explicit PublishActions(PahoTransport &transport) : transport_(transport) {}
+    void on_failure(const mqtt::token &tok) override;
+    void on_success(const mqtt::token &tok) override;
+
+  private:
+    PahoTransport &transport_;
+  };
+
+  std::unique_ptr<mqtt::async_client> client_;
+  mqtt::iaction_listener &actions_;
+  PublishActions publish_actions_{*this};
+  bool persistent_; // Created with a file persistence store
+  TransportListener *listener_ = nullptr;
+
+  // mqtt::callback
+  void connected(const std::string &cause) override;
+  void connection_lost(const std::string &cause) override;
+  void message_arrived(mqtt::const_message_ptr msg) override;
+  void delivery_complete(mqtt::delivery_token_ptr tok) override;
+};
@@ -0,0 +1,48 @@
+#!/bin/bash
+# Generates a local CA plus server and client certificates for
+# config/mosquitto-tls.conf and the TLS tests. Existing certificates are kept.
+set -e
+
+DIR="$(cd "$(dirname "$0")/.." && pwd)/config/certs"
+DAYS=365
+
+mkdir -p "$DIR"
+cd "$DIR"
+
+if [ -f ca.crt ] && [ -f server.crt ] && [ -f client.crt ]; then
+  echo "Certificates already present in $DIR"
+  exit 0
+fi
+
+echo "Generating test certificates in $DIR"
+
+# Certificate authority
+openssl req -x509 -newkey rsa:2048 -nodes -days "$DAYS" \
+  -keyout ca.key -out ca.crt -subj "/CN=mqtt-agent test CA"
+
+# Broker certificate, valid for the local hostnames
+cat > server.ext <<EXT
+subjectAltName = DNS:localhost, DNS:mosquitto-tls, IP:127.0.0.1
+extendedKeyUsage = serverAuth
+EXT
+openssl req -newkey rsa:2048 -nodes -keyout server.key -out server.csr \
+  -subj "/CN=localhost"
+openssl x509 -req -in server.csr -CA ca.crt -CAkey ca.key -CAcreateserial \
+  -days "$DAYS" -extfile server.ext -out server.crt
+
+# Client certificate for the mutual TLS listener
+cat > client.ext <<EXT
+extendedKeyUsage = clientAuth
+EXT
+openssl req -newkey rsa:2048 -nodes -keyout client.key -out client.csr \
+  -subj "/CN=mqtt-agent test client"
+openssl x509 -req -in client.csr -CA ca.crt -CAkey ca.key -CAcreateserial \
+  -days "$DAYS" -extfile client.ext -out client.crt
+
+# A second CA the broker does not know, for the rejection test
+openssl req -x509 -newkey rsa:2048 -nodes -days "$DAYS" \
+  -keyout other_ca.key -out other_ca.crt -subj "/CN=mqtt-agent other CA"
+
+rm -f ./*.csr ./*.ext ./*.srl
+# The broker runs as an unprivileged user in the container
+chmod 644 ./*.key
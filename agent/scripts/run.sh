@@ -2,6 +2,7 @@
 
 set -e
 
+./scripts/gen_certs.sh
 docker compose up -d
 mkdir -p build
 cd build
@@ -1,6 +1,9 @@
 #!/bin/bash
 set -e  # Exit on any error
 
+echo "Generating TLS test certificates..."
+./scripts/gen_certs.sh
+
 echo "Starting Mosquitto broker in Docker..."
 docker compose up -d
 
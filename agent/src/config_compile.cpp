@@ -0,0 +1,29 @@
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include "Config.hpp"
+#include "ConfigImage.hpp"
+
+/**
+ * Compiles a json config file into a binary image that the agent maps at
+ * startup instead of parsing the json. Pass the image path to --config like a
+ * json file.
+ */
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <config.json> <image>" << std::endl;
+    return 1;
+  }
+
+  try {
+    ConfigImage::compile(ConfigBuilder::load_from_json(argv[1]), argv[2]);
+    ConfigImage image(argv[2]);
+    std::cout << "Wrote " << argv[2] << ": " << image.subscription_count()
+              << " subscriptions, " << image.size() << " bytes" << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,87 @@
+#include "Affinity.hpp"
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+int parse_cpu(const std::string &list, const std::string &text) {
+  size_t used = 0;
+  int cpu = -1;
+  try {
+    cpu = std::stoi(text, &used);
+  } catch (const std::logic_error &) {
+  }
+  if (text.empty() || used != text.size() || cpu < 0 || cpu >= CPU_SETSIZE)
+    throw std::invalid_argument("Invalid CPU list " + list);
+  return cpu;
+}
+
+} // namespace
+
+std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.size();
+    std::string item = list.substr(start, end - start);
+
+    size_t dash = item.find('-');
+    int first = parse_cpu(list, item.substr(0, dash));
+    int last = first;
+    if (dash != std::string::npos)
+      last = parse_cpu(list, item.substr(dash + 1));
+    if (last < first)
+      throw std::invalid_argument("Invalid CPU list " + list);
+    for (int cpu = first; cpu <= last; ++cpu)
+      cpus.push_back(cpu);
+
+    // A trailing comma leaves an empty item
+    if (end == list.size() - 1)
+      throw std::invalid_argument("Invalid CPU list " + list);
+    start = end + 1;
+  }
+
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return cpus;
+}
+
+std::string format_cpu_list(const std::vector<int> &cpus) {
+  std::string list;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+      ++j;
+    if (!list.empty())
+      list += ",";
+    list += std::to_string(cpus[i]);
+    if (j > i)
+      list += "-" + std::to_string(cpus[j]);
+    i = j + 1;
+  }
+  return list;
+}
+
+bool pin_current_thread(const std::vector<int> &cpus) {
+  if (cpus.empty())
+    return true;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus)
+    CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+int current_numa_node() {
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+    return -1;
+  return static_cast<int>(node);
+}
@@ -0,0 +1,162 @@
+#include "AutoTuner.hpp"
+#include "PublishScheduler.hpp"
+#include <algorithm>
+#include <string>
+#include <utility>
+
+namespace {
+
+const size_t REALTIME = static_cast<size_t>(Priority::REALTIME);
+const size_t BULK = static_cast<size_t>(Priority::BULK);
+
+/* Sets value to to and records the change, if there is one */
+void change(std::vector<TuningDecision> &decisions, const char *setting,
+            size_t &value, size_t to, const std::string &reason) {
+  if (to == value)
+    return;
+  decisions.push_back(
+      {std::chrono::system_clock::now(), setting, value, to, reason});
+  value = to;
+}
+
+std::string ms(double value) {
+  std::string text = std::to_string(value);
+  return text.substr(0, text.find('.') + 3) + " ms";
+}
+
+} // namespace
+
+LatencyWindow::LatencyWindow(std::vector<const LatencyHistogram *> histograms)
+    : histograms_(std::move(histograms)), seen_(LatencyHistogram::BUCKETS) {
+  double p_ms;
+  advance(0.0, p_ms);
+}
+
+size_t LatencyWindow::advance(double quantile, double &p_ms) {
+  std::vector<size_t> window(LatencyHistogram::BUCKETS);
+  size_t total = 0;
+  for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+    size_t count = 0;
+    for (const LatencyHistogram *histogram : histograms_)
+      count += histogram->buckets[i].load(std::memory_order_relaxed);
+    window[i] = count - seen_[i];
+    seen_[i] = count;
+    total += window[i];
+  }
+
+  p_ms = 0.0;
+  size_t rank = static_cast<size_t>(quantile * total);
+  size_t seen = 0;
+  for (size_t i = 0; i < LatencyHistogram::BUCKETS && total > 0; ++i) {
+    seen += window[i];
+    if (seen > rank) {
+      p_ms = LatencyHistogram::bucket_limit(i) / 1000.0;
+      break;
+    }
+  }
+  return total;
+}
+
+AutoTuner::AutoTuner(PlatformMetrics &metrics)
+    : metrics_(metrics), dispatch_({&metrics.dispatch_latency}),
+      delivery_({&metrics.priorities[REALTIME].delivery_latency,
+                 &metrics.priorities[BULK].delivery_latency}),
+      queue_({&metrics.priorities[REALTIME].queue_latency,
+              &metrics.priorities[BULK].queue_latency}) {}
+
+TuningSample AutoTuner::sample(size_t queue_depth, size_t publish_queued) {
+  TuningSample sample;
+  sample.queue_depth = queue_depth;
+  sample.publish_queued = publish_queued;
+  sample.dispatch_samples = dispatch_.advance(0.99, sample.dispatch_p99_ms);
+
+  // QoS 0 messages are never acknowledged; when those make up the traffic
+  // the hand over to the client is all there is to measure
+  size_t queued = queue_.advance(0.99, sample.publish_queue_p99_ms);
+  sample.publish_samples = delivery_.advance(0.99, sample.publish_p99_ms);
+  sample.publish_acknowledged = sample.publish_samples >= MIN_SAMPLES;
+  if (!sample.publish_acknowledged) {
+    sample.publish_samples = queued;
+    sample.publish_p99_ms = sample.publish_queue_p99_ms;
+  }
+  return sample;
+}
+
+std::vector<TuningDecision> AutoTuner::decide(const Config &config,
+                                              const TuningSample &sample,
+                                              TuningSettings &settings) {
+  std::vector<TuningDecision> decisions;
+  const double target = config.tuning_target_p99.count();
+
+  // Realtime and bulk only send while the window is larger than the control
+  // reserve
+  size_t min_inflight = std::max(config.tuning_min_inflight,
+                                 config.control_reserved_inflight + 1);
+  size_t max_inflight = std::max(config.tuning_max_inflight, min_inflight);
+
+  // A reload may have moved the bounds past the current settings
+  change(decisions, "workers", settings.workers,
+         std::clamp(settings.workers, config.tuning_min_workers,
+                    config.tuning_max_workers),
+         "outside the configured bounds");
+  change(decisions, "max_inflight", settings.max_inflight,
+         std::clamp(settings.max_inflight, min_inflight, max_inflight),
+         "outside the configured bounds");
+  change(decisions, "batch_bytes", settings.batch_bytes,
+         std::clamp(settings.batch_bytes, config.tuning_min_batch_bytes,
+                    config.tuning_max_batch_bytes),
+         "outside the configured bounds");
+
+  if (sample.dispatch_samples >= MIN_SAMPLES) {
+    std::string p99 = "handler p99 " + ms(sample.dispatch_p99_ms);
+    if (sample.dispatch_p99_ms > target && sample.queue_depth > 0)
+      change(decisions, "workers", settings.workers,
+             std::min(settings.workers + 1, config.tuning_max_workers),
+             p99 + " above target with " +
+                 std::to_string(sample.queue_depth) + " queued");
+    else if (sample.dispatch_p99_ms < target / 2 && sample.queue_depth == 0)
+      change(decisions, "workers", settings.workers,
+             std::max(settings.workers - 1, config.tuning_min_workers),
+             p99 + " below half of target");
+  }
+
+  if (sample.publish_samples >= MIN_SAMPLES) {
+    std::string p99 = "publish p99 " + ms(sample.publish_p99_ms);
+    size_t step = std::max<size_t>(settings.max_inflight / 4, 1);
+    bool window = sample.publish_acknowledged;
+    if (sample.publish_p99_ms > target) {
+      if (window && sample.publish_queue_p99_ms * 2 >= sample.publish_p99_ms)
+        change(decisions, "max_inflight", settings.max_inflight,
+               std::min(settings.max_inflight + step, max_inflight),
+               p99 + " above target, mostly waiting for the window");
+      else if (window)
+        change(decisions, "max_inflight", settings.max_inflight,
+               std::max(settings.max_inflight - step, min_inflight),
+               p99 + " above target, mostly waiting for acknowledgements");
+      change(decisions, "batch_bytes", settings.batch_bytes,
+             std::max(settings.batch_bytes / 2, config.tuning_min_batch_bytes),
+             p99 + " above target, interleaving realtime more finely");
+    } else if (sample.publish_p99_ms < target / 2 &&
+               sample.publish_queued > 0) {
+      std::string reason = p99 + " below half of target with " +
+                           std::to_string(sample.publish_queued) + " queued";
+      if (window)
+        change(decisions, "max_inflight", settings.max_inflight,
+               std::min(settings.max_inflight + step, max_inflight), reason);
+      change(decisions, "batch_bytes", settings.batch_bytes,
+             std::min(settings.batch_bytes * 2, config.tuning_max_batch_bytes),
+             reason);
+    }
+  }
+
+  TuningMetrics &tuning = metrics_.tuning;
+  tuning.intervals++;
+  tuning.workers = settings.workers;
+  tuning.max_inflight = settings.max_inflight;
+  tuning.batch_bytes = settings.batch_bytes;
+  tuning.dispatch_p99_ms = sample.dispatch_p99_ms;
+  tuning.publish_p99_ms = sample.publish_p99_ms;
+  for (const TuningDecision &decision : decisions)
+    tuning.record(decision);
+  return decisions;
+}
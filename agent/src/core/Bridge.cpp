@@ -0,0 +1,358 @@
+#include "Bridge.hpp"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+/**
+ * Connection to one upstream broker. Holds the upstream's pending messages,
+ * guarded by the bridge's mutex.
+ */
+class Bridge::Upstream : public TransportListener {
+public:
+  Upstream(Bridge &bridge, std::string name, const Config &config,
+           std::unique_ptr<Transport> transport)
+      : name(std::move(name)), options(make_connect_options(config)),
+        clean_session(config.clean_session), transport(std::move(transport)),
+        bridge_(bridge) {
+    this->transport->set_listener(*this);
+  }
+
+  const std::string name;
+  const mqtt::connect_options options;
+  const bool clean_session;
+  std::unordered_map<const mqtt::message *, Pending> pending;
+
+  // Declared after pending so it is destroyed, and stops calling back,
+  // before the entries go
+  std::unique_ptr<Transport> transport;
+
+  void connected(const std::string &) override {
+    std::cout << "Bridge upstream " << name << " connected" << std::endl;
+    // The first connect has nothing to reset, and messages forwarded before
+    // its callback must survive it
+    if (lost_.exchange(false) && clean_session)
+      bridge_.reset(*this);
+  }
+
+  void connection_lost(const std::string &cause) override {
+    lost_ = true;
+    std::cerr << "Bridge upstream " << name << " lost: " << cause
+              << std::endl;
+  }
+
+  // Upstreams are not subscribed to anything
+  void message_arrived(mqtt::const_message_ptr) override {}
+
+  void delivery_complete(const mqtt::const_message_ptr &msg,
+                         const mqtt::delivery_token_ptr &) override {
+    if (msg)
+      bridge_.complete(*this, msg.get());
+  }
+
+  void delivery_failed(const mqtt::const_message_ptr &msg) override {
+    if (msg)
+      bridge_.fail(*this, msg.get());
+  }
+
+private:
+  Bridge &bridge_;
+  std::atomic<bool> lost_{false};
+};
+
+Bridge::Bridge(const Config &config, PlatformMetrics &metrics,
+               mqtt::iaction_listener &actions, TransportFactory factory) {
+  if (!factory)
+    factory = [&actions](const Config &upstream) {
+      return std::unique_ptr<Transport>(
+          std::make_unique<PahoTransport>(upstream, actions));
+    };
+
+  for (const auto &upstream : config.bridge_upstreams) {
+    Config connection = upstream_config(config, upstream);
+    upstreams_.push_back(std::make_unique<Upstream>(
+        *this, upstream.name, connection, factory(connection)));
+  }
+
+  // Pending messages point at their route, so routes_ never reallocates
+  // after this
+  routes_.reserve(config.bridge_routes.size());
+  for (const auto &route : config.bridge_routes) {
+    auto upstream = std::find_if(upstreams_.begin(), upstreams_.end(),
+                                 [&](const auto &candidate) {
+                                   return candidate->name == route.upstream;
+                                 });
+    if (upstream == upstreams_.end())
+      throw std::invalid_argument("No bridge upstream " + route.upstream);
+
+    routes_.push_back(
+        Route{route, upstream->get(), &metrics.bridge_route(route.name)});
+  }
+
+  if (!use_image(config))
+    for (size_t i = 0; i < routes_.size(); ++i)
+      matcher_.insert(subscription_filter(routes_[i].config.filter), i);
+}
+
+bool Bridge::use_image(const Config &config) {
+  const ConfigImage *image = config.image.get();
+  if (!image || image->subscription_count() != config.subscriptions.size())
+    return false;
+
+  std::unordered_map<std::string_view, size_t> indices;
+  for (size_t i = 0; i < image->subscription_count(); ++i) {
+    if (image->subscription(i) != config.subscriptions[i])
+      return false;
+    indices.emplace(image->subscription(i), i);
+  }
+
+  std::vector<std::vector<size_t>> routes(image->subscription_count());
+  for (size_t i = 0; i < routes_.size(); ++i) {
+    auto it = indices.find(routes_[i].config.filter);
+    if (it == indices.end())
+      return false;
+    routes[it->second].push_back(i);
+  }
+
+  image_ = config.image;
+  image_routes_ = std::move(routes);
+  return true;
+}
+
+Bridge::~Bridge() {
+  {
+    std::lock_guard<std::mutex> lock(reconnect_mutex_);
+    started_ = false;
+  }
+  if (reconnecting_.valid())
+    reconnecting_.wait();
+  for (auto &upstream : upstreams_)
+    upstream->transport.reset();
+}
+
+bool Bridge::connect() {
+  {
+    std::lock_guard<std::mutex> lock(reconnect_mutex_);
+    started_ = true;
+  }
+
+  bool connected = true;
+  for (auto &upstream : upstreams_) {
+    if (upstream->transport->is_connected())
+      continue;
+    try {
+      std::cout << "Connecting bridge upstream " << upstream->name << "..."
+                << std::endl;
+      upstream->transport->connect(upstream->options);
+    } catch (const mqtt::exception &exc) {
+      std::cerr << "Bridge upstream " << upstream->name
+                << " failed to connect: " << exc.what() << std::endl;
+    }
+    connected = connected && upstream->transport->is_connected();
+  }
+  return connected;
+}
+
+void Bridge::reconnect() {
+  std::lock_guard<std::mutex> lock(reconnect_mutex_);
+  if (!started_)
+    return;
+  if (reconnecting_.valid() &&
+      reconnecting_.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready)
+    return;
+  if (std::all_of(upstreams_.begin(), upstreams_.end(),
+                  [](const auto &upstream) {
+                    return upstream->transport->is_connected();
+                  }))
+    return;
+
+  // Connecting blocks until the upstream answers or the connect times out
+  reconnecting_ = std::async(std::launch::async, [this]() { connect(); });
+}
+
+void Bridge::disconnect() {
+  std::future<void> reconnecting;
+  {
+    std::lock_guard<std::mutex> lock(reconnect_mutex_);
+    started_ = false;
+    reconnecting = std::move(reconnecting_);
+  }
+  if (reconnecting.valid())
+    reconnecting.wait();
+
+  for (auto &upstream : upstreams_) {
+    try {
+      if (upstream->transport->is_connected())
+        upstream->transport->disconnect();
+    } catch (const mqtt::exception &exc) {
+      std::cerr << "Bridge upstream " << upstream->name
+                << " failed to disconnect: " << exc.what() << std::endl;
+    }
+  }
+}
+
+size_t Bridge::forward(const mqtt::const_message_ptr &msg) {
+  std::vector<size_t> matches;
+  if (image_) {
+    // The trie holds every subscription; only the route filters count
+    std::vector<size_t> subscriptions;
+    image_->match(msg->get_topic(), subscriptions);
+    for (size_t index : subscriptions)
+      matches.insert(matches.end(), image_routes_[index].begin(),
+                     image_routes_[index].end());
+  } else {
+    matcher_.match(msg->get_topic(), matches);
+  }
+  if (matches.empty())
+    return 0;
+
+  auto arrived = Clock::now();
+  size_t published = 0;
+  for (size_t index : matches) {
+    Route &route = routes_[index];
+
+    // The payload buffer is shared with msg, not copied. Properties stay
+    // behind: aliases and subscription identifiers belong to the local
+    // connection
+    int qos = static_cast<int>(
+        route.config.qos_map[std::clamp(msg->get_qos(), 0, 2)]);
+    auto out = mqtt::message::create(rewrite(route.config, msg->get_topic()),
+                                     msg->get_payload_ref(), qos,
+                                     msg->is_retained());
+
+    // QoS 0 publishes are never acknowledged, so they are forwarded once
+    // the transport took them and hold no slot
+    if (qos == 0) {
+      BridgeRouteMetrics &metrics = *route.metrics;
+      try {
+        route.upstream->transport->publish(out);
+        metrics.forwarded++;
+        metrics.bytes += out->get_payload().size();
+        metrics.latency.record(Clock::now() - arrived);
+        published++;
+      } catch (const mqtt::exception &) {
+        metrics.dropped++;
+      }
+      continue;
+    }
+
+    // Take a slot before publishing, so concurrent receivers cannot push a
+    // route past its bound
+    if (route.metrics->pending.fetch_add(1) >= route.config.max_pending) {
+      route.metrics->pending--;
+      route.metrics->dropped++;
+      continue;
+    }
+
+    // Registered before publishing, as the publish may complete before
+    // publish() returns
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      route.upstream->pending.emplace(out.get(),
+                                      Pending{&route, arrived, out});
+      pending_count_++;
+    }
+
+    try {
+      route.upstream->transport->publish(out);
+      published++;
+    } catch (const mqtt::exception &) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      release(*route.upstream, out.get(), false);
+    }
+  }
+  return published;
+}
+
+size_t Bridge::pending() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_count_;
+}
+
+bool Bridge::drain(std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return idle_.wait_until(lock, deadline,
+                          [this] { return pending_count_ == 0; });
+}
+
+size_t Bridge::abandon() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t abandoned = pending_count_;
+  for (auto &upstream : upstreams_)
+    while (!upstream->pending.empty())
+      release(*upstream, upstream->pending.begin()->first, false);
+  return abandoned;
+}
+
+std::string Bridge::rewrite(const BridgeRoute &route,
+                            const std::string &topic) {
+  if (!route.local_prefix.empty() &&
+      topic.compare(0, route.local_prefix.size(), route.local_prefix) == 0)
+    return route.remote_prefix + topic.substr(route.local_prefix.size());
+  return route.remote_prefix + topic;
+}
+
+Config Bridge::upstream_config(const Config &config,
+                               const BridgeUpstream &upstream) {
+  Config result = config;
+  result.broker_url = upstream.broker_url;
+  result.client_id = upstream.client_id;
+  result.username = upstream.username;
+  result.password = upstream.password;
+  result.use_ssl = upstream.use_ssl;
+  result.ca_certificate_file = upstream.ca_certificate_file;
+  result.client_certificate_file = upstream.client_certificate_file;
+  result.client_private_key_file = upstream.client_private_key_file;
+
+  // Forwarded messages were acknowledged to the local broker on arrival.
+  // The ones still pending at shutdown or lost with a clean upstream session
+  // are counted as dropped rather than stored, so the upstream connection
+  // keeps no store of its own. reconnect() retries the connection
+  result.enable_persistence = false;
+  result.automatic_reconnect = false;
+  result.enable_last_will = false;
+  result.enable_topic_aliases = false;
+  result.subscriptions.clear();
+  result.subscription_qos.clear();
+  result.bridge_upstreams.clear();
+  result.bridge_routes.clear();
+  result.image.reset();
+  return result;
+}
+
+void Bridge::complete(Upstream &upstream, const mqtt::message *msg) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  release(upstream, msg, true);
+}
+
+void Bridge::fail(Upstream &upstream, const mqtt::message *msg) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  release(upstream, msg, false);
+}
+
+void Bridge::reset(Upstream &upstream) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (!upstream.pending.empty())
+    release(upstream, upstream.pending.begin()->first, false);
+}
+
+void Bridge::release(Upstream &upstream, const mqtt::message *msg,
+                     bool forwarded) {
+  auto it = upstream.pending.find(msg);
+  if (it == upstream.pending.end())
+    return;
+
+  BridgeRouteMetrics &metrics = *it->second.route->metrics;
+  if (forwarded) {
+    metrics.forwarded++;
+    metrics.bytes += it->second.msg->get_payload().size();
+    metrics.latency.record(Clock::now() - it->second.arrived);
+  } else {
+    metrics.dropped++;
+  }
+  metrics.pending--;
+
+  upstream.pending.erase(it);
+  if (--pending_count_ == 0)
+    idle_.notify_all();
+}
@@ -1,4 +1,5 @@
 #include "Config.hpp"
+#include "ConfigImage.hpp"
 
 ConfigBuilder &ConfigBuilder::set_broker_url(const std::string &url) {
   config_.broker_url = url;
@@ -22,6 +23,11 @@ ConfigBuilder &ConfigBuilder::set_thread_pool_size(size_t count) {
   return *this;
 }
 
+ConfigBuilder &ConfigBuilder::set_message_queue_size(size_t size) {
+  config_.message_queue_size = size;
+  return *this;
+}
+
 ConfigBuilder &
 ConfigBuilder::add_subscription(const std::string &topic,
                                 QoSLevel qos = QoSLevel::AT_LEAST_ONCE) {
@@ -30,6 +36,13 @@ ConfigBuilder::add_subscription(const std::string &topic,
   return *this;
 }
 
+ConfigBuilder &ConfigBuilder::add_shared_subscription(
+    const std::string &group, const std::string &topic,
+    QoSLevel qos = QoSLevel::AT_LEAST_ONCE) {
+  return add_subscription(SHARED_SUBSCRIPTION_PREFIX + group + "/" + topic,
+                          qos);
+}
+
 ConfigBuilder &ConfigBuilder::enable_persistence(const std::string &directory) {
   config_.enable_persistence = true;
   config_.persistence_directory = directory;
@@ -49,6 +62,24 @@ ConfigBuilder &ConfigBuilder::enable_ssl(const std::string &ca_cert = "") {
   return *this;
 }
 
+ConfigBuilder &
+ConfigBuilder::set_client_certificate(const std::string &certificate,
+                                      const std::string &private_key) {
+  config_.client_certificate_file = certificate;
+  config_.client_private_key_file = private_key;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::enable_tls_session_resumption() {
+  config_.tls_session_resumption = true;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::set_clean_session(bool clean_session) {
+  config_.clean_session = clean_session;
+  return *this;
+}
+
 ConfigBuilder &ConfigBuilder::set_last_will(
     const std::string &topic, const std::string &message,
     QoSLevel qos = QoSLevel::AT_LEAST_ONCE, bool retained = true) {
@@ -76,6 +107,145 @@ ConfigBuilder &ConfigBuilder::enable_auto_reconnect(
   return *this;
 }
 
+ConfigBuilder &ConfigBuilder::enable_mqtt_v5() {
+  config_.mqtt_v5 = true;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::enable_topic_aliases(uint16_t maximum) {
+  config_.enable_topic_aliases = true;
+  config_.topic_alias_maximum = maximum;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::set_rpc(const std::string &response_topic,
+                                      std::chrono::milliseconds timeout) {
+  config_.rpc_response_topic = response_topic;
+  config_.rpc_timeout = timeout;
+  return *this;
+}
+
+ConfigBuilder &
+ConfigBuilder::set_heartbeat_interval(std::chrono::seconds interval) {
+  config_.heartbeat_interval = interval;
+  return *this;
+}
+
+ConfigBuilder &
+ConfigBuilder::set_timer_resolution(std::chrono::milliseconds resolution) {
+  config_.timer_resolution = resolution;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::set_metrics(bool enabled,
+                                          std::chrono::seconds interval) {
+  config_.enable_metrics = enabled;
+  config_.metrics_report_interval = interval;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::enable_capture(const std::string &path) {
+  config_.capture_file_path = path;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::enable_tracing(const std::string &path) {
+  config_.trace_file_path = path;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::enable_message_pool(bool enabled) {
+  config_.enable_message_pool = enabled;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::set_inflight_window(size_t max_inflight,
+                                                  size_t control_reserved = 2) {
+  config_.max_inflight_messages = max_inflight;
+  config_.control_reserved_inflight = control_reserved;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::set_priority_weights(size_t realtime,
+                                                   size_t bulk) {
+  config_.realtime_weight = realtime;
+  config_.bulk_weight = bulk;
+  return *this;
+}
+
+ConfigBuilder &
+ConfigBuilder::set_starvation_bounds(std::chrono::milliseconds realtime,
+                                     std::chrono::milliseconds bulk) {
+  config_.realtime_max_wait = realtime;
+  config_.bulk_max_wait = bulk;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::set_publish_queue_size(size_t size) {
+  config_.publish_queue_size = size;
+  return *this;
+}
+
+ConfigBuilder &
+ConfigBuilder::set_drain_timeout(std::chrono::milliseconds timeout) {
+  config_.drain_timeout = timeout;
+  return *this;
+}
+
+ConfigBuilder &
+ConfigBuilder::enable_auto_tuning(std::chrono::milliseconds target_p99,
+                                  std::chrono::milliseconds interval) {
+  config_.enable_auto_tuning = true;
+  config_.tuning_target_p99 = target_p99;
+  config_.tuning_interval = interval;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::set_tuning_bounds(size_t min_workers,
+                                                size_t max_workers,
+                                                size_t min_inflight,
+                                                size_t max_inflight,
+                                                size_t min_batch_bytes,
+                                                size_t max_batch_bytes) {
+  config_.tuning_min_workers = min_workers;
+  config_.tuning_max_workers = max_workers;
+  config_.tuning_min_inflight = min_inflight;
+  config_.tuning_max_inflight = max_inflight;
+  config_.tuning_min_batch_bytes = min_batch_bytes;
+  config_.tuning_max_batch_bytes = max_batch_bytes;
+  return *this;
+}
+
+ConfigBuilder &ConfigBuilder::set_cpu_affinity(const std::string &workers,
+                                               const std::string &timer,
+                                               const std::string &callback) {
+  config_.worker_cpus = workers;
+  config_.timer_cpus = timer;
+  config_.callback_cpus = callback;
+  return *this;
+}
+
+ConfigBuilder &
+ConfigBuilder::add_bridge_upstream(const BridgeUpstream &upstream) {
+  config_.bridge_upstreams.push_back(upstream);
+  return *this;
+}
+
+ConfigBuilder &
+ConfigBuilder::add_bridge_route(const BridgeRoute &route,
+                                QoSLevel qos = QoSLevel::AT_LEAST_ONCE) {
+  config_.bridge_routes.push_back(route);
+  auto &added = config_.bridge_routes.back();
+  if (added.name.empty())
+    added.name = added.filter + " -> " + added.upstream;
+
+  // Routes only see what the agent subscribes to
+  if (config_.subscription_qos.find(route.filter) ==
+      config_.subscription_qos.end())
+    add_subscription(route.filter, qos);
+  return *this;
+}
+
 Config ConfigBuilder::load_from_json(const std::string &path) {
   std::ifstream file(path);
   if (!file.is_open())
@@ -94,15 +264,25 @@ Config ConfigBuilder::load_from_json(const std::string &path) {
   if (j.contains("qos_level"))
     builder.set_qos_level(j["qos_level"]);
 
+  if (j.contains("thread_pool_size"))
+    builder.set_thread_pool_size(j["thread_pool_size"].get<size_t>());
+
+  if (j.contains("message_queue_size"))
+    builder.set_message_queue_size(j["message_queue_size"].get<size_t>());
+
   if (j.value("enable_persistence", false))
     builder.enable_persistence(
         j.value("persistence_directory", "./persistence"));
 
   if (j.contains("subscriptions") && j["subscriptions"].is_array())
-    for (const auto &sub : j["subscriptions"])
-      builder.add_subscription(
-          sub["topic"], static_cast<QoSLevel>(
-                            sub.value("qos_level", QoSLevel::AT_LEAST_ONCE)));
+    for (const auto &sub : j["subscriptions"]) {
+      auto qos = static_cast<QoSLevel>(
+          sub.value("qos_level", QoSLevel::AT_LEAST_ONCE));
+      if (sub.contains("group"))
+        builder.add_shared_subscription(sub["group"], sub["topic"], qos);
+      else
+        builder.add_subscription(sub["topic"], qos);
+    }
 
   if (j.contains("last_will") && j["last_will"].is_object()) {
     auto &last_will = j["last_will"];
@@ -116,6 +296,17 @@ Config ConfigBuilder::load_from_json(const std::string &path) {
     builder.enable_ssl(
         j.value("ca_certificate_file", "./authenication/ca_certificate"));
 
+  if (j.contains("client_certificate_file") ||
+      j.contains("client_private_key_file"))
+    builder.set_client_certificate(j.value("client_certificate_file", ""),
+                                   j.value("client_private_key_file", ""));
+
+  if (j.value("tls_session_resumption", false))
+    builder.enable_tls_session_resumption();
+
+  if (j.contains("clean_session"))
+    builder.set_clean_session(j["clean_session"].get<bool>());
+
   if (j.contains("log_level"))
     builder.set_log(string_to_log_level(j["log_level"]),
                     j.value("log_file_path", ""),
@@ -125,9 +316,135 @@ Config ConfigBuilder::load_from_json(const std::string &path) {
     builder.enable_auto_reconnect(
         std::chrono::seconds(j.value("reconnect_delay", 5)));
 
+  if (j.value("mqtt_v5", false))
+    builder.enable_mqtt_v5();
+
+  if (j.value("topic_alias_maximum", 0) > 0)
+    builder.enable_topic_aliases(j["topic_alias_maximum"].get<uint16_t>());
+
+  if (j.contains("rpc_response_topic") || j.contains("rpc_timeout_ms"))
+    builder.set_rpc(j.value("rpc_response_topic", ""),
+                    std::chrono::milliseconds(j.value("rpc_timeout_ms", 5000)));
+
+  if (j.contains("heartbeat_interval"))
+    builder.set_heartbeat_interval(
+        std::chrono::seconds(j["heartbeat_interval"].get<int>()));
+
+  if (j.contains("timer_resolution_ms"))
+    builder.set_timer_resolution(
+        std::chrono::milliseconds(j["timer_resolution_ms"].get<int>()));
+
+  if (j.contains("enable_metrics") || j.contains("metrics_report_interval"))
+    builder.set_metrics(
+        j.value("enable_metrics", true),
+        std::chrono::seconds(j.value("metrics_report_interval", 60)));
+
+  if (j.contains("capture_file_path"))
+    builder.enable_capture(j["capture_file_path"]);
+
+  if (j.contains("trace_file_path"))
+    builder.enable_tracing(j["trace_file_path"]);
+
+  if (j.contains("enable_message_pool"))
+    builder.enable_message_pool(j["enable_message_pool"].get<bool>());
+
+  if (j.contains("max_inflight_messages") ||
+      j.contains("control_reserved_inflight"))
+    builder.set_inflight_window(j.value("max_inflight_messages", 20),
+                                j.value("control_reserved_inflight", 2));
+
+  if (j.contains("realtime_weight") || j.contains("bulk_weight"))
+    builder.set_priority_weights(j.value("realtime_weight", 4),
+                                 j.value("bulk_weight", 1));
+
+  if (j.contains("realtime_max_wait_ms") || j.contains("bulk_max_wait_ms"))
+    builder.set_starvation_bounds(
+        std::chrono::milliseconds(j.value("realtime_max_wait_ms", 100)),
+        std::chrono::milliseconds(j.value("bulk_max_wait_ms", 2000)));
+
+  if (j.contains("publish_queue_size"))
+    builder.set_publish_queue_size(j["publish_queue_size"].get<size_t>());
+
+  if (j.contains("drain_timeout_ms"))
+    builder.set_drain_timeout(
+        std::chrono::milliseconds(j["drain_timeout_ms"].get<int>()));
+
+  if (j.value("enable_auto_tuning", false))
+    builder.enable_auto_tuning(
+        std::chrono::milliseconds(j.value("tuning_target_p99_ms", 100)),
+        std::chrono::milliseconds(j.value("tuning_interval_ms", 1000)));
+
+  if (j.contains("tuning_min_workers") || j.contains("tuning_max_workers") ||
+      j.contains("tuning_min_inflight") || j.contains("tuning_max_inflight") ||
+      j.contains("tuning_min_batch_bytes") ||
+      j.contains("tuning_max_batch_bytes"))
+    builder.set_tuning_bounds(j.value("tuning_min_workers", 1),
+                              j.value("tuning_max_workers", 16),
+                              j.value("tuning_min_inflight", 10),
+                              j.value("tuning_max_inflight", 1000),
+                              j.value("tuning_min_batch_bytes", 256),
+                              j.value("tuning_max_batch_bytes", 65536));
+
+  if (j.contains("worker_cpus") || j.contains("timer_cpus") ||
+      j.contains("callback_cpus"))
+    builder.set_cpu_affinity(j.value("worker_cpus", ""),
+                             j.value("timer_cpus", ""),
+                             j.value("callback_cpus", ""));
+
+  if (j.contains("bridge") && j["bridge"].is_object()) {
+    auto &bridge = j["bridge"];
+    if (bridge.contains("upstreams") && bridge["upstreams"].is_array())
+      for (const auto &item : bridge["upstreams"]) {
+        BridgeUpstream upstream;
+        upstream.name = item.value("name", "");
+        upstream.broker_url = item.value("broker_url", "");
+        upstream.client_id = item.value("client_id", "");
+        upstream.username = item.value("username", "");
+        upstream.password = item.value("password", "");
+        upstream.use_ssl = item.value("use_ssl", false);
+        upstream.ca_certificate_file = item.value("ca_certificate_file", "");
+        upstream.client_certificate_file =
+            item.value("client_certificate_file", "");
+        upstream.client_private_key_file =
+            item.value("client_private_key_file", "");
+        builder.add_bridge_upstream(upstream);
+      }
+
+    if (bridge.contains("routes") && bridge["routes"].is_array())
+      for (const auto &item : bridge["routes"]) {
+        BridgeRoute route;
+        route.name = item.value("name", "");
+        route.filter = item["filter"];
+        route.upstream = item["upstream"];
+        route.local_prefix = item.value("local_prefix", "");
+        route.remote_prefix = item.value("remote_prefix", "");
+        if (item.contains("qos_map") && item["qos_map"].is_array())
+          for (size_t i = 0; i < 3 && i < item["qos_map"].size(); i++)
+            route.qos_map[i] =
+                static_cast<QoSLevel>(item["qos_map"][i].get<int>());
+        route.max_pending = item.value("max_pending", 1000);
+        builder.add_bridge_route(
+            route, item.value("qos_level", QoSLevel::AT_LEAST_ONCE));
+      }
+  }
+
   return builder.build();
 }
 
+Config ConfigBuilder::load_from_image(const std::string &path) {
+  auto image = std::make_shared<const ConfigImage>(path);
+
+  Config config;
+  image->read(config);
+  config.image = std::move(image);
+  return config;
+}
+
+Config ConfigBuilder::load(const std::string &path) {
+  return ConfigImage::is_image(path) ? load_from_image(path)
+                                     : load_from_json(path);
+}
+
 Config ConfigBuilder::build() const {
   if (!config_.validate()) {
     throw std::invalid_argument("Invalid configuration");
@@ -135,6 +452,24 @@ Config ConfigBuilder::build() const {
   return config_;
 }
 
+bool operator==(const BridgeUpstream &a, const BridgeUpstream &b) {
+  return a.name == b.name && a.broker_url == b.broker_url &&
+         a.client_id == b.client_id && a.username == b.username &&
+         a.password == b.password && a.use_ssl == b.use_ssl &&
+         a.ca_certificate_file == b.ca_certificate_file &&
+         a.client_certificate_file == b.client_certificate_file &&
+         a.client_private_key_file == b.client_private_key_file;
+}
+
+bool operator==(const BridgeRoute &a, const BridgeRoute &b) {
+  return a.name == b.name && a.filter == b.filter &&
+         a.upstream == b.upstream && a.local_prefix == b.local_prefix &&
+         a.remote_prefix == b.remote_prefix &&
+         std::equal(std::begin(a.qos_map), std::end(a.qos_map),
+                    std::begin(b.qos_map)) &&
+         a.max_pending == b.max_pending;
+}
+
 LogLevel string_to_log_level(const std::string &log_level) {
   static const std::unordered_map<std::string, LogLevel> map = {
       {"DEBUG", LogLevel::DEBUG},
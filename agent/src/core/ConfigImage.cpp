@@ -0,0 +1,583 @@
+#include "ConfigImage.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+
+namespace {
+
+const char CONFIG_IMAGE_MAGIC[4] = {'M', 'Q', 'C', 'I'};
+
+size_t padded(size_t length) { return (length + 7) & ~size_t{7}; }
+
+uint64_t fnv1a(const char *data, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/*
+ * Calls visit(id, field) for every setting stored in an image. The ids are
+ * part of the image format: append new fields with new ids and never reuse
+ * or renumber an id.
+ */
+template <typename C, typename Visitor>
+void visit_settings(C &config, Visitor &&visit) {
+  visit(1, config.broker_url);
+  visit(2, config.client_id);
+  visit(3, config.username);
+  visit(4, config.password);
+  visit(5, config.connect_timeout);
+  visit(6, config.keep_alive_interval);
+  visit(7, config.clean_session);
+  visit(8, config.mqtt_v5);
+  visit(9, config.automatic_reconnect);
+  visit(10, config.reconnect_delay);
+  visit(11, config.max_reconnect_attempts);
+  visit(12, config.thread_pool_size);
+  visit(13, config.message_queue_size);
+  visit(14, config.enable_persistence);
+  visit(15, config.persistence_directory);
+  visit(16, config.qos_level);
+  visit(17, config.enable_last_will);
+  visit(18, config.last_will_topic);
+  visit(19, config.last_will_message);
+  visit(20, config.last_will_qos);
+  visit(21, config.last_will_retained);
+  visit(22, config.use_ssl);
+  visit(23, config.ca_certificate_file);
+  visit(24, config.client_certificate_file);
+  visit(25, config.client_private_key_file);
+  visit(26, config.log_level);
+  visit(27, config.log_file_path);
+  visit(28, config.log_to_console);
+  visit(29, config.max_inflight_messages);
+  visit(30, config.message_timeout);
+  visit(31, config.enable_message_pool);
+  visit(32, config.control_reserved_inflight);
+  visit(33, config.realtime_weight);
+  visit(34, config.bulk_weight);
+  visit(35, config.realtime_max_wait);
+  visit(36, config.bulk_max_wait);
+  visit(37, config.publish_queue_size);
+  visit(38, config.enable_metrics);
+  visit(39, config.metrics_report_interval);
+  visit(40, config.enable_topic_aliases);
+  visit(41, config.topic_alias_maximum);
+  visit(42, config.rpc_response_topic);
+  visit(43, config.rpc_timeout);
+  visit(44, config.heartbeat_interval);
+  visit(45, config.timer_resolution);
+  visit(46, config.capture_file_path);
+  visit(47, config.trace_file_path);
+  visit(48, config.drain_timeout);
+  visit(49, config.worker_cpus);
+  visit(50, config.timer_cpus);
+  visit(51, config.callback_cpus);
+  visit(52, config.enable_auto_tuning);
+  visit(53, config.tuning_target_p99);
+  visit(54, config.tuning_interval);
+  visit(55, config.tuning_min_workers);
+  visit(56, config.tuning_max_workers);
+  visit(57, config.tuning_min_inflight);
+  visit(58, config.tuning_max_inflight);
+  visit(59, config.tuning_min_batch_bytes);
+  visit(60, config.tuning_max_batch_bytes);
+  visit(61, config.tls_session_resumption);
+}
+
+/* Fields of a bridge upstream, with ids of their own */
+template <typename U, typename Visitor>
+void visit_upstream(U &upstream, Visitor &&visit) {
+  visit(1, upstream.name);
+  visit(2, upstream.broker_url);
+  visit(3, upstream.client_id);
+  visit(4, upstream.username);
+  visit(5, upstream.password);
+  visit(6, upstream.use_ssl);
+  visit(7, upstream.ca_certificate_file);
+  visit(8, upstream.client_certificate_file);
+  visit(9, upstream.client_private_key_file);
+}
+
+/* Fields of a bridge route, with ids of their own */
+template <typename R, typename Visitor>
+void visit_route(R &route, Visitor &&visit) {
+  visit(1, route.name);
+  visit(2, route.filter);
+  visit(3, route.upstream);
+  visit(4, route.local_prefix);
+  visit(5, route.remote_prefix);
+  visit(6, route.qos_map[0]);
+  visit(7, route.qos_map[1]);
+  visit(8, route.qos_map[2]);
+  visit(9, route.max_pending);
+}
+
+template <typename T> struct is_duration : std::false_type {};
+template <typename R, typename P>
+struct is_duration<std::chrono::duration<R, P>> : std::true_type {};
+
+/* Integers, booleans, enums and durations are all stored as int64 */
+template <typename T> int64_t to_integer(const T &value) {
+  if constexpr (is_duration<T>::value)
+    return static_cast<int64_t>(value.count());
+  else
+    return static_cast<int64_t>(value);
+}
+
+template <typename T> void from_integer(int64_t stored, T &value) {
+  if constexpr (is_duration<T>::value)
+    value = T(static_cast<typename T::rep>(stored));
+  else
+    value = static_cast<T>(stored);
+}
+
+/*
+ * Collects the strings of an image, storing each distinct string once.
+ */
+class StringTable {
+public:
+  uint32_t add(const std::string &value) {
+    auto it = offsets_.find(value);
+    if (it != offsets_.end())
+      return it->second;
+    if (data_.size() + value.size() > std::numeric_limits<uint32_t>::max())
+      throw std::runtime_error("Config too large for an image");
+    uint32_t offset = static_cast<uint32_t>(data_.size());
+    data_ += value;
+    offsets_.emplace(value, offset);
+    return offset;
+  }
+
+  const std::string &data() const { return data_; }
+
+private:
+  std::string data_;
+  std::unordered_map<std::string, uint32_t> offsets_;
+};
+
+template <typename T>
+ImageSetting make_setting(StringTable &strings, uint16_t id, const T &field) {
+  ImageSetting setting{};
+  setting.id = id;
+  if constexpr (std::is_same_v<T, std::string>) {
+    setting.type = IMAGE_SETTING_STRING;
+    setting.length = static_cast<uint32_t>(field.size());
+    setting.value = strings.add(field);
+  } else {
+    setting.type = IMAGE_SETTING_INTEGER;
+    setting.value = to_integer(field);
+  }
+  return setting;
+}
+
+/* Reads setting into field, unless its type does not fit the field */
+template <typename T>
+void read_setting(const ImageSetting &setting, const char *strings, T &field) {
+  if constexpr (std::is_same_v<T, std::string>) {
+    if (setting.type == IMAGE_SETTING_STRING)
+      field.assign(strings + setting.value, setting.length);
+  } else {
+    if (setting.type == IMAGE_SETTING_INTEGER)
+      from_integer(setting.value, field);
+  }
+}
+
+/*
+ * Topic filter trie while compiling. std::map keeps the children sorted, which
+ * is the order the image's binary search expects.
+ */
+struct BuildNode {
+  std::map<std::string, std::unique_ptr<BuildNode>> children;
+  std::vector<uint32_t> values;
+};
+
+std::vector<std::string_view> split_levels(std::string_view topic) {
+  std::vector<std::string_view> levels;
+  size_t start = 0;
+  while (true) {
+    size_t end = topic.find('/', start);
+    if (end == std::string_view::npos) {
+      levels.push_back(topic.substr(start));
+      return levels;
+    }
+    levels.push_back(topic.substr(start, end - start));
+    start = end + 1;
+  }
+}
+
+/* Checks that count elements of size bytes at offset fit in an image */
+bool section_fits(const ImageSection &section, size_t element_size,
+                  size_t image_size) {
+  if (section.count == 0)
+    return true;
+  return section.offset % 8 == 0 && section.offset <= image_size &&
+         section.count <= (image_size - section.offset) / element_size;
+}
+
+template <typename T>
+void append(std::string &image, ImageSection &section,
+            const std::vector<T> &elements) {
+  section.offset = image.size();
+  section.count = elements.size();
+  image.append(reinterpret_cast<const char *>(elements.data()),
+               elements.size() * sizeof(T));
+  image.resize(padded(image.size()), '\0');
+}
+
+} // namespace
+
+ConfigImage::ConfigImage(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw std::runtime_error("Couldn't open config image " + path);
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(ConfigImageHeader)) {
+    ::close(fd);
+    throw std::runtime_error("Not a config image: " + path);
+  }
+
+  size_ = st.st_size;
+  void *mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED)
+    throw std::runtime_error("Couldn't map config image " + path);
+  data_ = static_cast<const char *>(mapping);
+
+  try {
+    ConfigImageHeader header;
+    std::memcpy(&header, data_, sizeof(header));
+    validate(header, path);
+  } catch (...) {
+    munmap(mapping, size_);
+    throw;
+  }
+}
+
+ConfigImage::~ConfigImage() { munmap(const_cast<char *>(data_), size_); }
+
+void ConfigImage::validate(const ConfigImageHeader &header,
+                           const std::string &path) {
+  if (std::memcmp(header.magic, CONFIG_IMAGE_MAGIC, sizeof(header.magic)) !=
+      0)
+    throw std::runtime_error("Not a config image: " + path);
+  if (header.version != CONFIG_IMAGE_VERSION)
+    throw std::runtime_error("Unsupported config image version " +
+                             std::to_string(header.version) + ": " + path);
+  if (header.size != size_ ||
+      header.checksum != fnv1a(data_ + sizeof(header), size_ - sizeof(header)))
+    throw std::runtime_error("Corrupt config image " + path);
+
+  if (!section_fits(header.settings, sizeof(ImageSetting), size_) ||
+      !section_fits(header.strings, 1, size_) ||
+      !section_fits(header.subscriptions, sizeof(ImageSubscription), size_) ||
+      !section_fits(header.nodes, sizeof(ImageNode), size_) ||
+      !section_fits(header.edges, sizeof(ImageEdge), size_) ||
+      !section_fits(header.values, sizeof(uint32_t), size_) ||
+      !section_fits(header.bridge, sizeof(ImageSetting), size_) ||
+      header.nodes.count == 0)
+    throw std::runtime_error("Corrupt config image " + path);
+
+  // Sections are 8 byte aligned in the page aligned mapping, so they can be
+  // read in place
+  settings_ =
+      reinterpret_cast<const ImageSetting *>(data_ + header.settings.offset);
+  setting_count_ = header.settings.count;
+  strings_ = data_ + header.strings.offset;
+  subscriptions_ = reinterpret_cast<const ImageSubscription *>(
+      data_ + header.subscriptions.offset);
+  subscription_count_ = header.subscriptions.count;
+  nodes_ = reinterpret_cast<const ImageNode *>(data_ + header.nodes.offset);
+  edges_ = reinterpret_cast<const ImageEdge *>(data_ + header.edges.offset);
+  values_ = reinterpret_cast<const uint32_t *>(data_ + header.values.offset);
+  bridge_ =
+      reinterpret_cast<const ImageSetting *>(data_ + header.bridge.offset);
+  bridge_count_ = header.bridge.count;
+
+  auto string_fits = [&](uint64_t offset, uint64_t length) {
+    return offset <= header.strings.count &&
+           length <= header.strings.count - offset;
+  };
+
+  auto setting_fits = [&](const ImageSetting &setting) {
+    return setting.type != IMAGE_SETTING_STRING ||
+           (setting.value >= 0 && string_fits(setting.value, setting.length));
+  };
+  for (size_t i = 0; i < setting_count_; ++i)
+    if (!setting_fits(settings_[i]))
+      throw std::runtime_error("Corrupt config image " + path);
+  for (size_t i = 0; i < bridge_count_; ++i)
+    if (!setting_fits(bridge_[i]))
+      throw std::runtime_error("Corrupt config image " + path);
+
+  for (size_t i = 0; i < subscription_count_; ++i)
+    if (!string_fits(subscriptions_[i].offset, subscriptions_[i].length) ||
+        subscriptions_[i].qos > 2)
+      throw std::runtime_error("Corrupt config image " + path);
+
+  // Children always come after their parent, so matching cannot loop
+  auto child_fits = [&](uint32_t child, size_t parent) {
+    return child == IMAGE_NONE ||
+           (child > parent && child < header.nodes.count);
+  };
+
+  for (size_t i = 0; i < header.nodes.count; ++i) {
+    const auto &node = nodes_[i];
+    if (node.first_edge > header.edges.count ||
+        node.edge_count > header.edges.count - node.first_edge ||
+        node.first_value > header.values.count ||
+        node.value_count > header.values.count - node.first_value ||
+        !child_fits(node.single_child, i) || !child_fits(node.multi_child, i))
+      throw std::runtime_error("Corrupt config image " + path);
+
+    for (uint32_t e = node.first_edge; e < node.first_edge + node.edge_count;
+         ++e)
+      if (!string_fits(edges_[e].label_offset, edges_[e].label_length) ||
+          edges_[e].child == IMAGE_NONE || !child_fits(edges_[e].child, i))
+        throw std::runtime_error("Corrupt config image " + path);
+  }
+
+  for (size_t i = 0; i < header.values.count; ++i)
+    if (values_[i] >= subscription_count_)
+      throw std::runtime_error("Corrupt config image " + path);
+}
+
+void ConfigImage::compile(const Config &config, const std::string &path) {
+  if (!config.validate())
+    throw std::invalid_argument("Invalid configuration");
+
+  StringTable strings;
+
+  std::vector<ImageSetting> settings;
+  visit_settings(config, [&](uint16_t id, const auto &field) {
+    settings.push_back(make_setting(strings, id, field));
+  });
+
+  std::vector<ImageSetting> bridge;
+  auto add_bridge_field = [&](uint16_t id, const auto &field) {
+    bridge.push_back(make_setting(strings, id, field));
+  };
+  for (const auto &upstream : config.bridge_upstreams) {
+    add_bridge_field(IMAGE_BRIDGE_ELEMENT, IMAGE_BRIDGE_UPSTREAM);
+    visit_upstream(upstream, add_bridge_field);
+  }
+  for (const auto &route : config.bridge_routes) {
+    add_bridge_field(IMAGE_BRIDGE_ELEMENT, IMAGE_BRIDGE_ROUTE);
+    visit_route(route, add_bridge_field);
+  }
+
+  std::vector<ImageSubscription> subscriptions;
+  BuildNode root;
+  for (const auto &subscription : config.subscriptions) {
+    ImageSubscription entry{};
+    entry.offset = strings.add(subscription);
+    entry.length = static_cast<uint32_t>(subscription.size());
+    auto qos = config.subscription_qos.find(subscription);
+    entry.qos = static_cast<uint8_t>(
+        qos != config.subscription_qos.end() ? qos->second : config.qos_level);
+
+    BuildNode *node = &root;
+    std::string filter = subscription_filter(subscription);
+    for (auto level : split_levels(filter)) {
+      auto &child = node->children[std::string(level)];
+      if (!child)
+        child = std::make_unique<BuildNode>();
+      node = child.get();
+    }
+    node->values.push_back(static_cast<uint32_t>(subscriptions.size()));
+    subscriptions.push_back(entry);
+  }
+
+  // Flatten the trie breadth first, so every child is stored after its
+  // parent and the literal children of a node are adjacent and sorted
+  std::vector<ImageNode> nodes;
+  std::vector<ImageEdge> edges;
+  std::vector<uint32_t> values;
+  std::vector<const BuildNode *> order{&root};
+  auto add_node = [&](const BuildNode *node) {
+    order.push_back(node);
+    return static_cast<uint32_t>(order.size() - 1);
+  };
+
+  for (size_t i = 0; i < order.size(); ++i) {
+    const BuildNode *node = order[i];
+    ImageNode flat{};
+    flat.first_value = static_cast<uint32_t>(values.size());
+    flat.value_count = static_cast<uint32_t>(node->values.size());
+    values.insert(values.end(), node->values.begin(), node->values.end());
+    flat.single_child = flat.multi_child = IMAGE_NONE;
+    flat.first_edge = static_cast<uint32_t>(edges.size());
+
+    for (const auto &[label, child] : node->children) {
+      if (label == "+") {
+        flat.single_child = add_node(child.get());
+      } else if (label == "#") {
+        flat.multi_child = add_node(child.get());
+      } else {
+        ImageEdge edge{};
+        edge.label_offset = strings.add(label);
+        edge.label_length = static_cast<uint32_t>(label.size());
+        edge.child = add_node(child.get());
+        edges.push_back(edge);
+      }
+    }
+    flat.edge_count = static_cast<uint32_t>(edges.size()) - flat.first_edge;
+    nodes.push_back(flat);
+  }
+
+  ConfigImageHeader header{};
+  std::memcpy(header.magic, CONFIG_IMAGE_MAGIC, sizeof(header.magic));
+  header.version = CONFIG_IMAGE_VERSION;
+
+  std::string image(sizeof(header), '\0');
+  append(image, header.settings, settings);
+  append(image, header.strings,
+         std::vector<char>(strings.data().begin(), strings.data().end()));
+  append(image, header.subscriptions, subscriptions);
+  append(image, header.nodes, nodes);
+  append(image, header.edges, edges);
+  append(image, header.values, values);
+  append(image, header.bridge, bridge);
+
+  header.size = image.size();
+  header.checksum =
+      fnv1a(image.data() + sizeof(header), image.size() - sizeof(header));
+  std::memcpy(&image[0], &header, sizeof(header));
+
+  // Write next to the target and rename, so a running agent watching the
+  // path never maps a partial image
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!file.write(image.data(), image.size()) || !file.flush())
+      throw std::runtime_error("Couldn't write config image " + tmp_path);
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    throw std::runtime_error("Couldn't write config image " + path);
+  }
+}
+
+bool ConfigImage::is_image(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  char magic[sizeof(CONFIG_IMAGE_MAGIC)];
+  return file.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, CONFIG_IMAGE_MAGIC, sizeof(magic)) == 0;
+}
+
+void ConfigImage::read(Config &config) const {
+  // Settings are stored in id order, but look them up by id so images with
+  // fields unknown to this build, or without newer fields, still load
+  std::vector<const ImageSetting *> by_id;
+  for (size_t i = 0; i < setting_count_; ++i) {
+    if (settings_[i].id >= by_id.size())
+      by_id.resize(settings_[i].id + 1, nullptr);
+    by_id[settings_[i].id] = &settings_[i];
+  }
+
+  visit_settings(config, [&](uint16_t id, auto &field) {
+    if (id >= by_id.size() || by_id[id] == nullptr)
+      return;
+    read_setting(*by_id[id], strings_, field);
+  });
+
+  config.subscriptions.clear();
+  config.subscription_qos.clear();
+  config.subscriptions.reserve(subscription_count_);
+  config.subscription_qos.reserve(subscription_count_);
+  for (size_t i = 0; i < subscription_count_; ++i) {
+    config.subscriptions.emplace_back(subscription(i));
+    config.subscription_qos[config.subscriptions.back()] = subscription_qos(i);
+  }
+
+  // Fields of an element are looked up by id like the settings, so elements
+  // stored by other builds read the same way
+  config.bridge_upstreams.clear();
+  config.bridge_routes.clear();
+  int64_t element = 0;
+  for (size_t i = 0; i < bridge_count_; ++i) {
+    const ImageSetting &setting = bridge_[i];
+    auto read_field = [&](uint16_t id, auto &field) {
+      if (id == setting.id)
+        read_setting(setting, strings_, field);
+    };
+    if (setting.id == IMAGE_BRIDGE_ELEMENT) {
+      element = setting.value;
+      if (element == IMAGE_BRIDGE_UPSTREAM)
+        config.bridge_upstreams.emplace_back();
+      else if (element == IMAGE_BRIDGE_ROUTE)
+        config.bridge_routes.emplace_back();
+    } else if (element == IMAGE_BRIDGE_UPSTREAM) {
+      visit_upstream(config.bridge_upstreams.back(), read_field);
+    } else if (element == IMAGE_BRIDGE_ROUTE) {
+      visit_route(config.bridge_routes.back(), read_field);
+    }
+  }
+}
+
+std::string_view ConfigImage::subscription(size_t index) const {
+  return string_at(subscriptions_[index].offset, subscriptions_[index].length);
+}
+
+QoSLevel ConfigImage::subscription_qos(size_t index) const {
+  return static_cast<QoSLevel>(subscriptions_[index].qos);
+}
+
+void ConfigImage::match(std::string_view topic,
+                        std::vector<size_t> &out) const {
+  if (subscription_count_ == 0)
+    return;
+  match(0, split_levels(topic), 0, out);
+}
+
+void ConfigImage::match(uint32_t node_index,
+                        const std::vector<std::string_view> &levels,
+                        size_t index, std::vector<size_t> &out) const {
+  const ImageNode &node = nodes_[node_index];
+
+  // Wildcards at the first level never match topics starting with '$'
+  bool wildcards = index > 0 || levels[0].empty() || levels[0][0] != '$';
+
+  if (wildcards && node.multi_child != IMAGE_NONE) {
+    // '#' also matches the parent level, so "a/#" matches "a"
+    const ImageNode &multi = nodes_[node.multi_child];
+    out.insert(out.end(), values_ + multi.first_value,
+               values_ + multi.first_value + multi.value_count);
+  }
+
+  if (index == levels.size()) {
+    out.insert(out.end(), values_ + node.first_value,
+               values_ + node.first_value + node.value_count);
+    return;
+  }
+
+  if (wildcards && node.single_child != IMAGE_NONE)
+    match(node.single_child, levels, index + 1, out);
+
+  const ImageEdge *first = edges_ + node.first_edge;
+  const ImageEdge *last = first + node.edge_count;
+  const ImageEdge *edge =
+      std::lower_bound(first, last, levels[index],
+                       [this](const ImageEdge &e, std::string_view level) {
+                         return string_at(e.label_offset, e.label_length) <
+                                level;
+                       });
+  if (edge != last &&
+      string_at(edge->label_offset, edge->label_length) == levels[index])
+    match(edge->child, levels, index + 1, out);
+}
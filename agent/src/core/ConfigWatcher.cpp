@@ -0,0 +1,101 @@
+#include "ConfigWatcher.hpp"
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+ConfigWatcher::ConfigWatcher(const std::string &path, ChangeHandler on_change,
+                             std::chrono::milliseconds debounce)
+    : on_change_(std::move(on_change)), debounce_(debounce) {
+  auto slash = path.find_last_of('/');
+  if (slash == std::string::npos) {
+    directory_ = ".";
+    file_name_ = path;
+  } else {
+    directory_ = slash == 0 ? "/" : path.substr(0, slash);
+    file_name_ = path.substr(slash + 1);
+  }
+}
+
+ConfigWatcher::~ConfigWatcher() { stop(); }
+
+bool ConfigWatcher::start() {
+  if (thread_.joinable())
+    return true;
+
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (inotify_fd_ < 0 || stop_fd_ < 0 ||
+      inotify_add_watch(inotify_fd_, directory_.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+    std::cerr << "Cannot watch " << directory_ << ": " << std::strerror(errno)
+              << std::endl;
+    stop();
+    return false;
+  }
+
+  thread_ = std::thread(&ConfigWatcher::thread_main, this);
+  return true;
+}
+
+void ConfigWatcher::stop() {
+  if (thread_.joinable()) {
+    uint64_t one = 1;
+    ssize_t written = write(stop_fd_, &one, sizeof(one));
+    (void)written;
+    thread_.join();
+  }
+
+  if (inotify_fd_ >= 0)
+    close(inotify_fd_);
+  if (stop_fd_ >= 0)
+    close(stop_fd_);
+  inotify_fd_ = stop_fd_ = -1;
+}
+
+bool ConfigWatcher::read_events() {
+  alignas(inotify_event) char buffer[4096];
+  bool relevant = false;
+
+  while (true) {
+    ssize_t length = read(inotify_fd_, buffer, sizeof(buffer));
+    if (length <= 0)
+      return relevant;
+
+    for (ssize_t offset = 0; offset < length;) {
+      auto *event = reinterpret_cast<inotify_event *>(buffer + offset);
+      if (event->len > 0 && file_name_ == event->name)
+        relevant = true;
+      offset += sizeof(inotify_event) + event->len;
+    }
+  }
+}
+
+void ConfigWatcher::thread_main() {
+  pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+  bool pending = false;
+
+  while (true) {
+    // Wait indefinitely for the first event, then until the file is quiet
+    int timeout = pending ? static_cast<int>(debounce_.count()) : -1;
+    int ready = poll(fds, 2, timeout);
+    if (ready < 0 && errno != EINTR)
+      return;
+
+    if (fds[1].revents & POLLIN)
+      return;
+
+    if (ready > 0 && (fds[0].revents & POLLIN)) {
+      if (read_events())
+        pending = true;
+      continue;
+    }
+
+    if (ready == 0 && pending) {
+      pending = false;
+      on_change_(directory_ + "/" + file_name_);
+    }
+  }
+}
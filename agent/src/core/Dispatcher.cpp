@@ -0,0 +1,288 @@
+#include "Dispatcher.hpp"
+#include "Affinity.hpp"
+#include "Tracer.hpp"
+#include <chrono>
+#include <iostream>
+
+Dispatcher::Dispatcher(PlatformMetrics &metrics, size_t workers,
+                       size_t queue_size, std::vector<int> cpus)
+    : metrics_(metrics), worker_count_(workers ? workers : 1),
+      queue_size_(queue_size ? queue_size : 1), cpus_(std::move(cpus)) {}
+
+Dispatcher::~Dispatcher() { stop(); }
+
+namespace {
+
+// Largest subscription identifier, a variable byte integer
+const uint64_t MAX_SUBSCRIPTION_IDENTIFIER = 268435455;
+
+} // namespace
+
+int Dispatcher::add_subscription(const std::string &subscription) {
+  // FNV-1a of the subscription, so a session resumed by a later run gets
+  // the identifiers it was subscribed with. A collision only lets both
+  // routes take the message, as without identifiers
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : subscription) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+
+  std::unique_lock<std::shared_mutex> lock(routes_mutex_);
+  Route &route = routes_[route_for(subscription)];
+  route.identifier = static_cast<int>(hash % MAX_SUBSCRIPTION_IDENTIFIER + 1);
+  return route.identifier;
+}
+
+void Dispatcher::add_handler(const std::string &subscription,
+                             Handler handler) {
+  std::unique_lock<std::shared_mutex> lock(routes_mutex_);
+  Route &route = routes_[route_for(subscription)];
+  auto handlers = std::make_shared<std::vector<Handler>>(*route.handlers);
+  handlers->push_back(std::move(handler));
+  route.handlers = std::move(handlers);
+}
+
+size_t Dispatcher::route_for(const std::string &subscription) {
+  for (size_t i = 0; i < routes_.size(); ++i)
+    if (routes_[i].subscription == subscription)
+      return i;
+
+  Route route;
+  route.subscription = subscription;
+  route.handlers = std::make_shared<const std::vector<Handler>>();
+  std::string filter = subscription;
+  parse_shared_subscription(subscription, route.group, filter);
+
+  routes_.push_back(std::move(route));
+  matcher_.insert(filter, routes_.size() - 1);
+  return routes_.size() - 1;
+}
+
+bool Dispatcher::dispatch(mqtt::const_message_ptr msg) {
+  MQTT_TRACE_SCOPE("dispatcher", "enqueue");
+
+  {
+    std::shared_lock<std::shared_mutex> lock(routes_mutex_);
+    if (matcher_.empty())
+      return false;
+  }
+
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  not_full_.wait(lock,
+                 [this]() { return stopping_ || queue_.size() < queue_size_; });
+  if (stopping_ || workers_.empty())
+    return false;
+
+  queue_.push_back({std::move(msg), std::chrono::steady_clock::now()});
+  lock.unlock();
+  not_empty_.notify_one();
+  return true;
+}
+
+void Dispatcher::start() {
+  std::lock_guard<std::mutex> lock(queue_mutex_);
+  if (!workers_.empty())
+    return;
+
+  stopping_ = false;
+  for (size_t i = 0; i < worker_count_; ++i)
+    spawn(i);
+}
+
+void Dispatcher::set_worker_count(size_t workers) {
+  workers = workers ? workers : 1;
+  std::vector<std::unique_ptr<Worker>> finished;
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    worker_count_ = workers;
+    if (workers_.empty() || stopping_)
+      return;
+
+    // Surplus workers leave after their current message. The new ones are
+    // fresh threads, so a retired worker still in a handler is not revived
+    while (workers_.size() > worker_count_) {
+      workers_.back()->retired = true;
+      retired_.push_back(std::move(workers_.back()));
+      workers_.pop_back();
+    }
+    while (workers_.size() < worker_count_)
+      spawn(workers_.size());
+    not_empty_.notify_all();
+
+    for (auto it = retired_.begin(); it != retired_.end();) {
+      if ((*it)->done) {
+        finished.push_back(std::move(*it));
+        it = retired_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // These are past their last handler, so joining them does not block
+  for (auto &worker : finished)
+    worker->thread.join();
+}
+
+size_t Dispatcher::worker_count() const {
+  std::lock_guard<std::mutex> lock(queue_mutex_);
+  return worker_count_;
+}
+
+bool Dispatcher::drain(std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  if (workers_.empty())
+    return queue_.empty();
+  return idle_.wait_until(lock, deadline,
+                          [this]() { return queue_.empty() && active_ == 0; });
+}
+
+std::vector<mqtt::const_message_ptr> Dispatcher::stop() {
+  std::vector<std::unique_ptr<Worker>> workers;
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    stopping_ = true;
+    workers.swap(workers_);
+    for (auto &worker : retired_)
+      workers.push_back(std::move(worker));
+    retired_.clear();
+  }
+  not_empty_.notify_all();
+  not_full_.notify_all();
+
+  for (auto &worker : workers)
+    worker->thread.join();
+
+  std::lock_guard<std::mutex> lock(queue_mutex_);
+  std::vector<mqtt::const_message_ptr> left;
+  for (auto &entry : queue_)
+    left.push_back(std::move(entry.msg));
+  queue_.clear();
+  return left;
+}
+
+size_t Dispatcher::queue_depth() const {
+  std::lock_guard<std::mutex> lock(queue_mutex_);
+  return queue_.size();
+}
+
+namespace {
+
+// Match results of the worker, reserved once it is pinned
+thread_local std::vector<size_t> worker_matches;
+
+// Checks whether msg was delivered by the subscription with identifier.
+// Messages without identifiers, e.g. over MQTT 3.1.1, could come from any
+// matching subscription, as could routes subscribed without one
+bool delivered_by(const mqtt::const_message_ptr &msg, int identifier) {
+  const auto &props = msg->get_properties();
+  size_t tagged = props.count(mqtt::property::SUBSCRIPTION_IDENTIFIER);
+  if (!tagged || !identifier)
+    return true;
+  for (size_t i = 0; i < tagged; ++i)
+    if (mqtt::get<int>(props, mqtt::property::SUBSCRIPTION_IDENTIFIER, i) ==
+        identifier)
+      return true;
+  return false;
+}
+
+} // namespace
+
+void Dispatcher::process(const mqtt::const_message_ptr &msg) {
+  MQTT_TRACE_SCOPE("dispatcher", "process");
+  auto start = std::chrono::steady_clock::now();
+
+  // Allocated by the worker's first message, so also on its node
+  static thread_local std::vector<Matched> routes;
+  auto &matches = worker_matches;
+  matches.clear();
+
+  {
+    std::shared_lock<std::shared_mutex> lock(routes_mutex_);
+    matcher_.match(msg->get_topic(), matches);
+    for (size_t index : matches) {
+      const Route &route = routes_[index];
+      if (!delivered_by(msg, route.identifier))
+        continue;
+      routes.push_back({&route,
+                        route.group.empty() ? nullptr
+                                            : &metrics_.group(route.group),
+                        route.handlers});
+    }
+  }
+
+  for (const auto &matched : routes) {
+    if (matched.group)
+      matched.group->messages_received++;
+
+    for (const auto &handler : *matched.handlers) {
+      try {
+        MQTT_TRACE_SCOPE("dispatcher", "handler");
+        handler(msg);
+      } catch (const std::exception &e) {
+        std::cerr << "Handler for " << matched.route->subscription
+                  << " failed: " << e.what() << std::endl;
+      }
+    }
+
+    if (matched.group)
+      matched.group->messages_processed++;
+  }
+  // Drops the handler copies, which may hold the last reference
+  routes.clear();
+
+  // Exponential moving average of the time spent per message
+  double elapsed_ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+  double average = metrics_.average_processing_time_ms;
+  metrics_.average_processing_time_ms = average + (elapsed_ms - average) / 64;
+  metrics_.messages_processed++;
+}
+
+void Dispatcher::spawn(size_t index) {
+  auto worker = std::make_unique<Worker>();
+  worker->index = index;
+  worker->thread = std::thread(&Dispatcher::worker_main, this, worker.get());
+  workers_.push_back(std::move(worker));
+}
+
+void Dispatcher::worker_main(Worker *worker) {
+  // Pin before the worker touches its buffers, so they are allocated on the
+  // node it runs on
+  if (!cpus_.empty()) {
+    int cpu = cpus_[worker->index % cpus_.size()];
+    if (!pin_current_thread({cpu}))
+      std::cerr << "Couldn't pin dispatch worker " << worker->index
+                << " to CPU " << cpu << std::endl;
+  }
+  worker_matches.reserve(64);
+
+  while (true) {
+    Queued entry;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex_);
+      not_empty_.wait(lock, [this, worker]() {
+        return stopping_ || worker->retired || !queue_.empty();
+      });
+      if (stopping_ || worker->retired) {
+        worker->done = true;
+        return;
+      }
+
+      entry = std::move(queue_.front());
+      queue_.pop_front();
+      active_++;
+    }
+    not_full_.notify_one();
+
+    process(entry.msg);
+    metrics_.dispatch_latency.record(std::chrono::steady_clock::now() -
+                                     entry.queued);
+
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (--active_ == 0 && queue_.empty())
+      idle_.notify_all();
+  }
+}
@@ -0,0 +1,355 @@
+#include "LoopbackTransport.hpp"
+#include <algorithm>
+
+LoopbackBroker::LoopbackBroker(uint32_t seed)
+    : random_(seed), thread_(&LoopbackBroker::thread_main, this) {}
+
+LoopbackBroker::~LoopbackBroker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wakeup_.notify_all();
+  thread_.join();
+}
+
+void LoopbackBroker::set_conditions(const LoopbackConditions &conditions) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  conditions_ = conditions;
+}
+
+LoopbackConditions LoopbackBroker::conditions() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return conditions_;
+}
+
+bool LoopbackBroker::wait_idle(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return idle_.wait_for(lock, timeout,
+                        [this]() { return events_.empty() && !delivering_; });
+}
+
+uint64_t LoopbackBroker::attach(LoopbackTransport *client) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t id = next_client_++;
+  clients_[id] = client;
+  return id;
+}
+
+void LoopbackBroker::detach(uint64_t client) {
+  // Wait for a callback of this client that is running right now, unless the
+  // client is destroyed from within one of its own callbacks
+  std::unique_lock<std::mutex> callback_lock(callback_mutex_,
+                                             std::defer_lock);
+  if (std::this_thread::get_id() != thread_.get_id())
+    callback_lock.lock();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < subscriptions_.size(); i++)
+    if (subscriptions_[i].client == client)
+      erase_subscription(i);
+  clients_.erase(client);
+}
+
+void LoopbackBroker::subscribe(uint64_t client,
+                               const std::string &subscription, int qos,
+                               int identifier) {
+  std::string group, filter;
+  if (!parse_shared_subscription(subscription, group, filter))
+    filter = subscription;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Subscribing again replaces the QoS and identifier of the existing
+  // subscription
+  for (auto &entry : subscriptions_)
+    if (entry.client == client && entry.subscription == subscription) {
+      entry.qos = qos;
+      entry.identifier = identifier;
+      return;
+    }
+
+  size_t index;
+  if (free_subscriptions_.empty()) {
+    index = subscriptions_.size();
+    subscriptions_.emplace_back();
+  } else {
+    index = free_subscriptions_.back();
+    free_subscriptions_.pop_back();
+  }
+  subscriptions_[index] = {client, subscription, group, qos, identifier};
+  matcher_.insert(filter, index);
+
+  // Retained messages are sent to new non-shared subscriptions
+  if (!group.empty())
+    return;
+  for (const auto &entry : retained_) {
+    if (!topic_matches_filter(filter, entry.first))
+      continue;
+    const auto &retained = entry.second;
+    int delivery_qos = std::min(retained->get_qos(), qos);
+    auto props = retained->get_properties();
+    if (identifier)
+      props.add({mqtt::property::SUBSCRIPTION_IDENTIFIER, identifier});
+    auto msg = mqtt::message::create(retained->get_topic(),
+                                     retained->get_payload(), delivery_qos,
+                                     true, props);
+    transmit(delivery_qos, [this, client, msg]() {
+      notify(client, [&msg](LoopbackTransport &transport) {
+        transport.listener_->message_arrived(msg);
+      });
+    });
+  }
+}
+
+void LoopbackBroker::unsubscribe(uint64_t client,
+                                 const std::string &subscription) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < subscriptions_.size(); i++)
+    if (subscriptions_[i].client == client &&
+        subscriptions_[i].subscription == subscription)
+      erase_subscription(i);
+}
+
+void LoopbackBroker::erase_subscription(size_t index) {
+  matcher_.erase(subscription_filter(subscriptions_[index].subscription),
+                 index);
+  subscriptions_[index] = Subscription();
+  free_subscriptions_.push_back(index);
+}
+
+void LoopbackBroker::publish(uint64_t client, mqtt::const_message_ptr msg) {
+  int qos = msg->get_qos();
+  auto acknowledge = [this, client, msg]() {
+    notify(client, [&msg](LoopbackTransport &transport) {
+      transport.listener_->delivery_complete(msg, nullptr);
+    });
+  };
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // QoS 0 publishes are complete once they are sent
+  if (qos == 0)
+    schedule(Clock::duration::zero(), acknowledge);
+
+  transmit(qos, [this, qos, msg, acknowledge]() {
+    route(msg);
+    if (qos > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      transmit(qos, acknowledge);
+    }
+  });
+}
+
+void LoopbackBroker::route(const mqtt::const_message_ptr &msg) {
+  const std::string &topic = msg->get_topic();
+  std::vector<size_t> matches;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (msg->is_retained()) {
+    if (msg->get_payload().empty())
+      retained_.erase(topic);
+    else
+      retained_[topic] = msg;
+  }
+
+  matcher_.match(topic, matches);
+
+  // Every share group receives one copy, handed to its members in turn
+  std::map<std::string, std::vector<size_t>> groups;
+  std::vector<size_t> receivers;
+  for (size_t index : matches) {
+    if (subscriptions_[index].group.empty())
+      receivers.push_back(index);
+    else
+      groups[subscriptions_[index].subscription].push_back(index);
+  }
+  for (auto &group : groups) {
+    size_t &cursor = group_cursors_[group.first];
+    receivers.push_back(group.second[cursor++ % group.second.size()]);
+  }
+
+  for (size_t index : receivers) {
+    const auto &subscription = subscriptions_[index];
+    int qos = std::min(msg->get_qos(), subscription.qos);
+
+    // Forwarded messages are never flagged as retained and carry the
+    // identifier of the subscription that matched; unchanged messages are
+    // shared rather than copied
+    auto delivery = msg;
+    if (qos != msg->get_qos() || msg->is_retained() ||
+        subscription.identifier) {
+      auto props = msg->get_properties();
+      if (subscription.identifier)
+        props.add({mqtt::property::SUBSCRIPTION_IDENTIFIER,
+                   subscription.identifier});
+      delivery =
+          mqtt::message::create(topic, msg->get_payload(), qos, false, props);
+    }
+
+    uint64_t client = subscription.client;
+    messages_routed_++;
+    transmit(qos, [this, client, delivery]() {
+      notify(client, [&delivery](LoopbackTransport &transport) {
+        transport.listener_->message_arrived(delivery);
+      });
+    });
+  }
+}
+
+void LoopbackBroker::transmit(int qos, std::function<void()> action) {
+  if (conditions_.loss > 0 && loss_distribution_(random_) < conditions_.loss) {
+    packets_lost_++;
+    if (qos > 0)
+      schedule(conditions_.retry_interval, [this, qos, action]() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        transmit(qos, action);
+      });
+    return;
+  }
+
+  schedule(conditions_.latency, std::move(action));
+}
+
+void LoopbackBroker::schedule(Clock::duration delay,
+                              std::function<void()> action) {
+  events_.push({Clock::now() + delay, next_sequence_++, std::move(action)});
+  wakeup_.notify_one();
+}
+
+void LoopbackBroker::notify(
+    uint64_t client,
+    const std::function<void(LoopbackTransport &)> &callback) {
+  LoopbackTransport *transport;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = clients_.find(client);
+    if (it == clients_.end())
+      return;
+    transport = it->second;
+  }
+
+  if (transport->connected_ && transport->listener_)
+    callback(*transport);
+}
+
+void LoopbackBroker::thread_main() {
+  std::vector<std::function<void()>> due;
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (!stopping_) {
+    if (events_.empty()) {
+      delivering_ = false;
+      idle_.notify_all();
+      wakeup_.wait(lock);
+      continue;
+    }
+
+    // Copied, as wait_until keeps reading its deadline while publishers may
+    // grow the queue
+    auto now = Clock::now();
+    auto next = events_.top().due;
+    if (next > now) {
+      wakeup_.wait_until(lock, next);
+      continue;
+    }
+
+    // Run every event that is due in one batch
+    while (!events_.empty() && events_.top().due <= now) {
+      due.push_back(std::move(const_cast<Event &>(events_.top()).action));
+      events_.pop();
+    }
+    delivering_ = true;
+    lock.unlock();
+
+    {
+      std::lock_guard<std::mutex> callback_lock(callback_mutex_);
+      for (auto &action : due)
+        action();
+    }
+    due.clear();
+
+    lock.lock();
+  }
+}
+
+LoopbackTransport::LoopbackTransport(LoopbackBroker &broker)
+    : broker_(broker), id_(broker.attach(this)) {}
+
+LoopbackTransport::~LoopbackTransport() {
+  connected_ = false;
+  broker_.detach(id_);
+}
+
+void LoopbackTransport::set_listener(TransportListener &listener) {
+  listener_ = &listener;
+}
+
+ConnectResult LoopbackTransport::connect(const mqtt::connect_options &) {
+  if (!connected_.exchange(true)) {
+    std::lock_guard<std::mutex> lock(broker_.mutex_);
+    schedule_connected();
+  }
+
+  // Sessions are always clean
+  return ConnectResult();
+}
+
+void LoopbackTransport::disconnect() {
+  if (!connected_.exchange(false))
+    return;
+
+  std::lock_guard<std::mutex> lock(broker_.mutex_);
+  erase_subscriptions();
+}
+
+void LoopbackTransport::drop() {
+  if (connected_.exchange(false) && listener_)
+    listener_->connection_lost("");
+}
+
+void LoopbackTransport::reconnect(bool session_present) {
+  std::lock_guard<std::mutex> lock(broker_.mutex_);
+  if (!session_present)
+    erase_subscriptions();
+  if (!connected_.exchange(true))
+    schedule_connected();
+}
+
+void LoopbackTransport::schedule_connected() {
+  LoopbackBroker *broker = &broker_;
+  uint64_t id = id_;
+  broker_.schedule(LoopbackBroker::Clock::duration::zero(), [broker, id]() {
+    broker->notify(id, [](LoopbackTransport &transport) {
+      transport.listener_->connected("");
+    });
+  });
+}
+
+void LoopbackTransport::erase_subscriptions() {
+  for (size_t i = 0; i < broker_.subscriptions_.size(); i++)
+    if (broker_.subscriptions_[i].client == id_)
+      broker_.erase_subscription(i);
+}
+
+bool LoopbackTransport::is_connected() const { return connected_; }
+
+void LoopbackTransport::subscribe(const std::string &subscription, int qos,
+                                  int identifier) {
+  if (!connected_)
+    throw mqtt::exception(MQTTASYNC_DISCONNECTED);
+  broker_.subscribe(id_, subscription, qos, identifier);
+}
+
+void LoopbackTransport::unsubscribe(const std::string &subscription) {
+  if (!connected_)
+    throw mqtt::exception(MQTTASYNC_DISCONNECTED);
+  broker_.unsubscribe(id_, subscription);
+}
+
+void LoopbackTransport::publish(const mqtt::message_ptr &msg) {
+  if (!connected_)
+    throw mqtt::exception(MQTTASYNC_DISCONNECTED);
+  broker_.publish(id_, msg);
+}
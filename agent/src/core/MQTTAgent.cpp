@@ -1,16 +1,55 @@
 #include "MQTTAgent.hpp"
+#include "MessagePool.hpp"
+#include "Tracer.hpp"
+#include <algorithm>
 #include <memory>
 #include <mqtt/async_client.h>
-#include <mqtt/create_options.h>
+#include <mqtt/ssl_options.h>
+#include <cstdio>
+#include <iterator>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 std::atomic<bool> MQTTAgent::shutdown_requested{false};
 
+int MQTTAgent::shutdown_event_fd{-1};
+
 MQTTAgent *MQTTAgent::instance{nullptr};
 
+namespace {
+
+/* Filters the agent subscribes to with their QoS, in config order */
+std::vector<std::pair<std::string, int>>
+wanted_subscriptions(const Config &config, const RPCClient *rpc) {
+  std::vector<std::pair<std::string, int>> wanted;
+  for (const auto &topic : config.subscriptions) {
+    auto it = config.subscription_qos.find(topic);
+    wanted.emplace_back(topic,
+                        static_cast<int>(it != config.subscription_qos.end()
+                                             ? it->second
+                                             : config.qos_level));
+  }
+  if (rpc)
+    wanted.emplace_back(rpc->response_topic(), 1);
+  return wanted;
+}
+
+} // namespace
+
 MQTTAgent &MQTTAgent::get_instance(const Config &config,
                                    MQTTCallback &callback) {
+  return get_instance(config, callback, nullptr);
+}
+
+MQTTAgent &MQTTAgent::get_instance(const Config &config, MQTTCallback &callback,
+                                   std::unique_ptr<Transport> transport) {
+  if (shutdown_event_fd < 0)
+    shutdown_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
   if (instance == nullptr)
-    instance = new MQTTAgent(config, callback);
+    instance = new MQTTAgent(config, callback, std::move(transport));
 
   return *instance;
 }
@@ -20,51 +59,143 @@ void MQTTAgent::release_instance() {
   instance = nullptr;
 }
 
-MQTTAgent::MQTTAgent(const Config &config, MQTTCallback &callback)
-    : config_(config), callback_(callback) {
+void MQTTAgent::request_shutdown() {
+  shutdown_requested = true;
+  if (shutdown_event_fd >= 0) {
+    uint64_t one = 1;
+    ssize_t written = write(shutdown_event_fd, &one, sizeof(one));
+    (void)written;
+  }
+}
+
+MQTTAgent::MQTTAgent(const Config &config, MQTTCallback &callback,
+                     std::unique_ptr<Transport> transport)
+    : config_(std::make_shared<const Config>(config)), callback_(callback),
+      scheduler_(
+          callback.metrics,
+          [this](const mqtt::message_ptr &msg) { return transmit(msg); },
+          scheduler_options(config),
+          [this](const mqtt::message_ptr &msg) { return encode(msg); },
+          // A backlog continues in timer tasks, so neither the callback
+          // thread nor a single task sends all of it
+          [this]() {
+            timers_.schedule_once(std::chrono::milliseconds(0),
+                                  [this]() { scheduler_.resume(); });
+          }),
+      timers_(config.timer_resolution, parse_cpu_list(config.timer_cpus)),
+      callback_cpus_(parse_cpu_list(config.callback_cpus)),
+      dispatcher_(callback.metrics, config.thread_pool_size,
+                  config.message_queue_size,
+                  parse_cpu_list(config.worker_cpus)),
+      transport_(std::move(transport)) {
   // Create MQTT client
-  if (config_.enable_persistence)
-    client_ = std::make_unique<mqtt::async_client>(
-        config_.broker_url, config_.client_id, config_.persistence_directory);
-  else
-    client_ = std::make_unique<mqtt::async_client>(
-        config_.broker_url, config_.client_id, mqtt::NO_PERSISTENCE);
+  if (!transport_)
+    transport_ = std::make_unique<PahoTransport>(config, callback_);
+
+  // Route client events through the agent so RPC responses can be consumed
+  // before they reach the user callback
+  transport_->set_listener(*this);
 
-  // Set the callback
-  client_->set_callback(callback_);
+  if (!config.bridge_routes.empty())
+    bridge_ = std::make_unique<Bridge>(config, callback_.metrics, callback_);
+
+  if (config.enable_auto_tuning)
+    tuner_ = std::make_unique<AutoTuner>(callback_.metrics);
 
   // Setup connection options
   setup_connection_options();
+  if (config.enable_topic_aliases)
+    reset_topic_aliases();
+
+  if (!config.capture_file_path.empty())
+    capture_ = std::make_unique<TraceWriter>(config.capture_file_path);
+
+  if (!config.trace_file_path.empty())
+    Tracer::instance().enable();
+
+  timers_.start();
+
+  // Publishes whose completion never arrives would hold their window slot
+  // forever
+  timers_.schedule_periodic(std::chrono::seconds(1),
+                            [this]() { scheduler_.expire(); });
+  if (bridge_)
+    timers_.schedule_periodic(Bridge::RECONNECT_INTERVAL,
+                              [this]() { bridge_->reconnect(); });
+
+  // Shared subscriptions are routed even without handlers so their groups
+  // show up in the metrics
+  for (const auto &subscription : config.subscriptions)
+    if (subscription_filter(subscription) != subscription)
+      dispatcher_.add_subscription(subscription);
+  dispatcher_.start();
+
+  if (config.mqtt_v5) {
+    std::string response_topic =
+        config.rpc_response_topic.empty()
+            ? "rpc/" + config.client_id + "/response"
+            : config.rpc_response_topic;
+    rpc_ = std::make_unique<RPCClient>(
+        timers_, response_topic,
+        [this](mqtt::message_ptr msg) { send(msg, Priority::REALTIME); });
+  }
+
+  // A resumed session already holds the subscriptions of the config
+  for (const auto &entry : wanted_subscriptions(config, rpc_.get()))
+    subscribed_.insert(entry);
+}
+
+MQTTAgent::~MQTTAgent() {
+  // The expiry and bridge tasks are never cancelled and the periodic work
+  // is still scheduled if run() was not called. Stopping the wheel waits for
+  // a running task, so none outlives the dispatcher, the RPC client, the
+  // alias tables or the tuner
+  timers_.stop();
+  // Handlers may publish through the transport, which is destroyed first
+  dispatcher_.stop();
 }
 
 bool MQTTAgent::connect() {
+  MQTT_TRACE_SCOPE("agent", "connect");
+  auto config = this->config();
   try {
     std::cout << "Connecting to MQTT broker..." << std::endl;
-    auto token = client_->connect(connect_options_, nullptr, callback_);
-    token->wait(); // This will be changed to a non-blocking operation
+    auto start = std::chrono::steady_clock::now();
+    auto response = transport_->connect(connect_options_);
 
-    if (!client_->is_connected()) {
+    if (!transport_->is_connected()) {
+      callback_.metrics.connect_failures++;
       std::cerr << "Failed to connect to broker" << std::endl;
       return false;
     }
-
-    // Subscribe to topics iff there is no session already present
-    if (!token->get_connect_response().is_session_present()) {
-      for (const auto &topic : config_.subscriptions) {
-        auto qos = config_.subscription_qos.find(topic) !=
-                           config_.subscription_qos.end()
-                       ? static_cast<int>(config_.subscription_qos.at(topic))
-                       : static_cast<int>(config_.qos_level);
-
-        std::cout << "Subscribing to: " << topic << " (QoS " << qos << ")"
-                  << std::endl;
-        client_->subscribe(topic, qos, nullptr, callback_);
-      }
+    callback_.metrics.connect_latency.record(std::chrono::steady_clock::now() -
+                                             start);
+
+    // A broker that does not advertise a maximum accepts no aliases
+    if (config->enable_topic_aliases) {
+      const auto &props = response.properties;
+      broker_alias_maximum_ =
+          props.contains(mqtt::property::TOPIC_ALIAS_MAXIMUM)
+              ? mqtt::get<uint16_t>(props,
+                                    mqtt::property::TOPIC_ALIAS_MAXIMUM)
+              : 0;
+      reset_topic_aliases();
     }
 
+    // A new session gets every subscription, a resumed one what changed
+    // since it was last updated
+    update_subscriptions(response.session_present);
+
+    restore_offline_store();
+
+    // An unreachable upstream only affects its routes, which drop until
+    // the bridge's reconnect attempts get it back
+    if (bridge_)
+      bridge_->connect();
     return true;
 
   } catch (const mqtt::exception &exc) {
+    callback_.metrics.connect_failures++;
     std::cerr << "MQTT Exception: " << exc.what() << std::endl;
     return false;
   }
@@ -72,91 +203,681 @@ bool MQTTAgent::connect() {
 
 void MQTTAgent::publish_message(const std::string &topic,
                                 const std::string &payload, QoSLevel qos,
-                                bool retained) {
+                                bool retained, Priority priority) {
+  MQTT_TRACE_SCOPE("agent", "publish_message");
   try {
-    auto msg = mqtt::make_message(topic, payload);
-    msg->set_qos(static_cast<int>(qos));
-    msg->set_retained(retained);
+    auto msg = config()->enable_message_pool
+                   ? MessagePool::make_message(topic, payload,
+                                               static_cast<int>(qos), retained)
+                   : mqtt::make_message(topic, payload, static_cast<int>(qos),
+                                        retained);
+
+    if (callback_.should_log(LogLevel::DEBUG))
+      callback_.log(LogLevel::DEBUG, "Publishing to " + topic + ": " + payload);
+    send(msg, priority);
+
+  } catch (const mqtt::exception &exc) {
+    std::cerr << "Publish failed: " << exc.what() << std::endl;
+  }
+}
+
+void MQTTAgent::send(mqtt::message_ptr msg, Priority priority) {
+  MQTT_TRACE_SCOPE("agent", "send");
+  if (!scheduler_.enqueue(std::move(msg), priority))
+    std::cerr << "Publish dropped: " << priority_to_string(priority)
+              << " queue is full or shut down" << std::endl;
+}
+
+mqtt::message_ptr MQTTAgent::encode(const mqtt::message_ptr &msg) {
+  auto config = this->config();
+
+  // Aliases do not survive a reconnect, so only use them for messages that
+  // the client can never resend on a later connection. The offline store
+  // gets the message as queued, without the alias
+  if (!config->enable_topic_aliases ||
+      (msg->get_qos() > 0 && !config->clean_session))
+    return msg;
 
-    std::cout << "Publishing to " << topic << ": " << payload << std::endl;
-    client_->publish(msg, nullptr, callback_);
+  int64_t saved;
+  auto encoded = outbound_aliases_.apply(msg, saved);
+  callback_.metrics.topic_alias_bytes_saved_out += saved;
+  return encoded;
+}
 
+bool MQTTAgent::transmit(const mqtt::message_ptr &msg) {
+  MQTT_TRACE_SCOPE("agent", "transmit");
+  try {
+    transport_->publish(msg);
+    return true;
   } catch (const mqtt::exception &exc) {
     std::cerr << "Publish failed: " << exc.what() << std::endl;
+    return false;
   }
 }
 
+void MQTTAgent::add_handler(const std::string &subscription,
+                            Dispatcher::Handler handler) {
+  dispatcher_.add_handler(subscription, std::move(handler));
+}
+
+std::future<mqtt::const_message_ptr>
+MQTTAgent::call(const std::string &topic, const std::string &payload,
+                QoSLevel qos) {
+  return rpc().call(topic, payload, static_cast<int>(qos),
+                    config()->rpc_timeout);
+}
+
+void MQTTAgent::call(const std::string &topic, const std::string &payload,
+                     RPCClient::ResponseCallback callback, QoSLevel qos) {
+  rpc().call(topic, payload, static_cast<int>(qos), config()->rpc_timeout,
+             std::move(callback));
+}
+
+bool MQTTAgent::reply(const mqtt::const_message_ptr &request,
+                      const std::string &payload, QoSLevel qos) {
+  auto response =
+      RPCClient::make_response(request, payload, static_cast<int>(qos));
+  if (!response)
+    return false;
+
+  send(response, Priority::REALTIME);
+  return true;
+}
+
+RPCClient &MQTTAgent::rpc() {
+  if (!rpc_)
+    throw std::logic_error("RPC requires an MQTT v5 connection");
+  return *rpc_;
+}
+
 void MQTTAgent::run() {
   std::cout << "Platform running... Press Ctrl+C to stop" << std::endl;
 
   // Publish a startup message
-  std::string dev_topic = "device/" + config_.client_id;
+  std::string dev_topic = "device/" + config()->client_id;
   publish_message(dev_topic + "/status", "Client started",
-                  QoSLevel::AT_LEAST_ONCE, true);
+                  QoSLevel::AT_LEAST_ONCE, true, Priority::CONTROL);
+
+  // Periodic work runs on the timer wheel; this thread only waits for a
+  // shutdown request
+  {
+    std::lock_guard<std::mutex> lock(periodic_mutex_);
+    periodic_active_ = true;
+    schedule_periodic_work(*config());
+  }
 
-  // Main loop - in later phases this will be replaced with proper threading
-  int message_count = 0;
-  while (!shutdown_requested && client_->is_connected()) {
-    std::this_thread::sleep_for(std::chrono::seconds(10));
+  if (transport_->is_connected())
+    wait_for_shutdown();
 
-    // Send periodic heartbeat
-    publish_message(dev_topic + "/heartbeat",
-                    "Heartbeat " + std::to_string(++message_count));
+  {
+    std::lock_guard<std::mutex> lock(periodic_mutex_);
+    periodic_active_ = false;
+    cancel_periodic_work();
   }
 
-  // Publish shutdown message and shutdown
-  if (client_->is_connected()) {
+  // Publish shutdown message and shutdown. Drain even without a connection,
+  // so queued messages reach the offline store
+  if (transport_->is_connected())
     publish_message(dev_topic + "/status", "Client shutting down",
-                    QoSLevel::AT_LEAST_ONCE, true);
-    shutdown();
+                    QoSLevel::AT_LEAST_ONCE, true, Priority::CONTROL);
+  shutdown();
+}
+
+void MQTTAgent::schedule_periodic_work(const Config &config) {
+  std::string dev_topic = "device/" + config.client_id;
+  heartbeat_timer_ = timers_.schedule_periodic(
+      config.heartbeat_interval, [this, dev_topic]() {
+        if (!transport_->is_connected()) {
+          request_shutdown();
+          return;
+        }
+        publish_message(dev_topic + "/heartbeat",
+                        "Heartbeat " + std::to_string(++heartbeat_count_),
+                        QoSLevel::AT_LEAST_ONCE, false, Priority::CONTROL);
+      });
+
+  // Bounds how much of the capture is lost if the process dies
+  if (capture_)
+    capture_timer_ = timers_.schedule_periodic(std::chrono::seconds(1),
+                                               [this]() { capture_->flush(); });
+
+  if (config.enable_metrics)
+    metrics_timer_ =
+        timers_.schedule_periodic(config.metrics_report_interval,
+                                  [this]() { callback_.report_metrics(); });
+
+  if (tuner_)
+    tuning_timer_ =
+        timers_.schedule_periodic(config.tuning_interval, [this]() { tune(); });
+}
+
+void MQTTAgent::tune() {
+  // Keeps a reload from replacing the scheduler options in between
+  std::lock_guard<std::mutex> reload_lock(reload_mutex_);
+  auto config = this->config();
+  size_t publish_queued = 0;
+  for (Priority priority : {Priority::REALTIME, Priority::BULK})
+    publish_queued += scheduler_.queued(priority);
+  TuningSample sample =
+      tuner_->sample(dispatcher_.queue_depth(), publish_queued);
+
+  scheduler_options options = scheduler_.options();
+  TuningSettings settings{dispatcher_.worker_count(), options.max_inflight,
+                          options.quantum};
+  auto decisions = tuner_->decide(*config, sample, settings);
+  if (decisions.empty())
+    return;
+
+  dispatcher_.set_worker_count(settings.workers);
+  options.max_inflight = settings.max_inflight;
+  options.quantum = settings.batch_bytes;
+  scheduler_.set_options(options);
+
+  for (const auto &decision : decisions)
+    callback_.report_tuning(decision);
+}
+
+void MQTTAgent::cancel_periodic_work() {
+  if (heartbeat_timer_)
+    timers_.cancel(heartbeat_timer_);
+  if (metrics_timer_)
+    timers_.cancel(metrics_timer_);
+  if (capture_timer_)
+    timers_.cancel(capture_timer_);
+  if (tuning_timer_)
+    timers_.cancel(tuning_timer_);
+  heartbeat_timer_ = metrics_timer_ = capture_timer_ = tuning_timer_ = 0;
+}
+
+std::vector<std::string> MQTTAgent::apply_config(const Config &config) {
+  std::lock_guard<std::mutex> reload_lock(reload_mutex_);
+  auto current = this->config();
+  std::vector<std::string> restart_required;
+
+  // Settings that are baked into the client, the connection or the thread
+  // pools only take effect after a restart
+  auto check = [&](const char *name, bool changed) {
+    if (changed)
+      restart_required.emplace_back(name);
+  };
+  check("broker_url", config.broker_url != current->broker_url);
+  check("client_id", config.client_id != current->client_id);
+  check("credentials", config.username != current->username ||
+                           config.password != current->password);
+  check("connect_timeout", config.connect_timeout != current->connect_timeout);
+  check("keep_alive_interval",
+        config.keep_alive_interval != current->keep_alive_interval);
+  check("clean_session", config.clean_session != current->clean_session);
+  check("mqtt_v5", config.mqtt_v5 != current->mqtt_v5);
+  check("automatic_reconnect",
+        config.automatic_reconnect != current->automatic_reconnect ||
+            config.reconnect_delay != current->reconnect_delay ||
+            config.max_reconnect_attempts !=
+                current->max_reconnect_attempts);
+  check("thread_pool_size",
+        config.thread_pool_size != current->thread_pool_size);
+  check("message_queue_size",
+        config.message_queue_size != current->message_queue_size);
+  check("persistence",
+        config.enable_persistence != current->enable_persistence ||
+            config.persistence_directory != current->persistence_directory);
+  check("last_will",
+        config.enable_last_will != current->enable_last_will ||
+            config.last_will_topic != current->last_will_topic ||
+            config.last_will_message != current->last_will_message ||
+            config.last_will_qos != current->last_will_qos ||
+            config.last_will_retained != current->last_will_retained);
+  check("ssl", config.use_ssl != current->use_ssl ||
+                   config.ca_certificate_file != current->ca_certificate_file ||
+                   config.client_certificate_file !=
+                       current->client_certificate_file ||
+                   config.client_private_key_file !=
+                       current->client_private_key_file ||
+                   config.tls_session_resumption !=
+                       current->tls_session_resumption);
+  check("topic_aliases",
+        config.enable_topic_aliases != current->enable_topic_aliases ||
+            config.topic_alias_maximum != current->topic_alias_maximum);
+  check("rpc_response_topic",
+        config.rpc_response_topic != current->rpc_response_topic);
+  check("timer_resolution",
+        config.timer_resolution != current->timer_resolution);
+  check("capture_file_path",
+        config.capture_file_path != current->capture_file_path);
+  check("trace_file_path",
+        config.trace_file_path != current->trace_file_path);
+  check("cpu_affinity", config.worker_cpus != current->worker_cpus ||
+                           config.timer_cpus != current->timer_cpus ||
+                           config.callback_cpus != current->callback_cpus);
+  check("bridge", config.bridge_upstreams != current->bridge_upstreams ||
+                     config.bridge_routes != current->bridge_routes);
+  check("auto_tuning",
+        config.enable_auto_tuning != current->enable_auto_tuning);
+
+  // Keep the current values of everything that cannot change at runtime so
+  // the snapshot always describes what the agent actually does
+  Config next = *current;
+  next.subscriptions = config.subscriptions;
+  next.subscription_qos = config.subscription_qos;
+  next.image = config.image;
+  next.qos_level = config.qos_level;
+  next.log_level = config.log_level;
+  next.log_file_path = config.log_file_path;
+  next.log_to_console = config.log_to_console;
+  next.max_inflight_messages = config.max_inflight_messages;
+  next.message_timeout = config.message_timeout;
+  next.enable_message_pool = config.enable_message_pool;
+  next.control_reserved_inflight = config.control_reserved_inflight;
+  next.realtime_weight = config.realtime_weight;
+  next.bulk_weight = config.bulk_weight;
+  next.realtime_max_wait = config.realtime_max_wait;
+  next.bulk_max_wait = config.bulk_max_wait;
+  next.publish_queue_size = config.publish_queue_size;
+  next.drain_timeout = config.drain_timeout;
+  next.enable_metrics = config.enable_metrics;
+  next.metrics_report_interval = config.metrics_report_interval;
+  next.heartbeat_interval = config.heartbeat_interval;
+  next.rpc_timeout = config.rpc_timeout;
+  next.tuning_target_p99 = config.tuning_target_p99;
+  next.tuning_interval = config.tuning_interval;
+  next.tuning_min_workers = config.tuning_min_workers;
+  next.tuning_max_workers = config.tuning_max_workers;
+  next.tuning_min_inflight = config.tuning_min_inflight;
+  next.tuning_max_inflight = config.tuning_max_inflight;
+  next.tuning_min_batch_bytes = config.tuning_min_batch_bytes;
+  next.tuning_max_batch_bytes = config.tuning_max_batch_bytes;
+
+  // Shared subscriptions are routed even without handlers
+  for (const auto &topic : next.subscriptions)
+    if (subscription_filter(topic) != topic)
+      dispatcher_.add_subscription(topic);
+
+  callback_.set_log_options(log_options(next));
+  // The tuner owns the window and the batch; it moves them into the new
+  // bounds on its next interval. A larger control reserve must not leave
+  // realtime and bulk without a slot until then
+  scheduler_options options(next);
+  if (tuner_) {
+    options.max_inflight = std::max(scheduler_.options().max_inflight,
+                                    next.control_reserved_inflight + 1);
+    options.quantum = scheduler_.options().quantum;
+  }
+  scheduler_.set_options(options);
+
+  std::atomic_store(&config_, std::shared_ptr<const Config>(
+                                  std::make_shared<const Config>(next)));
+
+  // After the swap, so a reconnect racing with the reload sends the new set
+  update_subscriptions(true);
+
+  {
+    std::lock_guard<std::mutex> lock(periodic_mutex_);
+    if (periodic_active_ &&
+        (next.heartbeat_interval != current->heartbeat_interval ||
+         next.enable_metrics != current->enable_metrics ||
+         next.metrics_report_interval != current->metrics_report_interval ||
+         next.tuning_interval != current->tuning_interval)) {
+      cancel_periodic_work();
+      schedule_periodic_work(next);
+    }
+  }
+
+  for (const auto &name : restart_required)
+    std::cout << "Config reload: " << name
+              << " changed but only takes effect after a restart"
+              << std::endl;
+
+  return restart_required;
+}
+
+void MQTTAgent::update_subscriptions(bool session_present) {
+  std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+  if (!transport_->is_connected())
+    return;
+
+  // Read under the lock, so the last update sends the latest config
+  auto config = this->config();
+  auto wanted = wanted_subscriptions(*config, rpc_.get());
+  if (!session_present)
+    subscribed_.clear();
+
+  try {
+    for (auto it = subscribed_.begin(); it != subscribed_.end();) {
+      if (std::any_of(wanted.begin(), wanted.end(), [&](const auto &entry) {
+            return entry.first == it->first;
+          })) {
+        ++it;
+        continue;
+      }
+      std::cout << "Unsubscribing from: " << it->first << std::endl;
+      transport_->unsubscribe(it->first);
+      it = subscribed_.erase(it);
+    }
+
+    for (const auto &entry : wanted) {
+      auto it = subscribed_.find(entry.first);
+      // Subscribing again to an existing filter just replaces its QoS
+      if (it != subscribed_.end() && it->second == entry.second)
+        continue;
+      // Identifiers tell the dispatcher which subscription delivered a
+      // message; RPC responses never reach it
+      int identifier = 0;
+      if (config->mqtt_v5 && (!rpc_ || entry.first != rpc_->response_topic()))
+        identifier = dispatcher_.add_subscription(entry.first);
+      std::cout << "Subscribing to: " << entry.first << " (QoS "
+                << entry.second << ")" << std::endl;
+      transport_->subscribe(entry.first, entry.second, identifier);
+      subscribed_[entry.first] = entry.second;
+    }
+  } catch (const mqtt::exception &exc) {
+    std::cerr << "Subscription update failed: " << exc.what() << std::endl;
   }
 }
 
 void MQTTAgent::shutdown() {
   std::cout << "Shutting down platform..." << std::endl;
+  auto config = this->config();
+  auto deadline = std::chrono::steady_clock::now() + config->drain_timeout;
 
-  if (client_->is_connected()) {
+  // Stop intake. Messages the broker already sent still arrive and are
+  // handled while draining
+  if (transport_->is_connected()) {
     try {
-      // Unsubscribe from all topics
-      for (const auto &topic : config_.subscriptions) {
-        client_->unsubscribe(topic);
+      for (const auto &topic : config->subscriptions) {
+        transport_->unsubscribe(topic);
       }
+      if (rpc_)
+        transport_->unsubscribe(rpc_->response_topic());
+    } catch (const mqtt::exception &exc) {
+      std::cerr << "Shutdown error: " << exc.what() << std::endl;
+    }
+  }
 
-      // Disconnect
-      auto token = client_->disconnect();
-      token->wait(); // This will be changed to a non-blocking operation
+  drain(deadline);
 
+  if (transport_->is_connected()) {
+    try {
+      transport_->disconnect();
     } catch (const mqtt::exception &exc) {
       std::cerr << "Shutdown error: " << exc.what() << std::endl;
     }
   }
+  if (bridge_)
+    bridge_->disconnect();
+
+  // Nobody is left to answer outstanding calls
+  if (rpc_)
+    rpc_->cancel_all();
+
+  if (!config->trace_file_path.empty()) {
+    Tracer::instance().disable();
+    if (Tracer::instance().write_chrome_trace(config->trace_file_path))
+      std::cout << "Wrote trace to " << config->trace_file_path << std::endl;
+    else
+      std::cerr << "Couldn't write trace to " << config->trace_file_path
+                << std::endl;
+  }
+
+  if (capture_) {
+    capture_->flush();
+    std::cout << "Captured " << capture_->records() << " messages to "
+              << config->capture_file_path << std::endl;
+  }
 
   std::cout << "Platform shutdown complete." << std::endl;
 }
 
-void MQTTAgent::setup_connection_options() {
-  mqtt::connect_options_builder builder;
-
-  builder.clean_session(config_.clean_session)
-      .keep_alive_interval(config_.keep_alive_interval)
-      .connect_timeout(config_.connect_timeout)
-      .automatic_reconnect(config_.automatic_reconnect);
-
-  // Set credentials if provided
-  if (!config_.username.empty()) {
-    builder.user_name(config_.username);
-    if (!config_.password.empty()) {
-      builder.password(config_.password);
+void MQTTAgent::drain(std::chrono::steady_clock::time_point deadline) {
+  auto start = std::chrono::steady_clock::now();
+  auto config = this->config();
+  size_t pending = scheduler_.inflight() + dispatcher_.queue_depth();
+  for (size_t i = 0; i < PRIORITY_COUNT; i++)
+    pending += scheduler_.queued(static_cast<Priority>(i));
+  if (bridge_)
+    pending += bridge_->pending();
+  size_t accepted = scheduler_.accepted();
+
+  // Handlers go first, so what they publish (RPC replies, forwards) is
+  // still sent. Only then are publishes refused
+  dispatcher_.drain(deadline);
+  scheduler_.close();
+
+  // Acknowledgements only arrive over a live connection
+  if (transport_->is_connected())
+    scheduler_.drain(deadline);
+  if (bridge_)
+    bridge_->drain(deadline);
+
+  std::vector<PendingMessage> unsent, unacked;
+  scheduler_.take_pending(unsent, unacked);
+  std::vector<mqtt::const_message_ptr> unprocessed = dispatcher_.stop();
+  pending += scheduler_.accepted() - accepted;
+
+  // Forwarded messages were taken off the local broker already and have no
+  // store to go to. Publishes refused after the close, e.g. by handlers
+  // that overran the deadline, are lost as well
+  size_t refused = scheduler_.refused();
+  size_t persisted = 0, dropped = refused;
+  if (bridge_)
+    dropped += bridge_->abandon();
+  auto store = [&](const std::string &kind, size_t count,
+                   const auto &write) {
+    if (count == 0)
+      return;
+    if (!config->enable_persistence) {
+      dropped += count;
+      return;
+    }
+    try {
+      ::mkdir(config->persistence_directory.c_str(), 0755);
+      TraceWriter writer(offline_store_path(kind));
+      write(writer);
+      writer.flush();
+      persisted += count;
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Couldn't persist " << kind << " messages: " << e.what()
+                << std::endl;
+      dropped += count;
     }
+  };
+
+  // A transport with its own session store resends unacked publishes when
+  // the session is resumed; storing them too would send them twice
+  if (!config->clean_session && transport_->persists_publishes()) {
+    persisted += unacked.size();
+    unacked.clear();
   }
+  unacked.insert(unacked.end(), std::make_move_iterator(unsent.begin()),
+                 std::make_move_iterator(unsent.end()));
+  store("unsent", unacked.size(), [&](TraceWriter &writer) {
+    for (const auto &entry : unacked)
+      writer.record(*entry.msg, static_cast<uint8_t>(entry.priority));
+  });
+  store("unprocessed", unprocessed.size(), [&](TraceWriter &writer) {
+    for (const auto &msg : unprocessed)
+      writer.record(*msg);
+  });
+
+  // Refused publishes never counted as pending
+  size_t left = persisted + dropped - refused;
+  size_t drained = pending > left ? pending - left : 0;
+  callback_.metrics.drained_on_shutdown += drained;
+  callback_.metrics.persisted_on_shutdown += persisted;
+  callback_.metrics.dropped_on_shutdown += dropped;
+
+  std::cout << "Drained " << drained << " messages in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << " ms, persisted " << persisted << ", dropped " << dropped
+            << std::endl;
+}
+
+std::string MQTTAgent::offline_store_path(const std::string &kind) const {
+  auto config = this->config();
+  return config->persistence_directory + "/" + config->client_id + "-" +
+         kind + ".trace";
+}
+
+void MQTTAgent::restore_offline_store() {
+  if (!config()->enable_persistence)
+    return;
+
+  auto restore = [this](const std::string &kind, const auto &handle) {
+    std::string path = offline_store_path(kind);
+    if (::access(path.c_str(), F_OK) != 0)
+      return;
+    try {
+      TraceReader reader(path);
+      TraceRecord record;
+      while (reader.next(record)) {
+        handle(record.to_message(), record.priority);
+        callback_.metrics.restored_messages++;
+      }
+    } catch (const std::runtime_error &e) {
+      std::cerr << "Couldn't restore " << kind << " messages: " << e.what()
+                << std::endl;
+    }
+    std::remove(path.c_str());
+  };
+
+  restore("unsent", [this](mqtt::message_ptr msg, uint8_t priority) {
+    // Status and heartbeats describe a state that has passed, and a stale
+    // retained status would replace the startup one
+    if (priority == static_cast<uint8_t>(Priority::CONTROL)) {
+      std::cerr << "Dropping stale control message on " << msg->get_topic()
+                << std::endl;
+      return;
+    }
+    // Messages of older stores have no class and queue behind live
+    // realtime traffic
+    send(msg, priority < PRIORITY_COUNT ? static_cast<Priority>(priority)
+                                        : Priority::BULK);
+  });
+  restore("unprocessed", [this](mqtt::message_ptr msg, uint8_t) {
+    if (!dispatcher_.dispatch(msg))
+      std::cerr << "Dropping restored message on " << msg->get_topic()
+                << ": no handler" << std::endl;
+  });
+}
 
-  // Set Last Will Testament if enabled
-  if (config_.enable_last_will) {
-    auto will_msg = mqtt::message(
-        config_.last_will_topic, config_.last_will_message,
-        static_cast<int>(config_.last_will_qos), config_.last_will_retained);
-    builder.will(will_msg);
+void MQTTAgent::wait_for_shutdown() {
+  pollfd event{shutdown_event_fd, POLLIN, 0};
+
+  while (!shutdown_requested) {
+    if (event.fd < 0) {
+      // No eventfd available, fall back to polling the flag
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      continue;
+    }
+
+    if (poll(&event, 1, -1) > 0 && (event.revents & POLLIN)) {
+      uint64_t count;
+      ssize_t bytes = read(event.fd, &count, sizeof(count));
+      (void)bytes;
+    }
+  }
+}
+
+void MQTTAgent::setup_connection_options() {
+  connect_options_ = make_connect_options(*config());
+}
+
+void MQTTAgent::reset_topic_aliases() {
+  auto config = this->config();
+  outbound_aliases_.reset(
+      std::min<uint16_t>(broker_alias_maximum_, config->topic_alias_maximum));
+  inbound_aliases_.reset(config->topic_alias_maximum);
+}
+
+void MQTTAgent::connected(const std::string &cause) {
+  auto config = this->config();
+  // Also called after an automatic reconnect, which starts with empty tables
+  if (config->enable_topic_aliases)
+    reset_topic_aliases();
+
+  int64_t lost_at = connection_lost_at_.exchange(0);
+  if (lost_at) {
+    // A clean session drops whatever was in flight on the old connection.
+    // The first connect has nothing to forget, and publishes may already be
+    // in flight on it when this callback runs
+    if (config->clean_session)
+      scheduler_.reset_inflight();
+    // connect() updates the subscriptions of the connections it makes; an
+    // automatic reconnect has to do it here, including for reloads that
+    // happened while disconnected
+    if (config->automatic_reconnect)
+      update_subscriptions(!config->clean_session);
+    callback_.metrics.reconnect_latency.record(
+        std::chrono::steady_clock::now().time_since_epoch() -
+        std::chrono::steady_clock::duration(lost_at));
+  }
+  callback_.connected(cause);
+}
+
+void MQTTAgent::connection_lost(const std::string &cause) {
+  connection_lost_at_ =
+      std::chrono::steady_clock::now().time_since_epoch().count();
+  outbound_aliases_.reset(0);
+  callback_.connection_lost(cause);
+}
+
+void MQTTAgent::message_arrived(mqtt::const_message_ptr msg) {
+  MQTT_TRACE_SCOPE("agent", "message_arrived");
+  pin_callback_thread();
+
+  if (config()->enable_topic_aliases) {
+    int64_t saved;
+    msg = inbound_aliases_.resolve(msg, saved);
+    if (!msg) {
+      std::cerr << "Dropping message with unknown topic alias" << std::endl;
+      return;
+    }
+    callback_.metrics.topic_alias_bytes_saved_in += saved;
   }
 
-  connect_options_ = builder.finalize();
+  if (capture_)
+    capture_->record(*msg);
+
+  deliver(std::move(msg));
+}
+
+void MQTTAgent::pin_callback_thread() {
+  // The client owns its callback thread, so it is pinned from inside its
+  // first callback, before it touches the receive path's buffers
+  thread_local bool pinned = false;
+  if (pinned || callback_cpus_.empty())
+    return;
+  pinned = true;
+  if (!pin_current_thread(callback_cpus_))
+    std::cerr << "Couldn't pin callback thread to CPUs "
+              << format_cpu_list(callback_cpus_) << std::endl;
+}
+
+void MQTTAgent::deliver(mqtt::const_message_ptr msg) {
+  MQTT_TRACE_SCOPE("agent", "deliver");
+
+  // Responses to our own calls are consumed here
+  if (rpc_ && msg->get_topic() == rpc_->response_topic() &&
+      rpc_->handle_response(msg))
+    return;
+
+  callback_.message_arrived(msg);
+  if (bridge_)
+    bridge_->forward(msg);
+  dispatcher_.dispatch(std::move(msg));
+}
+
+void MQTTAgent::delivery_complete(const mqtt::const_message_ptr &msg,
+                                  const mqtt::delivery_token_ptr &tok) {
+  pin_callback_thread();
+  if (msg)
+    scheduler_.complete(msg.get());
+  callback_.delivery_complete(tok);
+}
+
+void MQTTAgent::delivery_failed(const mqtt::const_message_ptr &msg) {
+  pin_callback_thread();
+  if (msg)
+    scheduler_.fail(msg.get());
 }
@@ -1,30 +1,39 @@
 #include "MQTTCallback.hpp"
+#include "PublishScheduler.hpp"
+#include "Tracer.hpp"
+
+bool MQTTCallback::should_log(LogLevel level) const {
+  return !(level < log_level) && (log_to_console || log_to_file);
+}
 
 // Central logging function
 void MQTTCallback::log(LogLevel level, const std::string &msg) {
-  if (level < log_level)
+  if (!should_log(level))
     return;
 
   // Timestamp
   auto t = std::time(nullptr);
-  auto tm = *std::localtime(&t);
-  std::ostringstream time_ss;
-  time_ss << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
+  std::tm tm;
+  localtime_r(&t, &tm);
+  char time_text[32];
+  std::strftime(time_text, sizeof(time_text), "%Y-%m-%d %H:%M:%S", &tm);
 
-  std::ostringstream log_entry;
-  log_entry << "[" << time_ss.str() << "]"
-            << " [" << client_id << "]"
-            << " [" << log_level_to_string(level) << "] " << msg;
+  // Entries are formatted into a per-thread buffer that keeps its capacity
+  thread_local std::string log_entry;
+  log_entry.clear();
+  log_entry.append("[").append(time_text).append("] [").append(client_id);
+  log_entry.append("] [").append(log_level_to_string(level)).append("] ");
+  log_entry.append(msg);
 
   std::lock_guard<std::mutex> lock(log_mutex);
 
   // Console
   if (log_to_console)
-    std::cout << log_entry.str() << std::endl;
+    std::cout << log_entry << std::endl;
 
   // File
   if (log_file.is_open())
-    log_file << log_entry.str() << std::endl;
+    log_file << log_entry << std::endl;
 }
 
 MQTTCallback::MQTTCallback(const std::string &client_id,
@@ -32,24 +41,116 @@ MQTTCallback::MQTTCallback(const std::string &client_id,
     : client_id(client_id) {
   log_level = logOpts.log_level;
 
-  if (!logOpts.log_file_path.empty())
-    log_file.open(logOpts.log_file_path, std::ofstream::app);
+  log_file_path = logOpts.log_file_path;
+  if (!log_file_path.empty())
+    log_file.open(log_file_path, std::ofstream::app);
+  log_to_file = log_file.is_open();
 
+  log_to_console = logOpts.log_to_console;
+}
 
+void MQTTCallback::set_log_options(const log_options &logOpts) {
+  log_level = logOpts.log_level;
   log_to_console = logOpts.log_to_console;
+
+  std::lock_guard<std::mutex> lock(log_mutex);
+  if (logOpts.log_file_path == log_file_path)
+    return;
+
+  log_file_path = logOpts.log_file_path;
+  if (log_file.is_open())
+    log_file.close();
+  if (!log_file_path.empty())
+    log_file.open(log_file_path, std::ofstream::app);
+  log_to_file = log_file.is_open();
+}
+void MQTTCallback::report_metrics() {
+  MQTT_TRACE_SCOPE("callback", "report_metrics");
+  auto pool_stats = MessagePool::stats();
+  auto interval_pool_stats = pool_stats.since(last_pool_stats);
+  last_pool_stats = pool_stats;
+
+  std::ostringstream ss;
+  ss << "Metrics | Uptime: " << metrics.get_uptime_seconds() << "s"
+     << " | Received: " << metrics.messages_received
+     << " | Sent: " << metrics.messages_sent
+     << " | Processed: " << metrics.messages_processed
+     << " | Msg/s: " << metrics.get_messages_per_second()
+     << " | Alias bytes saved out/in: " << metrics.topic_alias_bytes_saved_out
+     << "/" << metrics.topic_alias_bytes_saved_in
+     << " | Allocs/msg: " << interval_pool_stats.allocations_per_message()
+     << " | RSS: " << PlatformMetrics::get_resident_set_bytes() / 1024
+     << " KiB"
+     << " | Connect p50/p99: " << metrics.connect_latency.percentile_ms(0.5)
+     << "/" << metrics.connect_latency.percentile_ms(0.99) << " ms ("
+     << metrics.connect_latency.samples << " ok, "
+     << metrics.connect_failures << " failed)"
+     << " | Reconnect p99: " << metrics.reconnect_latency.percentile_ms(0.99)
+     << " ms";
+
+  for (size_t i = 0; i < PRIORITY_COUNT; i++) {
+    const auto &priority = metrics.priorities[i];
+    ss << " | Publish " << priority_to_string(static_cast<Priority>(i))
+       << ": queued " << priority.queued << ", sent " << priority.sent
+       << ", dropped " << priority.dropped << " (expired "
+       << priority.expired << "), promoted "
+       << priority.starvation_promotions << ", p99 queue "
+       << priority.queue_latency.percentile_ms(0.99) << " ms, p99 delivery "
+       << priority.delivery_latency.percentile_ms(0.99) << " ms";
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(metrics.groups_mutex);
+    for (const auto &group : metrics.groups)
+      ss << " | Group " << group.first << ": "
+         << group.second->messages_processed << " ("
+         << group.second->get_messages_per_second() << " msg/s)";
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(metrics.bridge_routes_mutex);
+    for (const auto &[name, route] : metrics.bridge_routes)
+      ss << " | Bridge " << name << ": forwarded " << route->forwarded << " ("
+         << route->get_messages_per_second() << " msg/s), dropped "
+         << route->dropped << ", pending " << route->pending << ", p99 "
+         << route->latency.percentile_ms(0.99) << " ms";
+  }
+
+  if (metrics.tuning.intervals > 0)
+    ss << " | Tuning: workers " << metrics.tuning.workers << ", inflight "
+       << metrics.tuning.max_inflight << ", batch "
+       << metrics.tuning.batch_bytes << " bytes, decisions "
+       << metrics.tuning.decisions;
+  log(LogLevel::INFO, ss.str());
+}
+
+void MQTTCallback::report_tuning(const TuningDecision &decision) {
+  if (!should_log(LogLevel::INFO))
+    return;
+  log(LogLevel::INFO, "Tuning: " + decision.setting + " " +
+                          std::to_string(decision.from) + " -> " +
+                          std::to_string(decision.to) + ", " +
+                          decision.reason);
 }
+
 // Connection callbacks
 void MQTTCallback::connected(const std::string &cause) {
+  MQTT_TRACE_SCOPE("callback", "connected");
   log(LogLevel::INFO, "Connected: " + cause);
 }
 
 void MQTTCallback::connection_lost(const std::string &cause) {
+  MQTT_TRACE_SCOPE("callback", "connection_lost");
   log(LogLevel::ERROR, "Connection lost: " + cause);
 }
 
 // Message callback
 void MQTTCallback::message_arrived(mqtt::const_message_ptr msg) {
+  MQTT_TRACE_SCOPE("callback", "message_arrived");
   metrics.messages_received++;
+  if (!should_log(LogLevel::INFO))
+    return;
+
   std::ostringstream ss;
   ss << "Message arrived | Topic: " << msg->get_topic()
      << " | Payload: " << msg->get_payload_str() << " | QoS: " << msg->get_qos()
@@ -59,6 +160,7 @@ void MQTTCallback::message_arrived(mqtt::const_message_ptr msg) {
 
 // Action callbacks
 void MQTTCallback::on_failure(const mqtt::token &tok) {
+  MQTT_TRACE_SCOPE("callback", "on_failure");
   if (tok.get_reason_code() == mqtt::SUCCESS) {
     on_success(tok);
     return;
@@ -68,6 +170,7 @@ void MQTTCallback::on_failure(const mqtt::token &tok) {
 }
 
 void MQTTCallback::on_success(const mqtt::token &tok) {
+  MQTT_TRACE_SCOPE("callback", "on_success");
   switch (tok.get_type()) {
   case mqtt::token::CONNECT:
     log(LogLevel::INFO, "Connection successful");
@@ -85,7 +188,17 @@ void MQTTCallback::on_success(const mqtt::token &tok) {
 }
 
 void MQTTCallback::delivery_complete(mqtt::delivery_token_ptr tok) {
+  MQTT_TRACE_SCOPE("callback", "delivery_complete");
   metrics.messages_sent++;
+
+  if (!should_log(LogLevel::INFO))
+    return;
+
+  // Transports other than Paho have no delivery token
+  if (!tok) {
+    log(LogLevel::INFO, "Delivery complete");
+    return;
+  }
   log(LogLevel::INFO, "Delivery complete for message ID: " +
                           std::to_string(tok->get_message_id()));
 }
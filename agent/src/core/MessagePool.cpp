@@ -0,0 +1,306 @@
+#include "MessagePool.hpp"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+const size_t SIZE_CLASSES[] = {64, 128, 256, MessagePool::MAX_BLOCK_SIZE};
+const size_t CLASS_COUNT = sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+
+// Topics interned per thread before the table is started over
+const size_t MAX_INTERNED_TOPICS = 1024;
+
+int size_class(size_t size) {
+  for (size_t i = 0; i < CLASS_COUNT; i++)
+    if (size <= SIZE_CLASSES[i])
+      return static_cast<int>(i);
+  return -1;
+}
+
+struct Depot;
+
+// Precedes every block handed out by MessagePool::allocate
+struct alignas(16) BlockHeader {
+  Depot *owner;      // Null for blocks too large for the pools
+  size_t size_class;
+};
+
+// Link of a free block, stored in the block's usable memory
+struct FreeBlock {
+  FreeBlock *next;
+};
+
+struct PooledString {
+  std::string value;
+  Depot *owner;
+  PooledString *next = nullptr;
+};
+
+// The part of a thread's pool other threads may touch: memory released on
+// another thread is pushed onto these lists and collected by the owner once
+// its own free lists run dry. Depots live as long as the process, so a late
+// release can always look at orphaned; a release racing with the owner's
+// exit may leak its block
+struct Depot {
+  std::atomic<FreeBlock *> remote_blocks{nullptr};
+  std::atomic<PooledString *> remote_strings{nullptr};
+  std::atomic<bool> orphaned{false};
+};
+
+template <typename T> void push_remote(std::atomic<T *> &head, T *node) {
+  T *top = head.load(std::memory_order_relaxed);
+  do {
+    node->next = top;
+  } while (!head.compare_exchange_weak(top, node, std::memory_order_release,
+                                       std::memory_order_relaxed));
+}
+
+// Only written by the owning thread, read by stats()
+struct Counters {
+  std::atomic<size_t> messages{0};
+  std::atomic<size_t> heap_allocations{0};
+  std::atomic<size_t> reused{0};
+};
+
+void bump(std::atomic<size_t> &counter) {
+  counter.store(counter.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+}
+
+// Counters of live threads, totals of finished ones and every depot. Never
+// destroyed, as threads may finish during static destruction
+struct Registry {
+  std::mutex mutex;
+  std::vector<Counters *> live;
+  MessagePool::Stats retired;
+  std::vector<std::unique_ptr<Depot>> depots;
+};
+
+Registry &registry() {
+  static Registry *instance = new Registry();
+  return *instance;
+}
+
+struct ThreadPool {
+  Depot *depot;
+  std::vector<BlockHeader *> blocks[CLASS_COUNT];
+  std::vector<PooledString *> strings;
+  std::unordered_map<std::string, mqtt::string_ref> topics;
+  Counters counters;
+
+  ThreadPool() {
+    std::lock_guard<std::mutex> lock(registry().mutex);
+    registry().depots.push_back(std::make_unique<Depot>());
+    depot = registry().depots.back().get();
+    registry().live.push_back(&counters);
+  }
+
+  ~ThreadPool();
+
+  void cache_block(BlockHeader *header) {
+    auto &list = blocks[header->size_class];
+    if (list.size() < MessagePool::MAX_CACHED_BLOCKS)
+      list.push_back(header);
+    else
+      ::operator delete(header);
+  }
+
+  void cache_string(PooledString *string) {
+    if (strings.size() < MessagePool::MAX_CACHED_BLOCKS &&
+        string->value.capacity() <= MessagePool::MAX_CACHED_PAYLOAD) {
+      string->value.clear();
+      strings.push_back(string);
+    } else {
+      delete string;
+    }
+  }
+
+  /* Moves the memory other threads released into the local free lists */
+  void collect_remote() {
+    FreeBlock *block =
+        depot->remote_blocks.exchange(nullptr, std::memory_order_acquire);
+    while (block) {
+      FreeBlock *next = block->next;
+      cache_block(reinterpret_cast<BlockHeader *>(block) - 1);
+      block = next;
+    }
+
+    PooledString *string =
+        depot->remote_strings.exchange(nullptr, std::memory_order_acquire);
+    while (string) {
+      PooledString *next = string->next;
+      cache_string(string);
+      string = next;
+    }
+  }
+};
+
+// Set once the thread's pool is gone; memory released later on that thread
+// goes straight back to the heap
+thread_local bool pool_destroyed = false;
+
+ThreadPool::~ThreadPool() {
+  pool_destroyed = true;
+  depot->orphaned = true;
+
+  collect_remote();
+  for (auto &list : blocks)
+    for (BlockHeader *header : list)
+      ::operator delete(header);
+  for (PooledString *string : strings)
+    delete string;
+
+  auto &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  reg.retired.messages += counters.messages;
+  reg.retired.heap_allocations += counters.heap_allocations;
+  reg.retired.reused += counters.reused;
+  for (auto it = reg.live.begin(); it != reg.live.end(); ++it)
+    if (*it == &counters) {
+      reg.live.erase(it);
+      break;
+    }
+}
+
+ThreadPool *local_pool() {
+  if (pool_destroyed)
+    return nullptr;
+  thread_local ThreadPool pool;
+  return &pool;
+}
+
+// Returns a payload string to the pool of the thread that built it
+struct StringRecycler {
+  PooledString *string;
+
+  void operator()(std::string *) const {
+    ThreadPool *pool = local_pool();
+    if (pool && string->owner == pool->depot)
+      pool->cache_string(string);
+    else if (string->owner->orphaned)
+      delete string;
+    else
+      push_remote(string->owner->remote_strings, string);
+  }
+};
+
+mqtt::string_ref intern_topic(ThreadPool &pool, const std::string &topic) {
+  auto it = pool.topics.find(topic);
+  if (it != pool.topics.end()) {
+    bump(pool.counters.reused);
+    return it->second;
+  }
+
+  if (pool.topics.size() >= MAX_INTERNED_TOPICS)
+    pool.topics.clear();
+  bump(pool.counters.heap_allocations);
+  return pool.topics.emplace(topic, mqtt::string_ref(topic)).first->second;
+}
+
+PooledString *take_string(ThreadPool &pool, size_t size) {
+  if (pool.strings.empty())
+    pool.collect_remote();
+
+  PooledString *string;
+  if (pool.strings.empty()) {
+    string = new PooledString();
+    string->owner = pool.depot;
+    bump(pool.counters.heap_allocations);
+  } else {
+    string = pool.strings.back();
+    pool.strings.pop_back();
+    bump(pool.counters.reused);
+  }
+
+  // Growing the string is one more allocation
+  if (size > string->value.capacity())
+    bump(pool.counters.heap_allocations);
+  return string;
+}
+
+} // namespace
+
+void *MessagePool::allocate(size_t size) {
+  int index = size_class(size);
+  ThreadPool *pool = local_pool();
+
+  if (index < 0 || !pool) {
+    auto *header = static_cast<BlockHeader *>(
+        ::operator new(sizeof(BlockHeader) + size));
+    header->owner = nullptr;
+    header->size_class = CLASS_COUNT;
+    if (pool)
+      bump(pool->counters.heap_allocations);
+    return header + 1;
+  }
+
+  auto &list = pool->blocks[index];
+  if (list.empty())
+    pool->collect_remote();
+
+  BlockHeader *header;
+  if (list.empty()) {
+    header = static_cast<BlockHeader *>(
+        ::operator new(sizeof(BlockHeader) + SIZE_CLASSES[index]));
+    header->owner = pool->depot;
+    header->size_class = index;
+    bump(pool->counters.heap_allocations);
+  } else {
+    header = list.back();
+    list.pop_back();
+    bump(pool->counters.reused);
+  }
+  return header + 1;
+}
+
+void MessagePool::deallocate(void *block, size_t) {
+  BlockHeader *header = static_cast<BlockHeader *>(block) - 1;
+  if (!header->owner) {
+    ::operator delete(header);
+    return;
+  }
+
+  ThreadPool *pool = local_pool();
+  if (pool && header->owner == pool->depot)
+    pool->cache_block(header);
+  else if (header->owner->orphaned)
+    ::operator delete(header);
+  else
+    push_remote(header->owner->remote_blocks, static_cast<FreeBlock *>(block));
+}
+
+mqtt::message_ptr MessagePool::make_message(const std::string &topic,
+                                            const std::string &payload,
+                                            int qos, bool retained) {
+  ThreadPool *pool = local_pool();
+  if (!pool)
+    return mqtt::make_message(topic, payload, qos, retained);
+
+  bump(pool->counters.messages);
+
+  PooledString *buffer = take_string(*pool, payload.size());
+  buffer->value.assign(payload);
+  mqtt::binary_ref payload_ref(std::shared_ptr<const std::string>(
+      &buffer->value, StringRecycler{buffer}, PoolAllocator<std::string>()));
+
+  return std::allocate_shared<mqtt::message>(PoolAllocator<mqtt::message>(),
+                                             intern_topic(*pool, topic),
+                                             payload_ref, qos, retained);
+}
+
+MessagePool::Stats MessagePool::stats() {
+  auto &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+
+  Stats stats = reg.retired;
+  for (const Counters *counters : reg.live) {
+    stats.messages += counters->messages.load(std::memory_order_relaxed);
+    stats.heap_allocations +=
+        counters->heap_allocations.load(std::memory_order_relaxed);
+    stats.reused += counters->reused.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
@@ -0,0 +1,237 @@
+#include "MessageTrace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <mqtt/properties.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char TRACE_MAGIC[4] = {'M', 'Q', 'T', 'R'};
+
+// MQTT v5 properties kept with each record
+const mqtt::property::code TRACED_PROPERTIES[] = {
+    mqtt::property::RESPONSE_TOPIC, mqtt::property::CORRELATION_DATA};
+const size_t TRACED_PROPERTY_COUNT = std::size(TRACED_PROPERTIES);
+
+// Identifier byte and value length in front of every property value
+const size_t PROPERTY_HEADER_SIZE = 1 + sizeof(uint32_t);
+
+size_t padded(size_t length) { return (length + 7) & ~size_t{7}; }
+
+uint64_t steady_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+} // namespace
+
+TraceWriter::TraceWriter(const std::string &path, size_t buffer_size)
+    : buffer_size_(buffer_size), start_ns_(steady_now_ns()) {
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0)
+    throw std::runtime_error("Couldn't create trace file " + path);
+
+  buffer_.reserve(buffer_size_);
+
+  TraceFileHeader header{};
+  std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.start_time_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+
+  auto bytes = reinterpret_cast<const char *>(&header);
+  buffer_.insert(buffer_.end(), bytes, bytes + sizeof(header));
+}
+
+TraceWriter::~TraceWriter() {
+  flush();
+  ::close(fd_);
+}
+
+void TraceWriter::record(const mqtt::message &msg, uint8_t priority) {
+  const auto &topic = msg.get_topic();
+  const auto &payload = msg.get_payload();
+
+  const auto &props = msg.get_properties();
+  std::string values[TRACED_PROPERTY_COUNT];
+  bool present[TRACED_PROPERTY_COUNT] = {};
+  size_t properties_length = 0;
+  if (!props.empty()) {
+    for (size_t i = 0; i < TRACED_PROPERTY_COUNT; i++) {
+      if (!props.contains(TRACED_PROPERTIES[i]))
+        continue;
+      present[i] = true;
+      values[i] = mqtt::get<std::string>(props, TRACED_PROPERTIES[i]);
+      properties_length += PROPERTY_HEADER_SIZE + values[i].size();
+    }
+  }
+
+  TraceRecordHeader header{};
+  header.timestamp_ns = steady_now_ns() - start_ns_;
+  header.topic_length = static_cast<uint32_t>(topic.size());
+  header.payload_length = static_cast<uint32_t>(payload.size());
+  header.qos = static_cast<uint8_t>(msg.get_qos());
+  header.flags = msg.is_retained() ? TRACE_FLAG_RETAINED : 0;
+  header.priority = priority;
+  header.properties_length = static_cast<uint32_t>(properties_length);
+
+  size_t length = sizeof(header) +
+                  padded(topic.size() + payload.size() + properties_length);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (buffer_.size() + length > buffer_size_)
+    write_buffer();
+
+  size_t offset = buffer_.size();
+  buffer_.resize(offset + length, '\0');
+  char *out = buffer_.data() + offset;
+  std::memcpy(out, &header, sizeof(header));
+  out += sizeof(header);
+  std::memcpy(out, topic.data(), topic.size());
+  out += topic.size();
+  std::memcpy(out, payload.data(), payload.size());
+  out += payload.size();
+  for (size_t i = 0; i < TRACED_PROPERTY_COUNT; i++) {
+    if (!present[i])
+      continue;
+    auto identifier = static_cast<uint8_t>(TRACED_PROPERTIES[i]);
+    auto value_length = static_cast<uint32_t>(values[i].size());
+    std::memcpy(out, &identifier, 1);
+    std::memcpy(out + 1, &value_length, sizeof(value_length));
+    std::memcpy(out + PROPERTY_HEADER_SIZE, values[i].data(),
+                values[i].size());
+    out += PROPERTY_HEADER_SIZE + values[i].size();
+  }
+  records_++;
+}
+
+void TraceWriter::flush() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  write_buffer();
+}
+
+void TraceWriter::write_buffer() {
+  const char *data = buffer_.data();
+  size_t remaining = buffer_.size();
+  while (remaining > 0) {
+    ssize_t written = ::write(fd_, data, remaining);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      break; // Keep the agent running; the trace ends here
+    }
+    data += written;
+    remaining -= written;
+  }
+  buffer_.clear();
+}
+
+mqtt::message_ptr TraceRecord::to_message() const {
+  mqtt::properties props;
+  if (!response_topic.empty())
+    props.add({mqtt::property::RESPONSE_TOPIC, std::string(response_topic)});
+  if (!correlation_data.empty())
+    props.add(
+        {mqtt::property::CORRELATION_DATA, std::string(correlation_data)});
+  return mqtt::message::create(std::string(topic), std::string(payload), qos,
+                               retained, props);
+}
+
+TraceReader::TraceReader(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw std::runtime_error("Couldn't open trace file " + path);
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(TraceFileHeader)) {
+    ::close(fd);
+    throw std::runtime_error("Not a trace file: " + path);
+  }
+
+  size_ = st.st_size;
+  void *mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED)
+    throw std::runtime_error("Couldn't map trace file " + path);
+  data_ = static_cast<const char *>(mapping);
+  madvise(mapping, size_, MADV_SEQUENTIAL);
+
+  TraceFileHeader header;
+  std::memcpy(&header, data_, sizeof(header));
+  if (std::memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version < 1 || header.version > TRACE_VERSION) {
+    munmap(mapping, size_);
+    throw std::runtime_error("Not a trace file: " + path);
+  }
+
+  version_ = header.version;
+  start_time_ns_ = header.start_time_ns;
+  offset_ = sizeof(header);
+}
+
+TraceReader::~TraceReader() {
+  munmap(const_cast<char *>(data_), size_);
+}
+
+bool TraceReader::next(TraceRecord &record) {
+  if (size_ - offset_ < sizeof(TraceRecordHeader))
+    return false;
+
+  // Records are 8 byte aligned in the mapping, so the header can be read in
+  // place
+  auto header = reinterpret_cast<const TraceRecordHeader *>(data_ + offset_);
+  size_t properties_length = version_ >= 2 ? header->properties_length : 0;
+  size_t body = size_t{header->topic_length} + header->payload_length +
+                properties_length;
+  if (size_ - offset_ - sizeof(TraceRecordHeader) < body)
+    return false;
+
+  const char *topic = data_ + offset_ + sizeof(TraceRecordHeader);
+  record.timestamp_ns = header->timestamp_ns;
+  record.topic = std::string_view(topic, header->topic_length);
+  record.payload =
+      std::string_view(topic + header->topic_length, header->payload_length);
+  record.qos = header->qos;
+  record.retained = header->flags & TRACE_FLAG_RETAINED;
+  record.priority = version_ >= 2 ? header->priority : TRACE_NO_PRIORITY;
+  record.response_topic = std::string_view();
+  record.correlation_data = std::string_view();
+
+  const char *property = record.payload.data() + record.payload.size();
+  const char *end = property + properties_length;
+  while (end - property >= static_cast<ptrdiff_t>(PROPERTY_HEADER_SIZE)) {
+    uint8_t identifier;
+    uint32_t value_length;
+    std::memcpy(&identifier, property, 1);
+    std::memcpy(&value_length, property + 1, sizeof(value_length));
+    property += PROPERTY_HEADER_SIZE;
+    if (static_cast<size_t>(end - property) < value_length)
+      return false;
+
+    std::string_view value(property, value_length);
+    if (identifier == mqtt::property::RESPONSE_TOPIC)
+      record.response_topic = value;
+    else if (identifier == mqtt::property::CORRELATION_DATA)
+      record.correlation_data = value;
+    property += value_length;
+  }
+
+  // A trace cut off inside the padding of its last record, e.g. by a crash
+  // during a write, still holds the whole record
+  offset_ =
+      std::min(size_, offset_ + sizeof(TraceRecordHeader) + padded(body));
+  return true;
+}
+
+void TraceReader::rewind() { offset_ = sizeof(TraceFileHeader); }
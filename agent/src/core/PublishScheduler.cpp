@@ -0,0 +1,327 @@
+#include "PublishScheduler.hpp"
+#include <algorithm>
+#include <cstdint>
+
+std::string priority_to_string(Priority priority) {
+  switch (priority) {
+  case Priority::CONTROL:
+    return "control";
+  case Priority::REALTIME:
+    return "realtime";
+  case Priority::BULK:
+    return "bulk";
+  }
+  return "unknown";
+}
+
+PublishScheduler::PublishScheduler(PlatformMetrics &metrics, Sender sender,
+                                   const scheduler_options &options,
+                                   Encoder encoder, Resumer resumer)
+    : metrics_(metrics), sender_(std::move(sender)),
+      encoder_(std::move(encoder)), resumer_(std::move(resumer)),
+      options_(options) {}
+
+void PublishScheduler::set_options(const scheduler_options &options) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  options_ = options;
+  space_cv_.notify_all();
+  pump(lock);
+}
+
+scheduler_options PublishScheduler::options() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return options_;
+}
+
+bool PublishScheduler::enqueue(mqtt::message_ptr msg, Priority priority) {
+  size_t cls = static_cast<size_t>(priority);
+  auto &metrics = metrics_.priorities[cls];
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  if (priority != Priority::CONTROL &&
+      !space_cv_.wait_for(lock, options_.enqueue_timeout, [&]() {
+        return closed_ || queues_[cls].size() < options_.queue_size;
+      })) {
+    metrics.dropped++;
+    return false;
+  }
+  if (closed_) {
+    metrics.dropped++;
+    refused_++;
+    return false;
+  }
+
+  auto now = Clock::now();
+  if (queues_[cls].empty())
+    last_served_[cls] = now;
+  queues_[cls].push_back({std::move(msg), now});
+  metrics.queued++;
+  accepted_++;
+
+  pump(lock);
+  return true;
+}
+
+void PublishScheduler::complete(const mqtt::message *msg) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = inflight_.find(msg);
+  if (it == inflight_.end())
+    return;
+
+  metrics_.priorities[static_cast<size_t>(it->second.priority)]
+      .delivery_latency.record(Clock::now() - it->second.enqueued);
+  inflight_.erase(it);
+
+  pump(lock);
+}
+
+void PublishScheduler::fail(const mqtt::message *msg) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = inflight_.find(msg);
+  if (it == inflight_.end())
+    return;
+
+  metrics_.priorities[static_cast<size_t>(it->second.priority)].dropped++;
+  inflight_.erase(it);
+
+  pump(lock);
+}
+
+size_t PublishScheduler::expire() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto deadline = Clock::now() - options_.inflight_timeout;
+  size_t expired = 0;
+  for (auto it = inflight_.begin(); it != inflight_.end();) {
+    if (it->second.sent > deadline) {
+      ++it;
+      continue;
+    }
+    auto &metrics =
+        metrics_.priorities[static_cast<size_t>(it->second.priority)];
+    metrics.dropped++;
+    metrics.expired++;
+    it = inflight_.erase(it);
+    expired++;
+  }
+
+  if (expired)
+    pump(lock);
+  return expired;
+}
+
+void PublishScheduler::reset_inflight() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  inflight_.clear();
+  pump(lock);
+}
+
+void PublishScheduler::resume() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  resume_requested_ = false;
+  pump(lock);
+}
+
+void PublishScheduler::close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  closed_ = true;
+  space_cv_.notify_all();
+}
+
+bool PublishScheduler::drain(std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return idle_cv_.wait_until(lock, deadline, [this]() {
+    if (!inflight_.empty() || sending_)
+      return false;
+    for (const auto &queue : queues_)
+      if (!queue.empty())
+        return false;
+    return true;
+  });
+}
+
+void PublishScheduler::take_pending(std::vector<PendingMessage> &queued,
+                                    std::vector<PendingMessage> &inflight) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t cls = 0; cls < PRIORITY_COUNT; cls++) {
+    metrics_.priorities[cls].queued -= queues_[cls].size();
+    for (auto &entry : queues_[cls])
+      queued.push_back({std::move(entry.msg), static_cast<Priority>(cls)});
+    queues_[cls].clear();
+  }
+
+  // Oldest first, so messages sent again keep their order
+  std::vector<InFlight> pending;
+  for (auto &entry : inflight_)
+    pending.push_back(std::move(entry.second));
+  inflight_.clear();
+  std::sort(pending.begin(), pending.end(),
+            [](const InFlight &a, const InFlight &b) {
+              return a.enqueued < b.enqueued;
+            });
+  for (auto &entry : pending)
+    inflight.push_back({std::move(entry.msg), entry.priority});
+  space_cv_.notify_all();
+}
+
+size_t PublishScheduler::accepted() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return accepted_;
+}
+
+size_t PublishScheduler::refused() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return refused_;
+}
+
+size_t PublishScheduler::queued(Priority priority) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queues_[static_cast<size_t>(priority)].size();
+}
+
+size_t PublishScheduler::inflight() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return inflight_.size();
+}
+
+void PublishScheduler::pump(std::unique_lock<std::mutex> &lock) {
+  // The sending thread picks up whatever changed while it was unlocked
+  if (sending_)
+    return;
+  sending_ = true;
+
+  // One round of the round robin, so a backlog is sent in batches rather
+  // than all on the thread that happened to trigger it
+  size_t budget = SIZE_MAX, spent = 0;
+  if (resumer_) {
+    budget = 0;
+    for (size_t c = static_cast<size_t>(Priority::REALTIME);
+         c < PRIORITY_COUNT; c++)
+      budget += options_.weights[c] * std::max<size_t>(options_.quantum, 1);
+  }
+
+  size_t cls;
+  const auto &control = queues_[static_cast<size_t>(Priority::CONTROL)];
+  while ((spent < budget || !control.empty()) && next(cls)) {
+    Entry entry = std::move(queues_[cls].front());
+    queues_[cls].pop_front();
+    last_served_[cls] = Clock::now();
+    space_cv_.notify_all();
+    if (cls != static_cast<size_t>(Priority::CONTROL))
+      spent += entry.msg->get_topic().size() + entry.msg->get_payload().size();
+
+    mqtt::message_ptr encoded = encoder_ ? encoder_(entry.msg) : entry.msg;
+
+    // Registered before sending, as the delivery may complete before
+    // sender_ returns
+    bool tracked = encoded->get_qos() > 0;
+    if (tracked)
+      inflight_[encoded.get()] = {entry.msg, encoded,
+                                  static_cast<Priority>(cls), entry.enqueued,
+                                  last_served_[cls]};
+
+    auto &metrics = metrics_.priorities[cls];
+    metrics.queued--;
+    metrics.queue_latency.record(last_served_[cls] - entry.enqueued);
+
+    lock.unlock();
+    bool sent = sender_(encoded);
+    lock.lock();
+
+    if (sent) {
+      metrics.sent++;
+    } else {
+      metrics.dropped++;
+      if (tracked)
+        inflight_.erase(encoded.get());
+    }
+  }
+
+  sending_ = false;
+  idle_cv_.notify_all();
+
+  // Stopped at the budget while the window has room for more
+  if (spent < budget || resume_requested_ ||
+      inflight_.size() + options_.control_reserved >= options_.max_inflight)
+    return;
+  bool backlog = false;
+  for (size_t c = static_cast<size_t>(Priority::REALTIME); c < PRIORITY_COUNT;
+       c++)
+    backlog = backlog || !queues_[c].empty();
+  if (!backlog)
+    return;
+
+  resume_requested_ = true;
+  lock.unlock();
+  resumer_();
+  lock.lock();
+}
+
+bool PublishScheduler::next(size_t &cls) {
+  if (inflight_.size() >= options_.max_inflight)
+    return false;
+
+  if (!queues_[static_cast<size_t>(Priority::CONTROL)].empty()) {
+    cls = static_cast<size_t>(Priority::CONTROL);
+    return true;
+  }
+
+  // The rest of the window is kept for control messages
+  if (inflight_.size() + options_.control_reserved >= options_.max_inflight)
+    return false;
+
+  // A class that waited too long goes first, the longest overdue one if
+  // there are several
+  auto now = Clock::now();
+  bool pending = false, starved = false;
+  Clock::duration worst{};
+  for (size_t c = static_cast<size_t>(Priority::REALTIME); c < PRIORITY_COUNT;
+       c++) {
+    if (queues_[c].empty())
+      continue;
+    pending = true;
+    auto overdue = now - last_served_[c] - options_.max_wait[c];
+    if (overdue > Clock::duration::zero() && (!starved || overdue > worst)) {
+      starved = true;
+      worst = overdue;
+      cls = c;
+    }
+  }
+  if (!pending)
+    return false;
+  if (starved) {
+    metrics_.priorities[cls].starvation_promotions++;
+    return true;
+  }
+
+  // Deficit round robin. Terminates as some queue is not empty and its
+  // deficit grows every round
+  while (true) {
+    auto &queue = queues_[turn_];
+    if (queue.empty()) {
+      deficit_[turn_] = 0;
+      advance();
+      continue;
+    }
+
+    if (!quantum_added_) {
+      deficit_[turn_] +=
+          options_.weights[turn_] * std::max<size_t>(options_.quantum, 1);
+      quantum_added_ = true;
+    }
+
+    const auto &msg = *queue.front().msg;
+    size_t cost = msg.get_topic().size() + msg.get_payload().size();
+    if (cost <= deficit_[turn_]) {
+      deficit_[turn_] -= cost;
+      cls = turn_;
+      return true;
+    }
+    advance();
+  }
+}
+
+void PublishScheduler::advance() {
+  quantum_added_ = false;
+  turn_ = turn_ + 1 < PRIORITY_COUNT ? turn_ + 1
+                                     : static_cast<size_t>(Priority::REALTIME);
+}
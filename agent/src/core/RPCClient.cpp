@@ -0,0 +1,168 @@
+#include "RPCClient.hpp"
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mqtt/properties.h>
+#include <random>
+
+namespace {
+
+uint64_t random_nonce() {
+  std::random_device device;
+  return (uint64_t{device()} << 32) | device();
+}
+
+} // namespace
+
+RPCClient::RPCClient(TimerWheel &timers, const std::string &response_topic,
+                     PublishFunction publish)
+    : timers_(timers), response_topic_(response_topic),
+      publish_(std::move(publish)), nonce_(random_nonce()) {}
+
+RPCClient::~RPCClient() { cancel_all(); }
+
+void RPCClient::call(const std::string &topic, const std::string &payload,
+                     int qos, std::chrono::milliseconds timeout,
+                     ResponseCallback callback) {
+  uint64_t id = next_correlation_id_++;
+
+  // Register before publishing so a fast response always finds its call
+  {
+    Shard &shard = shard_for(id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.calls[id].callback = std::move(callback);
+  }
+  pending_++;
+
+  auto timer = timers_.schedule_once(timeout, [this, id]() {
+    PendingCall call;
+    if (!take(id, call))
+      return;
+    calls_timed_out++;
+    call.callback(RPCStatus::TIMEOUT, nullptr);
+  });
+
+  {
+    Shard &shard = shard_for(id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.calls.find(id);
+    if (it != shard.calls.end())
+      it->second.timer = timer;
+  }
+
+  mqtt::properties props{
+      {mqtt::property::RESPONSE_TOPIC, response_topic_},
+      {mqtt::property::CORRELATION_DATA, encode_correlation(id)}};
+
+  calls_sent++;
+  publish_(mqtt::message::create(topic, payload, qos, false, props));
+}
+
+std::future<mqtt::const_message_ptr>
+RPCClient::call(const std::string &topic, const std::string &payload, int qos,
+                std::chrono::milliseconds timeout) {
+  auto promise = std::make_shared<std::promise<mqtt::const_message_ptr>>();
+  auto future = promise->get_future();
+
+  call(topic, payload, qos, timeout,
+       [promise](RPCStatus status, mqtt::const_message_ptr response) {
+         if (status == RPCStatus::OK)
+           promise->set_value(std::move(response));
+         else
+           promise->set_exception(std::make_exception_ptr(
+               RPCError(status, status == RPCStatus::TIMEOUT
+                                    ? "RPC call timed out"
+                                    : "RPC call cancelled")));
+       });
+
+  return future;
+}
+
+bool RPCClient::handle_response(const mqtt::const_message_ptr &msg) {
+  const auto &props = msg->get_properties();
+  if (!props.contains(mqtt::property::CORRELATION_DATA))
+    return false;
+
+  uint64_t id;
+  if (!decode_correlation(
+          mqtt::get<mqtt::binary>(props, mqtt::property::CORRELATION_DATA),
+          id))
+    return false;
+
+  PendingCall call;
+  if (!take(id, call))
+    return false; // Late response to a call that already timed out
+
+  if (call.timer)
+    timers_.cancel(call.timer);
+
+  calls_completed++;
+  call.callback(RPCStatus::OK, msg);
+  return true;
+}
+
+mqtt::message_ptr
+RPCClient::make_response(const mqtt::const_message_ptr &request,
+                         const std::string &payload, int qos) {
+  const auto &req_props = request->get_properties();
+  if (!req_props.contains(mqtt::property::RESPONSE_TOPIC))
+    return nullptr;
+
+  auto topic =
+      mqtt::get<mqtt::string>(req_props, mqtt::property::RESPONSE_TOPIC);
+
+  mqtt::properties props;
+  if (req_props.contains(mqtt::property::CORRELATION_DATA))
+    props.add({mqtt::property::CORRELATION_DATA,
+               mqtt::get<mqtt::binary>(req_props,
+                                       mqtt::property::CORRELATION_DATA)});
+
+  return mqtt::message::create(topic, payload, qos, false, props);
+}
+
+void RPCClient::cancel_all() {
+  for (auto &shard : shards_) {
+    std::unordered_map<uint64_t, PendingCall> calls;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      calls.swap(shard.calls);
+    }
+    pending_ -= calls.size();
+
+    for (auto &entry : calls) {
+      if (entry.second.timer)
+        timers_.cancel(entry.second.timer);
+      entry.second.callback(RPCStatus::CANCELLED, nullptr);
+    }
+  }
+}
+
+bool RPCClient::take(uint64_t id, PendingCall &out) {
+  Shard &shard = shard_for(id);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto it = shard.calls.find(id);
+  if (it == shard.calls.end())
+    return false;
+
+  out = std::move(it->second);
+  shard.calls.erase(it);
+  pending_--;
+  return true;
+}
+
+std::string RPCClient::encode_correlation(uint64_t id) const {
+  std::string data(sizeof(nonce_) + sizeof(id), '\0');
+  std::memcpy(&data[0], &nonce_, sizeof(nonce_));
+  std::memcpy(&data[sizeof(nonce_)], &id, sizeof(id));
+  return data;
+}
+
+bool RPCClient::decode_correlation(const std::string &data,
+                                   uint64_t &id) const {
+  if (data.size() != sizeof(nonce_) + sizeof(id) ||
+      std::memcmp(data.data(), &nonce_, sizeof(nonce_)) != 0)
+    return false;
+  std::memcpy(&id, data.data() + sizeof(nonce_), sizeof(id));
+  return true;
+}
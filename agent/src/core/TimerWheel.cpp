@@ -0,0 +1,259 @@
+#include "TimerWheel.hpp"
+#include "Affinity.hpp"
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick, std::vector<int> cpus)
+    : tick_(tick.count() > 0 ? tick : std::chrono::milliseconds{1}),
+      epoch_(std::chrono::steady_clock::now()), cpus_(std::move(cpus)) {}
+
+TimerWheel::~TimerWheel() { stop(); }
+
+void TimerWheel::start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_)
+    return;
+
+  stop_requested_ = false;
+  running_ = true;
+  thread_ = std::thread(&TimerWheel::thread_main, this);
+}
+
+void TimerWheel::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_requested_ = true;
+  }
+  wakeup_.notify_all();
+
+  if (thread_.joinable() && thread_.get_id() != std::this_thread::get_id())
+    thread_.join();
+  running_ = false;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  slots_ = {};
+  occupied_ = {};
+  timers_.clear();
+}
+
+TimerWheel::TimerId TimerWheel::schedule_once(std::chrono::milliseconds delay,
+                                              Task task) {
+  return add_timer(to_ticks(delay), 0, std::move(task));
+}
+
+TimerWheel::TimerId
+TimerWheel::schedule_periodic(std::chrono::milliseconds interval, Task task) {
+  uint64_t ticks = std::max<uint64_t>(to_ticks(interval), 1);
+  return add_timer(ticks, ticks, std::move(task));
+}
+
+bool TimerWheel::cancel(TimerId id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto it = timers_.find(id);
+  if (it == timers_.end() || it->second->cancelled)
+    return false;
+
+  Timer *timer = it->second.get();
+  if (timer->running) {
+    // The wheel thread owns the timer until its task returns
+    timer->cancelled = true;
+    return true;
+  }
+
+  unlink(timer);
+  timers_.erase(it);
+  return true;
+}
+
+size_t TimerWheel::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return timers_.size();
+}
+
+TimerWheel::TimerId TimerWheel::add_timer(uint64_t delay_ticks,
+                                          uint64_t interval_ticks, Task task) {
+  TimerId id;
+  bool wake = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto timer = std::make_unique<Timer>();
+    id = next_id_++;
+    timer->id = id;
+    timer->expiry =
+        std::max(now_ticks(), current_) + std::max<uint64_t>(delay_ticks, 1);
+    timer->interval = interval_ticks;
+    timer->task = std::move(task);
+
+    // Only wake the thread if it is sleeping past the new expiry
+    wake = timer->expiry < next_wakeup_tick() || timers_.empty();
+
+    link(timer.get());
+    timers_.emplace(id, std::move(timer));
+  }
+
+  if (wake)
+    wakeup_.notify_one();
+  return id;
+}
+
+uint64_t TimerWheel::to_ticks(std::chrono::milliseconds duration) const {
+  if (duration.count() <= 0)
+    return 0;
+  // Round up so a timer never fires early
+  return static_cast<uint64_t>((duration.count() + tick_.count() - 1) /
+                               tick_.count());
+}
+
+uint64_t TimerWheel::now_ticks() const {
+  auto elapsed = std::chrono::steady_clock::now() - epoch_;
+  return static_cast<uint64_t>(elapsed / tick_);
+}
+
+void TimerWheel::link(Timer *timer) {
+  uint64_t delta = timer->expiry > current_ ? timer->expiry - current_ : 0;
+
+  unsigned level = 0;
+  while (level < LEVELS - 1 &&
+         delta >= (uint64_t{1} << (LEVEL_BITS * (level + 1))))
+    ++level;
+
+  // Timers beyond the range of the wheel are parked in the farthest slot of
+  // the top level and re-linked when that slot is cascaded
+  uint64_t position = timer->expiry;
+  const uint64_t range = uint64_t{1} << (LEVEL_BITS * LEVELS);
+  if (delta >= range)
+    position = current_ + range - 1;
+
+  unsigned slot = (position >> (LEVEL_BITS * level)) & SLOT_MASK;
+
+  Timer *&head = slots_[level][slot];
+  timer->level = level;
+  timer->slot = slot;
+  timer->prev = nullptr;
+  timer->next = head;
+  if (head)
+    head->prev = timer;
+  head = timer;
+  occupied_[level] |= uint64_t{1} << slot;
+}
+
+void TimerWheel::unlink(Timer *timer) {
+  Timer *&head = slots_[timer->level][timer->slot];
+
+  if (timer->prev)
+    timer->prev->next = timer->next;
+  else
+    head = timer->next;
+  if (timer->next)
+    timer->next->prev = timer->prev;
+
+  timer->prev = timer->next = nullptr;
+  if (!head)
+    occupied_[timer->level] &= ~(uint64_t{1} << timer->slot);
+}
+
+void TimerWheel::cascade(unsigned level, unsigned slot) {
+  Timer *timer = slots_[level][slot];
+  slots_[level][slot] = nullptr;
+  occupied_[level] &= ~(uint64_t{1} << slot);
+
+  while (timer) {
+    Timer *next = timer->next;
+    link(timer);
+    timer = next;
+  }
+}
+
+uint64_t TimerWheel::next_wakeup_tick() const {
+  // The next occupied level 0 slot before the wheel wraps, or the wrap itself
+  // since that is when higher levels cascade
+  unsigned position = current_ & SLOT_MASK;
+  uint64_t ahead = position == SLOT_MASK
+                       ? 0
+                       : occupied_[0] & (~uint64_t{0} << (position + 1));
+  if (ahead)
+    return current_ + (__builtin_ctzll(ahead) - position);
+
+  return (current_ | SLOT_MASK) + 1;
+}
+
+void TimerWheel::thread_main() {
+  // Pinned before expired is allocated, so it comes from the local node
+  if (!pin_current_thread(cpus_))
+    std::cerr << "Couldn't pin timer thread to CPUs "
+              << format_cpu_list(cpus_) << std::endl;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::vector<Timer *> expired;
+
+  while (!stop_requested_) {
+    uint64_t now = now_ticks();
+
+    while (current_ < now && !stop_requested_) {
+      uint64_t tick = ++current_;
+
+      // Cascade every level whose lower neighbour just wrapped around
+      for (unsigned level = 1; level < LEVELS; ++level) {
+        if ((tick >> (LEVEL_BITS * (level - 1))) & SLOT_MASK)
+          break;
+        cascade(level, (tick >> (LEVEL_BITS * level)) & SLOT_MASK);
+      }
+
+      unsigned slot = tick & SLOT_MASK;
+      Timer *timer = slots_[0][slot];
+      if (!timer)
+        continue;
+
+      slots_[0][slot] = nullptr;
+      occupied_[0] &= ~(uint64_t{1} << slot);
+      expired.clear();
+      while (timer) {
+        Timer *next = timer->next;
+        timer->prev = timer->next = nullptr;
+        if (timer->expiry <= tick) {
+          timer->running = true;
+          expired.push_back(timer);
+        } else {
+          link(timer);
+        }
+        timer = next;
+      }
+
+      // Tasks run without the lock so they may schedule or cancel timers
+      lock.unlock();
+      for (Timer *t : expired) {
+        if (t->cancelled)
+          continue;
+        try {
+          t->task();
+        } catch (const std::exception &e) {
+          std::cerr << "Timer task failed: " << e.what() << std::endl;
+        }
+      }
+      lock.lock();
+
+      for (Timer *t : expired) {
+        t->running = false;
+        if (t->cancelled || t->interval == 0) {
+          timers_.erase(t->id);
+          continue;
+        }
+        t->expiry += t->interval;
+        if (t->expiry <= current_)
+          t->expiry = current_ + 1;
+        link(t);
+      }
+    }
+
+    if (stop_requested_)
+      break;
+
+    if (timers_.empty())
+      wakeup_.wait(lock);
+    else
+      wakeup_.wait_until(lock, epoch_ + next_wakeup_tick() * tick_);
+  }
+}
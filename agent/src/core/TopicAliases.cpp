@@ -0,0 +1,90 @@
+#include "TopicAliases.hpp"
+#include <mqtt/properties.h>
+
+// A topic alias property is one identifier byte and a two byte integer
+const int64_t ALIAS_PROPERTY_SIZE = 3;
+
+void OutboundTopicAliases::reset(uint16_t maximum) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  maximum_ = maximum;
+  lru_.clear();
+  by_topic_.clear();
+}
+
+uint16_t OutboundTopicAliases::maximum() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return maximum_;
+}
+
+mqtt::message_ptr OutboundTopicAliases::apply(const mqtt::message_ptr &msg,
+                                              int64_t &saved) {
+  saved = 0;
+  const std::string &topic = msg->get_topic();
+  uint16_t alias;
+  bool known;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (maximum_ == 0 || topic.empty())
+      return msg;
+
+    auto it = by_topic_.find(topic);
+    known = it != by_topic_.end();
+    if (known) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      alias = it->second->alias;
+    } else {
+      if (lru_.size() < maximum_) {
+        alias = static_cast<uint16_t>(lru_.size() + 1);
+      } else {
+        // Reuse the alias of the least recently used topic
+        alias = lru_.back().alias;
+        by_topic_.erase(lru_.back().topic);
+        lru_.pop_back();
+      }
+      lru_.push_front({topic, alias});
+      by_topic_[topic] = lru_.begin();
+    }
+  }
+
+  mqtt::properties props = msg->get_properties();
+  props.add({mqtt::property::TOPIC_ALIAS, alias});
+  saved = known ? static_cast<int64_t>(topic.size()) - ALIAS_PROPERTY_SIZE
+                : -ALIAS_PROPERTY_SIZE;
+  return mqtt::message::create(known ? std::string() : topic,
+                               msg->get_payload_ref(), msg->get_qos(),
+                               msg->is_retained(), props);
+}
+
+void InboundTopicAliases::reset(uint16_t maximum) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  topics_.assign(static_cast<size_t>(maximum) + 1, std::string());
+}
+
+mqtt::const_message_ptr
+InboundTopicAliases::resolve(const mqtt::const_message_ptr &msg,
+                             int64_t &saved) {
+  saved = 0;
+  const auto &props = msg->get_properties();
+  if (!props.contains(mqtt::property::TOPIC_ALIAS))
+    return msg;
+
+  auto alias = mqtt::get<uint16_t>(props, mqtt::property::TOPIC_ALIAS);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (alias == 0 || alias >= topics_.size())
+    return nullptr;
+
+  if (!msg->get_topic().empty()) {
+    topics_[alias] = msg->get_topic();
+    saved = -ALIAS_PROPERTY_SIZE;
+    return msg;
+  }
+
+  const std::string &topic = topics_[alias];
+  if (topic.empty())
+    return nullptr;
+
+  saved = static_cast<int64_t>(topic.size()) - ALIAS_PROPERTY_SIZE;
+  return mqtt::message::create(topic, msg->get_payload(), msg->get_qos(),
+                               msg->is_retained(), props);
+}
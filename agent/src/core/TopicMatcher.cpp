@@ -0,0 +1,147 @@
+#include "TopicMatcher.hpp"
+#include <algorithm>
+
+namespace {
+
+std::vector<std::string> split_levels(const std::string &topic) {
+  std::vector<std::string> levels;
+  size_t start = 0;
+  while (true) {
+    size_t end = topic.find('/', start);
+    if (end == std::string::npos) {
+      levels.emplace_back(topic, start);
+      return levels;
+    }
+    levels.emplace_back(topic, start, end - start);
+    start = end + 1;
+  }
+}
+
+} // namespace
+
+bool parse_shared_subscription(const std::string &subscription,
+                               std::string &group, std::string &filter) {
+  if (subscription.compare(0, SHARED_SUBSCRIPTION_PREFIX.size(),
+                           SHARED_SUBSCRIPTION_PREFIX) != 0)
+    return false;
+
+  size_t group_start = SHARED_SUBSCRIPTION_PREFIX.size();
+  size_t group_end = subscription.find('/', group_start);
+  if (group_end == std::string::npos || group_end == group_start)
+    return false;
+
+  group = subscription.substr(group_start, group_end - group_start);
+  filter = subscription.substr(group_end + 1);
+
+  // The group name may not contain wildcards and the filter may not be empty
+  return group.find_first_of("+#") == std::string::npos && !filter.empty();
+}
+
+std::string subscription_filter(const std::string &subscription) {
+  std::string group, filter;
+  return parse_shared_subscription(subscription, group, filter) ? filter
+                                                                : subscription;
+}
+
+bool is_valid_topic_filter(const std::string &filter) {
+  if (filter.empty())
+    return false;
+
+  auto levels = split_levels(filter);
+  for (size_t i = 0; i < levels.size(); ++i) {
+    const auto &level = levels[i];
+    if (level.find_first_of("+#") == std::string::npos)
+      continue;
+    if (level.size() != 1)
+      return false;
+    if (level == "#" && i != levels.size() - 1)
+      return false;
+  }
+  return true;
+}
+
+bool topic_matches_filter(const std::string &filter, const std::string &topic) {
+  TopicMatcher matcher;
+  matcher.insert(filter, 0);
+
+  std::vector<size_t> out;
+  matcher.match(topic, out);
+  return !out.empty();
+}
+
+void TopicMatcher::insert(const std::string &filter, size_t value) {
+  Node *node = &root_;
+  for (const auto &level : split_levels(filter)) {
+    auto &child = node->children[level];
+    if (!child)
+      child = std::make_unique<Node>();
+    node = child.get();
+  }
+  node->values.push_back(value);
+  size_++;
+}
+
+bool TopicMatcher::erase(const std::string &filter, size_t value) {
+  auto levels = split_levels(filter);
+
+  // Remember the path so empty nodes can be pruned on the way back up
+  std::vector<Node *> path{&root_};
+  for (const auto &level : levels) {
+    auto it = path.back()->children.find(level);
+    if (it == path.back()->children.end())
+      return false;
+    path.push_back(it->second.get());
+  }
+
+  auto &values = path.back()->values;
+  auto it = std::find(values.begin(), values.end(), value);
+  if (it == values.end())
+    return false;
+  values.erase(it);
+  size_--;
+
+  for (size_t i = levels.size(); i > 0; --i) {
+    Node *node = path[i];
+    if (!node->values.empty() || !node->children.empty())
+      break;
+    path[i - 1]->children.erase(levels[i - 1]);
+  }
+  return true;
+}
+
+void TopicMatcher::match(const std::string &topic,
+                         std::vector<size_t> &out) const {
+  if (size_ == 0)
+    return;
+  match(root_, split_levels(topic), 0, out);
+}
+
+void TopicMatcher::match(const Node &node,
+                         const std::vector<std::string> &levels, size_t index,
+                         std::vector<size_t> &out) {
+  // Wildcards at the first level never match topics starting with '$'
+  bool wildcards = index > 0 || levels[0].empty() || levels[0][0] != '$';
+
+  if (wildcards) {
+    // '#' also matches the parent level, so "a/#" matches "a"
+    auto multi = node.children.find("#");
+    if (multi != node.children.end())
+      out.insert(out.end(), multi->second->values.begin(),
+                 multi->second->values.end());
+  }
+
+  if (index == levels.size()) {
+    out.insert(out.end(), node.values.begin(), node.values.end());
+    return;
+  }
+
+  if (wildcards) {
+    auto single = node.children.find("+");
+    if (single != node.children.end())
+      match(*single->second, levels, index + 1, out);
+  }
+
+  auto exact = node.children.find(levels[index]);
+  if (exact != node.children.end())
+    match(*exact->second, levels, index + 1, out);
+}
@@ -0,0 +1,98 @@
+#include "Tracer.hpp"
+#include <cstdio>
+#include <fstream>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+Tracer &Tracer::instance() {
+  static Tracer tracer;
+  return tracer;
+}
+
+void Tracer::enable(size_t events_per_thread) {
+  capacity_ = events_per_thread ? events_per_thread : 1;
+  enabled_ = true;
+}
+
+void Tracer::disable() { enabled_ = false; }
+
+Tracer::ThreadBuffer &Tracer::thread_buffer() {
+  thread_local ThreadBuffer *buffer = nullptr;
+  if (!buffer) {
+    auto owned = std::make_unique<ThreadBuffer>();
+    owned->thread_id = static_cast<uint32_t>(syscall(SYS_gettid));
+    buffer = owned.get();
+
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    buffers_.push_back(std::move(owned));
+  }
+  return *buffer;
+}
+
+void Tracer::record(const char *category, const char *name, uint64_t start_ns,
+                    uint64_t end_ns) {
+  ThreadBuffer &buffer = thread_buffer();
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+
+  // The ring is sized lazily so threads that never trace cost nothing
+  if (buffer.ring.empty())
+    buffer.ring.resize(capacity_);
+
+  buffer.ring[buffer.written % buffer.ring.size()] = {
+      category, name, start_ns, end_ns - start_ns, buffer.thread_id};
+  buffer.written++;
+}
+
+std::vector<TraceEvent> Tracer::events() const {
+  std::vector<TraceEvent> out;
+  std::lock_guard<std::mutex> buffers_lock(buffers_mutex_);
+
+  for (const auto &buffer : buffers_) {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    size_t size = buffer->ring.size();
+    uint64_t first = buffer->written > size ? buffer->written - size : 0;
+    for (uint64_t i = first; i < buffer->written; i++)
+      out.push_back(buffer->ring[i % size]);
+  }
+  return out;
+}
+
+void Tracer::clear() {
+  std::lock_guard<std::mutex> buffers_lock(buffers_mutex_);
+  for (auto &buffer : buffers_) {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    buffer->ring.clear();
+    buffer->written = 0;
+  }
+}
+
+bool Tracer::write_chrome_trace(const std::string &path) const {
+  std::ofstream file(path);
+  if (!file.is_open())
+    return false;
+
+  // Chrome traces count in microseconds; keep the nanosecond digits
+  auto micros = [](uint64_t ns) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%llu.%03llu",
+                  static_cast<unsigned long long>(ns / 1000),
+                  static_cast<unsigned long long>(ns % 1000));
+    return std::string(text);
+  };
+
+  // Complete ("X") events. Names are literals from the trace points and need
+  // no escaping
+  auto pid = getpid();
+  file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  for (const auto &event : events()) {
+    file << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name
+         << "\",\"cat\":\"" << event.category << "\",\"ph\":\"X\",\"ts\":"
+         << micros(event.start_ns) << ",\"dur\":" << micros(event.duration_ns)
+         << ",\"pid\":" << pid << ",\"tid\":" << event.thread_id << "}";
+    first = false;
+  }
+  file << "\n]}\n";
+
+  return static_cast<bool>(file);
+}
@@ -0,0 +1,156 @@
+#include "Transport.hpp"
+#include <iostream>
+#include <mqtt/create_options.h>
+
+PahoTransport::PahoTransport(const Config &config,
+                             mqtt::iaction_listener &actions)
+    : actions_(actions), persistent_(config.enable_persistence) {
+  if (config.mqtt_v5) {
+    mqtt::create_options create_opts(MQTTVERSION_5);
+    if (config.enable_persistence)
+      client_ = std::make_unique<mqtt::async_client>(
+          config.broker_url, config.client_id, create_opts,
+          config.persistence_directory);
+    else
+      client_ = std::make_unique<mqtt::async_client>(
+          config.broker_url, config.client_id, create_opts,
+          mqtt::NO_PERSISTENCE);
+  } else if (config.enable_persistence) {
+    client_ = std::make_unique<mqtt::async_client>(
+        config.broker_url, config.client_id, config.persistence_directory);
+  } else {
+    client_ = std::make_unique<mqtt::async_client>(
+        config.broker_url, config.client_id, mqtt::NO_PERSISTENCE);
+  }
+
+  client_->set_callback(*this);
+}
+
+void PahoTransport::set_listener(TransportListener &listener) {
+  listener_ = &listener;
+}
+
+ConnectResult PahoTransport::connect(const mqtt::connect_options &options) {
+  auto token = client_->connect(options, nullptr, actions_);
+  token->wait(); // This will be changed to a non-blocking operation
+
+  ConnectResult result;
+  if (client_->is_connected()) {
+    result.session_present =
+        token->get_connect_response().is_session_present();
+    result.properties = token->get_connect_response().get_properties();
+  }
+  return result;
+}
+
+void PahoTransport::disconnect() { client_->disconnect()->wait(); }
+
+bool PahoTransport::is_connected() const { return client_->is_connected(); }
+
+void PahoTransport::subscribe(const std::string &subscription, int qos,
+                              int identifier) {
+  mqtt::properties props;
+  if (identifier)
+    props.add({mqtt::property::SUBSCRIPTION_IDENTIFIER, identifier});
+  client_->subscribe(subscription, qos, nullptr, actions_,
+                     mqtt::subscribe_options(), props);
+}
+
+void PahoTransport::unsubscribe(const std::string &subscription) {
+  client_->unsubscribe(subscription);
+}
+
+void PahoTransport::publish(const mqtt::message_ptr &msg) {
+  client_->publish(msg, nullptr, publish_actions_);
+}
+
+bool PahoTransport::persists_publishes() const { return persistent_; }
+
+void PahoTransport::PublishActions::on_failure(const mqtt::token &tok) {
+  auto delivery = dynamic_cast<const mqtt::delivery_token *>(&tok);
+  if (delivery && transport_.listener_)
+    transport_.listener_->delivery_failed(delivery->get_message());
+  transport_.actions_.on_failure(tok);
+}
+
+void PahoTransport::PublishActions::on_success(const mqtt::token &tok) {
+  transport_.actions_.on_success(tok);
+}
+
+void PahoTransport::connected(const std::string &cause) {
+  if (listener_)
+    listener_->connected(cause);
+}
+
+void PahoTransport::connection_lost(const std::string &cause) {
+  if (listener_)
+    listener_->connection_lost(cause);
+}
+
+void PahoTransport::message_arrived(mqtt::const_message_ptr msg) {
+  if (listener_)
+    listener_->message_arrived(std::move(msg));
+}
+
+void PahoTransport::delivery_complete(mqtt::delivery_token_ptr tok) {
+  if (listener_)
+    listener_->delivery_complete(tok->get_message(), tok);
+}
+
+mqtt::connect_options make_connect_options(const Config &config) {
+  mqtt::connect_options_builder builder;
+
+  // The version has to be selected first: for v5 the clean session flag is
+  // sent as clean start
+  if (config.mqtt_v5)
+    builder.mqtt_version(MQTTVERSION_5).clean_start(config.clean_session);
+  else
+    builder.clean_session(config.clean_session);
+
+  builder.keep_alive_interval(config.keep_alive_interval)
+      .connect_timeout(config.connect_timeout)
+      .automatic_reconnect(config.automatic_reconnect);
+
+  // Set credentials if provided
+  if (!config.username.empty()) {
+    builder.user_name(config.username);
+    if (!config.password.empty()) {
+      builder.password(config.password);
+    }
+  }
+
+  // Set Last Will Testament if enabled
+  if (config.enable_last_will) {
+    auto will_msg = mqtt::message(
+        config.last_will_topic, config.last_will_message,
+        static_cast<int>(config.last_will_qos), config.last_will_retained);
+    builder.will(will_msg);
+  }
+
+  // Paho resumes the TLS session of the first handshake on later connects
+  // of a session that is not clean, see Config::tls_session_resumption.
+  // Otherwise every connect and reconnect does a full handshake
+  if (config.use_ssl) {
+    mqtt::ssl_options_builder ssl;
+    ssl.trust_store(config.ca_certificate_file)
+        .enable_server_cert_auth(true)
+        .verify(true)
+        .error_handler([](const std::string &error) {
+          std::cerr << "TLS error: " << error << std::endl;
+        });
+    if (!config.client_certificate_file.empty())
+      ssl.key_store(config.client_certificate_file)
+          .private_key(config.client_private_key_file);
+    // The session Paho keeps has to be resumable without a later ticket
+    if (config.tls_session_resumption)
+      ssl.ssl_version(MQTT_SSL_VERSION_TLS_1_2);
+    builder.ssl(ssl.finalize());
+  }
+
+  // Advertise how many inbound aliases we accept
+  if (config.mqtt_v5 && config.enable_topic_aliases)
+    builder.properties(
+        {{mqtt::property::TOPIC_ALIAS_MAXIMUM, config.topic_alias_maximum}});
+
+  return builder.finalize();
+}
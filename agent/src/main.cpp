@@ -10,6 +10,7 @@
 #include <mqtt/async_client.h>
 
 #include "Config.hpp"
+#include "ConfigWatcher.hpp"
 #include "MQTTAgent.hpp"
 
 const std::string DEFAULT_CONFIG_PATH{"config/default.json"};
@@ -26,7 +27,7 @@ int main(int argc, char *argv[]) {
     config_path = argv[3];
 
   // Build the Config object from the specified json file
-  Config config = ConfigBuilder::load_from_json(config_path);
+  Config config = ConfigBuilder::load(config_path);
 
   try {
     // Instantiate callback class
@@ -35,9 +36,22 @@ int main(int argc, char *argv[]) {
     // Create instance
     MQTTAgent &agent = MQTTAgent::get_instance(config, cb);
 
+    // Apply edits of the config file without reconnecting
+    ConfigWatcher watcher(config_path, [&agent](const std::string &path) {
+      try {
+        agent.apply_config(ConfigBuilder::load(path));
+        std::cout << "Reloaded configuration from " << path << std::endl;
+      } catch (const std::exception &e) {
+        std::cerr << "Ignoring invalid configuration: " << e.what()
+                  << std::endl;
+      }
+    });
+    watcher.start();
+
     // Connect and run agent
     agent.connect();
     agent.run();
+    watcher.stop();
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
   }
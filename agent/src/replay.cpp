@@ -0,0 +1,150 @@
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// MQTT includes
+#include <mqtt/async_client.h>
+
+#include "Config.hpp"
+#include "MQTTAgent.hpp"
+#include "MessageTrace.hpp"
+
+const std::string DEFAULT_CONFIG_PATH{"config/default.json"};
+
+// Publishes that may be outstanding before the replay waits for an ack
+const size_t MAX_OUTSTANDING_PUBLISHES = 100;
+
+void usage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " <trace> [--speed <factor>|max] [--config <path>]"
+            << " [--publish <broker_url>]\n"
+            << "  Without --publish, messages run through the receive path"
+            << " of an agent built\n  from the config file, without a broker"
+            << " connection: RPC response matching,\n  the callback and the"
+            << " dispatcher, whose workers run a handler that does\n  nothing"
+            << " for every configured subscription. Metrics are reported once"
+            << "\n  the handlers are done. With --publish, messages are"
+            << " republished to the\n  given broker." << std::endl;
+}
+
+/**
+ * Replays a trace recorded with Config::capture_file_path at its original
+ * pace multiplied by --speed, or as fast as possible with --speed max.
+ */
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::string trace_path = argv[1];
+  std::string config_path = DEFAULT_CONFIG_PATH;
+  std::string publish_url;
+  double speed = 1.0; // 0 replays as fast as possible
+
+  for (int i = 2; i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--speed") == 0)
+      speed =
+          std::strcmp(argv[i + 1], "max") == 0 ? 0 : std::stod(argv[i + 1]);
+    else if (std::strcmp(argv[i], "--config") == 0)
+      config_path = argv[i + 1];
+    else if (std::strcmp(argv[i], "--publish") == 0)
+      publish_url = argv[i + 1];
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (speed < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  size_t replayed = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  // Waits until the record is due at the requested speed
+  auto pace = [&](const TraceRecord &record) {
+    if (speed == 0)
+      return;
+    std::this_thread::sleep_until(
+        start + std::chrono::nanoseconds(static_cast<int64_t>(
+                    static_cast<double>(record.timestamp_ns) / speed)));
+  };
+
+  try {
+    TraceReader reader(trace_path);
+    TraceRecord record;
+
+    if (!publish_url.empty()) {
+      mqtt::async_client client(publish_url, "mqtt_replay",
+                                mqtt::NO_PERSISTENCE);
+      client.connect()->wait();
+
+      std::deque<mqtt::delivery_token_ptr> outstanding;
+      start = std::chrono::steady_clock::now();
+      while (reader.next(record)) {
+        pace(record);
+        auto msg = mqtt::make_message(
+            std::string(record.topic), record.payload.data(),
+            record.payload.size(), record.qos, record.retained);
+        auto token = client.publish(msg);
+        if (record.qos > 0)
+          outstanding.push_back(token);
+        if (outstanding.size() > MAX_OUTSTANDING_PUBLISHES) {
+          outstanding.front()->wait();
+          outstanding.pop_front();
+        }
+        replayed++;
+      }
+
+      for (auto &token : outstanding)
+        token->wait();
+      client.disconnect()->wait();
+    } else {
+      // Neither record nor forward the replay, and leave the offline store
+      // alone
+      Config config = ConfigBuilder::load(config_path);
+      config.capture_file_path.clear();
+      config.bridge_upstreams.clear();
+      config.bridge_routes.clear();
+      config.enable_persistence = false;
+      MQTTCallback cb(config.client_id, log_options(config));
+      MQTTAgent &agent = MQTTAgent::get_instance(config, cb);
+
+      // Messages only reach the workers through a matching route
+      for (const auto &subscription : config.subscriptions)
+        agent.add_handler(subscription, [](const mqtt::const_message_ptr &) {});
+
+      start = std::chrono::steady_clock::now();
+      while (reader.next(record)) {
+        pace(record);
+        agent.deliver(record.to_message());
+        replayed++;
+      }
+
+      // Waits up to drain_timeout for the handlers
+      agent.shutdown();
+      if (config.enable_metrics)
+        cb.report_metrics();
+      MQTTAgent::release_instance();
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  std::cout << "Replayed " << replayed << " messages in " << seconds << " s ("
+            << (seconds > 0 ? replayed / seconds : 0) << " msg/s)"
+            << std::endl;
+
+  return 0;
+}
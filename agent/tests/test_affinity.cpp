@@ -0,0 +1,58 @@
+#include "Affinity.hpp"
+#include "Config.hpp"
+#include "Dispatcher.hpp"
+#include "MQTTMetrics.hpp"
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <sched.h>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+TEST_CASE("CPU lists parse and format like the kernel's", "[affinity]") {
+  REQUIRE(parse_cpu_list("").empty());
+  REQUIRE(parse_cpu_list("3") == std::vector<int>{3});
+  REQUIRE(parse_cpu_list("8,0-2,2") == std::vector<int>{0, 1, 2, 8});
+  REQUIRE(format_cpu_list({0, 1, 2, 4, 6, 7}) == "0-2,4,6-7");
+  REQUIRE(format_cpu_list(parse_cpu_list("5,1-3")) == "1-3,5");
+
+  for (const char *list : {"a", "1-", "-1", "3-1", "1,", ",1", "1,,2",
+                           "100000"})
+    REQUIRE_THROWS_AS(parse_cpu_list(list), std::invalid_argument);
+
+  Config config = ConfigBuilder()
+                      .set_broker_url("tcp://localhost:1883")
+                      .set_client_id("test-affinity-agent")
+                      .set_cpu_affinity("0-1", "2", "")
+                      .build();
+  REQUIRE(config.validate());
+  config.timer_cpus = "2-";
+  REQUIRE_FALSE(config.validate());
+}
+
+TEST_CASE("Dispatcher workers run on their CPUs", "[affinity]") {
+  int cpu = sched_getcpu();
+  REQUIRE(cpu >= 0);
+  REQUIRE(current_numa_node() >= 0);
+
+  PlatformMetrics metrics;
+  Dispatcher dispatcher(metrics, 2, 16, {cpu});
+  std::atomic<int> handled{0}, elsewhere{0};
+  dispatcher.add_handler("pinned/#", [&](const mqtt::const_message_ptr &) {
+    if (sched_getcpu() != cpu)
+      elsewhere++;
+    handled++;
+  });
+  dispatcher.start();
+
+  for (int i = 0; i < 20; ++i)
+    REQUIRE(dispatcher.dispatch(mqtt::make_message("pinned/a", "x")));
+  REQUIRE(dispatcher.drain(std::chrono::steady_clock::now() + 5s));
+  dispatcher.stop();
+
+  REQUIRE(handled == 20);
+  REQUIRE(elsewhere == 0);
+}
@@ -0,0 +1,254 @@
+#include "AutoTuner.hpp"
+#include "Config.hpp"
+#include "Dispatcher.hpp"
+#include "MQTTMetrics.hpp"
+#include "PublishScheduler.hpp"
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+Config tuning_config() {
+  return ConfigBuilder()
+      .set_broker_url("tcp://localhost:1883")
+      .set_client_id("test-tuner-agent")
+      .enable_auto_tuning(10ms, 100ms)
+      .set_tuning_bounds(1, 4, 10, 100, 256, 4096)
+      .build();
+}
+
+void record(LatencyHistogram &histogram, size_t count,
+            std::chrono::microseconds latency) {
+  for (size_t i = 0; i < count; ++i)
+    histogram.record(latency);
+}
+
+LatencyHistogram &delivery(PlatformMetrics &metrics) {
+  return metrics.priorities[static_cast<size_t>(Priority::REALTIME)]
+      .delivery_latency;
+}
+
+LatencyHistogram &queueing(PlatformMetrics &metrics) {
+  return metrics.priorities[static_cast<size_t>(Priority::REALTIME)]
+      .queue_latency;
+}
+
+} // namespace
+
+TEST_CASE("Latency windows only see samples of the last interval",
+          "[tuner]") {
+  LatencyHistogram first, second;
+  record(first, 100, 50ms);
+  LatencyWindow window({&first, &second});
+
+  double p99 = -1;
+  REQUIRE(window.advance(0.99, p99) == 0);
+  REQUIRE(p99 == 0.0);
+
+  record(first, 199, 1ms);
+  record(second, 1, 20ms);
+  REQUIRE(window.advance(0.99, p99) == 200);
+  REQUIRE(p99 >= 1.0);
+  REQUIRE(p99 < 2.0);
+
+  record(second, 10, 20ms);
+  REQUIRE(window.advance(0.99, p99) == 10);
+  REQUIRE(p99 >= 20.0);
+  REQUIRE(p99 < 50.0);
+}
+
+TEST_CASE("Tuning bounds are validated when tuning is enabled", "[tuner]") {
+  Config config = tuning_config();
+  REQUIRE(config.validate());
+
+  config.tuning_min_inflight = 200;
+  REQUIRE_FALSE(config.validate());
+
+  // Realtime and bulk need a slot beyond the control reserve
+  config.tuning_min_inflight = config.control_reserved_inflight;
+  REQUIRE_FALSE(config.validate());
+
+  config.enable_auto_tuning = false;
+  REQUIRE(config.validate());
+}
+
+TEST_CASE("Tuner adds workers while handlers fall behind", "[tuner]") {
+  Config config = tuning_config();
+  PlatformMetrics metrics;
+  AutoTuner tuner(metrics);
+  TuningSettings settings{2, 20, 1024};
+
+  // Too few samples to act on
+  record(metrics.dispatch_latency, AutoTuner::MIN_SAMPLES - 1, 50ms);
+  REQUIRE(tuner.decide(config, tuner.sample(50, 0), settings).empty());
+
+  for (size_t expected : {3, 4, 4}) {
+    record(metrics.dispatch_latency, 100, 50ms);
+    tuner.decide(config, tuner.sample(50, 0), settings);
+    REQUIRE(settings.workers == expected);
+  }
+
+  // Idle again: back down to the minimum, one worker per interval
+  for (size_t expected : {3, 2, 1, 1}) {
+    record(metrics.dispatch_latency, 100, 1ms);
+    tuner.decide(config, tuner.sample(0, 0), settings);
+    REQUIRE(settings.workers == expected);
+  }
+
+  REQUIRE(metrics.tuning.intervals == 8);
+  REQUIRE(metrics.tuning.decisions == 5);
+  REQUIRE(metrics.tuning.workers == 1);
+  auto history = metrics.tuning.history();
+  REQUIRE(history.size() == 5);
+  REQUIRE(history.front().setting == "workers");
+  REQUIRE(history.front().from == 2);
+  REQUIRE(history.front().to == 3);
+  REQUIRE(history.back().to == 1);
+  REQUIRE_FALSE(history.back().reason.empty());
+}
+
+TEST_CASE("Tuner sizes the window and batch by where publishes wait",
+          "[tuner]") {
+  Config config = tuning_config();
+  PlatformMetrics metrics;
+  AutoTuner tuner(metrics);
+
+  SECTION("Waiting for a window slot widens the window") {
+    TuningSettings settings{1, 20, 1024};
+    record(delivery(metrics), 100, 40ms);
+    record(queueing(metrics), 100, 30ms);
+    tuner.decide(config, tuner.sample(0, 500), settings);
+    REQUIRE(settings.max_inflight == 25);
+    REQUIRE(settings.batch_bytes == 512);
+  }
+
+  SECTION("Waiting for acknowledgements narrows the window") {
+    TuningSettings settings{1, 20, 1024};
+    record(delivery(metrics), 100, 40ms);
+    record(queueing(metrics), 100, 1ms);
+    tuner.decide(config, tuner.sample(0, 500), settings);
+    REQUIRE(settings.max_inflight == 15);
+    REQUIRE(settings.batch_bytes == 512);
+  }
+
+  SECTION("Headroom with a backlog grows both up to their bounds") {
+    TuningSettings settings{1, 90, 2048};
+    for (int i = 0; i < 2; ++i) {
+      record(delivery(metrics), 100, 1ms);
+      record(queueing(metrics), 100, 1ms);
+      tuner.decide(config, tuner.sample(0, 500), settings);
+    }
+    REQUIRE(settings.max_inflight == 100);
+    REQUIRE(settings.batch_bytes == 4096);
+  }
+
+  SECTION("QoS 0 traffic leaves the window alone") {
+    TuningSettings settings{1, 20, 1024};
+    record(queueing(metrics), 100, 40ms);
+    TuningSample sample = tuner.sample(0, 500);
+    REQUIRE_FALSE(sample.publish_acknowledged);
+    tuner.decide(config, sample, settings);
+    REQUIRE(settings.max_inflight == 20);
+    REQUIRE(settings.batch_bytes == 512);
+
+    record(queueing(metrics), 100, 1ms);
+    tuner.decide(config, tuner.sample(0, 500), settings);
+    REQUIRE(settings.max_inflight == 20);
+    REQUIRE(settings.batch_bytes == 1024);
+  }
+
+  SECTION("The window stays above the control reserve") {
+    config.control_reserved_inflight = 12;
+    TuningSettings settings{1, 14, 1024};
+    for (int i = 0; i < 3; ++i) {
+      record(delivery(metrics), 100, 40ms);
+      record(queueing(metrics), 100, 1ms);
+      tuner.decide(config, tuner.sample(0, 500), settings);
+    }
+    REQUIRE(settings.max_inflight == 13);
+
+    // A reload raised the reserve past the window
+    config.control_reserved_inflight = 20;
+    tuner.decide(config, tuner.sample(0, 0), settings);
+    REQUIRE(settings.max_inflight == 21);
+  }
+
+  SECTION("Settings outside the bounds are moved into them") {
+    TuningSettings settings{8, 5, 100000};
+    auto decisions = tuner.decide(config, tuner.sample(0, 0), settings);
+    REQUIRE(decisions.size() == 3);
+    REQUIRE(settings.workers == 4);
+    REQUIRE(settings.max_inflight == 10);
+    REQUIRE(settings.batch_bytes == 4096);
+  }
+}
+
+TEST_CASE("Dispatcher worker count changes while running", "[tuner]") {
+  PlatformMetrics metrics;
+  Dispatcher dispatcher(metrics, 1, 64);
+  std::atomic<int> handled{0};
+  dispatcher.add_handler("tune/#",
+                         [&](const mqtt::const_message_ptr &) { handled++; });
+  dispatcher.start();
+
+  auto send = [&](int count) {
+    for (int i = 0; i < count; ++i)
+      REQUIRE(dispatcher.dispatch(mqtt::make_message("tune/a", "x")));
+    REQUIRE(dispatcher.drain(std::chrono::steady_clock::now() + 5s));
+  };
+
+  send(10);
+  dispatcher.set_worker_count(4);
+  REQUIRE(dispatcher.worker_count() == 4);
+  send(10);
+  dispatcher.set_worker_count(2);
+  REQUIRE(dispatcher.worker_count() == 2);
+  send(10);
+  dispatcher.set_worker_count(3);
+  send(10);
+  dispatcher.stop();
+
+  REQUIRE(handled == 40);
+  REQUIRE(metrics.dispatch_latency.samples == 40);
+}
+
+TEST_CASE("Dispatcher resizes without waiting for running handlers",
+          "[tuner]") {
+  PlatformMetrics metrics;
+  Dispatcher dispatcher(metrics, 2, 64);
+  std::atomic<bool> release{false}, blocked{false};
+  std::atomic<int> handled{0};
+  dispatcher.add_handler("tune/slow", [&](const mqtt::const_message_ptr &) {
+    blocked = true;
+    while (!release)
+      std::this_thread::sleep_for(1ms);
+  });
+  dispatcher.add_handler("tune/fast",
+                         [&](const mqtt::const_message_ptr &) { handled++; });
+  dispatcher.start();
+
+  REQUIRE(dispatcher.dispatch(mqtt::make_message("tune/slow", "x")));
+  while (!blocked)
+    std::this_thread::sleep_for(1ms);
+
+  // Shrinking may retire the blocked worker; growing again must not wait
+  // for it to leave
+  auto start = std::chrono::steady_clock::now();
+  dispatcher.set_worker_count(1);
+  dispatcher.set_worker_count(3);
+  REQUIRE(std::chrono::steady_clock::now() - start < 1s);
+
+  for (int i = 0; i < 10; ++i)
+    REQUIRE(dispatcher.dispatch(mqtt::make_message("tune/fast", "x")));
+  for (int i = 0; i < 5000 && handled < 10; ++i)
+    std::this_thread::sleep_for(1ms);
+  REQUIRE(handled == 10);
+
+  release = true;
+  REQUIRE(dispatcher.drain(std::chrono::steady_clock::now() + 5s));
+  dispatcher.stop();
+}
@@ -0,0 +1,409 @@
+#include "Bridge.hpp"
+#include "Config.hpp"
+#include "ConfigImage.hpp"
+#include "LoopbackTransport.hpp"
+#include "tests.hpp"
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+// Subscriber on an upstream broker
+class UpstreamListener : public TransportListener {
+public:
+  std::mutex mutex;
+  std::vector<mqtt::const_message_ptr> messages;
+
+  void connected(const std::string &) override {}
+  void connection_lost(const std::string &) override {}
+
+  void message_arrived(mqtt::const_message_ptr msg) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    messages.push_back(msg);
+  }
+
+  void delivery_complete(const mqtt::const_message_ptr &,
+                         const mqtt::delivery_token_ptr &) override {}
+};
+
+// Upstream connection like Paho's: QoS 0 publishes are never reported as
+// complete, and connecting only succeeds once accept is set
+class ManualTransport : public Transport {
+public:
+  std::atomic<bool> accept{true};
+  std::atomic<int> connects{0};
+  std::mutex mutex;
+  std::vector<mqtt::message_ptr> published;
+  TransportListener *listener = nullptr;
+
+  void set_listener(TransportListener &l) override { listener = &l; }
+  ConnectResult connect(const mqtt::connect_options &) override {
+    connects++;
+    connected_ = accept.load();
+    return {};
+  }
+  void disconnect() override { connected_ = false; }
+  bool is_connected() const override { return connected_; }
+  void subscribe(const std::string &, int, int) override {}
+  void unsubscribe(const std::string &) override {}
+  void publish(const mqtt::message_ptr &msg) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    published.push_back(msg);
+  }
+
+private:
+  std::atomic<bool> connected_{false};
+};
+
+BridgeUpstream upstream(const std::string &name) {
+  BridgeUpstream upstream;
+  upstream.name = name;
+  upstream.broker_url = "loopback://" + name;
+  upstream.client_id = "bridge-" + name;
+  return upstream;
+}
+
+BridgeRoute route(const std::string &filter, const std::string &upstream) {
+  BridgeRoute route;
+  route.filter = filter;
+  route.upstream = upstream;
+  return route;
+}
+
+Config bridge_config(const BridgeRoute &cloud_route,
+                     const BridgeRoute &backup_route) {
+  return ConfigBuilder()
+      .set_broker_url("loopback://local")
+      .set_client_id("test-bridge-agent")
+      .add_bridge_upstream(upstream("cloud"))
+      .add_bridge_upstream(upstream("backup"))
+      .add_bridge_route(cloud_route, QoSLevel::AT_LEAST_ONCE)
+      .add_bridge_route(backup_route, QoSLevel::EXACTLY_ONCE)
+      .build();
+}
+
+// Creates loopback transports on the broker named by the upstream's URL
+Bridge::TransportFactory
+loopback_factory(std::map<std::string, LoopbackBroker *> brokers) {
+  return [brokers](const Config &upstream) {
+    return std::unique_ptr<Transport>(std::make_unique<LoopbackTransport>(
+        *brokers.at(upstream.broker_url)));
+  };
+}
+
+} // namespace
+
+TEST_CASE("Bridge rewrites topics and maps QoS per route", "[bridge]") {
+  BridgeRoute telemetry = route("site/+/telemetry/#", "cloud");
+  telemetry.local_prefix = "site/";
+  telemetry.remote_prefix = "fleet/site/";
+  telemetry.qos_map[0] = QoSLevel::AT_LEAST_ONCE;
+  BridgeRoute alarms = route("site/+/alarms", "backup");
+  alarms.remote_prefix = "backup/";
+  Config config = bridge_config(telemetry, alarms);
+
+  REQUIRE(config.validate());
+  REQUIRE(config.subscriptions ==
+          std::vector<std::string>{"site/+/telemetry/#", "site/+/alarms"});
+  REQUIRE(config.subscription_qos.at("site/+/alarms") ==
+          QoSLevel::EXACTLY_ONCE);
+
+  LoopbackBroker cloud_broker, backup_broker;
+  DummyCallback callback;
+  Bridge bridge(config, callback.metrics, callback,
+                loopback_factory({{"loopback://cloud", &cloud_broker},
+                                  {"loopback://backup", &backup_broker}}));
+
+  UpstreamListener cloud, backup;
+  LoopbackTransport cloud_subscriber(cloud_broker),
+      backup_subscriber(backup_broker);
+  cloud_subscriber.set_listener(cloud);
+  backup_subscriber.set_listener(backup);
+  cloud_subscriber.connect(mqtt::connect_options());
+  backup_subscriber.connect(mqtt::connect_options());
+  cloud_subscriber.subscribe("#", 2);
+  backup_subscriber.subscribe("#", 2);
+  REQUIRE(bridge.connect());
+
+  auto received = mqtt::make_message("site/7/telemetry/power", "42", 0, false);
+  REQUIRE(bridge.forward(received) == 1);
+  REQUIRE(bridge.forward(mqtt::make_message("site/7/alarms", "fire", 2,
+                                            false)) == 1);
+  REQUIRE(bridge.forward(mqtt::make_message("site/7/config", "x", 1,
+                                            false)) == 0);
+
+  REQUIRE(bridge.drain(std::chrono::steady_clock::now() + 1s));
+  REQUIRE(cloud_broker.wait_idle(1s));
+  REQUIRE(backup_broker.wait_idle(1s));
+
+  REQUIRE(cloud.messages.size() == 1);
+  REQUIRE(cloud.messages[0]->get_topic() == "fleet/site/7/telemetry/power");
+  REQUIRE(cloud.messages[0]->get_payload_str() == "42");
+  REQUIRE(cloud.messages[0]->get_qos() == 1);
+  REQUIRE(backup.messages.size() == 1);
+  REQUIRE(backup.messages[0]->get_topic() == "backup/site/7/alarms");
+  REQUIRE(backup.messages[0]->get_qos() == 2);
+
+  auto &metrics = callback.metrics.bridge_route(telemetry.filter + " -> cloud");
+  REQUIRE(metrics.forwarded == 1);
+  REQUIRE(metrics.bytes == 2);
+  REQUIRE(metrics.pending == 0);
+  REQUIRE(metrics.latency.samples == 1);
+  REQUIRE(callback.metrics.bridge_routes.size() == 2);
+
+  // Topics without the local prefix keep theirs
+  REQUIRE(Bridge::rewrite(telemetry, "other/topic") ==
+          "fleet/site/other/topic");
+
+  bridge.disconnect();
+}
+
+TEST_CASE("Bridge drops messages of a route over max_pending", "[bridge]") {
+  BridgeRoute slow = route("sensors/#", "cloud");
+  slow.name = "slow";
+  slow.max_pending = 2;
+  BridgeRoute fast = route("sensors/#", "backup");
+  fast.name = "fast";
+  Config config = bridge_config(slow, fast);
+
+  LoopbackBroker cloud_broker, backup_broker;
+  LoopbackConditions conditions;
+  conditions.latency = std::chrono::milliseconds(50);
+  cloud_broker.set_conditions(conditions);
+
+  DummyCallback callback;
+  Bridge bridge(config, callback.metrics, callback,
+                loopback_factory({{"loopback://cloud", &cloud_broker},
+                                  {"loopback://backup", &backup_broker}}));
+
+  // Publishes fail before the upstreams are connected
+  REQUIRE(bridge.forward(mqtt::make_message("sensors/a", "0", 1, false)) == 0);
+  REQUIRE(callback.metrics.bridge_route("slow").dropped == 1);
+  REQUIRE(bridge.pending() == 0);
+
+  REQUIRE(bridge.connect());
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 1; i <= 5; ++i)
+    bridge.forward(
+        mqtt::make_message("sensors/a", std::to_string(i), 1, false));
+
+  // The slow upstream never held up the receive path
+  REQUIRE(std::chrono::steady_clock::now() - start < 50ms);
+
+  REQUIRE(bridge.drain(std::chrono::steady_clock::now() + 2s));
+  auto &slow_metrics = callback.metrics.bridge_route("slow");
+  auto &fast_metrics = callback.metrics.bridge_route("fast");
+  REQUIRE(slow_metrics.forwarded == 2);
+  REQUIRE(slow_metrics.dropped == 1 + 3);
+  REQUIRE(fast_metrics.forwarded == 5);
+  REQUIRE(fast_metrics.dropped == 1);
+  REQUIRE(slow_metrics.latency.percentile_ms(0.5) >= 50.0);
+
+  // Whatever is still pending at shutdown is given up on
+  bridge.forward(mqtt::make_message("sensors/a", "6", 1, false));
+  REQUIRE_FALSE(bridge.drain(std::chrono::steady_clock::now()));
+  REQUIRE(bridge.abandon() == 1);
+  REQUIRE(slow_metrics.dropped == 5);
+  REQUIRE(slow_metrics.pending == 0);
+
+  bridge.disconnect();
+}
+
+TEST_CASE("Bridge only holds slots for acknowledged publishes", "[bridge]") {
+  BridgeRoute telemetry = route("sensors/#", "cloud");
+  telemetry.name = "telemetry";
+  telemetry.max_pending = 2;
+  BridgeRoute backup = route("backup/#", "backup");
+  Config config = bridge_config(telemetry, backup);
+
+  std::map<std::string, ManualTransport *> transports;
+  DummyCallback callback;
+  Bridge bridge(config, callback.metrics, callback,
+                [&](const Config &upstream) {
+                  auto transport = std::make_unique<ManualTransport>();
+                  transports[upstream.broker_url] = transport.get();
+                  return std::unique_ptr<Transport>(std::move(transport));
+                });
+  REQUIRE(bridge.connect());
+  ManualTransport &cloud = *transports.at("loopback://cloud");
+
+  // Far more QoS 0 messages than max_pending, none of them acknowledged
+  for (int i = 0; i < 10; ++i)
+    REQUIRE(bridge.forward(mqtt::make_message("sensors/a", "x", 0, false)) ==
+            1);
+  auto &metrics = callback.metrics.bridge_route("telemetry");
+  REQUIRE(metrics.forwarded == 10);
+  REQUIRE(metrics.dropped == 0);
+  REQUIRE(bridge.pending() == 0);
+  REQUIRE(bridge.drain(std::chrono::steady_clock::now()));
+
+  // A failed QoS 1 publish gives its slot back
+  REQUIRE(bridge.forward(mqtt::make_message("sensors/a", "x", 1, false)) == 1);
+  REQUIRE(bridge.pending() == 1);
+  cloud.listener->delivery_failed(cloud.published.back());
+  REQUIRE(bridge.pending() == 0);
+  REQUIRE(metrics.dropped == 1);
+
+  bridge.disconnect();
+}
+
+TEST_CASE("Bridge retries upstreams that are down", "[bridge]") {
+  Config config =
+      bridge_config(route("sensors/#", "cloud"), route("backup/#", "backup"));
+
+  std::map<std::string, ManualTransport *> transports;
+  DummyCallback callback;
+  Bridge bridge(config, callback.metrics, callback,
+                [&](const Config &upstream) {
+                  auto transport = std::make_unique<ManualTransport>();
+                  transports[upstream.broker_url] = transport.get();
+                  return std::unique_ptr<Transport>(std::move(transport));
+                });
+  ManualTransport &cloud = *transports.at("loopback://cloud");
+
+  // Nothing to retry before the agent connected the bridge
+  bridge.reconnect();
+  REQUIRE(cloud.connects == 0);
+
+  cloud.accept = false;
+  REQUIRE_FALSE(bridge.connect());
+  REQUIRE(cloud.connects == 1);
+
+  cloud.accept = true;
+  bridge.reconnect();
+  for (int i = 0; i < 1000 && !cloud.is_connected(); ++i)
+    std::this_thread::sleep_for(1ms);
+  REQUIRE(cloud.is_connected());
+
+  // Nothing is retried after disconnect()
+  bridge.disconnect();
+  int connects = cloud.connects;
+  bridge.reconnect();
+  REQUIRE(cloud.connects == connects);
+}
+
+TEST_CASE("Bridge finds routes through the config image", "[bridge]") {
+  const std::string image_path = "test_bridge_routes.bin";
+  BridgeRoute telemetry = route("site/+/telemetry/#", "cloud");
+  BridgeRoute alarms = route("site/+/alarms", "backup");
+  BridgeRoute all_alarms = route("site/+/alarms", "cloud");
+  all_alarms.name = "all alarms";
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://local")
+                      .set_client_id("test-bridge-agent")
+                      .add_subscription("site/#", QoSLevel::AT_LEAST_ONCE)
+                      .add_bridge_upstream(upstream("cloud"))
+                      .add_bridge_upstream(upstream("backup"))
+                      .add_bridge_route(telemetry, QoSLevel::AT_LEAST_ONCE)
+                      .add_bridge_route(alarms, QoSLevel::AT_LEAST_ONCE)
+                      .add_bridge_route(all_alarms, QoSLevel::AT_LEAST_ONCE)
+                      .build();
+  ConfigImage::compile(config, image_path);
+  Config loaded = ConfigBuilder::load(image_path);
+  REQUIRE(loaded.image);
+
+  // A config changed after loading no longer matches its image
+  Config changed = loaded;
+  changed.subscriptions.push_back("site/+/status");
+
+  for (const Config *candidate : {&loaded, &changed}) {
+    DummyCallback callback;
+    std::vector<ManualTransport *> transports;
+    Bridge bridge(*candidate, callback.metrics, callback,
+                  [&](const Config &) {
+                    auto transport = std::make_unique<ManualTransport>();
+                    transports.push_back(transport.get());
+                    return std::unique_ptr<Transport>(std::move(transport));
+                  });
+    REQUIRE(bridge.connect());
+
+    // site/# is a subscription but no route
+    REQUIRE(bridge.forward(mqtt::make_message("site/1/telemetry/power", "1",
+                                              0, false)) == 1);
+    REQUIRE(bridge.forward(mqtt::make_message("site/1/alarms", "2", 0,
+                                              false)) == 2);
+    REQUIRE(bridge.forward(mqtt::make_message("site/1/status", "3", 0,
+                                              false)) == 0);
+    REQUIRE(transports[0]->published.size() == 2);
+    REQUIRE(transports[1]->published.size() == 1);
+    REQUIRE(callback.metrics.bridge_route("all alarms").forwarded == 1);
+    bridge.disconnect();
+  }
+
+  std::remove(image_path.c_str());
+}
+
+TEST_CASE("Bridge configuration loads from json and images", "[bridge]") {
+  const std::string json_path = "test_bridge.json";
+  const std::string image_path = "test_bridge.bin";
+  std::ofstream(json_path) << R"({
+    "broker_url": "tcp://localhost:1883",
+    "client_id": "test-bridge-agent",
+    "bridge": {
+      "upstreams": [
+        {"name": "cloud", "broker_url": "ssl://cloud:8883",
+         "client_id": "edge-1", "use_ssl": true,
+         "ca_certificate_file": "certs/ca.crt"}
+      ],
+      "routes": [
+        {"filter": "site/+/telemetry/#", "upstream": "cloud",
+         "local_prefix": "site/", "remote_prefix": "fleet/",
+         "qos_map": [1, 1, 1], "max_pending": 50, "qos_level": 0}
+      ]
+    }
+  })";
+
+  Config config = ConfigBuilder::load_from_json(json_path);
+  REQUIRE(config.bridge_upstreams.size() == 1);
+  REQUIRE(config.bridge_upstreams[0].use_ssl);
+  REQUIRE(config.bridge_routes.size() == 1);
+  const BridgeRoute &loaded = config.bridge_routes[0];
+  REQUIRE(loaded.name == "site/+/telemetry/# -> cloud");
+  REQUIRE(loaded.qos_map[2] == QoSLevel::AT_LEAST_ONCE);
+  REQUIRE(loaded.max_pending == 50);
+  REQUIRE(config.subscription_qos.at("site/+/telemetry/#") ==
+          QoSLevel::AT_MOST_ONCE);
+
+  Config connection =
+      Bridge::upstream_config(config, config.bridge_upstreams[0]);
+  REQUIRE(connection.broker_url == "ssl://cloud:8883");
+  REQUIRE(connection.subscriptions.empty());
+  REQUIRE(connection.keep_alive_interval == config.keep_alive_interval);
+
+  ConfigImage::compile(config, image_path);
+  Config image = ConfigBuilder::load(image_path);
+  REQUIRE(image.bridge_upstreams == config.bridge_upstreams);
+  REQUIRE(image.bridge_routes == config.bridge_routes);
+
+  // Upstreams get the same TLS checks as the agent's connection
+  REQUIRE(config.validate());
+  config.bridge_upstreams[0].broker_url = "tcp://cloud:1883";
+  REQUIRE_FALSE(config.validate());
+  config.bridge_upstreams[0].broker_url = "mqtts://cloud:8883";
+  config.bridge_upstreams[0].client_certificate_file = "certs/client.crt";
+  REQUIRE_FALSE(config.validate());
+  config.bridge_upstreams[0].client_private_key_file = "certs/client.key";
+  REQUIRE(config.validate());
+
+  // QoS levels past 2 are rejected
+  config.bridge_routes[0].qos_map[1] = static_cast<QoSLevel>(3);
+  REQUIRE_FALSE(config.validate());
+  config.bridge_routes[0].qos_map[1] = QoSLevel::AT_LEAST_ONCE;
+
+  // Routes must name a configured upstream
+  config.bridge_routes[0].upstream = "missing";
+  REQUIRE_FALSE(config.validate());
+
+  std::remove(json_path.c_str());
+  std::remove(image_path.c_str());
+}
@@ -0,0 +1,135 @@
+#include "Config.hpp"
+#include "ConfigImage.hpp"
+#include "TopicMatcher.hpp"
+#include <algorithm>
+#include <catch2/catch_test_macros.hpp>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+Config test_config() {
+  return ConfigBuilder()
+      .set_broker_url("ssl://localhost:8883")
+      .set_client_id("test-image-agent")
+      .set_credentials("user", "secret")
+      .enable_ssl("certs/ca.crt")
+      .set_last_will("status/agent", "gone", QoSLevel::EXACTLY_ONCE, false)
+      .set_rpc("", std::chrono::milliseconds(1500))
+      .set_inflight_window(50, 4)
+      .set_starvation_bounds(std::chrono::milliseconds(20),
+                             std::chrono::milliseconds(500))
+      .add_subscription("sensors/+/temp", QoSLevel::AT_MOST_ONCE)
+      .add_subscription("sensors/#", QoSLevel::AT_LEAST_ONCE)
+      .add_subscription("sensors/a/temp", QoSLevel::EXACTLY_ONCE)
+      .add_subscription("#", QoSLevel::AT_MOST_ONCE)
+      .add_subscription("+/+", QoSLevel::AT_MOST_ONCE)
+      .add_subscription("$SYS/#", QoSLevel::AT_MOST_ONCE)
+      .add_shared_subscription("workers", "jobs/+", QoSLevel::AT_LEAST_ONCE)
+      .build();
+}
+
+std::string read_file(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file), {});
+}
+
+void write_file(const std::string &path, const std::string &contents) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(contents.data(), contents.size());
+}
+
+} // namespace
+
+TEST_CASE("ConfigImage round trips a Config", "[config_image]") {
+  const std::string path = "test_config_image.bin";
+  Config config = test_config();
+  ConfigImage::compile(config, path);
+
+  REQUIRE(ConfigImage::is_image(path));
+  Config loaded = ConfigBuilder::load(path);
+  REQUIRE(loaded.image != nullptr);
+
+  REQUIRE(loaded.broker_url == config.broker_url);
+  REQUIRE(loaded.client_id == config.client_id);
+  REQUIRE(loaded.password == "secret");
+  REQUIRE(loaded.use_ssl);
+  REQUIRE(loaded.ca_certificate_file == "certs/ca.crt");
+  REQUIRE(loaded.last_will_qos == QoSLevel::EXACTLY_ONCE);
+  REQUIRE_FALSE(loaded.last_will_retained);
+  REQUIRE(loaded.rpc_timeout == std::chrono::milliseconds(1500));
+  REQUIRE(loaded.max_inflight_messages == 50);
+  REQUIRE(loaded.control_reserved_inflight == 4);
+  REQUIRE(loaded.bulk_max_wait == std::chrono::milliseconds(500));
+  REQUIRE(loaded.max_reconnect_attempts == -1);
+  REQUIRE(loaded.validate());
+
+  REQUIRE(loaded.subscriptions == config.subscriptions);
+  REQUIRE(loaded.subscription_qos == config.subscription_qos);
+  REQUIRE(loaded.image->subscription(6) == "$share/workers/jobs/+");
+  REQUIRE(loaded.image->subscription_qos(2) == QoSLevel::EXACTLY_ONCE);
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("ConfigImage matches like TopicMatcher", "[config_image]") {
+  const std::string path = "test_config_image.bin";
+  Config config = test_config();
+  ConfigImage::compile(config, path);
+  ConfigImage image(path);
+
+  TopicMatcher matcher;
+  for (size_t i = 0; i < config.subscriptions.size(); ++i)
+    matcher.insert(subscription_filter(config.subscriptions[i]), i);
+
+  for (const std::string topic :
+       {"sensors/a/temp", "sensors/b/temp", "sensors", "sensors/a",
+        "sensors/a/temp/raw", "$SYS/broker/load", "$SYS", "jobs/1", "other",
+        "", "/", "a//b"}) {
+    std::vector<size_t> expected, actual;
+    matcher.match(topic, expected);
+    image.match(topic, actual);
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    INFO(topic);
+    REQUIRE(actual == expected);
+  }
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("ConfigImage rejects damaged images", "[config_image]") {
+  const std::string path = "test_config_image.bin";
+  ConfigImage::compile(test_config(), path);
+  const std::string intact = read_file(path);
+
+  std::string flipped = intact;
+  flipped[flipped.size() / 2] ^= 0x01;
+  write_file(path, flipped);
+  REQUIRE_THROWS_AS(ConfigImage(path), std::runtime_error);
+
+  write_file(path, intact.substr(0, intact.size() - 8));
+  REQUIRE_THROWS_AS(ConfigImage(path), std::runtime_error);
+
+  std::string version = intact;
+  version[4] = 99;
+  write_file(path, version);
+  REQUIRE_THROWS_AS(ConfigImage(path), std::runtime_error);
+
+  write_file(path, "{\"broker_url\": \"tcp://localhost:1883\"}");
+  REQUIRE_FALSE(ConfigImage::is_image(path));
+  REQUIRE_THROWS_AS(ConfigImage(path), std::runtime_error);
+  REQUIRE_THROWS_AS(ConfigImage("missing_config_image.bin"),
+                    std::runtime_error);
+
+  // Invalid configurations are refused when compiling, not when loading
+  Config invalid = test_config();
+  invalid.thread_pool_size = 0;
+  REQUIRE_THROWS_AS(ConfigImage::compile(invalid, path), std::invalid_argument);
+
+  std::remove(path.c_str());
+}
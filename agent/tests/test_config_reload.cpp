@@ -0,0 +1,216 @@
+#include "Config.hpp"
+#include "ConfigWatcher.hpp"
+#include "LoopbackTransport.hpp"
+#include "MQTTAgent.hpp"
+#include "tests.hpp"
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+// Polls until condition holds or TIMEOUT passes
+template <typename Condition> bool wait_for(Condition condition) {
+  auto deadline = std::chrono::steady_clock::now() + TIMEOUT;
+  while (!condition()) {
+    if (std::chrono::steady_clock::now() > deadline)
+      return false;
+    std::this_thread::sleep_for(5ms);
+  }
+  return true;
+}
+
+} // namespace
+
+TEST_CASE("ConfigWatcher reports writes and replacements of the file",
+          "[reload]") {
+  const std::string directory = "test_config_watch";
+  const std::string path = directory + "/config.json";
+  ::mkdir(directory.c_str(), 0755);
+  std::ofstream(path) << "{}";
+
+  std::atomic<int> changes{0};
+  std::mutex mutex;
+  std::string changed_path;
+  ConfigWatcher watcher(
+      path,
+      [&](const std::string &changed) {
+        std::lock_guard<std::mutex> lock(mutex);
+        changed_path = changed;
+        changes++;
+      },
+      100ms);
+  REQUIRE(watcher.start());
+
+  // A burst of writes is reported once
+  for (int i = 0; i < 5; i++)
+    std::ofstream(path) << "{\"heartbeat_interval\": " << i << "}";
+  REQUIRE(wait_for([&]() { return changes == 1; }));
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    REQUIRE(changed_path == path);
+  }
+
+  // Other files in the directory are ignored
+  std::ofstream(directory + "/other.json") << "{}";
+  std::this_thread::sleep_for(300ms);
+  REQUIRE(changes == 1);
+
+  // Replacing the file through a rename counts as a change
+  std::ofstream(directory + "/config.json.tmp") << "{}";
+  REQUIRE(std::rename((directory + "/config.json.tmp").c_str(),
+                      path.c_str()) == 0);
+  REQUIRE(wait_for([&]() { return changes == 2; }));
+
+  watcher.stop();
+  std::ofstream(path) << "{}";
+  std::this_thread::sleep_for(300ms);
+  REQUIRE(changes == 2);
+
+  std::remove(path.c_str());
+  std::remove((directory + "/other.json").c_str());
+  ::rmdir(directory.c_str());
+}
+
+TEST_CASE("MQTTAgent applies reloaded configurations", "[reload][loopback]") {
+  LoopbackBroker broker;
+  LoopbackTransport peer(broker);
+  peer.connect(mqtt::connect_options());
+
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://")
+                      .set_client_id("test-reload-agent")
+                      .add_subscription("reload/a", QoSLevel::AT_LEAST_ONCE)
+                      .add_subscription("reload/b", QoSLevel::AT_MOST_ONCE)
+                      .build();
+
+  DummyCallback callback;
+  MQTTAgent &agent = MQTTAgent::get_instance(
+      config, callback, std::make_unique<LoopbackTransport>(broker));
+  std::mutex mutex;
+  std::set<std::string> received;
+  agent.add_handler("reload/#", [&](const mqtt::const_message_ptr &msg) {
+    std::lock_guard<std::mutex> lock(mutex);
+    received.insert(msg->get_topic());
+  });
+  REQUIRE(agent.connect());
+
+  Config next = ConfigBuilder()
+                    .set_broker_url("loopback://")
+                    .set_client_id("test-reload-agent")
+                    .set_credentials("user", "secret")
+                    .add_subscription("reload/b", QoSLevel::AT_LEAST_ONCE)
+                    .add_subscription("reload/c", QoSLevel::AT_LEAST_ONCE)
+                    .set_inflight_window(30, 3)
+                    .set_drain_timeout(1000ms)
+                    .build();
+
+  // Connection settings are reported and keep their value, the rest applies
+  auto restart_required = agent.apply_config(next);
+  REQUIRE(restart_required == std::vector<std::string>{"credentials"});
+
+  auto applied = agent.config();
+  REQUIRE(applied->username.empty());
+  REQUIRE(applied->subscriptions == next.subscriptions);
+  REQUIRE(applied->subscription_qos.at("reload/b") ==
+          QoSLevel::AT_LEAST_ONCE);
+  REQUIRE(applied->max_inflight_messages == 30);
+  REQUIRE(applied->control_reserved_inflight == 3);
+  REQUIRE(applied->drain_timeout == 1000ms);
+
+  // The subscriptions changed with the diff: a is gone, b stays, c is new
+  for (const char *topic : {"reload/a", "reload/b", "reload/c"})
+    peer.publish(mqtt::make_message(topic, "x", 1, false));
+  REQUIRE(wait_for([&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return received.size() >= 2;
+  }));
+  REQUIRE(broker.wait_idle(1s));
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    REQUIRE(received == std::set<std::string>{"reload/b", "reload/c"});
+  }
+
+  agent.shutdown();
+  MQTTAgent::release_instance();
+}
+
+TEST_CASE("MQTTAgent sends reloaded subscriptions after a reconnect",
+          "[reload][loopback]") {
+  bool clean_session = false;
+  SECTION("with the session kept") {}
+  SECTION("with a clean session") { clean_session = true; }
+
+  LoopbackBroker broker;
+  LoopbackTransport peer(broker);
+  peer.connect(mqtt::connect_options());
+
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://")
+                      .set_client_id("test-reload-agent")
+                      .set_clean_session(clean_session)
+                      .enable_auto_reconnect(1s)
+                      .add_subscription("reload/a", QoSLevel::AT_LEAST_ONCE)
+                      .add_subscription("reload/b", QoSLevel::AT_MOST_ONCE)
+                      .build();
+
+  DummyCallback callback;
+  auto transport = std::make_unique<LoopbackTransport>(broker);
+  LoopbackTransport *connection = transport.get();
+  MQTTAgent &agent =
+      MQTTAgent::get_instance(config, callback, std::move(transport));
+  std::mutex mutex;
+  std::vector<mqtt::const_message_ptr> received;
+  agent.add_handler("reload/#", [&](const mqtt::const_message_ptr &msg) {
+    std::lock_guard<std::mutex> lock(mutex);
+    received.push_back(msg);
+  });
+  REQUIRE(agent.connect());
+  REQUIRE(broker.wait_idle(1s));
+
+  // The reload arrives while the connection is down
+  connection->drop();
+  Config next = ConfigBuilder()
+                    .set_broker_url("loopback://")
+                    .set_client_id("test-reload-agent")
+                    .set_clean_session(clean_session)
+                    .enable_auto_reconnect(1s)
+                    .add_subscription("reload/b", QoSLevel::AT_LEAST_ONCE)
+                    .add_subscription("reload/c", QoSLevel::AT_LEAST_ONCE)
+                    .build();
+  REQUIRE(agent.apply_config(next).empty());
+  connection->reconnect(!clean_session);
+  REQUIRE(broker.wait_idle(1s));
+
+  for (const char *topic : {"reload/a", "reload/b", "reload/c"})
+    peer.publish(mqtt::make_message(topic, "x", 1, false));
+  REQUIRE(wait_for([&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return received.size() >= 2;
+  }));
+  REQUIRE(broker.wait_idle(1s));
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::set<std::string> topics;
+    for (const auto &msg : received) {
+      topics.insert(msg->get_topic());
+      // b was upgraded to QoS 1
+      REQUIRE(msg->get_qos() == 1);
+    }
+    REQUIRE(topics == std::set<std::string>{"reload/b", "reload/c"});
+  }
+
+  agent.shutdown();
+  MQTTAgent::release_instance();
+}
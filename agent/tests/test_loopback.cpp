@@ -0,0 +1,495 @@
+#include "Config.hpp"
+#include "LoopbackTransport.hpp"
+#include "MQTTAgent.hpp"
+#include "tests.hpp"
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+// Records everything a loopback client receives
+class RecordingListener : public TransportListener {
+public:
+  std::mutex mutex;
+  std::vector<mqtt::const_message_ptr> messages;
+  std::atomic<size_t> delivered{0};
+  std::atomic<size_t> connects{0};
+
+  void connected(const std::string &) override { connects++; }
+  void connection_lost(const std::string &) override {}
+
+  void message_arrived(mqtt::const_message_ptr msg) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    messages.push_back(msg);
+  }
+
+  void delivery_complete(const mqtt::const_message_ptr &,
+                         const mqtt::delivery_token_ptr &) override {
+    delivered++;
+  }
+
+  std::vector<std::string> payloads() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::string> out;
+    for (const auto &msg : messages)
+      out.push_back(msg->get_payload_str());
+    return out;
+  }
+};
+
+TEST_CASE("LoopbackBroker routes messages by topic filter", "[loopback]") {
+  LoopbackBroker broker;
+  RecordingListener sub_listener, pub_listener;
+  LoopbackTransport subscriber(broker), publisher(broker);
+  subscriber.set_listener(sub_listener);
+  publisher.set_listener(pub_listener);
+
+  subscriber.connect(mqtt::connect_options());
+  publisher.connect(mqtt::connect_options());
+  subscriber.subscribe("sensors/+/temperature", 1);
+
+  publisher.publish(mqtt::make_message("sensors/a/temperature", "1", 1, false));
+  publisher.publish(mqtt::make_message("sensors/a/humidity", "2", 1, false));
+  publisher.publish(mqtt::make_message("sensors/b/temperature", "3", 0, true));
+
+  REQUIRE(broker.wait_idle(1s));
+  REQUIRE(sub_listener.connects == 1);
+  REQUIRE(sub_listener.payloads() == std::vector<std::string>{"1", "3"});
+  REQUIRE(pub_listener.delivered == 3);
+
+  // Retained messages reach later subscribers
+  subscriber.subscribe("sensors/b/#", 1);
+  REQUIRE(broker.wait_idle(1s));
+  REQUIRE(sub_listener.payloads().back() == "3");
+  REQUIRE(sub_listener.messages.back()->is_retained());
+
+  subscriber.unsubscribe("sensors/+/temperature");
+  publisher.publish(mqtt::make_message("sensors/a/temperature", "4", 1, false));
+  REQUIRE(broker.wait_idle(1s));
+  REQUIRE(sub_listener.payloads().size() == 3);
+
+  subscriber.disconnect();
+  REQUIRE_THROWS_AS(
+      subscriber.publish(mqtt::make_message("sensors/a/temperature", "5")),
+      mqtt::exception);
+}
+
+TEST_CASE("LoopbackBroker splits shared subscriptions across members",
+          "[loopback]") {
+  LoopbackBroker broker;
+  RecordingListener first_listener, second_listener, pub_listener;
+  LoopbackTransport first(broker), second(broker), publisher(broker);
+  first.set_listener(first_listener);
+  second.set_listener(second_listener);
+  publisher.set_listener(pub_listener);
+
+  for (auto *transport : {&first, &second, &publisher})
+    transport->connect(mqtt::connect_options());
+  first.subscribe("$share/workers/jobs/#", 1);
+  second.subscribe("$share/workers/jobs/#", 1);
+
+  for (int i = 0; i < 100; i++)
+    publisher.publish(mqtt::make_message("jobs/" + std::to_string(i), "job",
+                                         1, false));
+
+  REQUIRE(broker.wait_idle(1s));
+  REQUIRE(first_listener.payloads().size() == 50);
+  REQUIRE(second_listener.payloads().size() == 50);
+}
+
+TEST_CASE("LoopbackBroker retransmits lost QoS 1 packets", "[loopback]") {
+  LoopbackBroker broker(42);
+  LoopbackConditions conditions;
+  conditions.latency = 100us;
+  conditions.loss = 0.3;
+  conditions.retry_interval = 1ms;
+  broker.set_conditions(conditions);
+
+  RecordingListener sub_listener, pub_listener;
+  LoopbackTransport subscriber(broker), publisher(broker);
+  subscriber.set_listener(sub_listener);
+  publisher.set_listener(pub_listener);
+  subscriber.connect(mqtt::connect_options());
+  publisher.connect(mqtt::connect_options());
+  subscriber.subscribe("lossy/qos1", 1);
+  subscriber.subscribe("lossy/qos0", 0);
+
+  const int count = 200;
+  for (int i = 0; i < count; i++) {
+    publisher.publish(mqtt::make_message("lossy/qos1", "a", 1, false));
+    publisher.publish(mqtt::make_message("lossy/qos0", "b", 0, false));
+  }
+
+  REQUIRE(broker.wait_idle(10s));
+  REQUIRE(broker.packets_lost() > 0);
+
+  size_t qos1 = 0, qos0 = 0;
+  for (const auto &payload : sub_listener.payloads())
+    (payload == "a" ? qos1 : qos0)++;
+  REQUIRE(qos1 == count);
+  REQUIRE(qos0 < count);
+  REQUIRE(pub_listener.delivered == 2 * count);
+}
+
+TEST_CASE("MQTTAgent publishes and subscribes over a loopback transport",
+          "[loopback]") {
+  LoopbackBroker broker;
+  RecordingListener peer_listener;
+  LoopbackTransport peer(broker);
+  peer.set_listener(peer_listener);
+  peer.connect(mqtt::connect_options());
+  peer.subscribe("test/out", 1);
+
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://")
+                      .set_client_id("test-agent")
+                      .set_qos_level(QoSLevel::AT_LEAST_ONCE)
+                      .add_subscription("test/topic", QoSLevel::AT_LEAST_ONCE)
+                      .build();
+
+  std::atomic<bool> message_received{false};
+  TestCallback callback(message_received);
+  MQTTAgent &agent = MQTTAgent::get_instance(
+      config, callback, std::make_unique<LoopbackTransport>(broker));
+  REQUIRE(agent.connect());
+
+  std::atomic<int> handled{0};
+  agent.add_handler("test/topic", [&](const mqtt::const_message_ptr &) {
+    handled++;
+  });
+
+  agent.publish_message("test/out", "Hello Test");
+  peer.publish(mqtt::make_message("test/topic", "Hello Test", 1, false));
+  REQUIRE(broker.wait_idle(1s));
+
+  REQUIRE(peer_listener.payloads() == std::vector<std::string>{"Hello Test"});
+  REQUIRE(callback.metrics.messages_sent == 1);
+  REQUIRE(message_received);
+
+  // Handlers run on the dispatcher's workers
+  auto deadline = std::chrono::steady_clock::now() + TIMEOUT;
+  while (handled == 0 && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::yield();
+  REQUIRE(handled == 1);
+
+  agent.shutdown();
+  MQTTAgent::release_instance();
+}
+
+TEST_CASE("MQTTAgent drains publishes and handlers on shutdown",
+          "[loopback][drain]") {
+  LoopbackBroker broker;
+  LoopbackConditions conditions;
+  conditions.latency = 10ms;
+  broker.set_conditions(conditions);
+
+  RecordingListener peer_listener;
+  LoopbackTransport peer(broker);
+  peer.set_listener(peer_listener);
+  peer.connect(mqtt::connect_options());
+  peer.subscribe("test/out", 1);
+
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://")
+                      .set_client_id("test-drain-agent")
+                      .add_subscription("test/in", QoSLevel::AT_LEAST_ONCE)
+                      .set_inflight_window(4, 1)
+                      .set_drain_timeout(5000ms)
+                      .build();
+
+  DummyCallback callback;
+  MQTTAgent &agent = MQTTAgent::get_instance(
+      config, callback, std::make_unique<LoopbackTransport>(broker));
+  std::atomic<int> handled{0};
+  agent.add_handler("test/in", [&](const mqtt::const_message_ptr &) {
+    std::this_thread::sleep_for(5ms);
+    handled++;
+    // Publishes of handlers running during the drain are still sent
+    agent.publish_message("test/out", "handled");
+  });
+  REQUIRE(agent.connect());
+
+  for (int i = 0; i < 10; i++)
+    peer.publish(mqtt::make_message("test/in", "work", 1, false));
+  REQUIRE(broker.wait_idle(1s));
+  for (int i = 0; i < 20; i++)
+    agent.publish_message("test/out", std::to_string(i));
+
+  agent.shutdown();
+  REQUIRE(handled == 10);
+  REQUIRE(peer_listener.payloads().size() == 30);
+  REQUIRE(callback.metrics.persisted_on_shutdown == 0);
+  REQUIRE(callback.metrics.dropped_on_shutdown == 0);
+  REQUIRE(callback.metrics.drained_on_shutdown > 0);
+  MQTTAgent::release_instance();
+}
+
+TEST_CASE("MQTTAgent persists what did not drain and restores it",
+          "[loopback][drain]") {
+  const std::string store = "test_drain_store";
+  LoopbackBroker broker;
+  RecordingListener peer_listener;
+  LoopbackTransport peer(broker);
+  peer.set_listener(peer_listener);
+  peer.connect(mqtt::connect_options());
+  peer.subscribe("test/out", 1);
+
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://")
+                      .set_client_id("test-drain-agent")
+                      .set_thread_pool_size(1)
+                      .add_subscription("test/in", QoSLevel::AT_LEAST_ONCE)
+                      .enable_persistence(store)
+                      .set_inflight_window(4, 1)
+                      .set_drain_timeout(50ms)
+                      .build();
+
+  std::atomic<int> handled{0};
+  auto handler = [&](const mqtt::const_message_ptr &) {
+    std::this_thread::sleep_for(100ms);
+    handled++;
+  };
+
+  {
+    DummyCallback callback;
+    MQTTAgent &agent = MQTTAgent::get_instance(
+        config, callback, std::make_unique<LoopbackTransport>(broker));
+    agent.add_handler("test/in", handler);
+    REQUIRE(agent.connect());
+
+    for (int i = 0; i < 5; i++)
+      peer.publish(mqtt::make_message("test/in", "work", 1, false));
+    REQUIRE(broker.wait_idle(1s));
+
+    // Acknowledgements will not arrive before the drain timeout
+    LoopbackConditions conditions;
+    conditions.latency = 10s;
+    broker.set_conditions(conditions);
+    for (int i = 0; i < 5; i++)
+      agent.publish_message("test/out", std::to_string(i));
+
+    agent.shutdown();
+    REQUIRE(callback.metrics.dropped_on_shutdown == 0);
+    REQUIRE(callback.metrics.persisted_on_shutdown ==
+            5 + (5 - static_cast<size_t>(handled)));
+    MQTTAgent::release_instance();
+  }
+
+  broker.set_conditions(LoopbackConditions());
+  DummyCallback callback;
+  MQTTAgent &agent = MQTTAgent::get_instance(
+      config, callback, std::make_unique<LoopbackTransport>(broker));
+  agent.add_handler("test/in", handler);
+  REQUIRE(agent.connect());
+
+  auto deadline = std::chrono::steady_clock::now() + TIMEOUT;
+  while ((handled < 5 || peer_listener.payloads().size() < 5) &&
+         std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(10ms);
+  REQUIRE(handled == 5);
+  REQUIRE(peer_listener.payloads() ==
+          std::vector<std::string>{"0", "1", "2", "3", "4"});
+  REQUIRE(callback.metrics.restored_messages > 5);
+
+  agent.shutdown();
+  MQTTAgent::release_instance();
+  std::remove((store + "/test-drain-agent-unsent.trace").c_str());
+  std::remove((store + "/test-drain-agent-unprocessed.trace").c_str());
+  ::rmdir(store.c_str());
+}
+
+TEST_CASE("MQTTAgent stores publishes with their class and properties",
+          "[loopback][drain]") {
+  const std::string store = "test_drain_store";
+  const std::string unsent = store + "/test-store-agent-unsent.trace";
+  LoopbackBroker broker;
+  RecordingListener peer_listener;
+  LoopbackTransport peer(broker);
+  peer.set_listener(peer_listener);
+  peer.connect(mqtt::connect_options());
+  peer.subscribe("test/#", 1);
+
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://")
+                      .set_client_id("test-store-agent")
+                      .enable_mqtt_v5()
+                      .set_rpc("", 10000ms)
+                      .enable_persistence(store)
+                      .set_drain_timeout(50ms)
+                      .build();
+
+  {
+    DummyCallback callback;
+    MQTTAgent &agent = MQTTAgent::get_instance(
+        config, callback, std::make_unique<LoopbackTransport>(broker));
+    REQUIRE(agent.connect());
+
+    // Acknowledgements will not arrive before the drain timeout
+    LoopbackConditions conditions;
+    conditions.latency = 10s;
+    broker.set_conditions(conditions);
+    agent.publish_message("test/status", "stopping", QoSLevel::AT_LEAST_ONCE,
+                          true, Priority::CONTROL);
+    agent.publish_message("test/bulk", "bulk", QoSLevel::AT_LEAST_ONCE,
+                          false, Priority::BULK);
+    agent.call("test/rpc", "request", [](RPCStatus, mqtt::const_message_ptr) {});
+
+    agent.shutdown();
+    REQUIRE(callback.metrics.persisted_on_shutdown == 3);
+    MQTTAgent::release_instance();
+  }
+
+  {
+    TraceReader reader(unsent);
+    TraceRecord record;
+    size_t records = 0;
+    while (reader.next(record)) {
+      records++;
+      if (record.topic == "test/status") {
+        REQUIRE(record.priority == static_cast<uint8_t>(Priority::CONTROL));
+        REQUIRE(record.retained);
+      } else if (record.topic == "test/bulk") {
+        REQUIRE(record.priority == static_cast<uint8_t>(Priority::BULK));
+      } else {
+        REQUIRE(record.topic == "test/rpc");
+        REQUIRE(record.priority == static_cast<uint8_t>(Priority::REALTIME));
+        REQUIRE(record.response_topic == "rpc/test-store-agent/response");
+        REQUIRE_FALSE(record.correlation_data.empty());
+      }
+    }
+    REQUIRE(records == 3);
+  }
+
+  // The stale status is dropped, the rest is sent again
+  broker.set_conditions(LoopbackConditions());
+  DummyCallback callback;
+  MQTTAgent &agent = MQTTAgent::get_instance(
+      config, callback, std::make_unique<LoopbackTransport>(broker));
+  REQUIRE(agent.connect());
+
+  auto deadline = std::chrono::steady_clock::now() + TIMEOUT;
+  while (peer_listener.payloads().size() < 2 &&
+         std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(10ms);
+  std::this_thread::sleep_for(100ms);
+  {
+    std::lock_guard<std::mutex> lock(peer_listener.mutex);
+    REQUIRE(peer_listener.messages.size() == 2);
+    for (const auto &msg : peer_listener.messages) {
+      REQUIRE(msg->get_topic() != "test/status");
+      if (msg->get_topic() == "test/rpc")
+        REQUIRE(msg->get_properties().contains(
+            mqtt::property::CORRELATION_DATA));
+    }
+  }
+
+  agent.shutdown();
+  MQTTAgent::release_instance();
+  std::remove(unsent.c_str());
+  ::rmdir(store.c_str());
+}
+
+TEST_CASE("MQTTAgent can be released while timer tasks are pending",
+          "[loopback]") {
+  LoopbackBroker broker;
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://")
+                      .set_client_id("test-release-agent")
+                      .enable_mqtt_v5()
+                      .enable_topic_aliases(10)
+                      .set_timer_resolution(1ms)
+                      .add_subscription("test/in", QoSLevel::AT_LEAST_ONCE)
+                      .build();
+
+  // Released right away: the expiry task and the RPC client are in place
+  for (int i = 0; i < 20; i++) {
+    DummyCallback callback;
+    MQTTAgent::get_instance(config, callback,
+                            std::make_unique<LoopbackTransport>(broker));
+    MQTTAgent::release_instance();
+  }
+
+  // Released while a task runs through the publish path: the destructor
+  // waits for it before the alias tables and the dispatcher go
+  DummyCallback callback;
+  MQTTAgent &agent = MQTTAgent::get_instance(
+      config, callback, std::make_unique<LoopbackTransport>(broker));
+  REQUIRE(agent.connect());
+  std::atomic<bool> started{false}, finished{false};
+  agent.timers().schedule_once(0ms, [&]() {
+    started = true;
+    std::this_thread::sleep_for(50ms);
+    for (int i = 0; i < 100; i++)
+      agent.publish_message("test/out", "late", QoSLevel::AT_MOST_ONCE);
+    finished = true;
+  });
+  agent.timers().schedule_periodic(1ms, [&]() {
+    agent.publish_message("test/out", "periodic", QoSLevel::AT_MOST_ONCE);
+  });
+  while (!started)
+    std::this_thread::yield();
+  MQTTAgent::release_instance();
+  REQUIRE(finished);
+}
+
+TEST_CASE("MQTTAgent counts a share group only for the group's deliveries",
+          "[loopback][shared]") {
+  LoopbackBroker broker;
+  RecordingListener member_listener;
+  LoopbackTransport member(broker), publisher(broker);
+  member.set_listener(member_listener);
+  member.connect(mqtt::connect_options());
+  publisher.connect(mqtt::connect_options());
+  member.subscribe("$share/workers/jobs/#", 1);
+
+  Config config = ConfigBuilder()
+                      .set_broker_url("loopback://")
+                      .set_client_id("test-group-agent")
+                      .enable_mqtt_v5()
+                      .add_subscription("jobs/#", QoSLevel::AT_LEAST_ONCE)
+                      .add_subscription("$share/workers/jobs/#",
+                                        QoSLevel::AT_LEAST_ONCE)
+                      .build();
+
+  DummyCallback callback;
+  MQTTAgent &agent = MQTTAgent::get_instance(
+      config, callback, std::make_unique<LoopbackTransport>(broker));
+  std::atomic<int> plain{0}, shared{0}, late{0};
+  agent.add_handler("jobs/#",
+                    [&](const mqtt::const_message_ptr &) { plain++; });
+  // Handlers run without the routes lock, so they can add handlers
+  agent.add_handler("$share/workers/jobs/#",
+                    [&](const mqtt::const_message_ptr &) {
+                      if (shared++ == 0)
+                        agent.add_handler("jobs/late",
+                                          [&](const mqtt::const_message_ptr &) {
+                                            late++;
+                                          });
+                    });
+  REQUIRE(agent.connect());
+
+  // Every job reaches the agent's plain subscription; the group hands every
+  // other one to the agent
+  for (int i = 0; i < 10; i++)
+    publisher.publish(
+        mqtt::make_message("jobs/" + std::to_string(i), "job", 1, false));
+  REQUIRE(broker.wait_idle(1s));
+  agent.shutdown();
+
+  REQUIRE(plain == 10);
+  REQUIRE(shared == 5);
+  REQUIRE(member_listener.payloads().size() == 5);
+  auto &group = callback.metrics.group("workers");
+  REQUIRE(group.messages_received == 5);
+  REQUIRE(group.messages_processed == 5);
+  REQUIRE(late == 0);
+
+  MQTTAgent::release_instance();
+}
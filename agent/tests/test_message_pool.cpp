@@ -0,0 +1,54 @@
+#include "MessagePool.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST_CASE("MessagePool builds messages equal to make_message", "[pool]") {
+  std::string payload(200, 'p');
+  auto pooled = MessagePool::make_message("pool/topic", payload, 1, true);
+  auto plain = mqtt::make_message("pool/topic", payload, 1, true);
+
+  REQUIRE(pooled->get_topic() == plain->get_topic());
+  REQUIRE(pooled->get_payload_str() == plain->get_payload_str());
+  REQUIRE(pooled->get_qos() == plain->get_qos());
+  REQUIRE(pooled->is_retained() == plain->is_retained());
+}
+
+TEST_CASE("MessagePool recycles released messages", "[pool]") {
+  // Warm up this thread's pools
+  for (int i = 0; i < 16; i++)
+    MessagePool::make_message("pool/recycle", std::string(100, 'x'));
+
+  auto before = MessagePool::stats();
+  for (int i = 0; i < 1000; i++)
+    MessagePool::make_message("pool/recycle", std::string(100, 'x'));
+  auto interval = MessagePool::stats().since(before);
+
+  REQUIRE(interval.messages == 1000);
+  REQUIRE(interval.heap_allocations == 0);
+  REQUIRE(interval.reused > 0);
+  REQUIRE(interval.allocations_per_message() == 0.0);
+}
+
+TEST_CASE("MessagePool messages released on another thread return to their "
+          "owner",
+          "[pool]") {
+  std::vector<mqtt::message_ptr> messages;
+  for (int i = 0; i < 100; i++)
+    messages.push_back(
+        MessagePool::make_message("pool/cross", std::to_string(i)));
+
+  std::thread([&messages]() { messages.clear(); }).join();
+  REQUIRE(messages.empty());
+
+  // The released memory is collected here instead of allocated again
+  auto before = MessagePool::stats();
+  for (int i = 0; i < 100; i++)
+    messages.push_back(
+        MessagePool::make_message("pool/cross", std::to_string(i)));
+  auto after = MessagePool::stats();
+
+  REQUIRE(after.heap_allocations == before.heap_allocations);
+  REQUIRE(messages.back()->get_payload_str() == "99");
+}
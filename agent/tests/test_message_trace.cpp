@@ -0,0 +1,111 @@
+#include "MessageTrace.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+TEST_CASE("TraceReader returns the records of a TraceWriter", "[trace]") {
+  const std::string path = "test_message_trace.bin";
+
+  {
+    TraceWriter writer(path, 64); // Small buffer to exercise partial flushes
+    writer.record(*mqtt::make_message("sensors/a", "1", 0, false));
+    writer.record(*mqtt::make_message("sensors/b", std::string(100, 'x'), 1,
+                                      true));
+    writer.record(*mqtt::make_message("sensors/c", "", 2, false));
+    writer.record(*mqtt::message::create(
+                      "rpc/request", "ping", 1, false,
+                      {{mqtt::property::RESPONSE_TOPIC, "rpc/response"},
+                       {mqtt::property::CORRELATION_DATA, "42"}}),
+                  2);
+    REQUIRE(writer.records() == 4);
+  }
+
+  TraceReader reader(path);
+  TraceRecord record;
+
+  REQUIRE(reader.next(record));
+  REQUIRE(record.topic == "sensors/a");
+  REQUIRE(record.payload == "1");
+  REQUIRE(record.qos == 0);
+  REQUIRE_FALSE(record.retained);
+  uint64_t first = record.timestamp_ns;
+
+  REQUIRE(reader.next(record));
+  REQUIRE(record.topic == "sensors/b");
+  REQUIRE(record.payload == std::string(100, 'x'));
+  REQUIRE(record.qos == 1);
+  REQUIRE(record.retained);
+  REQUIRE(record.timestamp_ns >= first);
+
+  REQUIRE(reader.next(record));
+  REQUIRE(record.topic == "sensors/c");
+  REQUIRE(record.payload.empty());
+  REQUIRE(record.qos == 2);
+  REQUIRE(record.priority == TRACE_NO_PRIORITY);
+
+  REQUIRE(reader.next(record));
+  REQUIRE(record.topic == "rpc/request");
+  REQUIRE(record.payload == "ping");
+  REQUIRE(record.priority == 2);
+  REQUIRE(record.response_topic == "rpc/response");
+  REQUIRE(record.correlation_data == "42");
+
+  auto msg = record.to_message();
+  REQUIRE(msg->get_topic() == "rpc/request");
+  REQUIRE(msg->get_payload_str() == "ping");
+  REQUIRE(msg->get_qos() == 1);
+  REQUIRE(mqtt::get<std::string>(msg->get_properties(),
+                                 mqtt::property::RESPONSE_TOPIC) ==
+          "rpc/response");
+  REQUIRE(mqtt::get<std::string>(msg->get_properties(),
+                                 mqtt::property::CORRELATION_DATA) == "42");
+
+  REQUIRE_FALSE(reader.next(record));
+
+  reader.rewind();
+  REQUIRE(reader.next(record));
+  REQUIRE(record.topic == "sensors/a");
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("TraceReader rejects files that are not traces", "[trace]") {
+  const std::string path = "test_message_trace.txt";
+  FILE *file = std::fopen(path.c_str(), "w");
+  std::fputs("definitely not a trace file", file);
+  std::fclose(file);
+
+  REQUIRE_THROWS_AS(TraceReader(path), std::runtime_error);
+  REQUIRE_THROWS_AS(TraceReader("missing_trace.bin"), std::runtime_error);
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("TraceReader stops at a trace cut off in the padding", "[trace]") {
+  const std::string path = "test_message_trace_cut.bin";
+  {
+    TraceWriter writer(path);
+    writer.record(*mqtt::make_message("sensors/a", "1", 0, false));
+    writer.record(*mqtt::make_message("sensors/b", "2", 0, false));
+  }
+
+  // The last record's body is 10 bytes, padded to 16
+  FILE *file = std::fopen(path.c_str(), "rb");
+  std::fseek(file, 0, SEEK_END);
+  long size = std::ftell(file);
+  std::fclose(file);
+  REQUIRE(::truncate(path.c_str(), size - 3) == 0);
+
+  TraceReader reader(path);
+  TraceRecord record;
+  REQUIRE(reader.next(record));
+  REQUIRE(reader.next(record));
+  REQUIRE(record.topic == "sensors/b");
+  REQUIRE(record.payload == "2");
+  REQUIRE_FALSE(reader.next(record));
+  REQUIRE_FALSE(reader.next(record));
+
+  std::remove(path.c_str());
+}
@@ -0,0 +1,324 @@
+#include "PublishScheduler.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+scheduler_options test_options(size_t max_inflight, size_t control_reserved) {
+  scheduler_options options;
+  options.max_inflight = max_inflight;
+  options.control_reserved = control_reserved;
+  options.max_wait[1] = options.max_wait[2] = std::chrono::hours(1);
+  options.enqueue_timeout = std::chrono::milliseconds(10);
+  return options;
+}
+
+mqtt::message_ptr make(const std::string &topic, int qos = 1,
+                       size_t payload = 100) {
+  return mqtt::make_message(topic, std::string(payload, 'x'), qos, false);
+}
+
+} // namespace
+
+TEST_CASE("PublishScheduler lets control messages preempt", "[scheduler]") {
+  PlatformMetrics metrics;
+  std::vector<mqtt::message_ptr> sent;
+  PublishScheduler scheduler(
+      metrics,
+      [&](const mqtt::message_ptr &msg) {
+        sent.push_back(msg);
+        return true;
+      },
+      test_options(4, 1));
+
+  // Bulk may only use 3 of the 4 slots
+  for (int i = 0; i < 10; i++)
+    REQUIRE(scheduler.enqueue(make("bulk"), Priority::BULK));
+  REQUIRE(sent.size() == 3);
+  REQUIRE(scheduler.queued(Priority::BULK) == 7);
+
+  REQUIRE(scheduler.enqueue(make("control"), Priority::CONTROL));
+  REQUIRE(sent.size() == 4);
+  REQUIRE(sent.back()->get_topic() == "control");
+
+  // The next free slot goes to control again before any bulk
+  REQUIRE(scheduler.enqueue(make("control"), Priority::CONTROL));
+  REQUIRE(sent.size() == 4);
+  scheduler.complete(sent[0].get());
+  REQUIRE(sent.size() == 5);
+  REQUIRE(sent.back()->get_topic() == "control");
+  REQUIRE(metrics.priorities[0].sent == 2);
+}
+
+TEST_CASE("PublishScheduler shares the window by weight", "[scheduler]") {
+  PlatformMetrics metrics;
+  std::vector<mqtt::message_ptr> sent;
+  PublishScheduler scheduler(
+      metrics,
+      [&](const mqtt::message_ptr &msg) {
+        sent.push_back(msg);
+        return true;
+      },
+      test_options(2, 1));
+
+  // One slot for realtime and bulk; everything queues behind the first
+  REQUIRE(scheduler.enqueue(make("first"), Priority::BULK));
+  for (int i = 0; i < 1000; i++) {
+    REQUIRE(scheduler.enqueue(make("realtime"), Priority::REALTIME));
+    REQUIRE(scheduler.enqueue(make("bulkbulk"), Priority::BULK));
+  }
+
+  // Rounds send whole quanta, so count over several of them
+  size_t realtime = 0, bulk = 0;
+  for (int i = 0; i < 500; i++) {
+    scheduler.complete(sent.back().get());
+    (sent.back()->get_topic() == "realtime" ? realtime : bulk)++;
+  }
+
+  // Same cost per message, weights 4:1
+  REQUIRE(realtime >= 3.5 * bulk);
+  REQUIRE(realtime <= 4.5 * bulk);
+  REQUIRE(metrics.priorities[1].delivery_latency.samples +
+              metrics.priorities[2].delivery_latency.samples ==
+          500);
+}
+
+TEST_CASE("PublishScheduler bounds starvation", "[scheduler]") {
+  PlatformMetrics metrics;
+  std::vector<mqtt::message_ptr> sent;
+  auto options = test_options(2, 1);
+  options.weights[1] = 1000;
+  options.max_wait[2] = std::chrono::milliseconds(10);
+  PublishScheduler scheduler(
+      metrics,
+      [&](const mqtt::message_ptr &msg) {
+        sent.push_back(msg);
+        return true;
+      },
+      options);
+
+  // A large bulk message needs many rounds of its small quantum
+  REQUIRE(scheduler.enqueue(make("realtime", 1, 10), Priority::REALTIME));
+  REQUIRE(scheduler.enqueue(make("bulk", 1, 100000), Priority::BULK));
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (sent.back()->get_topic() != "bulk" &&
+         std::chrono::steady_clock::now() < deadline) {
+    REQUIRE(scheduler.enqueue(make("realtime", 1, 10), Priority::REALTIME));
+    scheduler.complete(sent.back().get());
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  REQUIRE(sent.back()->get_topic() == "bulk");
+  REQUIRE(metrics.priorities[2].starvation_promotions == 1);
+}
+
+TEST_CASE("PublishScheduler does not hold slots for QoS 0", "[scheduler]") {
+  PlatformMetrics metrics;
+  size_t sent = 0;
+  PublishScheduler scheduler(
+      metrics,
+      [&](const mqtt::message_ptr &) {
+        sent++;
+        return true;
+      },
+      test_options(2, 1));
+
+  for (int i = 0; i < 10; i++)
+    REQUIRE(scheduler.enqueue(make("qos0", 0), Priority::BULK));
+  REQUIRE(sent == 10);
+  REQUIRE(scheduler.inflight() == 0);
+  REQUIRE(metrics.priorities[2].queue_latency.samples == 10);
+}
+
+TEST_CASE("PublishScheduler drops when a queue stays full", "[scheduler]") {
+  PlatformMetrics metrics;
+  auto options = test_options(2, 1);
+  options.queue_size = 1;
+  PublishScheduler scheduler(
+      metrics, [](const mqtt::message_ptr &) { return true; }, options);
+
+  REQUIRE(scheduler.enqueue(make("a"), Priority::REALTIME)); // In flight
+  REQUIRE(scheduler.enqueue(make("b"), Priority::REALTIME)); // Queued
+  REQUIRE_FALSE(scheduler.enqueue(make("c"), Priority::REALTIME));
+  REQUIRE(metrics.priorities[1].dropped == 1);
+
+  // Control is never refused
+  REQUIRE(scheduler.enqueue(make("d"), Priority::CONTROL));
+  REQUIRE(scheduler.enqueue(make("e"), Priority::CONTROL));
+  REQUIRE(scheduler.queued(Priority::CONTROL) == 1);
+}
+
+TEST_CASE("PublishScheduler frees the slot of a failed send", "[scheduler]") {
+  PlatformMetrics metrics;
+  bool accept = false;
+  PublishScheduler scheduler(
+      metrics, [&](const mqtt::message_ptr &) { return accept; },
+      test_options(2, 1));
+
+  REQUIRE(scheduler.enqueue(make("lost"), Priority::REALTIME));
+  REQUIRE(scheduler.inflight() == 0);
+  REQUIRE(metrics.priorities[1].dropped == 1);
+
+  accept = true;
+  REQUIRE(scheduler.enqueue(make("sent"), Priority::REALTIME));
+  REQUIRE(scheduler.inflight() == 1);
+  REQUIRE(metrics.priorities[1].sent == 1);
+}
+
+TEST_CASE("PublishScheduler frees slots of failed and expired publishes",
+          "[scheduler]") {
+  PlatformMetrics metrics;
+  std::vector<mqtt::message_ptr> sent;
+  auto options = test_options(3, 1);
+  options.inflight_timeout = std::chrono::milliseconds(20);
+  PublishScheduler scheduler(
+      metrics,
+      [&](const mqtt::message_ptr &msg) {
+        sent.push_back(msg);
+        return true;
+      },
+      options);
+
+  // Two slots for realtime, both taken
+  for (int i = 0; i < 4; i++)
+    REQUIRE(scheduler.enqueue(make("realtime"), Priority::REALTIME));
+  REQUIRE(sent.size() == 2);
+
+  // The broker refused the first one
+  scheduler.fail(sent[0].get());
+  REQUIRE(sent.size() == 3);
+  REQUIRE(metrics.priorities[1].dropped == 1);
+  REQUIRE(scheduler.expire() == 0);
+
+  // The others are never acknowledged
+  std::this_thread::sleep_for(std::chrono::milliseconds(30));
+  REQUIRE(scheduler.expire() == 2);
+  REQUIRE(sent.size() == 4);
+  REQUIRE(scheduler.inflight() == 1);
+  REQUIRE(metrics.priorities[1].expired == 2);
+  REQUIRE(metrics.priorities[1].dropped == 3);
+
+  // A late acknowledgement of an expired message is ignored
+  scheduler.complete(sent[1].get());
+  REQUIRE(scheduler.inflight() == 1);
+}
+
+TEST_CASE("PublishScheduler drains and hands over what is left",
+          "[scheduler]") {
+  PlatformMetrics metrics;
+  std::vector<mqtt::message_ptr> sent;
+  PublishScheduler scheduler(
+      metrics,
+      [&](const mqtt::message_ptr &msg) {
+        sent.push_back(msg);
+        return true;
+      },
+      test_options(3, 1));
+
+  for (int i = 0; i < 5; i++)
+    REQUIRE(scheduler.enqueue(make("drain/" + std::to_string(i)),
+                              Priority::REALTIME));
+  scheduler.close();
+  REQUIRE_FALSE(scheduler.enqueue(make("late"), Priority::CONTROL));
+
+  // Queued messages are still sent as acknowledgements free the window
+  std::thread acker([&]() {
+    for (int i = 0; i < 2; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      scheduler.complete(sent[i].get());
+    }
+  });
+  REQUIRE_FALSE(scheduler.drain(std::chrono::steady_clock::now() +
+                                std::chrono::milliseconds(100)));
+  acker.join();
+
+  std::vector<PendingMessage> queued, inflight;
+  scheduler.take_pending(queued, inflight);
+  REQUIRE(queued.size() == 1);
+  REQUIRE(queued[0].msg->get_topic() == "drain/4");
+  REQUIRE(queued[0].priority == Priority::REALTIME);
+  REQUIRE(inflight.size() == 2);
+  REQUIRE(inflight[0].msg->get_topic() == "drain/2");
+  REQUIRE(scheduler.accepted() == 5);
+  REQUIRE(scheduler.refused() == 1);
+  REQUIRE(scheduler.inflight() == 0);
+  REQUIRE(metrics.priorities[1].queued == 0);
+  REQUIRE(scheduler.drain(std::chrono::steady_clock::now()));
+}
+
+TEST_CASE("PublishScheduler sends encoded messages and keeps the originals",
+          "[scheduler]") {
+  PlatformMetrics metrics;
+  std::vector<mqtt::message_ptr> sent;
+  PublishScheduler scheduler(
+      metrics,
+      [&](const mqtt::message_ptr &msg) {
+        sent.push_back(msg);
+        return true;
+      },
+      test_options(10, 1), [](const mqtt::message_ptr &msg) {
+        return mqtt::make_message("", msg->get_payload_str(), msg->get_qos(),
+                                  false);
+      });
+
+  REQUIRE(scheduler.enqueue(make("encode/a"), Priority::BULK));
+  REQUIRE(scheduler.enqueue(make("encode/b"), Priority::BULK));
+  REQUIRE(sent.size() == 2);
+  REQUIRE(sent[0]->get_topic().empty());
+
+  // Completions refer to the message that was sent
+  scheduler.complete(sent[0].get());
+  REQUIRE(scheduler.inflight() == 1);
+
+  std::vector<PendingMessage> queued, inflight;
+  scheduler.take_pending(queued, inflight);
+  REQUIRE(inflight.size() == 1);
+  REQUIRE(inflight[0].msg->get_topic() == "encode/b");
+  REQUIRE(inflight[0].priority == Priority::BULK);
+}
+
+TEST_CASE("PublishScheduler sends a backlog one round per call",
+          "[scheduler]") {
+  PlatformMetrics metrics;
+  std::vector<mqtt::message_ptr> sent;
+  int resumes = 0;
+  PublishScheduler scheduler(
+      metrics,
+      [&](const mqtt::message_ptr &msg) {
+        sent.push_back(msg);
+        return true;
+      },
+      test_options(2, 1), nullptr, [&]() { resumes++; });
+
+  // QoS 0 waits behind the one slot realtime and bulk may use
+  REQUIRE(scheduler.enqueue(make("slot"), Priority::REALTIME));
+  for (int i = 0; i < 200; i++)
+    REQUIRE(scheduler.enqueue(make("bulk", 0), Priority::BULK));
+  REQUIRE(sent.size() == 1);
+  REQUIRE(resumes == 0);
+
+  // A round is 5 quanta of 1024 bytes, i.e. 50 messages of 104 bytes. The
+  // completion sends one round and asks to resume for the rest
+  scheduler.complete(sent[0].get());
+  REQUIRE(sent.size() == 51);
+  REQUIRE(resumes == 1);
+
+  // Control goes first, then the call carries on with the next round. A
+  // resume is already requested
+  REQUIRE(scheduler.enqueue(make("control", 0), Priority::CONTROL));
+  REQUIRE(sent[51]->get_topic() == "control");
+  REQUIRE(sent.size() == 102);
+  REQUIRE(resumes == 1);
+
+  scheduler.resume();
+  REQUIRE(sent.size() == 152);
+  REQUIRE(resumes == 2);
+  scheduler.resume();
+  REQUIRE(sent.size() == 202);
+  REQUIRE(scheduler.queued(Priority::BULK) == 0);
+  REQUIRE(resumes == 2);
+}
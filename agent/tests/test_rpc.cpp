@@ -0,0 +1,99 @@
+#include "Config.hpp"
+#include "MQTTAgent.hpp"
+#include "tests.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <mqtt/async_client.h>
+#include <string>
+#include <vector>
+
+const std::string BROKER{"tcp://localhost:1883"};
+
+// Responder that echoes the request payload back to the caller
+class EchoCallback : public virtual mqtt::callback {
+public:
+  explicit EchoCallback(mqtt::async_client &client) : client(client) {}
+
+  void message_arrived(mqtt::const_message_ptr msg) override {
+    auto response = RPCClient::make_response(msg, "echo: " +
+                                                      msg->get_payload_str());
+    if (response)
+      client.publish(response);
+  }
+
+  mqtt::async_client &client;
+};
+
+TEST_CASE("RPCClient ignores responses to another run", "[rpc]") {
+  TimerWheel timers(std::chrono::milliseconds(1));
+  timers.start();
+  std::vector<mqtt::message_ptr> sent;
+  auto publish = [&](mqtt::message_ptr msg) { sent.push_back(msg); };
+
+  // Both clients start counting at the same id, like two runs of an agent
+  RPCClient previous(timers, "rpc/test/response", publish);
+  RPCClient current(timers, "rpc/test/response", publish);
+  RPCStatus outcome = RPCStatus::CANCELLED;
+  previous.call("test/rpc", "old", 1, std::chrono::seconds(10),
+                [](RPCStatus, mqtt::const_message_ptr) {});
+  current.call("test/rpc", "new", 1, std::chrono::seconds(10),
+               [&](RPCStatus status, mqtt::const_message_ptr) {
+                 outcome = status;
+               });
+  REQUIRE(sent.size() == 2);
+
+  auto late = RPCClient::make_response(sent[0], "late");
+  REQUIRE_FALSE(current.handle_response(late));
+  REQUIRE(current.pending() == 1);
+
+  REQUIRE(current.handle_response(RPCClient::make_response(sent[1], "ok")));
+  REQUIRE(outcome == RPCStatus::OK);
+  REQUIRE(previous.handle_response(late));
+  timers.stop();
+}
+
+TEST_CASE("MQTTAgent RPC calls round trip via Mosquitto", "[mqtt][rpc]") {
+  try {
+    mqtt::async_client responder(BROKER, "test-rpc-responder",
+                                 mqtt::create_options(MQTTVERSION_5));
+    EchoCallback echo(responder);
+    responder.set_callback(echo);
+    responder
+        .connect(mqtt::connect_options_builder()
+                     .mqtt_version(MQTTVERSION_5)
+                     .clean_start(true)
+                     .finalize())
+        ->wait();
+    responder.subscribe("test/rpc/echo", 1)->wait();
+
+    Config config = ConfigBuilder()
+                        .set_broker_url(BROKER)
+                        .set_client_id("test-agent")
+                        .enable_mqtt_v5()
+                        .set_rpc("", std::chrono::milliseconds(2000))
+                        .build();
+
+    DummyCallback dummy;
+    MQTTAgent &agent = MQTTAgent::get_instance(config, dummy);
+    REQUIRE(agent.connect() == true);
+
+    auto response = agent.call("test/rpc/echo", "Hello Test");
+    REQUIRE(response.wait_for(TIMEOUT) == std::future_status::ready);
+    REQUIRE(response.get()->get_payload_str() == "echo: Hello Test");
+
+    // Nobody listens here, so the call must time out
+    auto unanswered = agent.call("test/rpc/nobody", "Hello Test");
+    REQUIRE(unanswered.wait_for(TIMEOUT) == std::future_status::ready);
+    REQUIRE_THROWS_AS(unanswered.get(), RPCError);
+
+    agent.shutdown();
+    MQTTAgent::release_instance();
+    responder.disconnect()->wait();
+
+  } catch (const mqtt::exception &exc) {
+    std::cerr << "MQTT Exception: " << exc.what() << std::endl;
+    FAIL("MQTT connection failed: " + std::string(exc.what()));
+  }
+}
@@ -0,0 +1,162 @@
+#include "Config.hpp"
+#include "MQTTAgent.hpp"
+#include "TopicMatcher.hpp"
+#include "tests.hpp"
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mqtt/async_client.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+const std::string BROKER{"tcp://localhost:1883"};
+const std::string SHARED_GROUP{"testgroup"};
+const std::string SHARED_FILTER{"test/shared/#"};
+const size_t WORKER_PROCESSES = 3;
+const size_t SHARED_MESSAGES = 300;
+
+TEST_CASE("TopicMatcher matches MQTT wildcards", "[topic]") {
+  TopicMatcher matcher;
+  matcher.insert("a/b", 0);
+  matcher.insert("a/+", 1);
+  matcher.insert("a/#", 2);
+  matcher.insert("#", 3);
+
+  std::vector<size_t> out;
+  matcher.match("a/b", out);
+  REQUIRE(out.size() == 4);
+
+  out.clear();
+  matcher.match("a", out);
+  REQUIRE(out == std::vector<size_t>{3, 2});
+
+  out.clear();
+  matcher.match("$SYS/a", out);
+  REQUIRE(out.empty());
+
+  REQUIRE(matcher.erase("a/#", 2));
+  REQUIRE_FALSE(matcher.erase("a/#", 2));
+  REQUIRE(matcher.size() == 3);
+
+  std::string group, filter;
+  REQUIRE(parse_shared_subscription("$share/g1/x/+/y", group, filter));
+  REQUIRE(group == "g1");
+  REQUIRE(filter == "x/+/y");
+  REQUIRE_FALSE(parse_shared_subscription("$share/g1", group, filter));
+  REQUIRE(subscription_filter("plain/topic") == "plain/topic");
+}
+
+// Run by the load balancing test in a separate process: consumes from the
+// shared subscription and prints how many messages it handled
+TEST_CASE("Config reads the dispatcher sizes from json", "[config]") {
+  const std::string path = "test_dispatcher_sizes.json";
+  std::ofstream(path) << R"({
+    "broker_url": "tcp://localhost:1883",
+    "client_id": "test-sizes-agent",
+    "thread_pool_size": 3,
+    "message_queue_size": 50
+  })";
+
+  Config config = ConfigBuilder::load_from_json(path);
+  std::remove(path.c_str());
+  REQUIRE(config.thread_pool_size == 3);
+  REQUIRE(config.message_queue_size == 50);
+}
+
+TEST_CASE("Shared subscription worker process", "[.shared_worker]") {
+  const char *index = std::getenv("SHARED_WORKER_INDEX");
+  REQUIRE(index != nullptr);
+
+  Config config =
+      ConfigBuilder()
+          .set_broker_url(BROKER)
+          .set_client_id(std::string("test-shared-") + index)
+          .add_shared_subscription(SHARED_GROUP, SHARED_FILTER,
+                                   QoSLevel::AT_LEAST_ONCE)
+          .build();
+
+  DummyCallback dummy;
+  MQTTAgent &agent = MQTTAgent::get_instance(config, dummy);
+
+  std::atomic<size_t> handled{0};
+  std::atomic<int64_t> last_message_ms{0};
+  auto now_ms = []() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  };
+  agent.add_handler("$share/" + SHARED_GROUP + "/" + SHARED_FILTER,
+                    [&](const mqtt::const_message_ptr &) {
+                      handled++;
+                      last_message_ms = now_ms();
+                    });
+  REQUIRE(agent.connect() == true);
+
+  // Stop once traffic has been idle for a second, or after ten seconds
+  auto start = now_ms();
+  while (now_ms() - start < 10000) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (handled > 0 && now_ms() - last_message_ms > 1000)
+      break;
+  }
+
+  auto &group = dummy.metrics.group(SHARED_GROUP);
+  REQUIRE(group.messages_processed == handled);
+  std::cout << "HANDLED " << handled << std::endl;
+
+  agent.shutdown();
+  MQTTAgent::release_instance();
+}
+
+TEST_CASE("Shared subscriptions balance load across agent processes",
+          "[mqtt][shared]") {
+  // Spawn the workers as separate processes running the hidden test above
+  std::vector<FILE *> workers;
+  for (size_t i = 0; i < WORKER_PROCESSES; ++i) {
+    std::string command = "SHARED_WORKER_INDEX=" + std::to_string(i) +
+                          " /proc/" + std::to_string(getpid()) +
+                          "/exe \"[.shared_worker]\"";
+    FILE *worker = popen(command.c_str(), "r");
+    REQUIRE(worker != nullptr);
+    workers.push_back(worker);
+  }
+
+  // Give every worker time to connect and subscribe
+  std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+
+  mqtt::async_client publisher(BROKER, "test-shared-publisher");
+  mqtt::connect_options connOpts;
+  connOpts.set_clean_session(true);
+  publisher.connect(connOpts)->wait();
+  mqtt::delivery_token_ptr last;
+  for (size_t i = 0; i < SHARED_MESSAGES; ++i)
+    last = publisher.publish("test/shared/" + std::to_string(i % 10),
+                             "Hello Test", 1, false);
+  last->wait_for(TIMEOUT);
+  publisher.disconnect()->wait();
+
+  size_t total = 0;
+  for (FILE *worker : workers) {
+    size_t handled = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), worker))
+      if (std::sscanf(line, "HANDLED %zu", &handled) == 1)
+        break;
+    while (fgets(line, sizeof(line), worker)) {
+    }
+    pclose(worker);
+
+    std::cout << "Worker handled " << handled << " messages" << std::endl;
+    REQUIRE(handled > 0);
+    total += handled;
+  }
+
+  REQUIRE(total == SHARED_MESSAGES);
+}
@@ -0,0 +1,73 @@
+#include "TimerWheel.hpp"
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+TEST_CASE("TimerWheel runs one-shot and periodic tasks", "[timer]") {
+  TimerWheel wheel(1ms);
+  wheel.start();
+
+  std::atomic<int> once{0};
+  std::atomic<int> periodic{0};
+  wheel.schedule_once(5ms, [&]() { once++; });
+  auto id = wheel.schedule_periodic(2ms, [&]() { periodic++; });
+
+  std::this_thread::sleep_for(100ms);
+  REQUIRE(once == 1);
+  REQUIRE(periodic >= 5);
+
+  REQUIRE(wheel.cancel(id));
+  int seen = periodic;
+  std::this_thread::sleep_for(20ms);
+  REQUIRE(periodic <= seen + 1);
+  REQUIRE(wheel.size() == 0);
+}
+
+TEST_CASE("TimerWheel cancelled timers never fire", "[timer]") {
+  TimerWheel wheel(1ms);
+  wheel.start();
+
+  std::atomic<bool> fired{false};
+  auto id = wheel.schedule_once(20ms, [&]() { fired = true; });
+  REQUIRE(wheel.cancel(id));
+  REQUIRE_FALSE(wheel.cancel(id));
+
+  std::this_thread::sleep_for(50ms);
+  REQUIRE_FALSE(fired);
+}
+
+TEST_CASE("TimerWheel cascades thousands of timers across levels",
+          "[timer]") {
+  TimerWheel wheel(1ms);
+  wheel.start();
+
+  // Delays span level 0 (< 64 ticks) and level 1 (< 4096 ticks)
+  constexpr int COUNT = 5000;
+  std::atomic<int> fired{0};
+  for (int i = 0; i < COUNT; ++i)
+    wheel.schedule_once(std::chrono::milliseconds(1 + i % 300),
+                        [&]() { fired++; });
+
+  auto deadline = std::chrono::steady_clock::now() + 2s;
+  while (fired < COUNT && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(10ms);
+
+  REQUIRE(fired == COUNT);
+  REQUIRE(wheel.size() == 0);
+}
+
+TEST_CASE("TimerWheel stop wakes the thread immediately", "[timer]") {
+  TimerWheel wheel(10ms);
+  wheel.start();
+  wheel.schedule_periodic(1h, []() {});
+
+  auto start = std::chrono::steady_clock::now();
+  wheel.stop();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  REQUIRE_FALSE(wheel.is_running());
+  REQUIRE(elapsed < 100ms);
+}
@@ -0,0 +1,310 @@
+#include "Config.hpp"
+#include "MQTTAgent.hpp"
+#include "tests.hpp"
+#include <arpa/inet.h>
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <iostream>
+#include <mqtt/async_client.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Certificates from scripts/gen_certs.sh, served by config/mosquitto-tls.conf
+const std::string CERTS{TEST_CERTS_DIR};
+const std::string TLS_BROKER{"ssl://localhost:8883"};
+const std::string MUTUAL_TLS_BROKER{"ssl://localhost:8884"};
+
+// TLS endpoint that answers CONNECT with CONNACK and records whether each
+// handshake resumed a session. It drops the first connection right after the
+// CONNACK, so the client reconnects, and keeps later ones open
+class ResumptionBroker {
+public:
+  ResumptionBroker() {
+    ctx_ = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate_chain_file(ctx_, (CERTS + "/server.crt").c_str());
+    SSL_CTX_use_PrivateKey_file(ctx_, (CERTS + "/server.key").c_str(),
+                                SSL_FILETYPE_PEM);
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER);
+
+    listener_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    if (::bind(listener_, reinterpret_cast<sockaddr *>(&addr), length) != 0 ||
+        ::listen(listener_, 4) != 0 ||
+        ::getsockname(listener_, reinterpret_cast<sockaddr *>(&addr),
+                      &length) != 0)
+      throw std::runtime_error("Couldn't listen for TLS connections");
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread([this]() { serve(); });
+  }
+
+  ~ResumptionBroker() {
+    stopping_ = true;
+    ::shutdown(listener_, SHUT_RDWR);
+    ::shutdown(client_, SHUT_RDWR);
+    thread_.join();
+    ::close(listener_);
+    SSL_CTX_free(ctx_);
+  }
+
+  std::string url() const {
+    return "ssl://localhost:" + std::to_string(port_);
+  }
+
+  /* Per connection, whether its handshake resumed a session */
+  std::vector<bool> resumed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return resumed_;
+  }
+
+private:
+  SSL_CTX *ctx_;
+  int listener_;
+  std::atomic<int> client_{-1};
+  uint16_t port_;
+  std::atomic<bool> stopping_{false};
+  std::mutex mutex_;
+  std::vector<bool> resumed_;
+  std::thread thread_;
+
+  /* Reads one MQTT packet and returns its type, or -1 */
+  static int read_packet(SSL *ssl) {
+    unsigned char header, byte;
+    if (SSL_read(ssl, &header, 1) != 1)
+      return -1;
+    size_t length = 0;
+    for (int shift = 0; shift < 28; shift += 7) {
+      if (SSL_read(ssl, &byte, 1) != 1)
+        return -1;
+      length |= static_cast<size_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        break;
+    }
+    std::vector<unsigned char> body(length);
+    for (size_t read = 0; read < length;) {
+      int n = SSL_read(ssl, body.data() + read, length - read);
+      if (n <= 0)
+        return -1;
+      read += n;
+    }
+    return header >> 4;
+  }
+
+  void serve() {
+    const unsigned char connack[] = {0x20, 0x02, 0x00, 0x00};
+    const unsigned char pingresp[] = {0xd0, 0x00};
+
+    while (!stopping_) {
+      int fd = ::accept(listener_, nullptr, nullptr);
+      if (fd < 0)
+        return;
+      client_ = fd;
+      SSL *ssl = SSL_new(ctx_);
+      SSL_set_fd(ssl, fd);
+
+      if (SSL_accept(ssl) == 1 && read_packet(ssl) == 1) {
+        size_t connections;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          resumed_.push_back(SSL_session_reused(ssl) == 1);
+          connections = resumed_.size();
+        }
+        SSL_write(ssl, connack, sizeof(connack));
+
+        // Serve later connections until DISCONNECT
+        int type;
+        while (connections > 1 && (type = read_packet(ssl)) > 0 &&
+               type != 14)
+          if (type == 12)
+            SSL_write(ssl, pingresp, sizeof(pingresp));
+      }
+
+      SSL_shutdown(ssl);
+      SSL_free(ssl);
+      client_ = -1;
+      ::close(fd);
+    }
+  }
+};
+
+TEST_CASE("MQTTAgent resumes its TLS session on automatic reconnects",
+          "[tls]") {
+  ResumptionBroker broker;
+  auto deadline = std::chrono::steady_clock::now() + TIMEOUT;
+  ConfigBuilder builder;
+  builder.set_broker_url(broker.url())
+      .set_client_id("test-tls-resumption-agent")
+      .enable_ssl(CERTS + "/ca.crt")
+      .enable_auto_reconnect(std::chrono::seconds(1));
+
+  SECTION("without a clean session") {
+    Config config =
+        builder.set_clean_session(false).enable_tls_session_resumption().build();
+
+    DummyCallback dummy;
+    MQTTAgent &agent = MQTTAgent::get_instance(config, dummy);
+    REQUIRE(agent.connect());
+    while (broker.resumed().size() < 2 &&
+           std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    REQUIRE(broker.resumed() == std::vector<bool>{false, true});
+    agent.shutdown();
+    MQTTAgent::release_instance();
+  }
+
+  SECTION("with a clean session") {
+    Config config = builder.build();
+
+    DummyCallback dummy;
+    MQTTAgent &agent = MQTTAgent::get_instance(config, dummy);
+    REQUIRE(agent.connect());
+    while (broker.resumed().size() < 2 &&
+           std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    REQUIRE(broker.resumed() == std::vector<bool>{false, false});
+    agent.shutdown();
+    MQTTAgent::release_instance();
+  }
+}
+
+TEST_CASE("MQTTAgent publishes over TLS via Mosquitto", "[mqtt][tls]") {
+  std::atomic<bool> message_received{false};
+
+  try {
+    mqtt::async_client subscriber(TLS_BROKER, "test-tls-subscriber");
+    SimpleCallback cb(message_received);
+    subscriber.set_callback(cb);
+    subscriber
+        .connect(mqtt::connect_options_builder()
+                     .clean_session(true)
+                     .ssl(mqtt::ssl_options_builder()
+                              .trust_store(CERTS + "/ca.crt")
+                              .finalize())
+                     .finalize())
+        ->wait();
+    subscriber.subscribe("test/tls", 1)->wait();
+
+    Config config = ConfigBuilder()
+                        .set_broker_url(TLS_BROKER)
+                        .set_client_id("test-tls-agent")
+                        .enable_ssl(CERTS + "/ca.crt")
+                        .build();
+
+    DummyCallback dummy;
+    MQTTAgent &agent = MQTTAgent::get_instance(config, dummy);
+    REQUIRE(agent.connect() == true);
+    REQUIRE(dummy.metrics.connect_latency.samples == 1);
+
+    agent.publish_message("test/tls", "Hello Test", QoSLevel::AT_LEAST_ONCE);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+    REQUIRE(message_received == true);
+
+    agent.shutdown();
+    subscriber.disconnect()->wait();
+    MQTTAgent::release_instance();
+
+  } catch (const mqtt::exception &exc) {
+    std::cerr << "MQTT Exception: " << exc.what() << std::endl;
+    FAIL("MQTT connection failed: " + std::string(exc.what()));
+  }
+}
+
+TEST_CASE("MQTTAgent authenticates with a client certificate",
+          "[mqtt][tls]") {
+  SECTION("with the certificate") {
+    Config config =
+        ConfigBuilder()
+            .set_broker_url(MUTUAL_TLS_BROKER)
+            .set_client_id("test-mtls-agent")
+            .enable_ssl(CERTS + "/ca.crt")
+            .set_client_certificate(CERTS + "/client.crt", CERTS + "/client.key")
+            .build();
+
+    DummyCallback dummy;
+    MQTTAgent &agent = MQTTAgent::get_instance(config, dummy);
+    REQUIRE(agent.connect() == true);
+    agent.shutdown();
+    MQTTAgent::release_instance();
+  }
+
+  SECTION("without the certificate") {
+    Config config = ConfigBuilder()
+                        .set_broker_url(MUTUAL_TLS_BROKER)
+                        .set_client_id("test-mtls-agent")
+                        .enable_ssl(CERTS + "/ca.crt")
+                        .build();
+
+    DummyCallback dummy;
+    MQTTAgent &agent = MQTTAgent::get_instance(config, dummy);
+    REQUIRE(agent.connect() == false);
+    REQUIRE(dummy.metrics.connect_failures == 1);
+    MQTTAgent::release_instance();
+  }
+}
+
+TEST_CASE("MQTTAgent rejects a broker signed by an unknown CA",
+          "[mqtt][tls]") {
+  Config config = ConfigBuilder()
+                      .set_broker_url(TLS_BROKER)
+                      .set_client_id("test-tls-agent")
+                      .enable_ssl(CERTS + "/other_ca.crt")
+                      .build();
+
+  DummyCallback dummy;
+  MQTTAgent &agent = MQTTAgent::get_instance(config, dummy);
+  REQUIRE(agent.connect() == false);
+  REQUIRE(dummy.metrics.connect_failures == 1);
+  MQTTAgent::release_instance();
+}
+
+TEST_CASE("Config rejects incomplete TLS settings", "[tls]") {
+  REQUIRE_THROWS_AS(ConfigBuilder()
+                        .set_broker_url("tcp://localhost:1883")
+                        .set_client_id("test-tls-agent")
+                        .enable_ssl(CERTS + "/ca.crt")
+                        .build(),
+                    std::invalid_argument);
+
+  REQUIRE_THROWS_AS(ConfigBuilder()
+                        .set_broker_url(TLS_BROKER)
+                        .set_client_id("test-tls-agent")
+                        .enable_ssl(CERTS + "/ca.crt")
+                        .set_client_certificate(CERTS + "/client.crt", "")
+                        .build(),
+                    std::invalid_argument);
+
+  REQUIRE_NOTHROW(ConfigBuilder()
+                      .set_broker_url("mqtts://localhost:8883")
+                      .set_client_id("test-tls-agent")
+                      .enable_ssl(CERTS + "/ca.crt")
+                      .build());
+
+  // Paho only keeps the session of connections that are not clean
+  REQUIRE_THROWS_AS(ConfigBuilder()
+                        .set_broker_url(TLS_BROKER)
+                        .set_client_id("test-tls-agent")
+                        .enable_ssl(CERTS + "/ca.crt")
+                        .enable_tls_session_resumption()
+                        .build(),
+                    std::invalid_argument);
+
+  REQUIRE_NOTHROW(ConfigBuilder()
+                      .set_broker_url(TLS_BROKER)
+                      .set_client_id("test-tls-agent")
+                      .enable_ssl(CERTS + "/ca.crt")
+                      .enable_mqtt_v5()
+                      .enable_tls_session_resumption()
+                      .build());
+}
@@ -0,0 +1,139 @@
+#include "MQTTMetrics.hpp"
+#include "PublishScheduler.hpp"
+#include "TopicAliases.hpp"
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <mqtt/properties.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+uint16_t alias_of(const mqtt::message_ptr &msg) {
+  return mqtt::get<uint16_t>(msg->get_properties(),
+                             mqtt::property::TOPIC_ALIAS);
+}
+
+mqtt::const_message_ptr aliased(const std::string &topic, uint16_t alias) {
+  return mqtt::message::create(topic, "x", 0, false,
+                               {{mqtt::property::TOPIC_ALIAS, alias}});
+}
+
+} // namespace
+
+TEST_CASE("Outbound aliases go to the most recently used topics",
+          "[aliases]") {
+  OutboundTopicAliases aliases;
+  aliases.reset(2);
+  int64_t saved;
+
+  auto a = mqtt::make_message("alias/a", "x");
+  auto first = aliases.apply(a, saved);
+  REQUIRE(first != a);
+  REQUIRE(first->get_topic() == "alias/a");
+  REQUIRE(alias_of(first) == 1);
+  REQUIRE(saved < 0);
+
+  REQUIRE(alias_of(aliases.apply(mqtt::make_message("alias/b", "x"),
+                                 saved)) == 2);
+
+  // A known topic is replaced by its alias; the original stays intact
+  auto again = aliases.apply(a, saved);
+  REQUIRE(again->get_topic().empty());
+  REQUIRE(alias_of(again) == 1);
+  REQUIRE(saved == static_cast<int64_t>(std::string("alias/a").size()) - 3);
+  REQUIRE(a->get_topic() == "alias/a");
+  REQUIRE_FALSE(a->get_properties().contains(mqtt::property::TOPIC_ALIAS));
+
+  // alias/b is the least recently used topic and gives up its alias
+  auto c = aliases.apply(mqtt::make_message("alias/c", "x"), saved);
+  REQUIRE(c->get_topic() == "alias/c");
+  REQUIRE(alias_of(c) == 2);
+
+  auto b = aliases.apply(mqtt::make_message("alias/b", "x"), saved);
+  REQUIRE(b->get_topic() == "alias/b");
+  REQUIRE(alias_of(b) == 1);
+
+  // Disabled after a reset to 0
+  aliases.reset(0);
+  REQUIRE(aliases.apply(a, saved) == a);
+  REQUIRE(saved == 0);
+}
+
+TEST_CASE("Inbound aliases resolve to the topic last sent with them",
+          "[aliases]") {
+  InboundTopicAliases aliases;
+  aliases.reset(2);
+  int64_t saved;
+
+  auto plain = mqtt::make_message("alias/plain", "x");
+  REQUIRE(aliases.resolve(plain, saved) == plain);
+  REQUIRE(saved == 0);
+
+  // Unknown or out of range aliases cannot be resolved
+  REQUIRE(aliases.resolve(aliased("", 1), saved) == nullptr);
+  REQUIRE(aliases.resolve(aliased("alias/a", 3), saved) == nullptr);
+  REQUIRE(aliases.resolve(aliased("alias/a", 0), saved) == nullptr);
+
+  auto mapping = aliased("alias/a", 1);
+  REQUIRE(aliases.resolve(mapping, saved) == mapping);
+  REQUIRE(saved == -3);
+
+  auto resolved = aliases.resolve(aliased("", 1), saved);
+  REQUIRE(resolved);
+  REQUIRE(resolved->get_topic() == "alias/a");
+  REQUIRE(resolved->get_payload_str() == "x");
+  REQUIRE(saved == static_cast<int64_t>(std::string("alias/a").size()) - 3);
+
+  // A new mapping replaces the old one
+  aliases.resolve(aliased("alias/b", 1), saved);
+  REQUIRE(aliases.resolve(aliased("", 1), saved)->get_topic() == "alias/b");
+
+  aliases.reset(2);
+  REQUIRE(aliases.resolve(aliased("", 1), saved) == nullptr);
+}
+
+TEST_CASE("Aliased publishes reach the client in the order of their aliases",
+          "[aliases]") {
+  OutboundTopicAliases outbound;
+  outbound.reset(3);
+  InboundTopicAliases broker;
+  broker.reset(3);
+
+  // The sender plays the broker: every publish must resolve to the topic it
+  // was queued with, which the payload carries
+  std::mutex mutex;
+  std::atomic<size_t> sent{0}, mismatched{0};
+  PlatformMetrics metrics;
+  PublishScheduler scheduler(
+      metrics,
+      [&](const mqtt::message_ptr &msg) {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t saved;
+        auto resolved = broker.resolve(msg, saved);
+        if (!resolved || resolved->get_topic() != msg->get_payload_str())
+          mismatched++;
+        sent++;
+        return true;
+      },
+      scheduler_options(), [&](const mqtt::message_ptr &msg) {
+        int64_t saved;
+        return outbound.apply(msg, saved);
+      });
+
+  std::vector<std::thread> publishers;
+  for (int t = 0; t < 4; t++)
+    publishers.emplace_back([&, t]() {
+      for (int i = 0; i < 500; i++) {
+        std::string topic = "alias/" + std::to_string((i + t) % 7);
+        scheduler.enqueue(mqtt::make_message(topic, topic), Priority::BULK);
+      }
+    });
+  for (auto &publisher : publishers)
+    publisher.join();
+
+  REQUIRE(sent == 2000);
+  REQUIRE(mismatched == 0);
+}
@@ -0,0 +1,45 @@
+#include "Tracer.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <cstdio>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <thread>
+
+TEST_CASE("Tracer records spans per thread and exports Chrome JSON",
+          "[tracer]") {
+  Tracer &tracer = Tracer::instance();
+  tracer.clear();
+
+  { TraceScope ignored("test", "disabled"); }
+  REQUIRE(tracer.events().empty());
+
+  tracer.enable(4);
+  { TraceScope scope("test", "outer"); }
+  std::thread([]() {
+    for (int i = 0; i < 10; i++)
+      TraceScope scope("test", "worker");
+  }).join();
+  tracer.disable();
+
+  // The worker's ring only keeps its newest four events
+  auto events = tracer.events();
+  REQUIRE(events.size() == 5);
+  REQUIRE(std::string(events[0].name) == "outer");
+  REQUIRE(events[0].thread_id != events[1].thread_id);
+  for (size_t i = 2; i < events.size(); i++)
+    REQUIRE(events[i].start_ns >= events[i - 1].start_ns);
+
+  const std::string path = "test_tracer.json";
+  REQUIRE(tracer.write_chrome_trace(path));
+  std::ifstream file(path);
+  auto json = nlohmann::json::parse(file);
+  REQUIRE(json["traceEvents"].size() == 5);
+  REQUIRE(json["traceEvents"][0]["name"] == "outer");
+  REQUIRE(json["traceEvents"][0]["ph"] == "X");
+  REQUIRE(json["traceEvents"][0]["dur"].get<double>() >= 0);
+
+  tracer.clear();
+  REQUIRE(tracer.events().empty());
+  std::remove(path.c_str());
+}